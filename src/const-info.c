@@ -72,6 +72,12 @@ static struct const_info consts_info[] = {
 	{  619, "GETDNS_CONTEXT_CODE_EDNS_CLIENT_SUBNET_PRIVATE", GETDNS_CONTEXT_CODE_EDNS_CLIENT_SUBNET_PRIVATE_TEXT },
 	{  620, "GETDNS_CONTEXT_CODE_TLS_QUERY_PADDING_BLOCKSIZE", GETDNS_CONTEXT_CODE_TLS_QUERY_PADDING_BLOCKSIZE_TEXT },
 	{  621, "GETDNS_CONTEXT_CODE_PUBKEY_PINSET", GETDNS_CONTEXT_CODE_PUBKEY_PINSET_TEXT },
+	{  622, "GETDNS_CONTEXT_CODE_MAX_UPSTREAM_CONNECTIONS", GETDNS_CONTEXT_CODE_MAX_UPSTREAM_CONNECTIONS_TEXT },
+	{  623, "GETDNS_CONTEXT_CODE_UDP_HEDGING", GETDNS_CONTEXT_CODE_UDP_HEDGING_TEXT },
+	{  624, "GETDNS_CONTEXT_CODE_TLS_SESSION_CACHE_FILE", GETDNS_CONTEXT_CODE_TLS_SESSION_CACHE_FILE_TEXT },
+	{  625, "GETDNS_CONTEXT_CODE_TLS_WARM_UPSTREAMS", GETDNS_CONTEXT_CODE_TLS_WARM_UPSTREAMS_TEXT },
+	{  626, "GETDNS_CONTEXT_CODE_TLS_KERNEL_OFFLOAD", GETDNS_CONTEXT_CODE_TLS_KERNEL_OFFLOAD_TEXT },
+	{  627, "GETDNS_CONTEXT_CODE_HOSTS", GETDNS_CONTEXT_CODE_HOSTS_TEXT },
 	{  700, "GETDNS_CALLBACK_COMPLETE", GETDNS_CALLBACK_COMPLETE_TEXT },
 	{  701, "GETDNS_CALLBACK_CANCEL", GETDNS_CALLBACK_CANCEL_TEXT },
 	{  702, "GETDNS_CALLBACK_TIMEOUT", GETDNS_CALLBACK_TIMEOUT_TEXT },
@@ -95,31 +101,106 @@ static struct const_info consts_info[] = {
 	{ 1301, "GETDNS_AUTHENTICATION_REQUIRED", GETDNS_AUTHENTICATION_REQUIRED_TEXT },
 };
 
-static int const_info_cmp(const void *a, const void *b)
-{
-	return ((struct const_info *) a)->code - ((struct const_info *) b)->code;
-}
+/* Index in consts_info by code, 0 for codes without constant */
+#define CONSTS_INFO_IDX_SZ 1302
+static const uint16_t consts_info_idx[CONSTS_INFO_IDX_SZ] = {
+	  1,  2,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  3,  4,  5,  6,
+	  7,  8,  9, 10, 11, 12, 13, 14, 15,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 16,
+	 17, 18, 19, 20, 21,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0, 22, 23, 24, 25, 26,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0, 27, 28,  0,  0,  0,  0,  0,  0,
+	  0,  0, 29, 30,  0,  0,  0,  0,  0,  0,  0,  0, 31, 32, 33, 34,
+	 35, 36,  0,  0,  0,  0, 37, 38, 39, 40, 41,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0, 42, 43, 44, 45, 46, 47, 48, 49,
+	 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 65,
+	 66, 67, 68,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 69, 70, 71, 72,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 73, 74,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0, 75, 76, 77, 78, 79,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0, 80, 81,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 82, 83, 84,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 85, 86, 87,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0, 88, 89,
+};
+
 struct const_info *
 _getdns_get_const_info(int value)
 {
-	struct const_info key = { value, "", "" };
-	struct const_info *i = bsearch(&key, consts_info,
-	    sizeof(consts_info) / sizeof(struct const_info),
-	    sizeof(struct const_info), const_info_cmp);
-	if (i)
-		return i;
+	if (value >= 0 && value < CONSTS_INFO_IDX_SZ)
+		return &consts_info[consts_info_idx[value]];
 	return consts_info;
 }
 
 const char *
 getdns_get_errorstr_by_id(uint16_t err)
 {
-	struct const_info key = { (int)err, "", "" };
-	struct const_info *i = bsearch(&key, consts_info,
-	    sizeof(consts_info) / sizeof(struct const_info),
-	    sizeof(struct const_info), const_info_cmp);
-	if (i)
-		return i->text;
+	if (err < CONSTS_INFO_IDX_SZ && consts_info_idx[err])
+		return consts_info[consts_info_idx[err]].text;
 	else
 		return NULL;
 }
@@ -150,8 +231,10 @@ static struct const_name_info consts_name_info[] = {
 	{ "GETDNS_CONTEXT_CODE_EDNS_MAXIMUM_UDP_PAYLOAD_SIZE", 610 },
 	{ "GETDNS_CONTEXT_CODE_EDNS_VERSION", 612 },
 	{ "GETDNS_CONTEXT_CODE_FOLLOW_REDIRECTS", 602 },
+	{ "GETDNS_CONTEXT_CODE_HOSTS", 627 },
 	{ "GETDNS_CONTEXT_CODE_IDLE_TIMEOUT", 617 },
 	{ "GETDNS_CONTEXT_CODE_LIMIT_OUTSTANDING_QUERIES", 606 },
+	{ "GETDNS_CONTEXT_CODE_MAX_UPSTREAM_CONNECTIONS", 622 },
 	{ "GETDNS_CONTEXT_CODE_MEMORY_FUNCTIONS", 615 },
 	{ "GETDNS_CONTEXT_CODE_NAMESPACES", 600 },
 	{ "GETDNS_CONTEXT_CODE_PUBKEY_PINSET", 621 },
@@ -159,7 +242,11 @@ static struct const_name_info consts_name_info[] = {
 	{ "GETDNS_CONTEXT_CODE_SUFFIX", 608 },
 	{ "GETDNS_CONTEXT_CODE_TIMEOUT", 616 },
 	{ "GETDNS_CONTEXT_CODE_TLS_AUTHENTICATION", 618 },
+	{ "GETDNS_CONTEXT_CODE_TLS_KERNEL_OFFLOAD", 626 },
 	{ "GETDNS_CONTEXT_CODE_TLS_QUERY_PADDING_BLOCKSIZE", 620 },
+	{ "GETDNS_CONTEXT_CODE_TLS_SESSION_CACHE_FILE", 624 },
+	{ "GETDNS_CONTEXT_CODE_TLS_WARM_UPSTREAMS", 625 },
+	{ "GETDNS_CONTEXT_CODE_UDP_HEDGING", 623 },
 	{ "GETDNS_CONTEXT_CODE_UPSTREAM_RECURSIVE_SERVERS", 603 },
 	{ "GETDNS_DNSSEC_BOGUS", 401 },
 	{ "GETDNS_DNSSEC_INDETERMINATE", 402 },
@@ -314,22 +401,72 @@ static struct const_name_info consts_name_info[] = {
 	{ "GETDNS_TRANSPORT_UDP_ONLY", 541 },
 };
 
-static int const_name_info_cmp(const void *a, const void *b)
-{
-	return strcmp( ((struct const_name_info *) a)->name
-	             , ((struct const_name_info *) b)->name );
-}
+/* Perfect hash on the constant names.  The bucket, selected by the top bits
+ * of the name's hash, gives the displacement with which the hash is moved to
+ * a slot with the index in consts_name_info (plus one).
+ */
+#define CONSTS_NAME_BUCKETS 128
+static const uint8_t consts_name_disp[CONSTS_NAME_BUCKETS] = {
+	  1,  0,  0,  0,  6,  0,  0,  1,  0,  0,  2,  1,  0,  0,  0,  0,
+	  2,  0,  1,  0,  0,  0,  0,  0,  0,  1,  1,  0,  0,  0,  3,  1,
+	  1,  0, 10,  7,  1,  1,  0,  2,  6,  0,  2,  0,  0,  0,  0,  3,
+	  0,  0,  7,  0,  0,  0,  0,  1,  8,  0,  0,  2,  1,  2,  0,  0,
+	 14,  4,  4,  1,  0,  7,  2,  0,  3,  2,  1,  5,  2,  0, 10,  4,
+	  5,  7,  0,  2,  3, 11,  2,  0,  0,  5,  6,  2,  2,  0,  4,  1,
+	  0,  0,  4,  0,  1,  0,  7,  0,  9,  0,  0,  0,  0,  8,  0,  0,
+	  0,  2,  0,  0,  4,  0,  3,  0,  0,  1, 10,  0,  2, 13,  0,  0,
+};
+
+#define CONSTS_NAME_SLOTS 256
+static const uint16_t consts_name_slot[CONSTS_NAME_SLOTS] = {
+	102,173,  0,104,193,141,136,131,113,154,  0, 24, 27, 51,133, 82,
+	187,  0,  0,121, 57, 39,170, 47,162,  0,  0,  0,108,  0,  0,  0,
+	 59, 46, 11,160,126,111, 42,176,  0,  0,  0,130,185, 66, 74, 25,
+	191,120, 75, 33,  0,155, 22,  0, 10, 60, 99, 30,181,168, 77,134,
+	  0,109, 93,  0,138, 32,180,150,  0,142,158, 29,144,  8, 16, 41,
+	122, 91,  0,  5,105, 45,118, 17,139,125, 72,  3,124,152,  0, 68,
+	 13,192,119, 61,  0,188,  1,178,137, 19, 40,  0,  0,179,110,  9,
+	 52,175,190,117,157, 20, 12,128,  0,  0,  0,100,  0,107,  0,  0,
+	  0,129,  2, 21, 80,  0, 34, 37,101, 88, 94,  6, 63,165,  0,  0,
+	145,174,164, 55,151, 36,  0,  0,  0, 50,  0, 48,  0, 28, 76,153,
+	 15,132,177,112,  0,149, 49,135,148,  0,182,  0,156,  0, 54, 97,
+	184, 67, 58, 96,172, 83,114, 73,  0, 70,147,171,  0, 78, 14,161,
+	  0, 38,  0,  0,115, 86, 64, 26, 62,  0,  0, 90, 87,163,  0, 95,
+	183, 35,167,  0,146,159,  0, 84, 81, 31,127,103,189,  0,  0,  0,
+	 79,  0,123,106,  0, 71, 98,  4,  7, 69, 44,169,  0,  0,  0,186,
+	 65,  0, 85, 56,140,  0,116, 89,  0, 43,143, 18,166, 53, 23, 92,
+};
 
 int
 _getdns_get_const_name_info(const char *name, uint32_t *code)
 {
-	struct const_name_info key = { name, 0 };
-	struct const_name_info *i = bsearch(&key, consts_name_info,
-	    sizeof(consts_name_info) / sizeof(struct const_name_info),
-	    sizeof(struct const_name_info), const_name_info_cmp);
-	if (!i)
+	const uint8_t *s = (const uint8_t *)name;
+	size_t len = strlen(name), i;
+	uint32_t h = (uint32_t)len;
+	uint16_t slot;
+
+	/* Four octets at a time, because the multiplications are on the
+	 * critical path
+	 */
+	for (i = 0; i + 4 <= len; i += 4)
+		h = (h + (s[i] | s[i + 1] << 8 | s[i + 2] << 16
+		    | (uint32_t)s[i + 3] << 24)) * 2654435761U;
+	switch (len - i) {
+	case 3: h = (h + (s[i] | s[i + 1] << 8 | s[i + 2] << 16))
+	            * 2654435761U;
+	        break;
+	case 2: h = (h + (s[i] | s[i + 1] << 8)) * 2654435761U;
+	        break;
+	case 1: h = (h + s[i]) * 2654435761U;
+	        break;
+	}
+	h += h >> 16;
+
+	slot = consts_name_slot[(h + consts_name_disp[(h >> 24)
+	    % CONSTS_NAME_BUCKETS] * ((h >> 16) | 1)) % CONSTS_NAME_SLOTS];
+	if (!slot || strcmp(consts_name_info[slot - 1].name, name))
 		return 0;
 	if (code)
-		*code = i->code;
+		*code = consts_name_info[slot - 1].code;
 	return 1;
 }
@@ -40,6 +40,8 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
 #else
 #include <winsock2.h>
 #include <iphlpapi.h>
@@ -58,6 +60,16 @@ typedef unsigned short in_port_t;
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(HAVE_INOTIFY_INIT1) && defined(HAVE_SYS_INOTIFY_H)
+#include <sys/inotify.h>
+#include <unistd.h>
+#define USE_INOTIFY 1
+#endif
 
 #include <assert.h>
 #include <ctype.h>
@@ -74,6 +86,7 @@ typedef unsigned short in_port_t;
 #include "debug.h"
 #include "gldns/str2wire.h"
 #include "gldns/wire2str.h"
+#include "gldns/gbuffer.h"
 #include "context.h"
 #include "types-internal.h"
 #include "util-internal.h"
@@ -100,14 +113,6 @@ static bool ssl_init=false;
 
 void *plain_mem_funcs_user_arg = MF_PLAIN;
 
-typedef struct host_name_addrs {
-	_getdns_rbnode_t node;
-	getdns_list *ipv4addrs;
-	getdns_list *ipv6addrs;
-	uint8_t host_name[];
-} host_name_addrs;
-
-
 /*  If changing these lists also remember to 
     change the value of GETDNS_UPSTREAM_TRANSPORTS */
 static getdns_transport_list_t 
@@ -137,6 +142,10 @@ static int transaction_id_cmp(const void *, const void *);
 static void dispatch_updated(struct getdns_context *, uint16_t);
 static void cancel_dns_req(getdns_dns_req *);
 static void cancel_outstanding_requests(struct getdns_context*, int);
+static void tls_sessions_clear(struct getdns_context *);
+static void tls_verified_clear(struct getdns_context *);
+static void tls_sessions_load(struct getdns_context *);
+static void tls_sessions_flush(struct getdns_context *);
 
 /* unbound helpers */
 #ifdef HAVE_LIBUNBOUND
@@ -256,13 +265,22 @@ upstream_port(getdns_upstream *upstream)
 	     : ((struct sockaddr_in6*)&upstream->addr)->sin6_port);
 }
 
-static void destroy_local_host(_getdns_rbnode_t * node, void *arg)
+static void destroy_local_hosts(getdns_context *context,
+    _getdns_local_hosts *lh)
 {
-	getdns_context *context = (getdns_context *)arg;
-	host_name_addrs *hnas = (host_name_addrs *)node;
-	getdns_list_destroy(hnas->ipv4addrs);
-	getdns_list_destroy(hnas->ipv6addrs);
-	GETDNS_FREE(context->my_mf, hnas);
+	_getdns_local_hosts_chunk *chunk, *next;
+
+	for (chunk = lh->names; chunk; chunk = next) {
+		next = chunk->next;
+		GETDNS_FREE(context->mf, chunk);
+	}
+	if (lh->hosts)
+		GETDNS_FREE(context->mf, lh->hosts);
+	if (lh->addr_idxs)
+		GETDNS_FREE(context->mf, lh->addr_idxs);
+	if (lh->addrs)
+		GETDNS_FREE(context->mf, lh->addrs);
+	(void) memset(lh, 0, sizeof(_getdns_local_hosts));
 }
 
 /**
@@ -302,22 +320,14 @@ create_default_dns_transports(struct getdns_context *context)
 
 static inline void canonicalize_dname(uint8_t *dname)
 {
-	uint8_t *next_label;
-
-	while (*dname && !(*dname & 0xC0)) {
-		next_label = dname + *dname + 1;
-		dname += 1;
-		while (dname < next_label) {
-			*dname = (uint8_t)tolower((unsigned char)*dname);
-			dname++;
-		}
-	}
+	_getdns_dname_fold(dname, dname, _getdns_dname_len(dname));
 }
 
 static int
 canonical_dname_compare(register const uint8_t *d1, register const uint8_t *d2)
 {
 	register uint8_t lab1, lab2;
+	int r;
 
 	assert(d1 && d2);
 
@@ -331,16 +341,10 @@ canonical_dname_compare(register const uint8_t *d1, register const uint8_t *d2)
 				return -1;
 			return 1;
 		}
-		while (lab1--) {
-			/* compare bytes first for speed */
-			if (*d1 != *d2) {
-				if (*d1 < *d2)
-					return -1;
-				return  1;
-			}
-			d1++;
-			d2++;
-		}
+		if ((r = memcmp(d1, d2, lab1)))
+			return r < 0 ? -1 : 1;
+		d1 += lab1;
+		d2 += lab1;
 		/* next pair of labels. */
 		lab1 = *d1++;
 		lab2 = *d2++;
@@ -348,67 +352,111 @@ canonical_dname_compare(register const uint8_t *d1, register const uint8_t *d2)
 	return 0;
 }
 
-static int
-local_host_cmp(const void *id1, const void *id2)
-{
-	return canonical_dname_compare(id1, id2);
-}
+#define LOCAL_HOSTS_CHUNK_SIZE 65536
 
-/** return 0 on success */
-static int
-add_local_host(getdns_context *context, getdns_dict *address, const char *str)
+/* Space for a name or scope_id that will not move while the table lives */
+static uint8_t *
+local_hosts_alloc(getdns_context *context, size_t sz)
 {
-	uint8_t host_name[256];
-	size_t host_name_len = sizeof(host_name);
-	host_name_addrs *hnas;
-	getdns_bindata *address_type;
-	int hnas_found = 0;
-	getdns_list **addrs;
-
-	if (gldns_str2wire_dname_buf(str, host_name, &host_name_len))
-		return -1;
+	_getdns_local_hosts_chunk *chunk = context->local_hosts.names;
 
-	canonicalize_dname(host_name);
-	
-	if (!(hnas = (host_name_addrs *)_getdns_rbtree_search(
-	    &context->local_hosts, host_name))) {
+	if (!chunk || chunk->used + sz > LOCAL_HOSTS_CHUNK_SIZE) {
+		if (!(chunk = (_getdns_local_hosts_chunk *)GETDNS_XMALLOC(
+		    context->mf, uint8_t, sizeof(_getdns_local_hosts_chunk)
+		                        + LOCAL_HOSTS_CHUNK_SIZE)))
+			return NULL;
+		chunk->next = context->local_hosts.names;
+		chunk->used = 0;
+		context->local_hosts.names = chunk;
+	}
+	chunk->used += sz;
+	return chunk->data + chunk->used - sz;
+}
 
-		if (!(hnas = (host_name_addrs *)GETDNS_XMALLOC(context->mf,
-		    uint8_t, sizeof(host_name_addrs) + host_name_len)))
-			return -1;
+/* A name and address pair, before they are grouped per name */
+typedef struct local_host_entry {
+	const uint8_t *name;
+	uint32_t       addr_idx;
+	int            family;
+} local_host_entry;
 
-		hnas->ipv4addrs = NULL;
-		hnas->ipv6addrs = NULL;
-		(void)memcpy(hnas->host_name, host_name, host_name_len);
-		hnas->node.key = &hnas->host_name;
+static int
+local_host_entry_cmp(const void *a, const void *b)
+{
+	const local_host_entry *e1 = a, *e2 = b;
+	int r;
 
-	} else
-		hnas_found = 1;
-	
-	if (getdns_dict_get_bindata(address, "address_type", &address_type) ||
+	if ((r = canonical_dname_compare(e1->name, e2->name)))
+		return r;
+	if (e1->family != e2->family)
+		return e1->family == AF_INET ? -1 : 1;
+	/* addr_idx increases with the position in the hosts file */
+	return e1->addr_idx < e2->addr_idx ? -1
+	     : e1->addr_idx > e2->addr_idx ?  1 : 0;
+}
 
-	    address_type->size < 4 ||
+static int
+local_host_cmp(const void *key, const void *host)
+{
+	return canonical_dname_compare(
+	    key, ((const _getdns_local_host *)host)->name);
+}
 
-	    !(addrs = address_type->data[3] == '4'? &hnas->ipv4addrs
-	            : address_type->data[3] == '6'? &hnas->ipv4addrs : NULL)) {
+/** return 0 on success */
+static int
+str2local_addr(getdns_context *context, const char *str,
+    _getdns_local_addr *addr)
+{
+	static struct addrinfo hints = { .ai_family = AF_UNSPEC
+	                               , .ai_flags  = AI_NUMERICHOST };
+	struct addrinfo *ai;
+	char addrstr[1024], *b;
+	size_t scope_len;
 
-		if (!hnas_found) GETDNS_FREE(context->mf, hnas);
-		return -1;
+	addr->scope_id = NULL;
+	if (!strchr(str, '%')) {
+		if (inet_pton(AF_INET, str, addr->addr) == 1) {
+			addr->family = AF_INET;
+			return 0;
+		}
+		if (inet_pton(AF_INET6, str, addr->addr) == 1) {
+			addr->family = AF_INET6;
+			return 0;
+		}
 	}
-	if (!*addrs && !(*addrs = getdns_list_create_with_context(context))) {
-		if (!hnas_found) GETDNS_FREE(context->mf, hnas);
+	/* Scoped or otherwise less common notations */
+	if (getaddrinfo(str, NULL, &hints, &ai))
 		return -1;
-	}
-	if (_getdns_list_append_this_dict(*addrs, address)) {
-	       	if (!hnas_found) {
-			getdns_list_destroy(*addrs);
-			GETDNS_FREE(context->mf, hnas);
-		}
+	if (!ai)
 		return -1;
 
-	} else if (!hnas_found)
-		(void)_getdns_rbtree_insert(&context->local_hosts, &hnas->node);
+	switch ((addr->family = ai->ai_addr->sa_family)) {
+	case AF_INET:
+		(void) memcpy(addr->addr,
+		    &((struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+		break;
+	case AF_INET6:
+		(void) memcpy(addr->addr,
+		    &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, 16);
 
+		/* Try to get scope_id too */
+		if (getnameinfo(ai->ai_addr, sizeof(struct sockaddr_in6),
+		    addrstr, sizeof(addrstr), NULL, 0, NI_NUMERICHOST) ||
+		    !(b = strchr(addrstr, '%')))
+			break;
+		scope_len = strlen(b + 1) + 1;
+		if (!(addr->scope_id = (char *)local_hosts_alloc(
+		    context, scope_len))) {
+			freeaddrinfo(ai);
+			return -1;
+		}
+		(void) memcpy((char *)addr->scope_id, b + 1, scope_len);
+		break;
+	default:
+		freeaddrinfo(ai);
+		return -1;
+	}
+	freeaddrinfo(ai);
 	return 0;
 }
 
@@ -472,118 +520,283 @@ sockaddr_dict(getdns_context *context, struct sockaddr *sa)
 }
 
 static getdns_dict *
-str_addr_dict(getdns_context *context, const char *str)
+local_addr_dict(getdns_context *context, const _getdns_local_addr *addr)
 {
-	static struct addrinfo hints = { .ai_family = AF_UNSPEC
-	                               , .ai_flags  = AI_NUMERICHOST };
-	struct addrinfo *ai;
-	getdns_dict *address;
+	getdns_dict *address = getdns_dict_create_with_context(context);
+	getdns_bindata bindata;
 
-	if (getaddrinfo(str, NULL, &hints, &ai))
-		return NULL;
-	if (!ai)
+	if (!address)
 		return NULL;
-		
-	address = sockaddr_dict(context, ai->ai_addr);
-	freeaddrinfo(ai);
 
+	bindata.size = addr->family == AF_INET ? 4 : 16;
+	bindata.data = (void *)addr->addr;
+	if (getdns_dict_util_set_string(address, "address_type",
+	    addr->family == AF_INET ? "IPv4" : "IPv6") ||
+	    getdns_dict_set_bindata(address, "address_data", &bindata) ||
+	    (addr->scope_id && getdns_dict_util_set_string(
+	    address, "scope_id", (char *)addr->scope_id))) {
+		getdns_dict_destroy(address);
+		return NULL;
+	}
 	return address;
 }
 
-static void
-create_local_hosts(getdns_context *context)
+/* Group the name and address pairs per name into the local_hosts table */
+static int
+local_hosts_from_entries(getdns_context *context,
+    local_host_entry *entries, size_t n_entries)
 {
-	/* enough space in buf for longest allowed domain name */
-	char buf[1024];
-	char *pos = buf, prev_c, *start_of_word = NULL;
-	FILE *in;
-	int start_of_line = 1;
-	getdns_dict *address = NULL;
+	_getdns_local_hosts *lh = &context->local_hosts;
+	_getdns_local_host *host;
+	size_t i, n, n_hosts;
 
-#ifdef USE_WINSOCK
-	in = fopen("c:\\WINDOWS\\system32\\drivers\\etc\\hosts", "r");
-#else
-	in = fopen("/etc/hosts", "r");
-#endif
-	while (fgets(pos, (int)(sizeof(buf) - (pos - buf)), in)) {
-		pos = buf;
-		/* Break out of for to read more */
+	qsort(entries, n_entries, sizeof(local_host_entry),
+	    local_host_entry_cmp);
+
+	/* A name listed twice for the same address (on one line, or on
+	 * consecutive lines sharing the address) is kept only once.
+	 */
+	for (i = 0, n = 0; i < n_entries; i++)
+		if (n == 0 || entries[n - 1].addr_idx != entries[i].addr_idx
+		    || canonical_dname_compare(entries[n - 1].name,
+		                               entries[i].name))
+			entries[n++] = entries[i];
+	n_entries = n;
+
+	for (i = 0, n_hosts = 0; i < n_entries; i++)
+		if (i == 0 || canonical_dname_compare(
+		    entries[i - 1].name, entries[i].name))
+			n_hosts++;
+
+	if (!(lh->hosts = GETDNS_XMALLOC(
+	    context->mf, _getdns_local_host, n_hosts ? n_hosts : 1)))
+		return -1;
+	if (!(lh->addr_idxs = GETDNS_XMALLOC(
+	    context->mf, uint32_t, n_entries ? n_entries : 1)))
+		return -1;
+
+	for (i = 0, host = lh->hosts - 1; i < n_entries; i++) {
+		if (i == 0 || canonical_dname_compare(
+		    entries[i - 1].name, entries[i].name)) {
+			host++;
+			host->name = entries[i].name;
+			host->addrs = i;
+			host->n_ipv4 = 0;
+			host->n_ipv6 = 0;
+		}
+		if (entries[i].family == AF_INET)
+			host->n_ipv4++;
+		else
+			host->n_ipv6++;
+		lh->addr_idxs[i] = entries[i].addr_idx;
+	}
+	lh->n_hosts = n_hosts;
+	return 0;
+}
+
+/* Parse the hosts file contents in data (not '\0' terminated).
+ * return 0 on success
+ */
+static int
+parse_local_hosts(getdns_context *context, const char *data, size_t len)
+{
+	_getdns_local_hosts *lh = &context->local_hosts;
+	const char *pos = data, *end = data + len, *start_of_word;
+	/* enough space in word for longest allowed domain name */
+	char word[1024];
+	uint8_t host_name[256], *name;
+	size_t host_name_len, addrs_sz = 0, n_entries = 0, entries_sz = 0;
+	size_t line_entries;
+	local_host_entry *entries = NULL, *new_entries;
+	_getdns_local_addr *new_addrs, *addr;
+	uint32_t addr_idx;
+
+	while (pos < end) {
+		addr = NULL;
+		line_entries = 0;
 		for (;;) {
 			/* Skip whitespace */
-			while (*pos == ' '  || *pos == '\f' 
-			    || *pos == '\t' || *pos == '\v')
+			while (pos < end && (*pos == ' '  || *pos == '\f'
+			                  || *pos == '\t' || *pos == '\v'))
 				pos++;
 
-			if (*pos == '\0') { /* End of read data */
-				pos = buf;
-				goto read_more;
-
-			} else if (*pos == '#' || *pos == '\r' || *pos == '\n')
+			if (pos == end ||
+			    *pos == '#' || *pos == '\r' || *pos == '\n')
 				/* Comments or end of line */
 				break; /* skip to next line */
 
-			assert(*pos && !isspace(*pos));
-
 			start_of_word = pos;
 
 			/* Search for end of word */
-			while (*pos && !isspace(*pos))
+			while (pos < end && !isspace((unsigned char)*pos))
 				pos++;
 
-			/* '\0' before whitespace, so either the word did not
-			 * fit, or we are at the end of the file.
-			 */
-			if (*pos == '\0') {
-				if (start_of_word == buf) /* word too big */
-					break; /* skip to next line */
+			if ((size_t)(pos - start_of_word) >= sizeof(word))
+				break; /* word too big, skip to next line */
 
-				/* Move word to fit in buffer */
-				memmove(buf,start_of_word,pos - start_of_word);
-				pos = buf + (pos - start_of_word);
-				start_of_word = buf;
-				*pos = '\0';
-				goto read_more;
-			}
-			assert(isspace(*pos));
-			prev_c = *pos;
-			*pos = '\0';
-			if (start_of_line) {
-				start_of_line = 0;
-				if (address) 
-					getdns_dict_destroy(address);
-				if (!(address =
-				    str_addr_dict(context, start_of_word)))
+			(void) memcpy(word, start_of_word, pos - start_of_word);
+			word[pos - start_of_word] = '\0';
+
+			if (!addr) {
+				if (lh->n_addrs >= addrs_sz) {
+					addrs_sz = addrs_sz ? addrs_sz * 2 : 64;
+					if (!(new_addrs = GETDNS_XREALLOC(
+					    context->mf, lh->addrs,
+					    _getdns_local_addr, addrs_sz)))
+						goto error;
+					lh->addrs = new_addrs;
+				}
+				addr = &lh->addrs[lh->n_addrs];
+				if (str2local_addr(context, word, addr))
 					/* Unparseable address */
 					break; /* skip to next line */
-			} else if (!add_local_host(context, address, start_of_word))
-				address = NULL;
-
-			start_of_word = NULL;
-			*pos = prev_c;
-			/* process next word in buf */
+				continue;
+			}
+			host_name_len = sizeof(host_name);
+			if (gldns_str2wire_dname_buf(
+			    word, host_name, &host_name_len))
+				continue;
+			canonicalize_dname(host_name);
+
+			if (n_entries >= entries_sz) {
+				entries_sz = entries_sz ? entries_sz * 2 : 64;
+				if (!(new_entries = GETDNS_XREALLOC(
+				    context->mf, entries,
+				    local_host_entry, entries_sz)))
+					goto error;
+				entries = new_entries;
+			}
+			if (!(name = local_hosts_alloc(context, host_name_len)))
+				goto error;
+			(void) memcpy(name, host_name, host_name_len);
+			entries[n_entries].name = name;
+			entries[n_entries].family = addr->family;
+			n_entries++;
+			line_entries++;
 		}
-		/* skip to next line */
-		while (*pos != '\r' && *pos != '\n')
-			if (*pos)
-				pos++;
-			else if (!fgets((pos = buf), sizeof(buf), in))
-				break; /* We're done */
-		start_of_line = 1;
-		if (address) {
-			getdns_dict_destroy(address);
-			address = NULL;
+		if (line_entries) {
+			/* Share the address with the previous line when equal,
+			 * as is common with hosts file based block lists.
+			 */
+			addr_idx = (uint32_t)lh->n_addrs;
+			if (lh->n_addrs && !addr->scope_id &&
+			    !lh->addrs[lh->n_addrs - 1].scope_id &&
+			    lh->addrs[lh->n_addrs - 1].family == addr->family &&
+			    memcmp(lh->addrs[lh->n_addrs - 1].addr, addr->addr,
+			    addr->family == AF_INET ? 4 : 16) == 0)
+				addr_idx--;
+			else
+				lh->n_addrs++;
+			while (line_entries)
+				entries[n_entries - line_entries--].addr_idx =
+				    addr_idx;
 		}
-		pos = buf;
-read_more:	;
+		/* skip to next line */
+		while (pos < end && *pos != '\n')
+			pos++;
+		if (pos < end)
+			pos++;
 	}
-	fclose(in);
-	if (address) {
-		/* One last name for this address? */
-		if (start_of_word && !start_of_line)
-			if (!add_local_host(context, address, start_of_word))
-				address = NULL;
-		getdns_dict_destroy(address);
+	if (!local_hosts_from_entries(context, entries, n_entries)) {
+		if (entries)
+			GETDNS_FREE(context->mf, entries);
+		return 0;
 	}
+error:
+	if (entries)
+		GETDNS_FREE(context->mf, entries);
+	destroy_local_hosts(context, lh);
+	return -1;
+}
+
+/* The hosts file set with getdns_context_set_hosts, or the system's */
+static const char *
+local_hosts_fn(getdns_context *context)
+{
+	if (context->hosts)
+		return context->hosts;
+#ifdef USE_WINSOCK
+	return "c:\\WINDOWS\\system32\\drivers\\etc\\hosts";
+#else
+	return GETDNS_FN_HOSTS;
+#endif
+}
+
+/** return 0 on success */
+static int
+create_local_hosts(getdns_context *context)
+{
+	const char *fn = local_hosts_fn(context);
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	int fd;
+	struct stat st;
+	void *data;
+#else
+	FILE *in;
+	char *data;
+	long len;
+#endif
+	int r = -1;
+
+	if (context->fchg_hosts == NULL) {
+		context->fchg_hosts = GETDNS_MALLOC(context->my_mf, struct filechg);
+		if (context->fchg_hosts == NULL)
+			return -1;
+		context->fchg_hosts->fn       = (char *)fn;
+		context->fchg_hosts->prevstat = NULL;
+		context->fchg_hosts->changes  = GETDNS_FCHG_NOCHANGES;
+		context->fchg_hosts->errors   = GETDNS_FCHG_NOERROR;
+		_getdns_filechg_check(context, context->fchg_hosts);
+	}
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	if ((fd = open(fn, O_RDONLY)) < 0)
+		return -1;
+
+	if (fstat(fd, &st) != 0)
+		; /* r = -1 */
+
+	else if (st.st_size == 0)
+		r = 0;
+
+	else if ((data = mmap(NULL, (size_t)st.st_size, PROT_READ,
+	    MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+		r = parse_local_hosts(context, data, (size_t)st.st_size);
+		(void) munmap(data, (size_t)st.st_size);
+	}
+	close(fd);
+#else
+	if (!(in = fopen(fn, "rb")))
+		return -1;
+
+	if (fseek(in, 0, SEEK_END) != 0 || (len = ftell(in)) < 0)
+		; /* r = -1 */
+
+	else if (len == 0)
+		r = 0;
+
+	else if (fseek(in, 0, SEEK_SET) == 0 &&
+	    (data = GETDNS_XMALLOC(context->mf, char, len))) {
+		if (fread(data, 1, len, in) == (size_t)len)
+			r = parse_local_hosts(context, data, (size_t)len);
+		GETDNS_FREE(context->mf, data);
+	}
+	fclose(in);
+#endif
+	return r;
+}
+
+/* Replace the local hosts table, but keep the current one on failure */
+static void
+reload_local_hosts(getdns_context *context)
+{
+	_getdns_local_hosts prev = context->local_hosts;
+
+	(void) memset(&context->local_hosts, 0, sizeof(_getdns_local_hosts));
+	if (create_local_hosts(context)) {
+		destroy_local_hosts(context, &context->local_hosts);
+		context->local_hosts = prev;
+	} else
+		destroy_local_hosts(context, &prev);
 }
 
 /**
@@ -631,6 +844,10 @@ _getdns_filechg_check(struct getdns_context *context, struct filechg *fchg)
             fchg->changes |= GETDNS_FCHG_MTIME;
         if(fchg->prevstat->st_ctime != finfo->st_ctime)
             fchg->changes |= GETDNS_FCHG_CTIME;
+        if(fchg->prevstat->st_ino  != finfo->st_ino ||
+           fchg->prevstat->st_dev  != finfo->st_dev ||
+           fchg->prevstat->st_size != finfo->st_size)
+            fchg->changes |= GETDNS_FCHG_INODE;
     	GETDNS_FREE(context->my_mf, fchg->prevstat);
     }
     fchg->prevstat = finfo;
@@ -645,17 +862,62 @@ upstreams_create(getdns_context *context, size_t size)
 	    sizeof(getdns_upstreams) +
 	    sizeof(getdns_upstream) * size);
 	r->mf = context->mf;
+	r->context = context;
 	r->referenced = 1;
 	r->count = 0;
 	r->current_udp = 0;
+	r->buf_pool = &context->buf_pool;
 	return r;
 }
 
+static void
+upstream_cleanup(getdns_upstreams *upstreams, getdns_upstream *upstream)
+{
+	getdns_dns_req *dnsreq;
+
+	if (upstream->loop && (   upstream->event.read_cb
+			       || upstream->event.write_cb
+			       || upstream->event.timeout_cb) ) {
+
+		GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
+		upstream->event.read_cb = NULL;
+		upstream->event.write_cb = NULL;
+		upstream->event.timeout_cb = NULL;
+	}
+	if (upstream->loop &&  upstream->finished_event.timeout_cb) {
+		GETDNS_CLEAR_EVENT(upstream->loop,
+		    &upstream->finished_event);
+		upstream->finished_event.timeout_cb = NULL;
+	}
+	while (upstream->finished_dnsreqs) {
+		dnsreq = upstream->finished_dnsreqs;
+		upstream->finished_dnsreqs = dnsreq->finished_next;
+		(void) _getdns_context_cancel_request(dnsreq->context,
+		    dnsreq->trans_id, 1);
+	}
+	if (upstream->tls_obj != NULL) {
+		SSL_shutdown(upstream->tls_obj);
+		SSL_free(upstream->tls_obj);
+	}
+	if (upstream->tls_session != NULL)
+		SSL_SESSION_free(upstream->tls_session);
+	if (upstream->fd != -1)
+	{
+#ifdef USE_WINSOCK
+		closesocket(upstream->fd);
+#else
+		close(upstream->fd);
+#endif
+	}
+	_getdns_buf_pool_release(upstreams->buf_pool, upstream->tcp.read_buf);
+	_getdns_buf_pool_release(upstreams->buf_pool, upstream->tcp.write_batch);
+	_getdns_qid_table_clear(&upstream->netreq_by_query_id, &upstreams->mf);
+}
+
 void
 _getdns_upstreams_dereference(getdns_upstreams *upstreams)
 {
-	getdns_upstream *upstream;
-	getdns_dns_req *dnsreq;
+	getdns_upstream *upstream, *conn;
 
 	if (!upstreams || --upstreams->referenced > 0)
 		return;
@@ -665,40 +927,14 @@ _getdns_upstreams_dereference(getdns_upstreams *upstreams)
 	    ; upstreams->count--, upstream++ ) {
 
 		sha256_pin_t *pin = upstream->tls_pubkey_pinset;
-		if (upstream->loop && (   upstream->event.read_cb
-		                       || upstream->event.write_cb
-		                       || upstream->event.timeout_cb) ) {
-
-			GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
-			upstream->event.read_cb = NULL;
-			upstream->event.write_cb = NULL;
-			upstream->event.timeout_cb = NULL;
-		}
-		if (upstream->loop &&  upstream->finished_event.timeout_cb) {
-			GETDNS_CLEAR_EVENT(upstream->loop,
-			    &upstream->finished_event);
-			upstream->finished_event.timeout_cb = NULL;
-		}
-		while (upstream->finished_dnsreqs) {
-			dnsreq = upstream->finished_dnsreqs;
-			upstream->finished_dnsreqs = dnsreq->finished_next;
-			(void) _getdns_context_cancel_request(dnsreq->context,
-			    dnsreq->trans_id, 1);
-		}
-		if (upstream->tls_obj != NULL) {
-		    if (upstream->tls_session != NULL)
-				SSL_SESSION_free(upstream->tls_session);
-			SSL_shutdown(upstream->tls_obj);
-			SSL_free(upstream->tls_obj);
-		}
-		if (upstream->fd != -1)
-		{
-#ifdef USE_WINSOCK
-			closesocket(upstream->fd);
-#else
-			close(upstream->fd);
-#endif
+
+		while ((conn = upstream->conn_next)) {
+			upstream->conn_next = conn->conn_next;
+			upstream_cleanup(upstreams, conn);
+			GETDNS_FREE(upstreams->mf, conn);
 		}
+		upstream_cleanup(upstreams, upstream);
+		_getdns_upstream_tsig_hmac_free(upstream);
 		while (pin) {
 			sha256_pin_t *nextpin = pin->next;
 			GETDNS_FREE(upstreams->mf, pin);
@@ -738,6 +974,11 @@ _getdns_upstream_shutdown(getdns_upstream *upstream)
 	             (upstream->transport == GETDNS_TRANSPORT_TLS ? "TLS" : "TCP"),
 	             (int)upstream->conn_completed, (int)upstream->conn_setup_failed,
 	             (int)upstream->conn_shutdowns, (int)upstream->conn_backoffs);
+	DEBUG_DAEMON("%s %s : Upstream stats: Transport=%s - TFO_ok=%d,TFO_fails=%d%s\n",
+	             STUB_DEBUG_DAEMON, upstream->addr_str,
+	             (upstream->transport == GETDNS_TRANSPORT_TLS ? "TLS" : "TCP"),
+	             (int)upstream->tfo_successes, (int)upstream->tfo_failures,
+	             (upstream->tfo_disabled ? ",TFO_disabled" : ""));
 #endif
 
 	/* Back off connections that never got up service at all (probably no
@@ -768,11 +1009,16 @@ _getdns_upstream_shutdown(getdns_upstream *upstream)
 #endif
 	}
 	// Reset per connection counters
+	upstream->tfo_attempted = 0;
+	upstream->tls_ktls_send = 0;
 	upstream->queries_sent = 0;
 	upstream->responses_received = 0;
 	upstream->responses_timeouts = 0;
 	upstream->keepalive_timeout = 0;
 	upstream->keepalive_shutdown = 0;
+	upstream->server_keepalive = 0;
+	upstream->is_warm = 0;
+	upstream->probe_sent = 0;
 
 	/* Now TLS stuff*/
 	upstream->tls_auth_state = GETDNS_AUTH_NONE;
@@ -789,6 +1035,12 @@ _getdns_upstream_shutdown(getdns_upstream *upstream)
 #endif
 		upstream->fd = -1;
 	}
+	/* Drop what was left of a coalesced write */
+	if (upstream->tcp.write_batch) {
+		_getdns_buf_pool_release(upstream->upstreams->buf_pool,
+		    upstream->tcp.write_batch);
+		upstream->tcp.write_batch = NULL;
+	}
 	/* Set connection ready for use again*/
 	if (upstream->conn_state != GETDNS_CONN_BACKOFF)
 		upstream->conn_state = GETDNS_CONN_CLOSED;
@@ -816,12 +1068,6 @@ tls_only_is_in_transports_list(getdns_context *context) {
 }
 
 
-static int
-net_req_query_id_cmp(const void *id1, const void *id2)
-{
-	return (intptr_t)id1 - (intptr_t)id2;
-}
-
 static getdns_tsig_info const tsig_info[] = {
 	  { GETDNS_NO_TSIG, NULL, 0, NULL, 0, 0, 0 }
 	, { GETDNS_HMAC_MD5   , "hmac-md5.sig-alg.reg.int", 24
@@ -910,17 +1156,28 @@ upstream_init(getdns_upstream *upstream,
 	upstream->conn_backoffs = 0;
 	upstream->total_responses = 0;
 	upstream->total_timeouts = 0;
+	upstream->tfo_successes = 0;
+	upstream->tfo_failures = 0;
+	upstream->tfo_failures_in_row = 0;
+	upstream->tfo_disabled = 0;
+	upstream->tfo_attempted = 0;
 	upstream->conn_state = GETDNS_CONN_CLOSED;
 	upstream->queries_sent = 0;
 	upstream->responses_received = 0;
 	upstream->responses_timeouts = 0;
 	upstream->keepalive_shutdown = 0;
 	upstream->keepalive_timeout = 0;
+	upstream->server_keepalive = 0;
+	upstream->is_warm = 0;
+	upstream->probe_sent = 0;
+	upstream->warm_skip = 0;
 	/* How is this upstream doing on UDP? */
 	upstream->to_retry =  2;
 	upstream->back_off =  1;
 	upstream->udp_responses = 0;
 	upstream->udp_timeouts = 0;
+	upstream->rtt_srtt = 0;
+	upstream->rtt_var = 0;
 
 	/* For sharing a socket to this upstream with TCP  */
 	upstream->fd       = -1;
@@ -930,6 +1187,7 @@ upstream_init(getdns_upstream *upstream,
 	upstream->tls_hs_state = GETDNS_HS_NONE;
 	upstream->tls_auth_name[0] = '\0';
 	upstream->tls_auth_state = GETDNS_AUTH_NONE;
+	upstream->tls_ktls_send = 0;
 	upstream->last_tls_auth_state = GETDNS_AUTH_NONE;
 	upstream->best_tls_auth_state = GETDNS_AUTH_NONE;
 	upstream->tls_pubkey_pinset = NULL;
@@ -940,6 +1198,9 @@ upstream_init(getdns_upstream *upstream,
 
 	upstream->write_queue = NULL;
 	upstream->write_queue_last = NULL;
+	upstream->write_queue_len = 0;
+	upstream->conn_next = NULL;
+	upstream->conn_primary = NULL;
 
 	upstream->finished_dnsreqs = NULL;
 	(void) getdns_eventloop_event_init(
@@ -948,14 +1209,78 @@ upstream_init(getdns_upstream *upstream,
 	upstream->has_client_cookie = 0;
 	upstream->has_prev_client_cookie = 0;
 	upstream->has_server_cookie = 0;
+	upstream->cookie_opt_len = 0;
 
 	upstream->tsig_alg  = GETDNS_NO_TSIG;
 	upstream->tsig_dname_len = 0;
 	upstream->tsig_size = 0;
+	upstream->tsig_hmac = NULL;
+	upstream->tsig_rr_len = 0;
 
 	/* Tracking of network requests on this socket */
-	_getdns_rbtree_init(&upstream->netreq_by_query_id,
-	    net_req_query_id_cmp);
+	_getdns_qid_table_init(&upstream->netreq_by_query_id);
+}
+
+/* Add a connection to the set of connections to upstream.  The new
+ * connection shares the address and settings of upstream, but starts
+ * closed and without history.
+ */
+getdns_upstream *
+_getdns_upstream_add_conn(getdns_upstream *upstream)
+{
+	getdns_upstream *primary = upstream->conn_primary
+	                         ? upstream->conn_primary : upstream;
+	getdns_upstream *conn;
+
+	if (!(conn = GETDNS_MALLOC(primary->upstreams->mf, getdns_upstream)))
+		return NULL;
+
+	(void) memcpy(conn, primary, sizeof(getdns_upstream));
+
+	conn->conn_completed = 0;
+	conn->conn_shutdowns = 0;
+	conn->conn_setup_failed = 0;
+	conn->conn_retry_time = 0;
+	conn->conn_backoffs = 0;
+	conn->total_responses = 0;
+	conn->total_timeouts = 0;
+	conn->tfo_attempted = 0;
+	conn->tls_ktls_send = 0;
+	conn->conn_state = GETDNS_CONN_CLOSED;
+	conn->queries_sent = 0;
+	conn->responses_received = 0;
+	conn->responses_timeouts = 0;
+	conn->keepalive_shutdown = 0;
+	conn->keepalive_timeout = 0;
+	conn->server_keepalive = 0;
+	conn->is_warm = 0;
+	conn->probe_sent = 0;
+	conn->warm_skip = 0;
+
+	conn->fd       = -1;
+	conn->tls_obj  = NULL;
+	conn->tls_session = NULL;
+	conn->tls_hs_state = GETDNS_HS_NONE;
+	conn->tls_auth_state = GETDNS_AUTH_NONE;
+	conn->loop = NULL;
+	(void) getdns_eventloop_event_init(
+	    &conn->event, conn, NULL, NULL, NULL);
+	(void) memset(&conn->tcp, 0, sizeof(conn->tcp));
+
+	conn->write_queue = NULL;
+	conn->write_queue_last = NULL;
+	conn->write_queue_len = 0;
+
+	conn->finished_dnsreqs = NULL;
+	(void) getdns_eventloop_event_init(
+	    &conn->finished_event, conn, NULL, NULL, NULL);
+
+	_getdns_qid_table_init(&conn->netreq_by_query_id);
+
+	conn->conn_primary = primary;
+	conn->conn_next = primary->conn_next;
+	primary->conn_next = conn;
+	return conn;
 }
 
 #ifdef USE_WINSOCK
@@ -1118,8 +1443,11 @@ set_os_defaults_windows(struct getdns_context *context)
 
 #else
 
-static getdns_return_t
-set_os_defaults(struct getdns_context *context)
+/* Read the nameservers and search suffixes from resolv.conf.
+ * returns NULL when resolv.conf could not be read.
+ */
+static getdns_upstreams *
+upstreams_from_resolvconf(struct getdns_context *context, getdns_list *suffix)
 {
 	FILE *in;
 	char line[1024], domain[1024];
@@ -1127,25 +1455,13 @@ set_os_defaults(struct getdns_context *context)
 	size_t upstream_count, length;
 	struct addrinfo hints;
 	struct addrinfo *result;
+	getdns_upstreams *upstreams;
 	getdns_upstream *upstream;
-	getdns_list     *suffix;
 	int s;
 
-	if(context->fchg_resolvconf == NULL) {
-		context->fchg_resolvconf =
-		    GETDNS_MALLOC(context->my_mf, struct filechg);
-		if(context->fchg_resolvconf == NULL)
-			return GETDNS_RETURN_MEMORY_ERROR;
-		context->fchg_resolvconf->fn       = "/etc/resolv.conf";
-		context->fchg_resolvconf->prevstat = NULL;
-		context->fchg_resolvconf->changes  = GETDNS_FCHG_NOCHANGES;
-		context->fchg_resolvconf->errors   = GETDNS_FCHG_NOERROR;
-	}
-	_getdns_filechg_check(context, context->fchg_resolvconf);
-
 	in = fopen(context->fchg_resolvconf->fn, "r");
 	if (!in)
-		return GETDNS_RETURN_GOOD;
+		return NULL;
 
 	upstream_count = 0;
 	while (fgets(line, (int)sizeof(line), in))
@@ -1153,13 +1469,13 @@ set_os_defaults(struct getdns_context *context)
 			upstream_count++;
 	fclose(in);
 
-	suffix = getdns_list_create_with_context(context);
-	context->upstreams = upstreams_create(
-	    context, upstream_count * GETDNS_UPSTREAM_TRANSPORTS);
+	if (!(upstreams = upstreams_create(
+	    context, upstream_count * GETDNS_UPSTREAM_TRANSPORTS)))
+		return NULL;
 
 	in = fopen(context->fchg_resolvconf->fn, "r");
 	if (!in)
-		return GETDNS_RETURN_GOOD;
+		return upstreams;
 
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family    = AF_UNSPEC;      /* Allow IPv4 or IPv6 */
@@ -1218,9 +1534,8 @@ set_os_defaults(struct getdns_context *context)
 			if (!result)
 				continue;
 
-			upstream = &context->upstreams->
-			    upstreams[context->upstreams->count++];
-			upstream_init(upstream, context->upstreams, result);
+			upstream = &upstreams->upstreams[upstreams->count++];
+			upstream_init(upstream, upstreams, result);
 			upstream->transport = getdns_upstream_transports[i];
 			freeaddrinfo(result);
 		}
@@ -1230,13 +1545,174 @@ set_os_defaults(struct getdns_context *context)
 	(void) getdns_list_get_length(suffix, &length);
 	if (length == 0 && *domain != 0)
 		_getdns_list_append_string(suffix, domain);
-	(void )getdns_context_set_suffix(context, suffix);
+
+	return upstreams;
+}
+
+static getdns_return_t
+set_os_defaults(struct getdns_context *context)
+{
+	getdns_list *suffix;
+
+	if(context->fchg_resolvconf == NULL) {
+		context->fchg_resolvconf =
+		    GETDNS_MALLOC(context->my_mf, struct filechg);
+		if(context->fchg_resolvconf == NULL)
+			return GETDNS_RETURN_MEMORY_ERROR;
+		context->fchg_resolvconf->fn       = GETDNS_FN_RESOLVCONF;
+		context->fchg_resolvconf->prevstat = NULL;
+		context->fchg_resolvconf->changes  = GETDNS_FCHG_NOCHANGES;
+		context->fchg_resolvconf->errors   = GETDNS_FCHG_NOERROR;
+	}
+	_getdns_filechg_check(context, context->fchg_resolvconf);
+
+	if (!(suffix = getdns_list_create_with_context(context)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	if ((context->upstreams = upstreams_from_resolvconf(context, suffix))) {
+		(void )getdns_context_set_suffix(context, suffix);
+		context->os_upstreams = 1;
+		context->os_suffix = 1;
+	}
 	getdns_list_destroy(suffix);
 
 	return GETDNS_RETURN_GOOD;
 } /* set_os_defaults */
+
+static int
+upstream_equal(getdns_upstream *a, getdns_upstream *b)
+{
+	return a->addr_len == b->addr_len &&
+	    memcmp(&a->addr, &b->addr, a->addr_len) == 0 &&
+	    a->transport == b->transport &&
+	    strcmp(a->tls_auth_name, b->tls_auth_name) == 0;
+}
+
+static int
+upstreams_equal(getdns_upstreams *a, getdns_upstreams *b)
+{
+	size_t i;
+
+	if (!a || !b || a->count != b->count)
+		return 0;
+	for (i = 0; i < a->count; i++)
+		if (!upstream_equal(&a->upstreams[i], &b->upstreams[i]))
+			return 0;
+	return 1;
+}
+
+/* Apply a changed resolv.conf.  When the nameservers did not change, the
+ * current upstreams are kept as they are.  Otherwise, upstreams that are
+ * still listed inherit the state and idle connections of their current
+ * counterparts.  Outstanding requests finish on the upstreams they were
+ * scheduled on.
+ */
+static void
+reload_resolvconf(struct getdns_context *context)
+{
+	getdns_upstreams *upstreams;
+	getdns_list *suffix;
+	size_t i, j;
+
+	if (!(suffix = getdns_list_create_with_context(context)))
+		return;
+
+	if (!(upstreams = upstreams_from_resolvconf(context, suffix))) {
+		getdns_list_destroy(suffix);
+		return;
+	}
+	if (context->os_suffix) {
+		(void )getdns_context_set_suffix(context, suffix);
+		context->os_suffix = 1;
+	}
+	getdns_list_destroy(suffix);
+
+	if (!context->os_upstreams ||
+	    upstreams_equal(upstreams, context->upstreams)) {
+		_getdns_upstreams_dereference(upstreams);
+		return;
+	}
+	for (i = 0; context->upstreams && i < upstreams->count; i++) {
+		for (j = 0; j < context->upstreams->count; j++) {
+			if (upstream_equal(&upstreams->upstreams[i],
+			    &context->upstreams->upstreams[j])) {
+				_getdns_upstream_inherit(&upstreams->upstreams[i],
+				    &context->upstreams->upstreams[j]);
+				break;
+			}
+		}
+	}
+	_getdns_upstreams_dereference(context->upstreams);
+	context->upstreams = upstreams;
+	_getdns_upstreams_warm(context);
+	dispatch_updated(context,
+		GETDNS_CONTEXT_CODE_UPSTREAM_RECURSIVE_SERVERS);
+}
 #endif
 
+/* Watch resolv.conf and the hosts file with inotify, when available.  The
+ * directory is watched as well, to notice files being replaced.
+ */
+static void
+watch_os_files(struct getdns_context *context)
+{
+#ifdef USE_INOTIFY
+	static const uint32_t file_mask = IN_MODIFY | IN_CLOSE_WRITE
+	    | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+	static const uint32_t dir_mask = IN_CREATE | IN_MOVED_TO
+	    | IN_MOVED_FROM | IN_DELETE;
+
+	if (context->fchg_fd == -1 &&
+	    (context->fchg_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+		return;
+
+	(void) inotify_add_watch(context->fchg_fd, "/etc", dir_mask);
+	if (context->fchg_resolvconf)
+		(void) inotify_add_watch(context->fchg_fd,
+		    context->fchg_resolvconf->fn, file_mask);
+	if (context->fchg_hosts)
+		(void) inotify_add_watch(context->fchg_fd,
+		    context->fchg_hosts->fn, file_mask);
+#else
+	(void)context;
+#endif
+}
+
+/* Reload resolv.conf and the hosts file when they have changed.  With
+ * inotify, the files are only looked at after a notification.  Otherwise
+ * they are stat'ed at most once per second.
+ */
+static void
+check_os_files(struct getdns_context *context)
+{
+	time_t now;
+#ifdef USE_INOTIFY
+	char buf[4096];
+	int notified = 0;
+
+	if (context->fchg_fd != -1) {
+		while (read(context->fchg_fd, buf, sizeof(buf)) > 0)
+			notified = 1;
+		if (!notified)
+			return;
+		/* Watches on replaced files are gone, so renew them */
+		watch_os_files(context);
+	} else
+#endif
+	if ((now = time(NULL)) == context->fchg_checked)
+		return;
+	else
+		context->fchg_checked = now;
+
+#ifndef USE_WINSOCK
+	if ((context->os_upstreams || context->os_suffix) &&
+	    _getdns_filechg_check(context, context->fchg_resolvconf) > 0)
+		reload_resolvconf(context);
+#endif
+	if (_getdns_filechg_check(context, context->fchg_hosts) > 0)
+		reload_local_hosts(context);
+}
+
 /* compare of transaction ids in DESCENDING order
    so that 0 comes last
 */
@@ -1318,10 +1794,12 @@ getdns_context_create_with_extended_memory_functions(
 	result->my_mf.mf.ext.malloc  = malloc;
 	result->my_mf.mf.ext.realloc = realloc;
 	result->my_mf.mf.ext.free    = free;
+	_getdns_buf_pool_init(&result->buf_pool, &result->my_mf);
 
 	result->update_callback  = NULL;
 	result->update_callback2 = NULL_update_callback;
 	result->update_userarg   = NULL;
+	result->config_serial    = 0;
 
 	result->mf.mf_arg         = userarg;
 	result->mf.mf.ext.malloc  = malloc;
@@ -1331,7 +1809,8 @@ getdns_context_create_with_extended_memory_functions(
 	result->resolution_type_set = 0;
 
 	_getdns_rbtree_init(&result->outbound_requests, transaction_id_cmp);
-	_getdns_rbtree_init(&result->local_hosts, local_host_cmp);
+	(void) memset(&result->local_hosts, 0, sizeof(_getdns_local_hosts));
+	result->hosts = NULL;
 
 	result->server = NULL;
 
@@ -1385,6 +1864,17 @@ getdns_context_create_with_extended_memory_functions(
 	result->edns_do_bit = 0;
 	result->edns_client_subnet_private = 0;
 	result->tls_query_padding_blocksize = 1; /* default is to not try to pad */
+	result->max_upstream_connections = 1;
+	result->udp_hedging = 0;
+	result->tls_warm_upstreams = 0;
+	result->tls_warm_loop_used = 0;
+	result->tls_kernel_offload = 0;
+	result->tls_sessions = NULL;
+	result->n_tls_sessions = 0;
+	result->tls_session_cache_file = NULL;
+	result->tls_sessions_dirty = 0;
+	result->tls_verified = NULL;
+	result->n_tls_verified = 0;
 	result->tls_ctx = NULL;
 
 	result->extension = &result->default_eventloop.loop;
@@ -1414,6 +1904,10 @@ getdns_context_create_with_extended_memory_functions(
 	 */
 	result->fchg_resolvconf = NULL;
 	result->fchg_hosts      = NULL;
+	result->fchg_fd         = -1;
+	result->fchg_checked    = 0;
+	result->os_upstreams    = 0;
+	result->os_suffix       = 0;
 
 	// resolv.conf does not exist on Windows, handle differently
 #ifndef USE_WINSOCK 
@@ -1458,7 +1952,8 @@ getdns_context_create_with_extended_memory_functions(
 		goto error;
 #endif
 
-	create_local_hosts(result);
+	(void) create_local_hosts(result);
+	watch_os_files(result);
 
 	*context = result;
 	return GETDNS_RETURN_GOOD;
@@ -1555,8 +2050,17 @@ getdns_context_destroy(struct getdns_context *context)
 			GETDNS_FREE(context->my_mf, context->fchg_hosts->prevstat);
 		GETDNS_FREE(context->my_mf, context->fchg_hosts);
 	}
+#ifdef USE_INOTIFY
+	if (context->fchg_fd != -1)
+		close(context->fchg_fd);
+#endif
 	if (context->tls_ctx)
 		SSL_CTX_free(context->tls_ctx);
+	tls_sessions_flush(context);
+	tls_sessions_clear(context);
+	tls_verified_clear(context);
+	if (context->tls_session_cache_file)
+		GETDNS_FREE(context->my_mf, context->tls_session_cache_file);
 
 	getdns_list_destroy(context->dns_root_servers);
 
@@ -1572,9 +2076,10 @@ getdns_context_destroy(struct getdns_context *context)
 	    context->trust_anchors != context->trust_anchors_spc)
 		GETDNS_FREE(context->mf, context->trust_anchors);
 
-	_getdns_traverse_postorder(&context->local_hosts,
-	    destroy_local_host, context);
-
+	destroy_local_hosts(context, &context->local_hosts);
+	if (context->hosts)
+		GETDNS_FREE(context->my_mf, context->hosts);
+	_getdns_buf_pool_clear(&context->buf_pool);
 
 	getdns_dict_destroy(context->header);
 	getdns_dict_destroy(context->add_opt_parameters);
@@ -1756,6 +2261,8 @@ rebuild_ub_ctx(struct getdns_context* context) {
 static void
 dispatch_updated(struct getdns_context *context, uint16_t item)
 {
+	context->config_serial++;
+
 	if (context->update_callback2 != NULL_update_callback)
 		context->update_callback2(
 		    context, item, context->update_userarg);
@@ -2326,6 +2833,7 @@ getdns_context_set_suffix(getdns_context *context, getdns_list *value)
 
 		context->suffixes = no_suffixes;
 		context->suffixes_len = sizeof(no_suffixes);
+		context->os_suffix = 0;
 		return GETDNS_RETURN_GOOD;
 	}
 	gldns_buffer_init_frm_data(&gbuf, buf_spc, sizeof(buf_spc));
@@ -2386,6 +2894,7 @@ getdns_context_set_suffix(getdns_context *context, getdns_list *value)
 
 	context->suffixes = suffixes;
 	context->suffixes_len = suffixes_len;
+	context->os_suffix = 0;
 
 	dispatch_updated(context, GETDNS_CONTEXT_CODE_SUFFIX);
 	return GETDNS_RETURN_GOOD;
@@ -2690,6 +3199,8 @@ getdns_context_set_upstream_recursive_servers(struct getdns_context *context,
 	}
 	_getdns_upstreams_dereference(context->upstreams);
 	context->upstreams = upstreams;
+	context->os_upstreams = 0;
+	_getdns_upstreams_warm(context);
 	dispatch_updated(context,
 		GETDNS_CONTEXT_CODE_UPSTREAM_RECURSIVE_SERVERS);
 
@@ -2785,51 +3296,208 @@ getdns_context_set_edns_do_bit(struct getdns_context *context, uint8_t value)
 
     context->edns_do_bit = value;
 
-    dispatch_updated(context, GETDNS_CONTEXT_CODE_EDNS_DO_BIT);
+    dispatch_updated(context, GETDNS_CONTEXT_CODE_EDNS_DO_BIT);
+
+    return GETDNS_RETURN_GOOD;
+}               /* getdns_context_set_edns_do_bit */
+
+/*
+ * getdns_context_set_edns_client_subnet_private
+ *
+ */
+getdns_return_t
+getdns_context_set_edns_client_subnet_private(struct getdns_context *context, uint8_t value)
+{
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    /* only allow 1 */
+    if (value != 0 && value != 1) {
+        return GETDNS_RETURN_CONTEXT_UPDATE_FAIL;
+    }
+
+    context->edns_client_subnet_private = value;
+
+    dispatch_updated(context, GETDNS_CONTEXT_CODE_EDNS_CLIENT_SUBNET_PRIVATE);
+
+    return GETDNS_RETURN_GOOD;
+}               /* getdns_context_set_edns_client_subnet_private */
+
+/*
+ * getdns_context_set_tls_query_padding_blocksize
+ *
+ */
+getdns_return_t
+getdns_context_set_tls_query_padding_blocksize(struct getdns_context *context, uint16_t value)
+{
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    /* only allow values between 0 and MAXIMUM_UPSTREAM_OPTION_SPACE - 4
+       (4 is for the overhead of the option itself) */
+    if (value > MAXIMUM_UPSTREAM_OPTION_SPACE - 4) {
+        return GETDNS_RETURN_CONTEXT_UPDATE_FAIL;
+    }
+
+    context->tls_query_padding_blocksize = value;
+
+    dispatch_updated(context, GETDNS_CONTEXT_CODE_TLS_QUERY_PADDING_BLOCKSIZE);
+
+    return GETDNS_RETURN_GOOD;
+}               /* getdns_context_set_tls_query_padding_blocksize */
+
+/*
+ * getdns_context_set_max_upstream_connections
+ *
+ */
+getdns_return_t
+getdns_context_set_max_upstream_connections(
+    struct getdns_context *context, uint16_t value)
+{
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    if (value == 0)
+        return GETDNS_RETURN_INVALID_PARAMETER;
+
+    context->max_upstream_connections = value;
+
+    dispatch_updated(context, GETDNS_CONTEXT_CODE_MAX_UPSTREAM_CONNECTIONS);
+
+    return GETDNS_RETURN_GOOD;
+}               /* getdns_context_set_max_upstream_connections */
+
+/*
+ * getdns_context_set_udp_hedging
+ *
+ */
+getdns_return_t
+getdns_context_set_udp_hedging(struct getdns_context *context, uint8_t value)
+{
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    if (value != 0 && value != 1)
+        return GETDNS_RETURN_INVALID_PARAMETER;
+
+    context->udp_hedging = value;
+
+    dispatch_updated(context, GETDNS_CONTEXT_CODE_UDP_HEDGING);
+
+    return GETDNS_RETURN_GOOD;
+}               /* getdns_context_set_udp_hedging */
+
+/*
+ * getdns_context_set_tls_session_cache_file
+ *
+ */
+getdns_return_t
+getdns_context_set_tls_session_cache_file(
+    struct getdns_context *context, const char *filename)
+{
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    if (filename && (!*filename || strlen(filename) + 4 >= FILENAME_MAX))
+        return GETDNS_RETURN_INVALID_PARAMETER;
+
+    tls_sessions_flush(context);
+    if (context->tls_session_cache_file)
+        GETDNS_FREE(context->my_mf, context->tls_session_cache_file);
+    context->tls_session_cache_file = NULL;
+
+    if (filename) {
+        if (!(context->tls_session_cache_file =
+            _getdns_strdup(&context->my_mf, filename)))
+            return GETDNS_RETURN_MEMORY_ERROR;
+        tls_sessions_load(context);
+    }
+    dispatch_updated(context, GETDNS_CONTEXT_CODE_TLS_SESSION_CACHE_FILE);
+
+    return GETDNS_RETURN_GOOD;
+}               /* getdns_context_set_tls_session_cache_file */
+
+/*
+ * getdns_context_set_hosts
+ *
+ */
+getdns_return_t
+getdns_context_set_hosts(struct getdns_context *context, const char *hosts)
+{
+    char *prev_hosts;
+    struct filechg *prev_fchg;
+    _getdns_local_hosts prev;
+
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    RETURN_IF_NULL(hosts, GETDNS_RETURN_INVALID_PARAMETER);
+
+    prev_hosts = context->hosts;
+    prev_fchg = context->fchg_hosts;
+    prev = context->local_hosts;
+    if (!(context->hosts = _getdns_strdup(&context->my_mf, hosts))) {
+        context->hosts = prev_hosts;
+        return GETDNS_RETURN_MEMORY_ERROR;
+    }
+    /* The new file is watched from scratch */
+    context->fchg_hosts = NULL;
+    (void) memset(&context->local_hosts, 0, sizeof(_getdns_local_hosts));
+    if (create_local_hosts(context)) {
+        /* Keep the current file and table */
+        destroy_local_hosts(context, &context->local_hosts);
+        if (context->fchg_hosts) {
+            if (context->fchg_hosts->prevstat)
+                GETDNS_FREE(context->my_mf, context->fchg_hosts->prevstat);
+            GETDNS_FREE(context->my_mf, context->fchg_hosts);
+        }
+        GETDNS_FREE(context->my_mf, context->hosts);
+        context->hosts = prev_hosts;
+        context->fchg_hosts = prev_fchg;
+        context->local_hosts = prev;
+        return GETDNS_RETURN_GENERIC_ERROR;
+    }
+    destroy_local_hosts(context, &prev);
+    if (prev_fchg) {
+        if (prev_fchg->prevstat)
+            GETDNS_FREE(context->my_mf, prev_fchg->prevstat);
+        GETDNS_FREE(context->my_mf, prev_fchg);
+    }
+    if (prev_hosts)
+        GETDNS_FREE(context->my_mf, prev_hosts);
+#ifdef USE_INOTIFY
+    if (context->fchg_fd != -1)
+        watch_os_files(context);
+#endif
+    dispatch_updated(context, GETDNS_CONTEXT_CODE_HOSTS);
 
     return GETDNS_RETURN_GOOD;
-}               /* getdns_context_set_edns_do_bit */
+}               /* getdns_context_set_hosts */
 
 /*
- * getdns_context_set_edns_client_subnet_private
+ * getdns_context_set_tls_warm_upstreams
  *
  */
 getdns_return_t
-getdns_context_set_edns_client_subnet_private(struct getdns_context *context, uint8_t value)
+getdns_context_set_tls_warm_upstreams(
+    struct getdns_context *context, uint16_t value)
 {
     RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
-    /* only allow 1 */
-    if (value != 0 && value != 1) {
-        return GETDNS_RETURN_CONTEXT_UPDATE_FAIL;
-    }
 
-    context->edns_client_subnet_private = value;
+    context->tls_warm_upstreams = value;
+    _getdns_upstreams_warm(context);
 
-    dispatch_updated(context, GETDNS_CONTEXT_CODE_EDNS_CLIENT_SUBNET_PRIVATE);
+    dispatch_updated(context, GETDNS_CONTEXT_CODE_TLS_WARM_UPSTREAMS);
 
     return GETDNS_RETURN_GOOD;
-}               /* getdns_context_set_edns_client_subnet_private */
+}               /* getdns_context_set_tls_warm_upstreams */
 
 /*
- * getdns_context_set_tls_query_padding_blocksize
+ * getdns_context_set_tls_kernel_offload
  *
  */
 getdns_return_t
-getdns_context_set_tls_query_padding_blocksize(struct getdns_context *context, uint16_t value)
+getdns_context_set_tls_kernel_offload(
+    struct getdns_context *context, uint8_t value)
 {
     RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
-    /* only allow values between 0 and MAXIMUM_UPSTREAM_OPTION_SPACE - 4
-       (4 is for the overhead of the option itself) */
-    if (value > MAXIMUM_UPSTREAM_OPTION_SPACE - 4) {
-        return GETDNS_RETURN_CONTEXT_UPDATE_FAIL;
-    }
+    if (value != 0 && value != 1)
+        return GETDNS_RETURN_INVALID_PARAMETER;
 
-    context->tls_query_padding_blocksize = value;
+    context->tls_kernel_offload = value;
 
-    dispatch_updated(context, GETDNS_CONTEXT_CODE_TLS_QUERY_PADDING_BLOCKSIZE);
+    dispatch_updated(context, GETDNS_CONTEXT_CODE_TLS_KERNEL_OFFLOAD);
 
     return GETDNS_RETURN_GOOD;
-}               /* getdns_context_set_tls_query_padding_blocksize */
+}               /* getdns_context_set_tls_kernel_offload */
 /*
  * getdns_context_set_extended_memory_functions
  *
@@ -2901,6 +3569,8 @@ _getdns_context_cancel_request(getdns_context *context,
     getdns_transaction_t transaction_id, int fire_callback)
 {
 	getdns_dns_req *dnsreq;
+	getdns_callback_t cb;
+	void *user_arg;
 
 	if (!context)
 		return GETDNS_RETURN_INVALID_PARAMETER;
@@ -2913,15 +3583,19 @@ _getdns_context_cancel_request(getdns_context *context,
 	/* do the cancel */
 	cancel_dns_req(dnsreq);
 
+	/* clean up before the callback, which may release the memory of
+	 * the request when it was allocated by getdns_general_bulk.
+	 */
+	cb = dnsreq->user_callback;
+	user_arg = dnsreq->user_pointer;
+	_getdns_dns_req_free(dnsreq);
+
 	if (fire_callback) {
 		context->processing = 1;
-		dnsreq->user_callback(context, GETDNS_CALLBACK_CANCEL,
-		    NULL, dnsreq->user_pointer, transaction_id);
+		cb(context, GETDNS_CALLBACK_CANCEL,
+		    NULL, user_arg, transaction_id);
 		context->processing = 0;
 	}
-
-	/* clean up */
-	_getdns_dns_req_free(dnsreq);
 	return GETDNS_RETURN_GOOD;
 }
 
@@ -3114,6 +3788,455 @@ _getdns_ns_dns_setup(struct getdns_context *context)
 	return GETDNS_RETURN_BAD_CONTEXT;
 }
 
+/* TLS sessions are kept per upstream address, port, authentication name and
+ * pinset, so that a session is only resumed with an upstream that is
+ * authenticated with the same credentials as the one it was established
+ * with.  Returns the length of the key, or 0 when it doesn't fit.
+ */
+static size_t
+tls_session_key(getdns_upstream *upstream, uint8_t *key, size_t key_sz)
+{
+	uint8_t *k = key;
+	size_t name_len = strlen(upstream->tls_auth_name) + 1;
+	const sha256_pin_t *pin;
+
+	if (upstream->addr.ss_family == AF_INET) {
+		struct sockaddr_in *sa4 = (struct sockaddr_in *)&upstream->addr;
+
+		if (key_sz < 7 + name_len)
+			return 0;
+		*k++ = 4;
+		(void) memcpy(k, &sa4->sin_port, 2);
+		(void) memcpy(k + 2, &sa4->sin_addr, 4);
+		k += 6;
+	} else {
+		struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)&upstream->addr;
+
+		if (key_sz < 23 + name_len)
+			return 0;
+		*k++ = 6;
+		(void) memcpy(k, &sa6->sin6_port, 2);
+		(void) memcpy(k + 2, &sa6->sin6_addr, 16);
+		(void) memcpy(k + 18, &sa6->sin6_scope_id, 4);
+		k += 22;
+	}
+	(void) memcpy(k, upstream->tls_auth_name, name_len);
+	k += name_len;
+
+	for (pin = upstream->tls_pubkey_pinset; pin; pin = pin->next) {
+		if (k + sizeof(pin->pin) > key + key_sz)
+			return 0;
+		(void) memcpy(k, pin->pin, sizeof(pin->pin));
+		k += sizeof(pin->pin);
+	}
+	return k - key;
+}
+
+static int
+tls_session_expired(SSL_SESSION *session, time_t now)
+{
+	return (long)now >= SSL_SESSION_get_time(session)
+	                  + SSL_SESSION_get_timeout(session);
+}
+
+static _getdns_tls_session **
+tls_session_find(getdns_context *context, const uint8_t *key, size_t key_len)
+{
+	_getdns_tls_session **s;
+
+	for (s = &context->tls_sessions; *s; s = &(*s)->next)
+		if ((*s)->key_len == key_len &&
+		    memcmp((*s)->data, key, key_len) == 0)
+			break;
+	return s;
+}
+
+static void
+tls_session_unlink(getdns_context *context, _getdns_tls_session **s)
+{
+	_getdns_tls_session *to_free = *s;
+
+	*s = to_free->next;
+	GETDNS_FREE(context->my_mf, to_free);
+	context->n_tls_sessions--;
+}
+
+static void
+tls_sessions_clear(getdns_context *context)
+{
+	while (context->tls_sessions)
+		tls_session_unlink(context, &context->tls_sessions);
+}
+
+/* Link a new session, as most recent when s points at the head of the list,
+ * or as least recent when it points at the next field of the last one.
+ */
+static _getdns_tls_session *
+tls_session_link(getdns_context *context, _getdns_tls_session **s,
+    const uint8_t *key, size_t key_len, size_t der_len,
+    getdns_auth_state_t auth_state)
+{
+	_getdns_tls_session *session, **last;
+
+	if (!(session = (_getdns_tls_session *)GETDNS_XMALLOC(context->my_mf,
+	    uint8_t, sizeof(_getdns_tls_session) + key_len + der_len)))
+		return NULL;
+
+	session->auth_state = auth_state;
+	session->key_len = key_len;
+	session->der_len = der_len;
+	(void) memcpy(session->data, key, key_len);
+	session->next = *s;
+	*s = session;
+
+	if (++context->n_tls_sessions > GETDNS_TLS_SESSIONS_MAX) {
+		for ( last = &context->tls_sessions
+		    ; (*last)->next; last = &(*last)->next)
+			; /* pass */
+		tls_session_unlink(context, last);
+	}
+	return session;
+}
+
+/* The session cache file starts with TLS_SESSIONS_MAGIC, followed by
+ * records with a two octet key length, the key, one octet authentication
+ * state, a two octet DER length and the session in DER.  Lengths are in
+ * network byte order.  Sessions hold the secrets to resume a connection
+ * with, so the file is created readable by the owner only.
+ */
+#define TLS_SESSIONS_MAGIC "getdns-tls-sessions-1\n"
+
+static void
+tls_sessions_save(getdns_context *context)
+{
+	char tmp_fn[FILENAME_MAX];
+	FILE *fh;
+	_getdns_tls_session *s;
+	uint8_t hdr[2];
+	int fd, r;
+
+	if (snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp",
+	    context->tls_session_cache_file) >= (int)sizeof(tmp_fn))
+		return;
+#ifndef USE_WINSOCK
+	if ((fd = open(tmp_fn, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+		return;
+	if (!(fh = fdopen(fd, "wb"))) {
+		close(fd);
+		(void) unlink(tmp_fn);
+		return;
+	}
+#else
+	(void) fd;
+	if (!(fh = fopen(tmp_fn, "wb")))
+		return;
+#endif
+	r = fwrite(TLS_SESSIONS_MAGIC, sizeof(TLS_SESSIONS_MAGIC) - 1, 1, fh);
+	for (s = context->tls_sessions; s && r == 1; s = s->next) {
+		gldns_write_uint16(hdr, s->key_len);
+		if ((r = fwrite(hdr, 2, 1, fh)) != 1 ||
+		    (r = fwrite(s->data, s->key_len, 1, fh)) != 1)
+			break;
+		hdr[0] = (uint8_t)s->auth_state;
+		if ((r = fwrite(hdr, 1, 1, fh)) != 1)
+			break;
+		gldns_write_uint16(hdr, s->der_len);
+		if ((r = fwrite(hdr, 2, 1, fh)) != 1)
+			break;
+		r = fwrite(s->data + s->key_len, s->der_len, 1, fh);
+	}
+	if (fclose(fh) || r != 1) {
+		(void) remove(tmp_fn);
+		return;
+	}
+#ifdef USE_WINSOCK
+	(void) remove(context->tls_session_cache_file);
+#endif
+	if (rename(tmp_fn, context->tls_session_cache_file))
+		(void) remove(tmp_fn);
+}
+
+/* Write the sessions to the session cache file, if they changed since it
+ * was last written.
+ */
+static void
+tls_sessions_flush(getdns_context *context)
+{
+	if (!context->tls_sessions_dirty)
+		return;
+	context->tls_sessions_dirty = 0;
+	if (context->tls_session_cache_file)
+		tls_sessions_save(context);
+}
+
+/* Add the not yet expired sessions from the session cache file for the
+ * upstreams that don't have a more recent session already.
+ */
+static void
+tls_sessions_load(getdns_context *context)
+{
+	FILE *fh;
+	char magic[sizeof(TLS_SESSIONS_MAGIC) - 1];
+	uint8_t *key, *der, hdr[2], auth_state;
+	const unsigned char *der_p;
+	size_t key_len, der_len;
+	_getdns_tls_session **last, *s;
+	SSL_SESSION *session;
+	time_t now = time(NULL);
+
+	if (!(fh = fopen(context->tls_session_cache_file, "rb")))
+		return;
+
+	if (fread(magic, sizeof(magic), 1, fh) != 1 ||
+	    memcmp(magic, TLS_SESSIONS_MAGIC, sizeof(magic))) {
+		(void) fclose(fh);
+		return;
+	}
+	if (!(key = GETDNS_XMALLOC(context->my_mf, uint8_t, 1024 + 65535))) {
+		(void) fclose(fh);
+		return;
+	}
+	der = key + 1024;
+	for (last = &context->tls_sessions; *last; last = &(*last)->next)
+		; /* pass */
+
+	while (context->n_tls_sessions < GETDNS_TLS_SESSIONS_MAX) {
+		if (fread(hdr, 2, 1, fh) != 1 ||
+		    (key_len = gldns_read_uint16(hdr)) > 1024 ||
+		    fread(key, key_len, 1, fh) != 1 ||
+		    fread(&auth_state, 1, 1, fh) != 1 ||
+		    fread(hdr, 2, 1, fh) != 1 ||
+		    (der_len = gldns_read_uint16(hdr)) == 0 ||
+		    fread(der, der_len, 1, fh) != 1)
+			break;
+
+		if (*tls_session_find(context, key, key_len))
+			continue;
+
+		der_p = der;
+		if (!(session = d2i_SSL_SESSION(NULL, &der_p, der_len)))
+			continue;
+		if (tls_session_expired(session, now)) {
+			SSL_SESSION_free(session);
+			continue;
+		}
+		SSL_SESSION_free(session);
+		if (!(s = tls_session_link(context, last, key, key_len,
+		    der_len, (getdns_auth_state_t)auth_state)))
+			break;
+		(void) memcpy(s->data + key_len, der, der_len);
+		last = &s->next;
+	}
+	GETDNS_FREE(context->my_mf, key);
+	(void) fclose(fh);
+}
+
+static void
+tls_session_store(getdns_context *context, getdns_upstream *upstream,
+    SSL_SESSION *session, getdns_auth_state_t auth_state)
+{
+	uint8_t key[1024], *der_p;
+	size_t key_len;
+	int der_len;
+	_getdns_tls_session **s, *new_s;
+
+	if (!(key_len = tls_session_key(upstream, key, sizeof(key))) ||
+	    (der_len = i2d_SSL_SESSION(session, NULL)) <= 0 || der_len > 65535)
+		return;
+
+	if (*(s = tls_session_find(context, key, key_len)))
+		tls_session_unlink(context, s);
+
+	if (!(new_s = tls_session_link(context, &context->tls_sessions,
+	    key, key_len, der_len, auth_state)))
+		return;
+
+	der_p = new_s->data + key_len;
+	if (i2d_SSL_SESSION(session, &der_p) != der_len) {
+		tls_session_unlink(context, &context->tls_sessions);
+		return;
+	}
+	context->tls_sessions_dirty = 1;
+}
+
+SSL_SESSION *
+_getdns_context_tls_session_fetch(getdns_context *context,
+    getdns_upstream *upstream, getdns_auth_state_t *auth_state)
+{
+	uint8_t key[1024];
+	size_t key_len;
+	_getdns_tls_session **s;
+	const unsigned char *der_p;
+	SSL_SESSION *session;
+
+	if (!(key_len = tls_session_key(upstream, key, sizeof(key))) ||
+	    !*(s = tls_session_find(context, key, key_len)))
+		return NULL;
+
+	der_p = (*s)->data + key_len;
+	if (!(session = d2i_SSL_SESSION(NULL, &der_p, (*s)->der_len)))
+		; /* pass */
+
+	else if (tls_session_expired(session, time(NULL))) {
+		SSL_SESSION_free(session);
+		session = NULL;
+	} else {
+		*auth_state = (*s)->auth_state;
+		return session;
+	}
+	tls_session_unlink(context, s);
+	return NULL;
+}
+
+/* Called by OpenSSL with every new session negotiated with an upstream.
+ * With TLS 1.3 this happens after the handshake, when a session ticket is
+ * received.  A resumed session was not verified again, so it inherits the
+ * authentication state of the session it resumed.
+ */
+static int
+tls_new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+	getdns_context *context = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	getdns_upstream *upstream = _getdns_upstream_from_SSL(ssl);
+
+	if (!context || !upstream)
+		return 0;
+
+	tls_session_store(context, upstream, session,
+	    SSL_session_reused(ssl) ? upstream->last_tls_auth_state
+	                            : upstream->tls_auth_state);
+	if (upstream->tls_session)
+		SSL_SESSION_free(upstream->tls_session);
+	upstream->tls_session = session;
+	return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000 || defined(HAVE_LIBRESSL)
+#define X509_STORE_CTX_get0_cert(store) ((store)->cert)
+#endif
+
+/* The key for the verification result of cert with the credentials of
+ * upstream.  Returns 0 when upstream has no credentials (nothing to verify)
+ * or when they do not fit.
+ */
+static int
+tls_verified_key(getdns_upstream *upstream, X509 *cert, uint8_t *key)
+{
+	uint8_t buf[1024], *b = buf;
+	unsigned int len = SHA256_DIGEST_LENGTH;
+	size_t name_len = strlen(upstream->tls_auth_name) + 1;
+	const sha256_pin_t *pin;
+
+	if (name_len == 1 && !upstream->tls_pubkey_pinset)
+		return 0;
+	if (!X509_digest(cert, EVP_sha256(), b, &len)
+	    || len + name_len > sizeof(buf))
+		return 0;
+	b += len;
+	(void) memcpy(b, upstream->tls_auth_name, name_len);
+	b += name_len;
+	for (pin = upstream->tls_pubkey_pinset; pin; pin = pin->next) {
+		if (b + sizeof(pin->pin) > buf + sizeof(buf))
+			return 0;
+		(void) memcpy(b, pin->pin, sizeof(pin->pin));
+		b += sizeof(pin->pin);
+	}
+	return EVP_Digest(buf, b - buf, key, NULL, EVP_sha256(), NULL);
+}
+
+static void
+tls_verified_clear(getdns_context *context)
+{
+	_getdns_tls_verified *v;
+
+	while ((v = context->tls_verified)) {
+		context->tls_verified = v->next;
+		GETDNS_FREE(context->my_mf, v);
+	}
+	context->n_tls_verified = 0;
+}
+
+/* Find key and move it to the front.  Entries older than
+ * GETDNS_TLS_VERIFIED_TTL are dropped.
+ */
+static int
+tls_verified_lookup(getdns_context *context, const uint8_t *key, time_t now)
+{
+	_getdns_tls_verified **v, *found;
+
+	for (v = &context->tls_verified; *v; v = &(*v)->next)
+		if (memcmp((*v)->key, key, SHA256_DIGEST_LENGTH) == 0)
+			break;
+	if (!(found = *v))
+		return 0;
+
+	*v = found->next;
+	if (now - found->verified >= GETDNS_TLS_VERIFIED_TTL) {
+		GETDNS_FREE(context->my_mf, found);
+		context->n_tls_verified--;
+		return 0;
+	}
+	found->next = context->tls_verified;
+	context->tls_verified = found;
+	return 1;
+}
+
+static void
+tls_verified_add(getdns_context *context, const uint8_t *key, time_t now)
+{
+	_getdns_tls_verified *v, **last;
+
+	if (!(v = GETDNS_MALLOC(context->my_mf, _getdns_tls_verified)))
+		return;
+	v->verified = now;
+	(void) memcpy(v->key, key, SHA256_DIGEST_LENGTH);
+	v->next = context->tls_verified;
+	context->tls_verified = v;
+
+	if (++context->n_tls_verified > GETDNS_TLS_VERIFIED_MAX) {
+		for ( last = &context->tls_verified
+		    ; (*last)->next; last = &(*last)->next)
+			; /* pass */
+		GETDNS_FREE(context->my_mf, *last);
+		*last = NULL;
+		context->n_tls_verified--;
+	}
+}
+
+/* Does the certificate verification for the handshakes with upstreams,
+ * instead of X509_verify_cert().  A server certificate that passed
+ * verification with the same credentials before (and is still within its
+ * validity period) is accepted without building and checking its chain
+ * again; tls_verify_callback() is then not called.  The TLS handshake
+ * itself still proves that the upstream holds the certificate's key.
+ */
+static int
+tls_cert_verify_cb(X509_STORE_CTX *store, void *arg)
+{
+	getdns_context *context = (getdns_context *)arg;
+	getdns_upstream *upstream = _getdns_upstream_from_x509_store(store);
+	X509 *cert = X509_STORE_CTX_get0_cert(store);
+	uint8_t key[SHA256_DIGEST_LENGTH];
+	time_t now = time(NULL);
+	int r;
+
+	if (!upstream || !cert || !tls_verified_key(upstream, cert, key))
+		return X509_verify_cert(store);
+
+	if (X509_cmp_current_time(X509_get_notBefore(cert)) < 0 &&
+	    X509_cmp_current_time(X509_get_notAfter(cert)) > 0 &&
+	    tls_verified_lookup(context, key, now)) {
+		upstream->tls_auth_state = GETDNS_AUTH_OK;
+		X509_STORE_CTX_set_error(store, X509_V_OK);
+		return 1;
+	}
+	r = X509_verify_cert(store);
+	if (r == 1 && X509_STORE_CTX_get_error(store) == X509_V_OK &&
+	    upstream->tls_auth_state == GETDNS_AUTH_OK)
+		tls_verified_add(context, key, now);
+	return r;
+}
+
 getdns_return_t
 _getdns_context_prepare_for_resolution(struct getdns_context *context,
     int usenamespaces)
@@ -3125,6 +4248,7 @@ _getdns_context_prepare_for_resolution(struct getdns_context *context,
     if (context->destroying) {
         return GETDNS_RETURN_BAD_CONTEXT;
     }
+	check_os_files(context);
 
 	/* Transport can in theory be set per query in stub mode */
 	if (context->resolution_type == GETDNS_RESOLUTION_STUB && 
@@ -3150,6 +4274,14 @@ _getdns_context_prepare_for_resolution(struct getdns_context *context,
 			if(context->tls_ctx == NULL)
 				return GETDNS_RETURN_BAD_CONTEXT;
 
+			/* Sessions are kept by tls_new_session_cb for resumption */
+			SSL_CTX_set_app_data(context->tls_ctx, context);
+			(void) SSL_CTX_set_session_cache_mode(context->tls_ctx,
+			    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+			SSL_CTX_sess_set_new_cb(context->tls_ctx, tls_new_session_cb);
+			SSL_CTX_set_cert_verify_callback(context->tls_ctx,
+			    tls_cert_verify_cb, context);
+
 #  ifdef HAVE_TLS_CLIENT_METHOD
 			if (!SSL_CTX_set_min_proto_version(
 			    context->tls_ctx, TLS1_2_VERSION)) {
@@ -3173,6 +4305,9 @@ _getdns_context_prepare_for_resolution(struct getdns_context *context,
 				if (context->tls_auth_min == GETDNS_AUTHENTICATION_REQUIRED) 
 					return GETDNS_RETURN_BAD_CONTEXT;
 			}
+			/* When TLS was enabled after the first asynchronous
+			 * request, the connections to keep warm open now. */
+			_getdns_upstreams_warm(context);
 #else /* HAVE_TLS_v1_2 */
 			if (tls_only_is_in_transports_list(context) == 1)
 				return GETDNS_RETURN_BAD_CONTEXT;
@@ -3567,6 +4702,7 @@ getdns_context_set_return_dnssec_status(getdns_context* context, int enabled) {
         return GETDNS_RETURN_INVALID_PARAMETER;
     }
     context->dnssec_return_status = enabled == GETDNS_EXTENSION_TRUE;
+    context->config_serial++;
     return GETDNS_RETURN_GOOD;
 }
 
@@ -3594,12 +4730,12 @@ _getdns_context_local_namespace_resolve(
     getdns_dns_req *dnsreq, getdns_dict **response)
 {
 	getdns_context  *context = dnsreq->context;
-	host_name_addrs *hnas;
+	_getdns_local_host *host;
 	uint8_t lookup[256];
 	getdns_list    empty_list = { 0, 0, NULL, { NULL, {{ NULL, NULL, NULL }}}};
 	getdns_bindata bindata;
 	getdns_list   *jaa;
-	size_t         i;
+	size_t         i, n;
 	getdns_dict   *addr;
 	int ipv4 = dnsreq->netreqs[0]->request_type == GETDNS_RRTYPE_A ||
 	    (dnsreq->netreqs[1] &&
@@ -3615,14 +4751,16 @@ _getdns_context_local_namespace_resolve(
 	(void)memcpy(lookup, dnsreq->name, dnsreq->name_len);
 	canonicalize_dname(lookup);
 
-	if (!(hnas = (host_name_addrs *)
-	    _getdns_rbtree_search(&context->local_hosts, lookup)))
-		return GETDNS_RETURN_GENERIC_ERROR;
-
-	if (!hnas->ipv4addrs && (!ipv6 || !hnas->ipv6addrs))
+	if (!context->local_hosts.n_hosts ||
+	    !(host = bsearch(lookup, context->local_hosts.hosts,
+	    context->local_hosts.n_hosts, sizeof(_getdns_local_host),
+	    local_host_cmp)))
 		return GETDNS_RETURN_GENERIC_ERROR;
 
-	if (!hnas->ipv6addrs && (!ipv4 || !hnas->ipv4addrs))
+	/* Only the requested address families */
+	i = ipv4 ? 0 : host->n_ipv4;
+	n = host->n_ipv4 + (ipv6 ? host->n_ipv6 : 0);
+	if (i == n)
 		return GETDNS_RETURN_GENERIC_ERROR;
 
 	if (!(*response = getdns_dict_create_with_context(context)))
@@ -3643,27 +4781,20 @@ _getdns_context_local_namespace_resolve(
 	if (getdns_dict_set_int(*response, "status", GETDNS_RESPSTATUS_GOOD))
 		goto error;
 
-	if (!ipv4 || !hnas->ipv4addrs) {
-		if (getdns_dict_set_list(*response,
-		    "just_address_answers", hnas->ipv6addrs))
-			goto error;
-		return GETDNS_RETURN_GOOD;
-	} else if (!ipv6 || !hnas->ipv6addrs) {
-		if (getdns_dict_set_list(*response,
-		    "just_address_answers", hnas->ipv4addrs))
-			goto error;
-		return GETDNS_RETURN_GOOD;
-	}
 	if (!(jaa = getdns_list_create_with_context(context)))
 		goto error;
 
-	for (i = 0; !getdns_list_get_dict(hnas->ipv4addrs, i, &addr); i++)
-		if (_getdns_list_append_dict(jaa, addr))
+	for (; i < n; i++) {
+		if (!(addr = local_addr_dict(context, &context->local_hosts.addrs[
+		    context->local_hosts.addr_idxs[host->addrs + i]])))
 			break;
-	for (i = 0; !getdns_list_get_dict(hnas->ipv6addrs, i, &addr); i++)
-		if (_getdns_list_append_dict(jaa, addr))
+		if (_getdns_list_append_this_dict(jaa, addr)) {
+			getdns_dict_destroy(addr);
 			break;
-	if (!_getdns_dict_set_this_list(*response, "just_address_answers", jaa))
+		}
+	}
+	if (i == n &&
+	    !_getdns_dict_set_this_list(*response, "just_address_answers", jaa))
 		return GETDNS_RETURN_GOOD;
 	else
 		getdns_list_destroy(jaa);
@@ -4040,6 +5171,58 @@ getdns_context_get_tls_query_padding_blocksize(getdns_context *context, uint16_t
     return GETDNS_RETURN_GOOD;
 }
 
+getdns_return_t
+getdns_context_get_max_upstream_connections(
+    getdns_context *context, uint16_t* value) {
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    RETURN_IF_NULL(value, GETDNS_RETURN_INVALID_PARAMETER);
+    *value = context->max_upstream_connections;
+    return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+getdns_context_get_udp_hedging(getdns_context *context, uint8_t* value) {
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    RETURN_IF_NULL(value, GETDNS_RETURN_INVALID_PARAMETER);
+    *value = context->udp_hedging;
+    return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+getdns_context_get_tls_warm_upstreams(
+    getdns_context *context, uint16_t* value) {
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    RETURN_IF_NULL(value, GETDNS_RETURN_INVALID_PARAMETER);
+    *value = context->tls_warm_upstreams;
+    return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+getdns_context_get_tls_kernel_offload(
+    getdns_context *context, uint8_t* value) {
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    RETURN_IF_NULL(value, GETDNS_RETURN_INVALID_PARAMETER);
+    *value = context->tls_kernel_offload;
+    return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+getdns_context_get_tls_session_cache_file(
+    getdns_context *context, const char **filename) {
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    RETURN_IF_NULL(filename, GETDNS_RETURN_INVALID_PARAMETER);
+    *filename = context->tls_session_cache_file;
+    return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+getdns_context_get_hosts(getdns_context *context, const char **hosts) {
+    RETURN_IF_NULL(context, GETDNS_RETURN_INVALID_PARAMETER);
+    RETURN_IF_NULL(hosts, GETDNS_RETURN_INVALID_PARAMETER);
+    *hosts = local_hosts_fn(context);
+    return GETDNS_RETURN_GOOD;
+}
+
 static int _streq(const getdns_bindata *name, const char *str)
 {
 	if (strlen(str) != name->size)
@@ -4125,6 +5308,7 @@ _getdns_context_config_setting(getdns_context *context,
 	getdns_return_t r = GETDNS_RETURN_GOOD;
 	getdns_dict *dict;
 	getdns_list *list;
+	getdns_bindata *bindata;
 	getdns_namespace_t namespaces[100];
 	getdns_transport_list_t dns_transport_list[100];
 	size_t count, i;
@@ -4163,6 +5347,10 @@ _getdns_context_config_setting(getdns_context *context,
 	CONTEXT_SETTING_INT(edns_client_subnet_private)
 	CONTEXT_SETTING_INT(tls_authentication)
 	CONTEXT_SETTING_INT(tls_query_padding_blocksize)
+	CONTEXT_SETTING_INT(max_upstream_connections)
+	CONTEXT_SETTING_INT(udp_hedging)
+	CONTEXT_SETTING_INT(tls_warm_upstreams)
+	CONTEXT_SETTING_INT(tls_kernel_offload)
 
 	/**************************************/
 	/****                              ****/
@@ -4204,6 +5392,35 @@ _getdns_context_config_setting(getdns_context *context,
 			    context->header, "header", dict);
 		}
 
+	} else if (_streq(setting, "tls_session_cache_file")) {
+		if (!(r = getdns_dict_get_bindata(
+		    config_dict, "tls_session_cache_file", &bindata))) {
+			if (bindata->size >= FILENAME_MAX)
+				r = GETDNS_RETURN_INVALID_PARAMETER;
+			else {
+				char fn[FILENAME_MAX];
+
+				(void) memcpy(fn, bindata->data, bindata->size);
+				fn[bindata->size] = 0;
+				r = getdns_context_set_tls_session_cache_file(
+				    context, fn);
+			}
+		}
+
+	} else if (_streq(setting, "hosts")) {
+		if (!(r = getdns_dict_get_bindata(
+		    config_dict, "hosts", &bindata))) {
+			if (bindata->size >= FILENAME_MAX)
+				r = GETDNS_RETURN_INVALID_PARAMETER;
+			else {
+				char fn[FILENAME_MAX];
+
+				(void) memcpy(fn, bindata->data, bindata->size);
+				fn[bindata->size] = 0;
+				r = getdns_context_set_hosts(context, fn);
+			}
+		}
+
 	} else if (_streq(setting, "specify_class")) {
 		if (!(r = getdns_dict_get_int(
 		    config_dict, "specify_class" , &n)))
@@ -4219,6 +5436,8 @@ _getdns_context_config_setting(getdns_context *context,
 	    !_streq(setting, "version_string")) {
 		r = GETDNS_RETURN_NOT_IMPLEMENTED;
 	}
+	/* Not all settings are dispatched, i.e. the default extensions */
+	context->config_serial++;
 	return r;
 }
 
@@ -56,7 +56,8 @@ enum filechgs { GETDNS_FCHG_ERRORS = -1
  , GETDNS_FCHG_NOERROR   = 0
  , GETDNS_FCHG_NOCHANGES = 0
  , GETDNS_FCHG_MTIME     = 1
- , GETDNS_FCHG_CTIME     = 2};
+ , GETDNS_FCHG_CTIME     = 2
+ , GETDNS_FCHG_INODE     = 4};
 
 /** function pointer typedefs */
 typedef void (*getdns_update_callback) (struct getdns_context *,
@@ -100,6 +101,15 @@ typedef enum getdns_tsig_algo {
 	GETDNS_HMAC_SHA512 = 7
 } getdns_tsig_algo;
 
+/* The keyed HMAC for TSIG.  HMAC_CTX is deprecated since OpenSSL 3.0, so
+ * the EVP_MAC interface is used when available.
+ */
+#ifdef HAVE_EVP_MAC_CTX_NEW
+typedef EVP_MAC_CTX _getdns_tsig_hmac;
+#else
+typedef HMAC_CTX _getdns_tsig_hmac;
+#endif
+
 typedef struct getdns_tsig_info {
 	getdns_tsig_algo  alg;
 	const char       *name;
@@ -134,6 +144,12 @@ typedef struct getdns_upstream {
 	size_t                   udp_responses;
 	size_t                   udp_timeouts;
 
+	/* Smoothed round trip time and its variation (RFC 6298) in
+	   microseconds, measured over all transports.  A rtt_srtt of 0
+	   means no measurement yet. */
+	uint32_t                 rtt_srtt;
+	uint32_t                 rtt_var;
+
 	/* For stateful upstreams, need to share the connection and track the
 	   activity on the connection */
 	int                      fd;
@@ -149,6 +165,13 @@ typedef struct getdns_upstream {
 	size_t                   conn_backoffs;
 	size_t                   total_responses;
 	size_t                   total_timeouts;
+	/* TCP Fast Open outcome of connections that attempted it.  TFO is
+	 * no longer attempted after GETDNS_TFO_ATTEMPTS failures in a row
+	 * (i.e. when the upstream does not accept our cookie). */
+	size_t                   tfo_successes;
+	size_t                   tfo_failures;
+	size_t                   tfo_failures_in_row;
+	unsigned                 tfo_disabled : 1;
 	getdns_auth_state_t      best_tls_auth_state;
 	getdns_auth_state_t      last_tls_auth_state;
 	/* These are per connection. */
@@ -158,11 +181,35 @@ typedef struct getdns_upstream {
 	size_t                   responses_timeouts;
 	size_t                   keepalive_shutdown;
 	uint64_t                 keepalive_timeout;
+	uint64_t                 server_keepalive; /* ms, 0 if not signalled */
+
+	/* A warm connection is kept open while idle, and probed to keep it
+	 * alive (see _getdns_upstreams_warm).  probe_sent is set while a
+	 * probe is awaiting its answer.  warm_skip is set (in the upstreams
+	 * array) when a connection to the upstream failed during setup, or
+	 * a warm one was closed before it answered.  It is not kept warm
+	 * again until it answered a query. */
+	unsigned                 is_warm    : 1;
+	unsigned                 probe_sent : 1;
+	unsigned                 warm_skip  : 1;
+	/* TCP Fast Open was attempted with this connection, and its outcome
+	 * has not been recorded yet. */
+	unsigned                 tfo_attempted : 1;
 
 	/* Management of outstanding requests on stateful transports */
 	getdns_network_req      *write_queue;
 	getdns_network_req      *write_queue_last;
-	_getdns_rbtree_t         netreq_by_query_id;
+	size_t                   write_queue_len;
+	_getdns_qid_table        netreq_by_query_id;
+
+	/* Additional connections to this upstream.  They are opened when
+	 * all open connections have more than GETDNS_CONN_QUEUE_THRESHOLD
+	 * requests outstanding, up to context->max_upstream_connections.
+	 * Each is a copy of the upstream in the upstreams array, with its
+	 * own connection state, linked from that upstream.
+	 */
+	struct getdns_upstream  *conn_next;
+	struct getdns_upstream  *conn_primary; /* NULL in upstreams array */
 
     /* TLS specific connection handling*/
 	SSL*                     tls_obj;
@@ -170,6 +217,8 @@ typedef struct getdns_upstream {
 	getdns_tls_hs_state_t    tls_hs_state;
 	getdns_auth_state_t      tls_auth_state;
 	unsigned                 tls_fallback_ok : 1;
+	/* The kernel encrypts what is written to fd (kTLS) */
+	unsigned                 tls_ktls_send : 1;
 	/* Auth credentials*/
 	char                     tls_auth_name[256];
 	sha256_pin_t            *tls_pubkey_pinset;
@@ -203,6 +252,13 @@ typedef struct getdns_upstream {
 	unsigned has_server_cookie : 1;
 	unsigned server_cookie_len : 5;
 
+	/* The cookie option for the queries in wire format, ready to be
+	 * copied in.  Rebuilt by attach_edns_cookie when cookie_opt_len is 0,
+	 * so set that to 0 with each change of the cookies above.
+	 */
+	uint8_t  cookie_opt[4 + 8 + 32];
+	uint8_t  cookie_opt_len;
+
 	/* TSIG */
 	uint8_t          tsig_dname[256];
 	size_t           tsig_dname_len;
@@ -210,16 +266,93 @@ typedef struct getdns_upstream {
 	uint8_t          tsig_key[256];
 	getdns_tsig_algo tsig_alg;
 
+	/* Precomputed TSIG signing state, built on first use and owned by
+	 * the primary upstream (connections use their primary's):  The
+	 * keyed HMAC, with the inner and outer pads already digested, and
+	 * the TSIG RR up to and including the Algorithm Name.
+	 */
+	_getdns_tsig_hmac *tsig_hmac;
+	size_t           tsig_mac_len;
+	uint8_t          tsig_rr[256 + 10 + 26];
+	size_t           tsig_rr_len;
+
 } getdns_upstream;
 
 typedef struct getdns_upstreams {
 	struct mem_funcs mf;
+	struct getdns_context *context;
 	size_t referenced;
 	size_t count;
 	size_t current_udp;
+	_getdns_buf_pool *buf_pool; /* of the context, for tcp.read_buf */
 	getdns_upstream upstreams[];
 } getdns_upstreams;
 
+/* An address from the hosts file. */
+typedef struct _getdns_local_addr {
+	uint8_t     addr[16];
+	int         family;    /* AF_INET or AF_INET6 */
+	const char *scope_id;  /* NULL, or in the local_hosts names arena */
+} _getdns_local_addr;
+
+/* A host name from the hosts file.  Its addresses are n_ipv4 + n_ipv6
+ * consecutive indices in local_hosts.addr_idxs, with the IPv4 addresses
+ * first, in the order in which they appeared in the hosts file.
+ */
+typedef struct _getdns_local_host {
+	const uint8_t *name;   /* Canonical wireformat, in the names arena */
+	size_t         addrs;
+	uint32_t       n_ipv4;
+	uint32_t       n_ipv6;
+} _getdns_local_host;
+
+typedef struct _getdns_local_hosts_chunk {
+	struct _getdns_local_hosts_chunk *next;
+	size_t                            used;
+	uint8_t                           data[];
+} _getdns_local_hosts_chunk;
+
+/* The hosts file as a table of host names, sorted in canonical order for
+ * binary search, referring to addresses that are shared between names.
+ * Names and scope_id's live in chunks that are never moved.
+ */
+typedef struct _getdns_local_hosts {
+	_getdns_local_host        *hosts;
+	size_t                     n_hosts;
+	uint32_t                  *addr_idxs;
+	_getdns_local_addr        *addrs;
+	size_t                     n_addrs;
+	_getdns_local_hosts_chunk *names;
+} _getdns_local_hosts;
+
+/* A TLS session to resume, kept per upstream address and credentials (see
+ * tls_session_key() in context.c).  data holds the key, followed by the
+ * session in DER.  Most recently stored first.
+ */
+typedef struct _getdns_tls_session {
+	struct _getdns_tls_session *next;
+	getdns_auth_state_t         auth_state;
+	size_t                      key_len;
+	size_t                      der_len;
+	uint8_t                     data[];
+} _getdns_tls_session;
+
+#define GETDNS_TLS_SESSIONS_MAX 64
+
+/* A server certificate that passed verification (chain, host name and
+ * pinset) for an authentication name and pinset.  key is the SHA-256 digest
+ * over the certificate's SHA-256 digest and those credentials (see
+ * tls_verified_key() in context.c).  Most recently used first.
+ */
+typedef struct _getdns_tls_verified {
+	struct _getdns_tls_verified *next;
+	time_t                       verified;
+	uint8_t                      key[SHA256_DIGEST_LENGTH];
+} _getdns_tls_verified;
+
+#define GETDNS_TLS_VERIFIED_MAX 64
+#define GETDNS_TLS_VERIFIED_TTL 3600 /* Verify again at least every hour */
+
 struct getdns_context {
 	/* Context values */
 	getdns_resolution_t  resolution_type;
@@ -258,12 +391,41 @@ struct getdns_context {
 	int edns_maximum_udp_payload_size; /* -1 is unset */
 	uint8_t edns_client_subnet_private;
 	uint16_t tls_query_padding_blocksize;
+	uint16_t max_upstream_connections;
+	uint8_t  udp_hedging;
+	uint16_t tls_warm_upstreams;
+	/* Warm connections are kept on the extension event loop, so they are
+	 * only opened once an asynchronous request showed it is being run.
+	 */
+	uint8_t  tls_warm_loop_used;
+	uint8_t  tls_kernel_offload;
 	SSL_CTX* tls_ctx;
 
+	/* TLS sessions for resumption, by upstream.  They survive changes of
+	 * the upstreams and, with a tls_session_cache_file, restarts too.
+	 * New sessions only mark the cache dirty; the file is written when
+	 * the context is destroyed or the cache file is changed.
+	 */
+	_getdns_tls_session *tls_sessions;
+	size_t               n_tls_sessions;
+	char                *tls_session_cache_file;
+	int                  tls_sessions_dirty;
+
+	/* Recently verified server certificates, so that full handshakes
+	 * with known upstreams need not build and check the chain again.
+	 */
+	_getdns_tls_verified *tls_verified;
+	size_t                n_tls_verified;
+
 	getdns_update_callback  update_callback;
 	getdns_update_callback2 update_callback2;
 	void                   *update_userarg;
 
+	/* Incremented with every change of the configuration, so that
+	 * getdns_request_profiles can tell their settings are outdated.
+	 */
+	uint64_t config_serial;
+
 	int processing;
 	int destroying;
 
@@ -278,8 +440,12 @@ struct getdns_context {
 	_getdns_ub_loop ub_loop;
 #endif
 #endif
-	/* A tree to hold local host information*/
-	_getdns_rbtree_t local_hosts;
+	/* A flat sorted table to hold local host information*/
+	_getdns_local_hosts local_hosts;
+	char               *hosts; /* NULL for the system's hosts file */
+
+	/* Buffers to receive answers in */
+	_getdns_buf_pool buf_pool;
 
 	/* which resolution type the contexts are configured for
 	 * 0 means nothing set
@@ -329,6 +495,14 @@ struct getdns_context {
 	 */
 	struct filechg *fchg_resolvconf;
 	struct filechg *fchg_hosts;
+	int             fchg_fd;      /* inotify descriptor, or -1 */
+	time_t          fchg_checked; /* last stat() based check */
+
+	/* Upstreams and suffixes were read from resolv.conf and should be
+	 * reloaded when it changes.
+	 */
+	unsigned os_upstreams : 1;
+	unsigned os_suffix    : 1;
 
 	uint8_t trust_anchors_spc[1024];
 
@@ -378,10 +552,19 @@ getdns_return_t _getdns_context_local_namespace_resolve(
 
 int _getdns_filechg_check(struct getdns_context *context, struct filechg *fchg);
 
+/* Returns a TLS session to resume with upstream, or NULL.  The caller owns
+ * the returned session.  auth_state is set to the authentication state of
+ * the connection in which the session was established.
+ */
+SSL_SESSION *_getdns_context_tls_session_fetch(struct getdns_context *context,
+    getdns_upstream *upstream, getdns_auth_state_t *auth_state);
+
 void _getdns_context_ub_read_cb(void *userarg);
 
 void _getdns_upstreams_dereference(getdns_upstreams *upstreams);
 
 void _getdns_upstream_shutdown(getdns_upstream *upstream);
 
+getdns_upstream *_getdns_upstream_add_conn(getdns_upstream *upstream);
+
 #endif /* _GETDNS_CONTEXT_H_ */
@@ -484,6 +484,75 @@ getdns_rr_dict2str_scan(
 }
 
 
+/* Finish a wire2str scan.  sz_needed characters were (or would have been)
+ * written to the buffer that started at prev_str, leaving sz.
+ */
+static getdns_return_t
+_getdns_wire2str_scan_done(
+    char **str, int *str_len, char *prev_str, size_t sz, int sz_needed)
+{
+	if (sz_needed >= *str_len) {
+		/* Also when only the terminating zero did not fit */
+		*str = prev_str + sz_needed;
+		*str_len -= sz_needed;
+		return GETDNS_RETURN_NEED_MORE_SPACE;
+	}
+	*str_len = (int)sz;
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+getdns_wire2rr_str_buf(const uint8_t *wire, size_t *wire_sz,
+    char *str, size_t *str_len)
+{
+	size_t my_wire_sz;
+	int my_str_len;
+	getdns_return_t r;
+
+	if (!wire_sz || !str_len)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	my_wire_sz = *wire_sz;
+	my_str_len = *str_len;
+	r = getdns_wire2rr_str_scan(&wire, &my_wire_sz, &str, &my_str_len);
+	if (r == GETDNS_RETURN_GOOD || r == GETDNS_RETURN_NEED_MORE_SPACE) {
+		*wire_sz -= my_wire_sz;
+		*str_len -= my_str_len;
+	}
+	return r;
+}
+
+getdns_return_t
+getdns_wire2rr_str_scan(const uint8_t **wire, size_t *wire_sz,
+    char **str, int *str_len)
+{
+	_getdns_rr_iter rr_iter_spc, *rr_iter;
+	uint8_t *scan_buf;
+	size_t scan_sz, sz;
+	char *prev_str;
+	int sz_needed;
+
+	if (!wire || !*wire || !wire_sz || !str || !*str || !str_len)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	if (!(rr_iter = _getdns_single_rr_iter_init(
+	    &rr_iter_spc, *wire, *wire_sz)))
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	scan_buf = (uint8_t *)rr_iter->pos;
+	scan_sz  = rr_iter->nxt - rr_iter->pos;
+	*wire_sz -= scan_sz;
+	*wire = rr_iter->nxt;
+
+	prev_str = *str;
+	sz = *str_len > 0 ? (size_t)*str_len : 0;
+	sz_needed = gldns_wire2str_rr_scan(
+	    &scan_buf, &scan_sz, str, &sz, NULL, 0);
+
+	return _getdns_wire2str_scan_done(
+	    str, str_len, prev_str, sz, sz_needed);
+}
+
 getdns_return_t
 _getdns_str2rr_dict(struct mem_funcs *mf,
     const char *str, getdns_dict **rr_dict, const char *origin, uint32_t default_ttl)
@@ -534,57 +603,111 @@ getdns_str2rr_dict(
 }
 
 
+getdns_return_t
+_getdns_fp2wire_iter_init(_getdns_fp2wire_iter *i, FILE *in,
+    uint8_t *rr_spc, size_t rr_spc_sz, const char *origin, uint32_t default_ttl)
+{
+	if (!i || !in || !rr_spc)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	i->pst.origin_len = sizeof(i->pst.origin);
+	if (!origin) {
+		*i->pst.origin = 0;
+		i->pst.origin_len = 1;
+
+	} else if (gldns_str2wire_dname_buf(
+	    origin, i->pst.origin, &i->pst.origin_len))
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	*i->pst.prev_rr = 0;
+	i->pst.prev_rr_len = 1;
+	i->pst.default_ttl = default_ttl;
+	i->pst.lineno = 1;
+
+	i->in = in;
+	i->rr = rr_spc;
+	i->rr_spc_sz = rr_spc_sz;
+	i->rr_len = 0;
+	i->dname_len = 0;
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+_getdns_fp2wire_iter_next(_getdns_fp2wire_iter *i)
+{
+	while (!feof(i->in)) {
+		i->rr_len = i->rr_spc_sz;
+		i->dname_len = 0;
+		if (gldns_fp2wire_rr_buf(
+		    i->in, i->rr, &i->rr_len, &i->dname_len, &i->pst)) {
+			i->rr_len = 0;
+			return GETDNS_RETURN_GENERIC_ERROR;
+		}
+		if (i->dname_len && i->dname_len < sizeof(i->pst.prev_rr)) {
+			memcpy(i->pst.prev_rr, i->rr, i->dname_len);
+			i->pst.prev_rr_len = i->dname_len;
+		}
+		if (i->rr_len)
+			return GETDNS_RETURN_GOOD;
+		/* empty line, comment, $TTL or $ORIGIN */
+	}
+	i->rr_len = 0;
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+_getdns_fp2wire_arena(_getdns_fp2wire_iter *i, gldns_buffer *gbuf,
+    size_t *rr_count)
+{
+	getdns_return_t r;
+	size_t count = 0;
+
+	while (!(r = _getdns_fp2wire_iter_next(i)) && i->rr_len) {
+		if (!gbuf->_fixed && !gldns_buffer_reserve(gbuf, i->rr_len))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		gldns_buffer_write(gbuf, i->rr, i->rr_len);
+		count++;
+	}
+	if (rr_count)
+		*rr_count = count;
+	return r;
+}
+
 getdns_return_t
 _getdns_fp2rr_list(struct mem_funcs *mf,
     FILE *in, getdns_list **rr_list, const char *origin, uint32_t default_ttl)
 {
-	struct gldns_file_parse_state pst;
+	_getdns_fp2wire_iter i;
 	getdns_list *rrs;
 	getdns_return_t r = GETDNS_RETURN_GOOD;
 	uint8_t *rr;
-	size_t len, dname_len;
 	getdns_dict *rr_dict;
 
 	if (!in || !rr_list)
 		return GETDNS_RETURN_INVALID_PARAMETER;
 
-	if (!origin) {
-		*pst.origin = 0;
-		pst.origin_len = 1;
-
-	} else if (gldns_str2wire_dname_buf(origin,pst.origin,&pst.origin_len))
-		return GETDNS_RETURN_GENERIC_ERROR;
-
-	*pst.prev_rr = 0;
-	pst.prev_rr_len = 1;
-	pst.default_ttl = default_ttl;
-	pst.lineno = 1;
-
-	if (!(rrs = _getdns_list_create_with_mf(mf)))
-		return GETDNS_RETURN_MEMORY_ERROR;
-	
-
 	if (!(rr = GETDNS_XMALLOC(*mf, uint8_t, GLDNS_RR_BUF_SIZE)))
-		r = GETDNS_RETURN_MEMORY_ERROR;
+		return GETDNS_RETURN_MEMORY_ERROR;
 
-	else while (r == GETDNS_RETURN_GOOD && !feof(in)) {
-		len = GLDNS_RR_BUF_SIZE;
-		dname_len = 0;
-		if (gldns_fp2wire_rr_buf(in, rr, &len, &dname_len, &pst))
-			break;
-		if (dname_len && dname_len < sizeof(pst.prev_rr)) {
-			memcpy(pst.prev_rr, rr, dname_len);
-			pst.prev_rr_len = dname_len;
-		}
-		if (len == 0)
-			continue;
-		if ((r = _getdns_wire2rr_dict(mf, rr, len, &rr_dict)))
+	if ((r = _getdns_fp2wire_iter_init(
+	    &i, in, rr, GLDNS_RR_BUF_SIZE, origin, default_ttl))) {
+		GETDNS_FREE(*mf, rr);
+		return r;
+	}
+	if (!(rrs = _getdns_list_create_with_mf(mf))) {
+		GETDNS_FREE(*mf, rr);
+		return GETDNS_RETURN_MEMORY_ERROR;
+	}
+	/* Like before, a parse error ends the list without failing */
+	while (!_getdns_fp2wire_iter_next(&i) && i.rr_len) {
+		if ((r = _getdns_wire2rr_dict(mf, i.rr, i.rr_len, &rr_dict)))
 			break;
-		if ((r = _getdns_list_append_this_dict(rrs, rr_dict)))
+		if ((r = _getdns_list_append_this_dict(rrs, rr_dict))) {
 			getdns_dict_destroy(rr_dict);
+			break;
+		}
 	}
-	if (rr)
-		GETDNS_FREE(*mf, rr);
+	GETDNS_FREE(*mf, rr);
 	if (r)
 		getdns_list_destroy(rrs);
 	else
@@ -600,6 +723,83 @@ getdns_fp2rr_list(
 	    &_getdns_plain_mem_funcs, in, rr_list, origin, default_ttl);
 }
 
+struct getdns_fp2wire_iter {
+	_getdns_fp2wire_iter i;
+	uint8_t              rr_spc[GLDNS_RR_BUF_SIZE];
+};
+
+getdns_return_t
+getdns_fp2wire_iter_create(FILE *in, getdns_fp2wire_iter **iter,
+    const char *origin, uint32_t default_ttl)
+{
+	getdns_fp2wire_iter *it;
+	getdns_return_t r;
+
+	if (!in || !iter)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	if (!(it = malloc(sizeof(getdns_fp2wire_iter))))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	if ((r = _getdns_fp2wire_iter_init(&it->i, in,
+	    it->rr_spc, sizeof(it->rr_spc), origin, default_ttl))) {
+		free(it);
+		return r;
+	}
+	*iter = it;
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+getdns_fp2wire_iter_next(getdns_fp2wire_iter *iter,
+    const uint8_t **rr, size_t *rr_sz)
+{
+	getdns_return_t r;
+
+	if (!iter || !rr || !rr_sz)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	if ((r = _getdns_fp2wire_iter_next(&iter->i)))
+		return r;
+
+	*rr = iter->i.rr_len ? iter->i.rr : NULL;
+	*rr_sz = iter->i.rr_len;
+	return GETDNS_RETURN_GOOD;
+}
+
+void
+getdns_fp2wire_iter_destroy(getdns_fp2wire_iter *iter)
+{
+	free(iter);
+}
+
+getdns_return_t
+getdns_fp2wire_rrs(FILE *in, uint8_t **wire, size_t *wire_sz,
+    size_t *rr_count, const char *origin, uint32_t default_ttl)
+{
+	getdns_fp2wire_iter *it;
+	gldns_buffer *gbuf;
+	getdns_return_t r;
+
+	if (!wire || !wire_sz)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	if ((r = getdns_fp2wire_iter_create(in, &it, origin, default_ttl)))
+		return r;
+
+	if (!(gbuf = gldns_buffer_new(4096))) {
+		getdns_fp2wire_iter_destroy(it);
+		return GETDNS_RETURN_MEMORY_ERROR;
+	}
+	if (!(r = _getdns_fp2wire_arena(&it->i, gbuf, rr_count))) {
+		*wire_sz = gldns_buffer_position(gbuf);
+		*wire = gldns_buffer_export(gbuf);
+	}
+	gldns_buffer_free(gbuf);
+	getdns_fp2wire_iter_destroy(it);
+	return r;
+}
+
 #define SET_WIRE_INT(X,Y) if (getdns_dict_set_int(header, #X , (int) \
                               GLDNS_ ## Y ## _WIRE(*wire))) goto error
 #define SET_WIRE_BIT(X,Y) if (getdns_dict_set_int(header, #X , \
@@ -1072,6 +1272,66 @@ getdns_msg_dict2str_scan(
 	return r;
 }
 
+getdns_return_t
+getdns_wire2msg_str_buf(const uint8_t *wire, size_t *wire_sz,
+    char *str, size_t *str_len)
+{
+	size_t my_wire_sz;
+	int my_str_len;
+	getdns_return_t r;
+
+	if (!wire_sz || !str_len)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	my_wire_sz = *wire_sz;
+	my_str_len = *str_len;
+	r = getdns_wire2msg_str_scan(&wire, &my_wire_sz, &str, &my_str_len);
+	if (r == GETDNS_RETURN_GOOD || r == GETDNS_RETURN_NEED_MORE_SPACE) {
+		*wire_sz -= my_wire_sz;
+		*str_len -= my_str_len;
+	}
+	return r;
+}
+
+getdns_return_t
+getdns_wire2msg_str_scan(const uint8_t **wire, size_t *wire_sz,
+    char **str, int *str_len)
+{
+	_getdns_rr_iter rr_iter_spc, *rr_iter;
+	const uint8_t *eop; /* end of packet */
+	uint8_t *scan_buf;
+	size_t scan_sz, sz;
+	char *prev_str;
+	int sz_needed;
+
+	if (!wire || !*wire || !wire_sz || !str || !*str || !str_len)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	if (*wire_sz < GLDNS_HEADER_SIZE)
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	/* The message ends where getdns_wire2msg_dict_scan would end it */
+	eop = *wire + GLDNS_HEADER_SIZE;
+	for ( rr_iter = _getdns_rr_iter_init(&rr_iter_spc, *wire, *wire_sz)
+	    ; rr_iter
+	    ; rr_iter = _getdns_rr_iter_next(rr_iter)) {
+
+		if (rr_iter->nxt > eop)
+			eop = rr_iter->nxt;
+	}
+	scan_buf = (uint8_t *)*wire;
+	scan_sz  = eop - *wire;
+	*wire_sz -= scan_sz;
+	*wire = eop;
+
+	prev_str = *str;
+	sz = *str_len > 0 ? (size_t)*str_len : 0;
+	sz_needed = gldns_wire2str_pkt_scan(&scan_buf, &scan_sz, str, &sz);
+
+	return _getdns_wire2str_scan_done(
+	    str, str_len, prev_str, sz, sz_needed);
+}
+
 static getdns_dict *
 _getdns_ipaddr_dict_mf(struct mem_funcs *mf, const char *ipstr)
 {
@@ -1363,7 +1623,8 @@ _getdns_destroy_item_data(struct mem_funcs *mf, getdns_item *item)
 		break;
 
 	case t_bindata:
-		GETDNS_FREE(*mf, item->data.bindata->data);
+		if (!item->borrowed)
+			GETDNS_FREE(*mf, item->data.bindata->data);
 		GETDNS_FREE(*mf, item->data.bindata);
 	default:
 		break;
@@ -1502,6 +1763,7 @@ static int _jsmn_get_item(struct mem_funcs *mf, const char *js, jsmntok_t *t,
 {
 	assert(item);
 
+	item->borrowed = 0;
 	switch (t->type) {
 	case JSMN_STRING:
 		if (t->end < t->start)
@@ -1742,3 +2004,464 @@ getdns_str2int(const char *str, uint32_t *value)
 	return GETDNS_RETURN_GOOD;
 }
 
+
+/* ------------------------ dict, list, binary conversions ----------------- */
+
+/* The binary format is a subset of CBOR (RFC 7049), preceded by a three
+ * octet header: the characters 'g' and 'd' followed by a version octet.
+ * Ints are encoded as unsigned integers, bindatas as byte strings, lists
+ * as arrays and dicts as maps with text string keys.  Only the definite
+ * length encodings with up to 32 bit arguments are used.
+ */
+#define GETDNS_BIN_MAGIC_0  0x67
+#define GETDNS_BIN_MAGIC_1  0x64
+#define GETDNS_BIN_VERSION  1
+#define GETDNS_BIN_HDR_SZ   3
+#define GETDNS_BIN_MAX_DEPTH 64
+
+#define GETDNS_BIN_UINT     0x00
+#define GETDNS_BIN_BYTES    0x40
+#define GETDNS_BIN_TEXT     0x60
+#define GETDNS_BIN_ARRAY    0x80
+#define GETDNS_BIN_MAP      0xA0
+
+static void
+_getdns_bin_write_head(gldns_buffer *buf, uint8_t major, uint32_t n)
+{
+	if (n < 24)
+		gldns_buffer_write_u8(buf, major | n);
+
+	else if (n <= 0xFF) {
+		gldns_buffer_write_u8(buf, major | 24);
+		gldns_buffer_write_u8(buf, n);
+
+	} else if (n <= 0xFFFF) {
+		gldns_buffer_write_u8(buf, major | 25);
+		gldns_buffer_write_u16(buf, n);
+	} else {
+		gldns_buffer_write_u8(buf, major | 26);
+		gldns_buffer_write_u32(buf, n);
+	}
+}
+
+static getdns_return_t _getdns_list2bin(
+    gldns_buffer *buf, const getdns_list *list, int depth);
+
+static getdns_return_t
+_getdns_dict2bin(gldns_buffer *buf, const getdns_dict *dict, int depth);
+
+static getdns_return_t
+_getdns_item2bin(gldns_buffer *buf, const getdns_item *item, int depth)
+{
+	switch (item->dtype) {
+	case t_int:
+		_getdns_bin_write_head(buf, GETDNS_BIN_UINT, item->data.n);
+		return GETDNS_RETURN_GOOD;
+
+	case t_bindata:
+		if (item->data.bindata->size > 0xFFFFFFFF)
+			return GETDNS_RETURN_GENERIC_ERROR;
+		_getdns_bin_write_head(buf, GETDNS_BIN_BYTES,
+		    item->data.bindata->size);
+		gldns_buffer_write(buf, item->data.bindata->data,
+		    item->data.bindata->size);
+		return GETDNS_RETURN_GOOD;
+
+	case t_list:
+		return _getdns_list2bin(buf, item->data.list, depth + 1);
+
+	case t_dict:
+		return _getdns_dict2bin(buf, item->data.dict, depth + 1);
+
+	default:
+		return GETDNS_RETURN_WRONG_TYPE_REQUESTED;
+	}
+}
+
+static getdns_return_t
+_getdns_list2bin(gldns_buffer *buf, const getdns_list *list, int depth)
+{
+	getdns_return_t r;
+	size_t i;
+
+	if (depth > GETDNS_BIN_MAX_DEPTH || list->numinuse > 0xFFFFFFFF)
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	_getdns_bin_write_head(buf, GETDNS_BIN_ARRAY, list->numinuse);
+	for (i = 0; i < list->numinuse; i++)
+		if ((r = _getdns_item2bin(buf, &list->items[i], depth)))
+			return r;
+	return GETDNS_RETURN_GOOD;
+}
+
+static getdns_return_t
+_getdns_dict2bin(gldns_buffer *buf, const getdns_dict *dict, int depth)
+{
+	struct getdns_dict_item *item;
+	getdns_return_t r;
+	size_t key_len;
+
+	if (depth > GETDNS_BIN_MAX_DEPTH)
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	_getdns_bin_write_head(buf, GETDNS_BIN_MAP, dict->root.count);
+	RBTREE_FOR(item, struct getdns_dict_item *,
+	    (_getdns_rbtree_t *)&dict->root) {
+		key_len = strlen((const char *)item->node.key);
+		_getdns_bin_write_head(buf, GETDNS_BIN_TEXT, key_len);
+		gldns_buffer_write(buf, item->node.key, key_len);
+		if ((r = _getdns_item2bin(buf, &item->i, depth)))
+			return r;
+	}
+	return GETDNS_RETURN_GOOD;
+}
+
+static getdns_return_t
+_getdns_item2bin_buf(const getdns_item *item, uint8_t *bin, size_t *bin_sz)
+{
+	gldns_buffer gbuf;
+	getdns_return_t r;
+
+	if (!bin_sz || (!bin && *bin_sz))
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	gldns_buffer_init_frm_data(&gbuf, bin, *bin_sz);
+	gldns_buffer_write_u8(&gbuf, GETDNS_BIN_MAGIC_0);
+	gldns_buffer_write_u8(&gbuf, GETDNS_BIN_MAGIC_1);
+	gldns_buffer_write_u8(&gbuf, GETDNS_BIN_VERSION);
+	if ((r = _getdns_item2bin(&gbuf, item, 0)))
+		return r;
+
+	*bin_sz = gldns_buffer_position(&gbuf);
+	return gldns_buffer_position(&gbuf) > gldns_buffer_limit(&gbuf)
+	    ? GETDNS_RETURN_NEED_MORE_SPACE : GETDNS_RETURN_GOOD;
+}
+
+static getdns_return_t
+_getdns_item2bin_alloc(const getdns_item *item, uint8_t **bin, size_t *bin_sz)
+{
+	uint8_t buf_spc[4096], *buf;
+	size_t buf_len = sizeof(buf_spc);
+	getdns_return_t r;
+
+	if (!bin || !bin_sz)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	r = _getdns_item2bin_buf(item, buf_spc, &buf_len);
+	if (r != GETDNS_RETURN_GOOD && r != GETDNS_RETURN_NEED_MORE_SPACE)
+		return r;
+
+	if (!(buf = malloc(buf_len)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	if (!r)
+		memcpy(buf, buf_spc, buf_len);
+
+	else if ((r = _getdns_item2bin_buf(item, buf, &buf_len))) {
+		free(buf);
+		return r;
+	}
+	*bin = buf;
+	*bin_sz = buf_len;
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+getdns_dict2bin(const getdns_dict *dict, uint8_t **bin, size_t *bin_sz)
+{
+	getdns_item item;
+
+	if (!dict)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	item.dtype = t_dict;
+	item.data.dict = (getdns_dict *)dict;
+	return _getdns_item2bin_alloc(&item, bin, bin_sz);
+}
+
+getdns_return_t
+getdns_dict2bin_buf(const getdns_dict *dict, uint8_t *bin, size_t *bin_sz)
+{
+	getdns_item item;
+
+	if (!dict)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	item.dtype = t_dict;
+	item.data.dict = (getdns_dict *)dict;
+	return _getdns_item2bin_buf(&item, bin, bin_sz);
+}
+
+getdns_return_t
+getdns_list2bin(const getdns_list *list, uint8_t **bin, size_t *bin_sz)
+{
+	getdns_item item;
+
+	if (!list)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	item.dtype = t_list;
+	item.data.list = (getdns_list *)list;
+	return _getdns_item2bin_alloc(&item, bin, bin_sz);
+}
+
+getdns_return_t
+getdns_list2bin_buf(const getdns_list *list, uint8_t *bin, size_t *bin_sz)
+{
+	getdns_item item;
+
+	if (!list)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	item.dtype = t_list;
+	item.data.list = (getdns_list *)list;
+	return _getdns_item2bin_buf(&item, bin, bin_sz);
+}
+
+static void
+_getdns_bin_item_destroy(struct mem_funcs *mf, getdns_item *item)
+{
+	switch (item->dtype) {
+	case t_dict:
+		getdns_dict_destroy(item->data.dict);
+		break;
+	case t_list:
+		getdns_list_destroy(item->data.list);
+		break;
+	case t_bindata:
+		_getdns_item_bindata_destroy(mf, item);
+	default:
+		break;
+	}
+}
+
+static int
+_getdns_bin_read_head(const uint8_t **bin, const uint8_t *end,
+    uint8_t *major, uint32_t *n)
+{
+	const uint8_t *p = *bin;
+	uint8_t ai;
+
+	if (p >= end)
+		return 0;
+
+	*major = *p & 0xE0;
+	ai = *p++ & 0x1F;
+	if (ai < 24)
+		*n = ai;
+
+	else if (ai == 24 && end - p >= 1)
+		*n = *p++;
+
+	else if (ai == 25 && end - p >= 2) {
+		*n = gldns_read_uint16(p);
+		p += 2;
+
+	} else if (ai == 26 && end - p >= 4) {
+		*n = gldns_read_uint32(p);
+		p += 4;
+	} else
+		return 0;
+
+	*bin = p;
+	return 1;
+}
+
+static getdns_return_t
+_getdns_bin2item(struct mem_funcs *mf, const uint8_t **bin,
+    const uint8_t *end, getdns_item *item, int borrow, int depth)
+{
+	char key_spc[1024], *key;
+	getdns_item child, *child_ref;
+	getdns_return_t r = GETDNS_RETURN_GOOD;
+	uint8_t major;
+	uint32_t n, key_len;
+
+	if (depth > GETDNS_BIN_MAX_DEPTH ||
+	    !_getdns_bin_read_head(bin, end, &major, &n))
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	item->borrowed = 0;
+	switch (major) {
+	case GETDNS_BIN_UINT:
+		item->dtype = t_int;
+		item->data.n = n;
+		return GETDNS_RETURN_GOOD;
+
+	case GETDNS_BIN_BYTES:
+		if ((size_t)(end - *bin) < n)
+			return GETDNS_RETURN_GENERIC_ERROR;
+
+		if (!borrow) {
+			if (!(item->data.bindata =
+			    _getdns_bindata_copy(mf, n, *bin)))
+				return GETDNS_RETURN_MEMORY_ERROR;
+
+		} else if (!(item->data.bindata =
+		    GETDNS_MALLOC(*mf, getdns_bindata)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		else {
+			item->data.bindata->size = n;
+			item->data.bindata->data = (uint8_t *)*bin;
+			item->borrowed = 1;
+		}
+		item->dtype = t_bindata;
+		*bin += n;
+		return GETDNS_RETURN_GOOD;
+
+	case GETDNS_BIN_ARRAY:
+		if (!(item->data.list = _getdns_list_create_with_mf(mf)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		item->dtype = t_list;
+
+		while (n--) {
+			if ((r = _getdns_bin2item(
+			    mf, bin, end, &child, borrow, depth + 1)))
+				break;
+			if ((r = _getdns_list_find_and_add(
+			    item->data.list, "-", &child_ref))) {
+				_getdns_bin_item_destroy(mf, &child);
+				break;
+			}
+			*child_ref = child;
+		}
+		if (r)
+			getdns_list_destroy(item->data.list);
+		return r;
+
+	case GETDNS_BIN_MAP:
+		if (!(item->data.dict = _getdns_dict_create_with_mf(mf)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		item->dtype = t_dict;
+
+		while (n--) {
+			if (!_getdns_bin_read_head(bin, end, &major, &key_len)
+			    || major != GETDNS_BIN_TEXT || key_len == 0
+			    || (size_t)(end - *bin) < key_len) {
+				r = GETDNS_RETURN_GENERIC_ERROR;
+				break;
+			}
+			if (key_len < sizeof(key_spc))
+				key = key_spc;
+
+			else if (!(key = GETDNS_XMALLOC(
+			    *mf, char, key_len + 1))) {
+				r = GETDNS_RETURN_MEMORY_ERROR;
+				break;
+			}
+			(void) memcpy(key, *bin, key_len);
+			key[key_len] = '\0';
+			*bin += key_len;
+
+			if (!(r = _getdns_bin2item(
+			    mf, bin, end, &child, borrow, depth + 1))) {
+				if ((r = _getdns_dict_find_and_add(
+				    item->data.dict, key, &child_ref)))
+					_getdns_bin_item_destroy(mf, &child);
+				else
+					*child_ref = child;
+			}
+			if (key != key_spc)
+				GETDNS_FREE(*mf, key);
+			if (r)
+				break;
+		}
+		if (r)
+			getdns_dict_destroy(item->data.dict);
+		return r;
+
+	default:
+		return GETDNS_RETURN_GENERIC_ERROR;
+	}
+}
+
+static getdns_return_t
+_getdns_bin2item_mf(struct mem_funcs *mf, const uint8_t *bin, size_t bin_sz,
+    getdns_item *item, int borrow)
+{
+	const uint8_t *end = bin + bin_sz;
+	getdns_return_t r;
+
+	if (bin_sz < GETDNS_BIN_HDR_SZ || bin[0] != GETDNS_BIN_MAGIC_0 ||
+	    bin[1] != GETDNS_BIN_MAGIC_1 || bin[2] != GETDNS_BIN_VERSION)
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	bin += GETDNS_BIN_HDR_SZ;
+	if ((r = _getdns_bin2item(mf, &bin, end, item, borrow, 0)))
+		return r;
+
+	if (bin != end) {
+		/* Trailing garbage */
+		_getdns_bin_item_destroy(mf, item);
+		return GETDNS_RETURN_GENERIC_ERROR;
+	}
+	return GETDNS_RETURN_GOOD;
+}
+
+static getdns_return_t
+_getdns_bin2dict(const uint8_t *bin, size_t bin_sz, getdns_dict **dict,
+    int borrow)
+{
+	getdns_item item;
+	getdns_return_t r;
+
+	if (!bin || !dict)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	if ((r = _getdns_bin2item_mf(
+	    &_getdns_plain_mem_funcs, bin, bin_sz, &item, borrow)))
+		return r;
+
+	else if (item.dtype != t_dict) {
+		_getdns_bin_item_destroy(&_getdns_plain_mem_funcs, &item);
+		return GETDNS_RETURN_WRONG_TYPE_REQUESTED;
+	}
+	*dict = item.data.dict;
+	return GETDNS_RETURN_GOOD;
+}
+
+static getdns_return_t
+_getdns_bin2list(const uint8_t *bin, size_t bin_sz, getdns_list **list,
+    int borrow)
+{
+	getdns_item item;
+	getdns_return_t r;
+
+	if (!bin || !list)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	if ((r = _getdns_bin2item_mf(
+	    &_getdns_plain_mem_funcs, bin, bin_sz, &item, borrow)))
+		return r;
+
+	else if (item.dtype != t_list) {
+		_getdns_bin_item_destroy(&_getdns_plain_mem_funcs, &item);
+		return GETDNS_RETURN_WRONG_TYPE_REQUESTED;
+	}
+	*list = item.data.list;
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+getdns_bin2dict(const uint8_t *bin, size_t bin_sz, getdns_dict **dict)
+{
+	return _getdns_bin2dict(bin, bin_sz, dict, 0);
+}
+
+getdns_return_t
+getdns_bin2dict_borrow(const uint8_t *bin, size_t bin_sz, getdns_dict **dict)
+{
+	return _getdns_bin2dict(bin, bin_sz, dict, 1);
+}
+
+getdns_return_t
+getdns_bin2list(const uint8_t *bin, size_t bin_sz, getdns_list **list)
+{
+	return _getdns_bin2list(bin, bin_sz, list, 0);
+}
+
+getdns_return_t
+getdns_bin2list_borrow(const uint8_t *bin, size_t bin_sz, getdns_list **list)
+{
+	return _getdns_bin2list(bin, bin_sz, list, 1);
+}
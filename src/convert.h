@@ -37,6 +37,8 @@
 
 #include "types-internal.h"
 #include <stdio.h>
+#include "gldns/gbuffer.h"
+#include "gldns/str2wire.h"
 
 getdns_return_t _getdns_wire2rr_dict(struct mem_funcs *mf,
     const uint8_t *wire, size_t wire_len, getdns_dict **rr_dict);
@@ -50,6 +52,32 @@ getdns_return_t _getdns_wire2rr_dict_scan(struct mem_funcs *mf,
 getdns_return_t _getdns_str2rr_dict(struct mem_funcs *mf, const char *str,
     getdns_dict **rr_dict, const char *origin, uint32_t default_ttl);
 
+/* Iterator over the RRs in a zone file.  The RRs are yielded in wireformat,
+ * one at a time, in the caller provided rr space, without a getdns_dict being
+ * created for each of them.
+ */
+typedef struct _getdns_fp2wire_iter {
+	FILE                          *in;
+	struct gldns_file_parse_state  pst;
+	uint8_t                       *rr;
+	size_t                         rr_spc_sz;
+	size_t                         rr_len;
+	size_t                         dname_len;
+} _getdns_fp2wire_iter;
+
+getdns_return_t _getdns_fp2wire_iter_init(_getdns_fp2wire_iter *i, FILE *in,
+    uint8_t *rr_spc, size_t rr_spc_sz, const char *origin, uint32_t default_ttl);
+
+/* On success, i->rr_len is the length of the next RR, or 0 at end of file */
+getdns_return_t _getdns_fp2wire_iter_next(_getdns_fp2wire_iter *i);
+
+/* Append the (remaining) RRs of i back to back to gbuf.  A dynamic gbuf
+ * grows as needed.  The position of a fixed gbuf continues past its limit,
+ * so that the needed space is known afterwards.
+ */
+getdns_return_t _getdns_fp2wire_arena(_getdns_fp2wire_iter *i,
+    gldns_buffer *gbuf, size_t *rr_count);
+
 getdns_return_t _getdns_fp2rr_list(struct mem_funcs *mf, FILE *in,
     getdns_list **rr_list, const char *origin, uint32_t default_ttl);
 
@@ -174,7 +174,7 @@ getdns_dict_item_free(_getdns_rbnode_t *node, void *arg)
 	switch (d->i.dtype) {
 	case t_dict   : getdns_dict_destroy(d->i.data.dict); break;
 	case t_list   : getdns_list_destroy(d->i.data.list); break;
-	case t_bindata: _getdns_bindata_destroy(&dict->mf, d->i.data.bindata);
+	case t_bindata: _getdns_item_bindata_destroy(&dict->mf, &d->i);
 	default       : break;
 	}
 	if (node->key)
@@ -220,6 +220,7 @@ _getdns_dict_find_and_add(
 		/* add a node */
 		d = GETDNS_MALLOC(dict->mf, struct getdns_dict_item);
 		d->node.key = _json_ptr_keydup(&dict->mf, key);
+		d->i.borrowed = 0;
 		_getdns_rbtree_insert(&(dict->root), (_getdns_rbnode_t *) d);
 		if (*key != '/' || !(next = strchr(key + 1, '/'))) {
 			(void) memset(&d->i.data, 0, sizeof(d->i.data));
@@ -244,11 +245,12 @@ _getdns_dict_find_and_add(
 		switch (d->i.dtype) {
 		case t_dict   : getdns_dict_destroy(d->i.data.dict); break;
 		case t_list   : getdns_list_destroy(d->i.data.list); break;
-		case t_bindata: _getdns_bindata_destroy(
-				      &dict->mf, d->i.data.bindata); break;
+		case t_bindata: _getdns_item_bindata_destroy(
+				      &dict->mf, &d->i); break;
 		default       : break;
 		}
 		d->i.dtype = t_int;
+		d->i.borrowed = 0;
 		d->i.data.n = 33355555;
 		*item = &d->i;
 		return GETDNS_RETURN_GOOD;
@@ -262,6 +264,17 @@ _getdns_dict_find_and_add(
 }				/* getdns_dict_find_and_add */
 
 
+void
+_getdns_item_bindata_destroy(struct mem_funcs *mf, getdns_item *item)
+{
+	if (!item->borrowed)
+		_getdns_bindata_destroy(mf, item->data.bindata);
+
+	else if (item->data.bindata)
+		GETDNS_FREE(*mf, item->data.bindata);
+}
+
+
 /*---------------------------------------- getdns_dict_get_names
 */
 getdns_return_t
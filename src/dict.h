@@ -71,6 +71,11 @@ getdns_return_t _getdns_dict_find(
 getdns_return_t _getdns_dict_find_and_add(
     getdns_dict *dict, const char *key, getdns_item **item);
 
+/* Free the bindata of item, but leave data that the item merely borrows
+ * alone.
+ */
+void _getdns_item_bindata_destroy(struct mem_funcs *mf, getdns_item *item);
+
 /* Return 1 (true) if bindata can be interpreted as an
  * uncompressed dname.
  */
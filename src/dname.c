@@ -0,0 +1,214 @@
+/**
+ *
+ * /brief Functions for uncompressed wireformat domain names
+ */
+/*
+ * Copyright (c) 2013, NLnet Labs, Verisign, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <string.h>
+#include "dname.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const uint8_t _getdns_dname_lower[256] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+	0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+	0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+	0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+	0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+	0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+	0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+	0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+	0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+	0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+	0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+#ifdef __SSE2__
+static inline __m128i
+fold16(const uint8_t *src)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)src);
+	__m128i upper = _mm_and_si128(
+	    _mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+	    _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+void
+_getdns_dname_fold(uint8_t *dst, const uint8_t *src, size_t len)
+{
+#ifdef __SSE2__
+	for (; len >= 16; len -= 16, src += 16, dst += 16)
+		_mm_storeu_si128((__m128i *)dst, fold16(src));
+#endif
+	for (; len; len--)
+		*dst++ = _getdns_dname_lower[*src++];
+}
+
+int
+_getdns_dname_fold_equal(const uint8_t *l, const uint8_t *r, size_t len)
+{
+#ifdef __SSE2__
+	for (; len >= 16; len -= 16, l += 16, r += 16)
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(fold16(l), fold16(r)))
+		    != 0xFFFF)
+			return 0;
+#endif
+	for (; len; len--, l++, r++)
+		if (*l != *r &&
+		    _getdns_dname_lower[*l] != _getdns_dname_lower[*r])
+			return 0;
+	return 1;
+}
+
+int
+_getdns_dname_fold_cmp(const uint8_t *l, const uint8_t *r, size_t len)
+{
+#ifdef __SSE2__
+	/* Skip the equal blocks, the scalar loop will find the difference */
+	for (; len >= 16; len -= 16, l += 16, r += 16)
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(fold16(l), fold16(r)))
+		    != 0xFFFF)
+			break;
+#endif
+	for (; len; len--, l++, r++)
+		if (*l != *r &&
+		    _getdns_dname_lower[*l] != _getdns_dname_lower[*r])
+			return (int)_getdns_dname_lower[*l]
+			     - (int)_getdns_dname_lower[*r];
+	return 0;
+}
+
+/* Octet by octet, for names with compression pointers or unknown labels */
+static int
+dname_equal_slow(const uint8_t *s1, const uint8_t *s2)
+{
+	uint8_t i;
+	for (;;) {
+		if (*s1 != *s2)
+			return 0;
+		else if (!*s1)
+			return 1;
+		for (i = *s1++, s2++; i > 0; i--, s1++, s2++)
+			if (*s1 != *s2 && _getdns_dname_lower[*s1]
+			               != _getdns_dname_lower[*s2])
+				return 0;
+	}
+}
+
+int
+_getdns_dname_equal(const uint8_t *s1, const uint8_t *s2)
+{
+	const uint8_t *p1, *p2;
+
+	/* Names with different label lengths are never equal.  Once the
+	 * lengths are known to match, compare the names as a whole.
+	 */
+	for ( p1 = s1, p2 = s2
+	    ; *p1 == *p2 && *p1 && !(*p1 & 0xC0)
+	    ; p1 += *p1 + 1, p2 += *p2 + 1)
+		if (p1 + *p1 + 1 - s1 > 254)
+			return dname_equal_slow(s1, s2);
+
+	if (*p1 != *p2)
+		return 0;
+	if (*p1)
+		return dname_equal_slow(s1, s2);
+
+	return _getdns_dname_fold_equal(s1, s2, p1 - s1);
+}
+
+int
+_getdns_dname_is_parent(const uint8_t *parent, const uint8_t *subdomain)
+{
+	size_t parent_len, subdomain_len;
+
+	if (!(parent_len = _getdns_dname_len(parent)) ||
+	    !(subdomain_len = _getdns_dname_len(subdomain))) {
+		while (*subdomain) {
+			if (dname_equal_slow(parent, subdomain))
+				return 1;
+
+			subdomain += *subdomain + 1;
+		}
+		return *parent == 0;
+	}
+	/* Only the parent of subdomain with the same length can match */
+	while (subdomain_len > parent_len) {
+		subdomain_len -= *subdomain + 1;
+		subdomain += *subdomain + 1;
+	}
+	return subdomain_len == parent_len
+	    && _getdns_dname_fold_equal(parent, subdomain, parent_len);
+}
+
+/* Fills offsets with the offsets of the labels of dname (without the root)
+ * and returns the number of labels.
+ */
+static size_t
+dname_label_offsets(const uint8_t *dname, uint8_t *offsets)
+{
+	const uint8_t *p;
+	size_t n = 0;
+
+	for (p = dname; *p && n < 127 && p - dname < 255; p += *p + 1)
+		offsets[n++] = (uint8_t)(p - dname);
+	return n;
+}
+
+int
+_getdns_dname_canonical_cmp(const uint8_t *left, const uint8_t *right)
+{
+	uint8_t loffsets[128], roffsets[128];
+	size_t n_llabels, n_rlabels;
+	const uint8_t *l, *r;
+	int c;
+
+	n_llabels = dname_label_offsets(left, loffsets);
+	n_rlabels = dname_label_offsets(right, roffsets);
+
+	/* From the top level domain down */
+	while (n_llabels && n_rlabels) {
+		l = left  + loffsets[--n_llabels];
+		r = right + roffsets[--n_rlabels];
+		if ((c = _getdns_dname_fold_cmp(l + 1, r + 1, *l < *r ? *l : *r)))
+			return c < 0 ? -1 : 1;
+		if (*l != *r)
+			return *l < *r ? -1 : 1;
+	}
+	return n_llabels ? 1 : n_rlabels ? -1 : 0;
+}
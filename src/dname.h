@@ -0,0 +1,93 @@
+/**
+ *
+ * /brief Functions for uncompressed wireformat domain names
+ *
+ * Case folding, comparison and label counting of uncompressed domain names
+ * in wireformat.  When available, SSE2 is used to process sixteen octets at
+ * a time.  Label length octets are never in the range 'A' - 'Z', so a name
+ * can be case folded and compared as a whole once its length is known.
+ */
+/*
+ * Copyright (c) 2013, NLnet Labs, Verisign, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DNAME_H_
+#define DNAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ASCII lower case of every octet, as in RFC 4343 */
+extern const uint8_t _getdns_dname_lower[256];
+
+/* Length of the dname including the root label, or 0 when it is longer
+ * than 255 octets or contains compression pointers or unknown label types.
+ */
+static inline size_t _getdns_dname_len(const uint8_t *dname)
+{
+	const uint8_t *p;
+
+	for (p = dname; *p; p += *p + 1)
+		if ((*p & 0xC0) || p + *p + 1 - dname > 254)
+			return 0;
+
+	return p - dname + 1;
+}
+
+/* Every label length depends on the previous, so there is nothing to gain
+ * from processing more than one octet at a time here.
+ */
+static inline size_t _getdns_dname_label_count(const uint8_t *dname)
+{
+	size_t c;
+
+	for (c = 0; *dname; dname += *dname + 1, c++)
+		; /* pass */
+	return c;
+}
+
+/* Copy len octets from src to dst (which may be the same), lower cased */
+void _getdns_dname_fold(uint8_t *dst, const uint8_t *src, size_t len);
+
+/* Case insensitive comparison of len octets.  _getdns_dname_fold_cmp returns
+ * a value smaller than, equal to or greater than zero like memcmp.
+ */
+int _getdns_dname_fold_equal(const uint8_t *l, const uint8_t *r, size_t len);
+int _getdns_dname_fold_cmp(const uint8_t *l, const uint8_t *r, size_t len);
+
+/* Case insensitive equality of two dnames */
+int _getdns_dname_equal(const uint8_t *s1, const uint8_t *s2);
+
+/* Whether parent is subdomain, or one of its parents */
+int _getdns_dname_is_parent(const uint8_t *parent, const uint8_t *subdomain);
+
+/* Canonical DNS name order (RFC 4034 Section 6.1).
+ * Returns -1, 0 or 1 when left sorts before, equal or after right.
+ */
+int _getdns_dname_canonical_cmp(const uint8_t *left, const uint8_t *right);
+
+#endif
+/* dname.h */
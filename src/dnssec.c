@@ -208,6 +208,7 @@
 #include "general.h"
 #include "dict.h"
 #include "list.h"
+#include "convert.h"
 #include "util/val_secalgo.h"
 
 #define SIGNATURE_VERIFIED         0x10000
@@ -228,11 +229,7 @@ static inline size_t _dname_len(const uint8_t *name)
 
 static inline size_t _dname_label_count(const uint8_t *name)
 {
-	size_t c;
-	for (c = 0; *name; name += *name + 1, c++)
-		/* pass */
-		;
-	return c;
+	return _getdns_dname_label_count(name);
 }
 
 static inline int _dname_equal(const uint8_t *left, const uint8_t *right)
@@ -240,16 +237,10 @@ static inline int _dname_equal(const uint8_t *left, const uint8_t *right)
 	return _getdns_dname_equal(left, right);
 }
 
-static int _dname_is_parent(
+static inline int _dname_is_parent(
     const uint8_t * const parent, const uint8_t *subdomain)
 {
-	while (*subdomain) {
-		if (_dname_equal(parent, subdomain))
-			return 1;
-
-		subdomain += *subdomain + 1;
-	}
-	return *parent == 0;
+	return _getdns_dname_is_parent(parent, subdomain);
 }
 
 static uint8_t *_dname_label_copy(uint8_t *dst, const uint8_t *src, size_t dst_len)
@@ -259,8 +250,8 @@ static uint8_t *_dname_label_copy(uint8_t *dst, const uint8_t *src, size_t dst_l
 	if (!src || (size_t)*src + 1 > dst_len)
 		return NULL;
 
-	for (i = (*dst++ = *src++); i ; i--)
-		*dst++ = tolower(*src++);
+	i = (*dst++ = *src++);
+	_getdns_dname_fold(dst, src, i);
 
 	return r;
 }
@@ -292,7 +283,7 @@ static const uint8_t *dname_shared_parent(
     const uint8_t *left, const uint8_t *right)
 {
 	const uint8_t *llabels[128], *rlabels[128], **last_llabel, **last_rlabel,
-		**llabel, **rlabel, *l, *r;
+		**llabel, **rlabel;
 	uint8_t sz;
 
 	last_llabel = reverse_labels(left, llabels);
@@ -313,51 +304,15 @@ static const uint8_t *dname_shared_parent(
 		    || **llabel != **rlabel)
 			return llabel[-1];
 
-		for (l = *llabel+1, r = *rlabel+1; sz; l++, r++, sz-- ) 
-			if (*l != *r && tolower((unsigned char)*l) !=
-					tolower((unsigned char)*r))
-				return llabel[-1];
+		if (!_getdns_dname_fold_equal(*llabel + 1, *rlabel + 1, sz))
+			return llabel[-1];
 	}
 	return llabel[-1];
 }
 
-static int dname_compare(const uint8_t *left, const uint8_t *right)
+static inline int dname_compare(const uint8_t *left, const uint8_t *right)
 {
-	const uint8_t *llabels[128], *rlabels[128], **last_llabel, **last_rlabel,
-		**llabel, **rlabel, *l, *r;
-	uint8_t lsz, rsz;
-
-	last_llabel = reverse_labels(left, llabels);
-	last_rlabel = reverse_labels(right, rlabels);
-
-	for ( llabel = llabels, rlabel = rlabels
-	    ; llabel < last_llabel
-	    ; llabel++, rlabel++ ) {
-
-		if (rlabel == last_rlabel)
-			return 1;
-
-		for ( l = *llabel, lsz = *l++, r = *rlabel, rsz = *r++
-		    ; lsz; l++, r++, lsz--, rsz-- ) {
-
-			/* No compression pointers here */
-			assert(lsz <= 63);
-			assert(rsz <= 63);
-
-			if (!rsz)
-				return 1;
-			if (*l != *r && tolower((unsigned char)*l) !=
-					tolower((unsigned char)*r)) {
-				if (tolower((unsigned char)*l) <
-				    tolower((unsigned char)*r))
-					return -1;
-				return 1;
-			}
-		}
-		if (rsz)
-			return -1;
-	}
-	return rlabel == last_rlabel ? 0 : -1;
+	return _getdns_dname_canonical_cmp(left, right);
 }
 
 static int bitmap_has_type(_getdns_rdf_iter *bitmap, uint16_t rr_type)
@@ -611,6 +566,7 @@ static chain_head *add_rrset2val_chain(struct mem_funcs *mf,
 	head->rrset.pkt = rrset->pkt;
 	head->rrset.pkt_len = rrset->pkt_len;
 	head->rrset.sections = rrset->sections;
+	head->rrset.index = rrset->index;
 	head->netreq = netreq;
 	head->signer = -1;
 	head->node_count = node_count;
@@ -642,9 +598,11 @@ static chain_head *add_rrset2val_chain(struct mem_funcs *mf,
 		node->ds.pkt          = NULL;
 		node->ds.pkt_len      = 0;
 		node->ds.sections     = head->rrset.sections;
+		node->ds.index        = NULL;
 		node->dnskey.pkt      = NULL;
 		node->dnskey.pkt_len  = 0;
 		node->dnskey.sections = head->rrset.sections;
+		node->dnskey.index    = NULL;
 		node->ds_req          = NULL;
 		node->dnskey_req      = NULL;
 		node->soa_req         = NULL;
@@ -693,7 +651,7 @@ static int is_synthesized_cname(_getdns_rrset *cname)
 
 	/* Find a matching DNAME */
 	for ( i = _getdns_rrset_iter_init(&i_spc, cname->pkt, cname->pkt_len
-	                                        , SECTION_ANSWER)
+	                                        , cname->index, SECTION_ANSWER)
 	    ; i
 	    ; i = _getdns_rrset_iter_next(i)) {
 
@@ -742,6 +700,12 @@ static int is_synthesized_cname(_getdns_rrset *cname)
 	return 0;
 }
 
+/* The index of pkt, when it is the response of netreq */
+static inline _getdns_rr_index *netreq_pkt_index(
+    getdns_network_req *netreq, const uint8_t *pkt)
+{ return netreq && netreq->response == pkt
+       ? _getdns_netreq_rr_index(netreq) : NULL; }
+
 /* Create the validation chain structure for the given packet.
  * When netreq is set, queries will be scheduled for the DS
  * and DNSKEY RR's for the nodes on the validation chain.
@@ -773,6 +737,7 @@ static void add_pkt2val_chain(struct mem_funcs *mf,
 	/* For all things without signature, find SOA (zonecut) and query DS */
 
 	for ( i = _getdns_rrset_iter_init(&i_spc, pkt, pkt_len
+	                                        , netreq_pkt_index(netreq, pkt)
 	                                        , SECTION_NO_ADDITIONAL)
 	    ; i
 	    ; i = _getdns_rrset_iter_next(i)) {
@@ -833,6 +798,7 @@ static void add_question2val_chain(struct mem_funcs *mf,
 	q_rrset.rrset.pkt      = pkt;
 	q_rrset.rrset.pkt_len  = pkt_len;
 	q_rrset.rrset.sections = SECTION_ANSWER;
+	q_rrset.rrset.index    = netreq_pkt_index(netreq, pkt);
 
 	if (_getdns_initialized_rrset_answer(&q_rrset))
 		return;
@@ -1048,9 +1014,13 @@ static void val_chain_node_cb(getdns_dns_req *dnsreq)
 	switch (netreq->request_type) {
 	case GETDNS_RRTYPE_DS    : node->ds.pkt     = netreq->response;
 	                           node->ds.pkt_len = netreq->response_len;
+	                           node->ds.index   =
+	                               _getdns_netreq_rr_index(netreq);
 	                           break;
 	case GETDNS_RRTYPE_DNSKEY: node->dnskey.pkt     = netreq->response;
 	                           node->dnskey.pkt_len = netreq->response_len;
+	                           node->dnskey.index   =
+	                               _getdns_netreq_rr_index(netreq);
 	default                  : check_chain_complete(node->chains);
 				   return;
 	}
@@ -1058,6 +1028,7 @@ static void val_chain_node_cb(getdns_dns_req *dnsreq)
 	n_signers = 0;
 	for ( i = _getdns_rrset_iter_init(&i_spc, netreq->response
 	                                        , netreq->response_len
+	                                        , _getdns_netreq_rr_index(netreq)
 	                                        , SECTION_NO_ADDITIONAL)
 	    ; i
 	    ; i = _getdns_rrset_iter_next(i)) {
@@ -1101,6 +1072,7 @@ static void val_chain_node_soa_cb(getdns_dns_req *dnsreq)
 
 	for ( i = _getdns_rrset_iter_init(&i_spc, netreq->response
 	                                        , netreq->response_len
+	                                        , _getdns_netreq_rr_index(netreq)
 	                                        , SECTION_ANSWER)
 	    ; i
 	    ; i = _getdns_rrset_iter_next(i)) {
@@ -2055,7 +2027,7 @@ static int find_nsec_covering_name(
 		*opt_out = 0;
 
 	for ( i = _getdns_rrset_iter_init(&i_spc, rrset->pkt, rrset->pkt_len
-	                                        , SECTION_NO_ADDITIONAL)
+	                                        , rrset->index, SECTION_NO_ADDITIONAL)
 	    ; i ; i = _getdns_rrset_iter_next(i)) {
 
 		if ((n = _getdns_rrset_iter_value(i))
@@ -2277,7 +2249,7 @@ static int key_proves_nonexistance(
 	 * - First find the NSEC that covers the owner name.
 	 */
 	for ( i = _getdns_rrset_iter_init(&i_spc, rrset->pkt, rrset->pkt_len
-	                                        , SECTION_NO_ADDITIONAL)
+	                                        , rrset->index, SECTION_NO_ADDITIONAL)
 	    ; i ; i = _getdns_rrset_iter_next(i)) {
 
 		cover = _getdns_rrset_iter_value(i);
@@ -2348,7 +2320,7 @@ static int key_proves_nonexistance(
 	 * NSEC3 has same (hashed) ownername as the rrset to deny.
 	 */
 	for ( i = _getdns_rrset_iter_init(&i_spc, rrset->pkt, rrset->pkt_len
-	                                        , SECTION_NO_ADDITIONAL)
+	                                        , rrset->index, SECTION_NO_ADDITIONAL)
 	    ; i ; i = _getdns_rrset_iter_next(i)) {
 
 		/* ce is potentially the NSEC3 that matches complete qname
@@ -2421,7 +2393,7 @@ static int key_proves_nonexistance(
 	    ; *ce_name ; nc_name = ce_name, ce_name += *ce_name + 1) {
 
 		for ( i = _getdns_rrset_iter_init(&i_spc, rrset->pkt, rrset->pkt_len
-		                                        , SECTION_NO_ADDITIONAL)
+		                                        , rrset->index, SECTION_NO_ADDITIONAL)
 		    ; i ; i = _getdns_rrset_iter_next(i)) {
 
 			if (   !(ce = _getdns_rrset_iter_value(i))
@@ -2903,6 +2875,7 @@ static void append_rrs2val_chain_list(getdns_context *ctxt,
 
 	for ( i = _getdns_rrset_iter_init(&i_spc, netreq->response
 	                                        , netreq->response_len
+	                                        , _getdns_netreq_rr_index(netreq)
 	                                        , SECTION_NO_ADDITIONAL)
 	    ; i
 	    ; i = _getdns_rrset_iter_next(i)) {
@@ -3013,7 +2986,7 @@ static void check_chain_complete(chain_head *chain)
 
 		chain_set_netreq_dnssec_status(chain,_getdns_rrset_iter_init(&tas_iter,
 		    context->trust_anchors, context->trust_anchors_len,
-		    SECTION_ANSWER));
+		    NULL, SECTION_ANSWER));
 #else
 	if (dnsreq->dnssec_return_validation_chain
 	    && context->trust_anchors)
@@ -3023,7 +2996,7 @@ static void check_chain_complete(chain_head *chain)
 		    chain, _getdns_rrset_iter_init( &tas_iter
 		                          , context->trust_anchors
 		                          , context->trust_anchors_len
-		                          , SECTION_ANSWER));
+		                          , NULL, SECTION_ANSWER));
 #endif
 #ifdef DNSSEC_ROADBLOCK_AVOIDANCE
 	if (    dnsreq->dnssec_roadblock_avoidance
@@ -3226,13 +3199,15 @@ static int wire_validate_dnssec(struct mem_funcs *mf,
 
 			node->dnskey.pkt = support;
 			node->dnskey.pkt_len = support_len;
+			node->dnskey.index = NULL;
 			node->ds.pkt = support;
 			node->ds.pkt_len = support_len;
+			node->ds.index = NULL;
 		}
 	}
 	s = chain_validate_dnssec(mf, now, skew, chain,
 	    _getdns_rrset_iter_init(
-		    &tas_iter, tas, tas_len, SECTION_ANSWER));
+		    &tas_iter, tas, tas_len, NULL, SECTION_ANSWER));
 
 	/* Cleanup the chain */
 	for (head = chain; head; head = next_head) {
@@ -3353,10 +3328,9 @@ uint16_t
 _getdns_parse_ta_file(time_t *ta_mtime, gldns_buffer *gbuf)
 {
 
-	struct gldns_file_parse_state pst;
+	_getdns_fp2wire_iter i;
 	struct stat st;
 	uint8_t rr[8192]; /* Reasonable size for a single DNSKEY or DS RR */
-	size_t len, dname_len;
 	FILE *in;
 	uint16_t ta_count = 0;
 	size_t pkt_start;
@@ -3370,30 +3344,30 @@ _getdns_parse_ta_file(time_t *ta_mtime, gldns_buffer *gbuf)
 	if (!(in = fopen(TRUST_ANCHOR_FILE, "r")))
 		return 0;
 
-	memset(&pst, 0, sizeof(pst));
-	pst.default_ttl = 3600;
-	pst.lineno = 1;
-
+	if (_getdns_fp2wire_iter_init(&i, in, rr, sizeof(rr), NULL, 3600)) {
+		fclose(in);
+		return 0;
+	}
 	pkt_start = gldns_buffer_position(gbuf);
 	/* Empty header */
+	if (!gbuf->_fixed && !gldns_buffer_reserve(gbuf, GLDNS_HEADER_SIZE)) {
+		fclose(in);
+		return 0;
+	}
 	gldns_buffer_write_u32(gbuf, 0);
 	gldns_buffer_write_u32(gbuf, 0);
 	gldns_buffer_write_u32(gbuf, 0);
 
-	while (!feof(in)) {
-		len = sizeof(rr);
-		dname_len = 0;
-		if (gldns_fp2wire_rr_buf(in, rr, &len, &dname_len, &pst))
-			break;
-		if (len == 0)  /* empty, $TTL, $ORIGIN */
-			continue;
-		if (gldns_wirerr_get_type(rr, len, dname_len) 
+	while (!_getdns_fp2wire_iter_next(&i) && i.rr_len) {
+		if (gldns_wirerr_get_type(i.rr, i.rr_len, i.dname_len)
 		    != GLDNS_RR_TYPE_DS &&
-		    gldns_wirerr_get_type(rr, len, dname_len)
+		    gldns_wirerr_get_type(i.rr, i.rr_len, i.dname_len)
 		    != GLDNS_RR_TYPE_DNSKEY)
 			continue;
 
-		gldns_buffer_write(gbuf, rr, len);
+		if (!gbuf->_fixed && !gldns_buffer_reserve(gbuf, i.rr_len))
+			break;
+		gldns_buffer_write(gbuf, i.rr, i.rr_len);
 		ta_count++;
 	}
 	fclose(in);
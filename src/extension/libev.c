@@ -41,10 +41,23 @@
 #include <ev.h>
 #endif
 
+typedef struct io_timer {
+	ev_io    read;
+	ev_io    write;
+	ev_timer timer;
+} io_timer;
+
+/* Cleared watchers are kept for reuse by the next schedule, so that the
+ * frequent clear and reschedule of connections does not allocate.
+ */
+#define SPARE_WATCHERS 64
+
 typedef struct getdns_libev {
 	getdns_eventloop_vmt *vmt;
 	struct ev_loop       *loop;
 	struct mem_funcs      mf;
+	io_timer             *spare[SPARE_WATCHERS];
+	size_t                n_spare;
 } getdns_libev;
 
 static void 
@@ -64,15 +77,12 @@ static void
 getdns_libev_cleanup(getdns_eventloop *loop)
 {
 	getdns_libev *ext = (getdns_libev *)loop;
+
+	while (ext->n_spare)
+		GETDNS_FREE(ext->mf, ext->spare[--ext->n_spare]);
 	GETDNS_FREE(ext->mf, ext);
 }
 
-typedef struct io_timer {
-	ev_io    read;
-	ev_io    write;
-	ev_timer timer;
-} io_timer;
-
 static getdns_return_t
 getdns_libev_clear(getdns_eventloop *loop, getdns_eventloop_event *el_ev)
 {
@@ -81,14 +91,15 @@ getdns_libev_clear(getdns_eventloop *loop, getdns_eventloop_event *el_ev)
 	
 	assert(my_ev);
 
-	if (el_ev->read_cb)
-		ev_io_stop(ext->loop, &my_ev->read);
-	if (el_ev->write_cb)
-		ev_io_stop(ext->loop, &my_ev->write);
-	if (el_ev->timeout_cb)
-		ev_timer_stop(ext->loop, &my_ev->timer);
+	/* All watchers, as they must all be inactive for reuse */
+	ev_io_stop(ext->loop, &my_ev->read);
+	ev_io_stop(ext->loop, &my_ev->write);
+	ev_timer_stop(ext->loop, &my_ev->timer);
 
-	GETDNS_FREE(ext->mf, el_ev->ev);
+	if (ext->n_spare < SPARE_WATCHERS)
+		ext->spare[ext->n_spare++] = my_ev;
+	else
+		GETDNS_FREE(ext->mf, my_ev);
 	el_ev->ev = NULL;
 	return GETDNS_RETURN_GOOD;
 }
@@ -134,8 +145,16 @@ getdns_libev_schedule(getdns_eventloop *loop,
 	assert(!(el_ev->read_cb || el_ev->write_cb) || fd >= 0);
 	assert(  el_ev->read_cb || el_ev->write_cb  || el_ev->timeout_cb);
 
-	if (!(my_ev = GETDNS_MALLOC(ext->mf, io_timer)))
+	if (ext->n_spare)
+		my_ev = ext->spare[--ext->n_spare];
+
+	else if (!(my_ev = GETDNS_MALLOC(ext->mf, io_timer)))
 		return GETDNS_RETURN_MEMORY_ERROR;
+	else {
+		ev_init(&my_ev->read, getdns_libev_read_cb);
+		ev_init(&my_ev->write, getdns_libev_write_cb);
+		ev_init(&my_ev->timer, getdns_libev_timeout_cb);
+	}
 
 	el_ev->ev = my_ev;
 	
@@ -184,6 +203,7 @@ getdns_extension_set_libev_loop(getdns_context *context,
 	ext->vmt  = &getdns_libev_vmt;
 	ext->loop = loop;
 	ext->mf   = *priv_getdns_context_mf(context);
+	ext->n_spare = 0;
 
 	return getdns_context_set_eventloop(context, (getdns_eventloop *)ext);
 }
@@ -63,12 +63,26 @@ event_new(struct event_base *b, evutil_socket_t fd, short ev, void (*cb)(int, sh
 	event_base_set(b, e);
 	return e;
 }
+
+static int
+event_assign(struct event *e, struct event_base *b, evutil_socket_t fd, short ev, void (*cb)(int, short, void*), void *arg)
+{
+	event_set(e, fd, ev, cb, arg);
+	return event_base_set(b, e);
+}
 #endif /* no event2 */
 
+/* Cleared events are kept for reuse by the next schedule, so that the
+ * frequent clear and reschedule of connections does not allocate.
+ */
+#define SPARE_EVENTS 64
+
 typedef struct getdns_libevent {
 	getdns_eventloop_vmt *vmt;
         struct event_base    *base;
 	struct mem_funcs      mf;
+	struct event         *spare[SPARE_EVENTS];
+	size_t                n_spare;
 } getdns_libevent;
 
 static void
@@ -88,21 +102,27 @@ static void
 getdns_libevent_cleanup(getdns_eventloop *loop)
 {
 	getdns_libevent *ext = (getdns_libevent *)loop;
+
+	while (ext->n_spare)
+		event_free(ext->spare[--ext->n_spare]);
 	GETDNS_FREE(ext->mf, ext);
 }
 
 static getdns_return_t
 getdns_libevent_clear(getdns_eventloop *loop, getdns_eventloop_event *el_ev)
 {
+	getdns_libevent *ext = (getdns_libevent *)loop;
 	struct event *my_ev = (struct event *)el_ev->ev;
-	(void)loop;
 
 	assert(my_ev);
 
 	if (event_del(my_ev) != 0)
 		return GETDNS_RETURN_GENERIC_ERROR;
 
-	event_free(my_ev);
+	if (ext->n_spare < SPARE_EVENTS)
+		ext->spare[ext->n_spare++] = my_ev;
+	else
+		event_free(my_ev);
 	el_ev->ev = NULL;
 	return GETDNS_RETURN_GOOD;
 }
@@ -133,17 +153,25 @@ getdns_libevent_schedule(getdns_eventloop *loop,
 	getdns_libevent *ext = (getdns_libevent *)loop;
 	struct event *my_ev;
 	struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+	short events;
 
 	assert(el_ev);
 	assert(!(el_ev->read_cb || el_ev->write_cb) || fd >= 0);
 	assert(  el_ev->read_cb || el_ev->write_cb  || el_ev->timeout_cb);
 
-	my_ev = event_new(ext->base, fd, (
-	    (el_ev->read_cb ? EV_READ|EV_PERSIST : 0) |
-	    (el_ev->write_cb ? EV_WRITE|EV_PERSIST : 0) |
-	    (el_ev->timeout_cb ? EV_TIMEOUT : 0)),
-	    getdns_libevent_callback, el_ev);
-	if (!my_ev)
+	events = (el_ev->read_cb ? EV_READ|EV_PERSIST : 0) |
+	         (el_ev->write_cb ? EV_WRITE|EV_PERSIST : 0) |
+	         (el_ev->timeout_cb ? EV_TIMEOUT : 0);
+
+	if (ext->n_spare) {
+		my_ev = ext->spare[--ext->n_spare];
+		if (event_assign(my_ev, ext->base, fd, events,
+		    getdns_libevent_callback, el_ev)) {
+			event_free(my_ev);
+			return GETDNS_RETURN_GENERIC_ERROR;
+		}
+	} else if (!(my_ev = event_new(ext->base, fd, events,
+	    getdns_libevent_callback, el_ev)))
 		return GETDNS_RETURN_MEMORY_ERROR;
 
 	el_ev->ev = my_ev;
@@ -181,6 +209,7 @@ getdns_extension_set_libevent_base(getdns_context *context,
 	ext->vmt  = &getdns_libevent_vmt;
 	ext->base = base;
 	ext->mf   = *priv_getdns_context_mf(context);
+	ext->n_spare = 0;
 
 	return getdns_context_set_eventloop(context, (getdns_eventloop *)ext);
 }
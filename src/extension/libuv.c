@@ -46,10 +46,27 @@
 #define DEBUG_UV(...) DEBUG_OFF(__VA_ARGS__)
 #endif
 
+typedef struct poll_timer {
+	uv_poll_t        poll;
+	uv_timer_t       timer;
+	int              fd; /* poll is initialized for fd, or -1 */
+	int              to_close;
+	struct mem_funcs mf;
+} poll_timer;
+
+/* Cleared handles are kept for reuse by the next schedule, so that the
+ * frequent clear and reschedule of connections does not allocate and
+ * close handles.  A poll handle is only reused for the fd it was
+ * initialized with.
+ */
+#define SPARE_HANDLES 64
+
 typedef struct getdns_libuv {
 	getdns_eventloop_vmt *vmt;
 	uv_loop_t            *loop;
 	struct mem_funcs      mf;
+	poll_timer           *spare[SPARE_HANDLES];
+	size_t                n_spare;
 } getdns_libuv;
 
 static void
@@ -65,21 +82,6 @@ getdns_libuv_run_once(getdns_eventloop *loop, int blocking)
 	    blocking ? UV_RUN_ONCE : UV_RUN_NOWAIT);
 }
 
-static void
-getdns_libuv_cleanup(getdns_eventloop *loop)
-{
-	getdns_libuv *ext = (getdns_libuv *)loop;
-	GETDNS_FREE(ext->mf, ext);
-}
-
-typedef struct poll_timer {
-	uv_poll_t        read;
-	uv_poll_t        write;
-	uv_timer_t       timer;
-	int              to_close;
-	struct mem_funcs mf;
-} poll_timer;
-
 static void
 getdns_libuv_close_cb(uv_handle_t *handle)
 {
@@ -98,69 +100,85 @@ getdns_libuv_close_cb(uv_handle_t *handle)
 	DEBUG_UV("enter libuv_close_cb freed: %p\n", my_ev);
 }
 
+/* Close the (stopped) handles of my_ev, which is freed once libuv is done
+ * with them.
+ */
+static void
+getdns_libuv_close(poll_timer *my_ev)
+{
+	if (my_ev->fd >= 0) {
+		my_ev->to_close += 1;
+		my_ev->poll.data = my_ev;
+		uv_close((uv_handle_t *)&my_ev->poll, getdns_libuv_close_cb);
+	}
+	my_ev->to_close += 1;
+	my_ev->timer.data = my_ev;
+	uv_close((uv_handle_t *)&my_ev->timer, getdns_libuv_close_cb);
+}
+
+static void
+getdns_libuv_cleanup(getdns_eventloop *loop)
+{
+	getdns_libuv *ext = (getdns_libuv *)loop;
+
+	while (ext->n_spare)
+		getdns_libuv_close(ext->spare[--ext->n_spare]);
+	GETDNS_FREE(ext->mf, ext);
+}
+
 static getdns_return_t
 getdns_libuv_clear(getdns_eventloop *loop, getdns_eventloop_event *el_ev)
 {
+	getdns_libuv *ext = (getdns_libuv *)loop;
 	poll_timer   *my_ev = (poll_timer *)el_ev->ev;
-	uv_poll_t    *my_poll;
-	uv_timer_t   *my_timer;
-	(void)loop;
 	
 	assert(my_ev);
 
 	DEBUG_UV("enter libuv_clear(el_ev = %p, my_ev = %p, to_close = %d)\n"
 	        , el_ev, my_ev, my_ev->to_close);
 
-	if (el_ev->read_cb) {
-		my_poll = &my_ev->read;
-		uv_poll_stop(my_poll);
-		my_ev->to_close += 1;
-		my_poll->data = my_ev;
-		uv_close((uv_handle_t *)my_poll, getdns_libuv_close_cb);
-	}
-	if (el_ev->write_cb) {
-		my_poll = &my_ev->write;
-		uv_poll_stop(my_poll);
-		my_ev->to_close += 1;
-		my_poll->data = my_ev;
-		uv_close((uv_handle_t *)my_poll, getdns_libuv_close_cb);
-	}
-	if (el_ev->timeout_cb) {
-		my_timer = &my_ev->timer;
-		uv_timer_stop(my_timer);
-		my_ev->to_close += 1;
-		my_timer->data = my_ev;
-		uv_close((uv_handle_t *)my_timer, getdns_libuv_close_cb);
-	}
+	if (my_ev->fd >= 0)
+		uv_poll_stop(&my_ev->poll);
+	uv_timer_stop(&my_ev->timer);
 	el_ev->ev = NULL;
+
+#ifdef USE_WINSOCK
+	/* A poll handle on Windows is bound to the socket (not only to its
+	 * number), which may be closed after this.  Reuse only the timer. */
+	if (my_ev->fd >= 0)
+		getdns_libuv_close(my_ev);
+	else
+#endif
+	{
+		/* Make room by dropping one of the longer unused */
+		if (ext->n_spare == SPARE_HANDLES) {
+			getdns_libuv_close(ext->spare[0]);
+			ext->spare[0] = ext->spare[--ext->n_spare];
+		}
+		ext->spare[ext->n_spare++] = my_ev;
+	}
+
 	DEBUG_UV("exit  libuv_clear(el_ev = %p, my_ev = %p, to_close = %d)\n"
 	        , el_ev, my_ev, my_ev->to_close);
 	return GETDNS_RETURN_GOOD;
 }
 
 static void
-getdns_libuv_read_cb(uv_poll_t *poll, int status, int events)
+getdns_libuv_poll_cb(uv_poll_t *poll, int status, int events)
 {
         getdns_eventloop_event *el_ev = (getdns_eventloop_event *)poll->data;
-	(void)status; (void)events;
-        assert(el_ev->read_cb);
-	DEBUG_UV("enter libuv_read_cb(el_ev = %p, el_ev->ev = %p)\n"
-	        , el_ev, el_ev->ev);
-        el_ev->read_cb(el_ev->userarg);
-	DEBUG_UV("exit  libuv_read_cb(el_ev = %p, el_ev->ev = %p)\n"
-	        , el_ev, el_ev->ev);
-}
 
-static void
-getdns_libuv_write_cb(uv_poll_t *poll, int status, int events)
-{
-        getdns_eventloop_event *el_ev = (getdns_eventloop_event *)poll->data;
-	(void)status; (void)events;
-        assert(el_ev->write_cb);
-	DEBUG_UV("enter libuv_write_cb(el_ev = %p, el_ev->ev = %p)\n"
+	DEBUG_UV("enter libuv_poll_cb(el_ev = %p, el_ev->ev = %p)\n"
 	        , el_ev, el_ev->ev);
-        el_ev->write_cb(el_ev->userarg);
-	DEBUG_UV("exit  libuv_write_cb(el_ev = %p, el_ev->ev = %p)\n"
+	/* On error (status < 0) let the callbacks find out */
+	if (el_ev->read_cb &&
+	    ((events & UV_READABLE) || status < 0 || !el_ev->write_cb))
+		el_ev->read_cb(el_ev->userarg);
+	else {
+		assert(el_ev->write_cb);
+		el_ev->write_cb(el_ev->userarg);
+	}
+	DEBUG_UV("exit  libuv_poll_cb(el_ev = %p, el_ev->ev = %p)\n"
 	        , el_ev, el_ev->ev);
 }
 
@@ -185,9 +203,8 @@ getdns_libuv_schedule(getdns_eventloop *loop,
     int fd, uint64_t timeout, getdns_eventloop_event *el_ev)
 {
 	getdns_libuv *ext = (getdns_libuv *)loop;
-	poll_timer   *my_ev;
-	uv_poll_t    *my_poll;
-	uv_timer_t   *my_timer;
+	poll_timer   *my_ev = NULL;
+	size_t        i, found = ext->n_spare;
 
 	assert(el_ev);
 	assert(!(el_ev->read_cb || el_ev->write_cb) || fd >= 0);
@@ -196,30 +213,48 @@ getdns_libuv_schedule(getdns_eventloop *loop,
 	DEBUG_UV("enter libuv_schedule(el_ev = %p, el_ev->ev = %p)\n"
 	        , el_ev, el_ev->ev);
 
-	if (!(my_ev = GETDNS_MALLOC(ext->mf, poll_timer)))
-		return GETDNS_RETURN_MEMORY_ERROR;
+	if (!(el_ev->read_cb || el_ev->write_cb))
+		fd = -1;
 
-	my_ev->to_close = 0;
-	my_ev->mf = ext->mf;
-	el_ev->ev = my_ev;
-	
-	if (el_ev->read_cb) {
-		my_poll = &my_ev->read;
-		my_poll->data = el_ev;
-		uv_poll_init(ext->loop, my_poll, fd);
-		uv_poll_start(my_poll, UV_READABLE, getdns_libuv_read_cb);
+	/* A spare polling fd, or else one without a poll handle */
+	for (i = ext->n_spare; i > 0; i--) {
+		if (ext->spare[i - 1]->fd == fd || fd < 0) {
+			found = i - 1;
+			break;
+		}
+		if (ext->spare[i - 1]->fd < 0 && found == ext->n_spare)
+			found = i - 1;
 	}
-	if (el_ev->write_cb) {
-		my_poll = &my_ev->write;
-		my_poll->data = el_ev;
-		uv_poll_init(ext->loop, my_poll, fd);
-		uv_poll_start(my_poll, UV_WRITABLE, getdns_libuv_write_cb);
+	if (found < ext->n_spare) {
+		my_ev = ext->spare[found];
+		ext->spare[found] = ext->spare[--ext->n_spare];
+
+	} else if (!(my_ev = GETDNS_MALLOC(ext->mf, poll_timer)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	else {
+		my_ev->fd = -1;
+		my_ev->to_close = 0;
+		my_ev->mf = ext->mf;
+		uv_timer_init(ext->loop, &my_ev->timer);
+	}
+	el_ev->ev = my_ev;
+
+	if (fd >= 0) {
+		if (my_ev->fd != fd) {
+			assert(my_ev->fd < 0);
+			uv_poll_init(ext->loop, &my_ev->poll, fd);
+			my_ev->fd = fd;
+		}
+		my_ev->poll.data = el_ev;
+		uv_poll_start(&my_ev->poll,
+		    (el_ev->read_cb  ? UV_READABLE : 0) |
+		    (el_ev->write_cb ? UV_WRITABLE : 0),
+		    getdns_libuv_poll_cb);
 	}
 	if (el_ev->timeout_cb) {
-		my_timer = &my_ev->timer;
-		my_timer->data = el_ev;
-		uv_timer_init(ext->loop, my_timer);
-		uv_timer_start(my_timer, getdns_libuv_timeout_cb, timeout, 0);
+		my_ev->timer.data = el_ev;
+		uv_timer_start(&my_ev->timer, getdns_libuv_timeout_cb,
+		    timeout, 0);
 	}
 	DEBUG_UV("exit  libuv_schedule(el_ev = %p, el_ev->ev = %p)\n"
 	        , el_ev, el_ev->ev);
@@ -249,6 +284,7 @@ getdns_extension_set_libuv_loop(getdns_context *context, uv_loop_t *loop)
 	ext->vmt  = &getdns_libuv_vmt;
 	ext->loop = loop;
 	ext->mf   = *priv_getdns_context_mf(context);
+	ext->n_spare = 0;
 
 	return getdns_context_set_eventloop(context, (getdns_eventloop *)ext);
 }
@@ -91,7 +91,8 @@ no_answer(getdns_dns_req *dns_req)
 		if (netreq->response_len > 0 &&
 		    GLDNS_ANCOUNT(netreq->response) > 0 &&
 		    _getdns_rrset_answer(&answer, netreq->response
-		                                , netreq->response_len))
+		                                , netreq->response_len
+		                                , _getdns_netreq_rr_index(netreq)))
 			return 0;
 	}
 	return 1;
@@ -410,16 +411,109 @@ validate_extensions(struct getdns_dict * extensions)
 }				/* _getdns_validate_extensions */
 
 
+/* Issue all network requests of req.  Returns DNS_REQ_FINISHED when req was
+ * already answered (and freed) in the process.
+ */
+static int
+submit_dns_req(getdns_dns_req *req)
+{
+	getdns_network_req *netreq, **netreq_p;
+	int r = GETDNS_RETURN_GOOD;
+
+	for (netreq_p = req->netreqs; !r && (netreq = *netreq_p); netreq_p++) {
+		if ((r = _getdns_submit_netreq(netreq))) {
+			if (r == DNS_REQ_FINISHED)
+				return r;
+			netreq->state = NET_REQ_FINISHED;
+		}
+	}
+	return r;
+}
+
+/* Extensions compiled for a context.  The settings are recalculated when the
+ * configuration of the context changed since they were last determined.
+ */
+struct getdns_request_profile {
+	getdns_context          *context;
+	struct mem_funcs         mf;
+	getdns_dict             *extensions;
+
+	uint64_t                 config_serial;
+	getdns_dns_req_settings  settings;
+	uint8_t                 *opt_rr;
+	size_t                   opt_rr_sz;
+};
+
+static getdns_return_t
+profile_refresh(getdns_request_profile *profile)
+{
+	getdns_context *context = profile->context;
+	size_t opt_rr_sz;
+
+	_getdns_dns_req_settings_init(
+	    &profile->settings, context, profile->extensions);
+
+	opt_rr_sz = profile->settings.with_opt
+	          ? 11 + profile->settings.opt_options_size : 0;
+	if (opt_rr_sz > profile->opt_rr_sz) {
+		GETDNS_NULL_FREE(profile->mf, profile->opt_rr);
+		profile->opt_rr_sz = 0;
+		if (!(profile->opt_rr = GETDNS_XMALLOC(
+		    profile->mf, uint8_t, opt_rr_sz)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		profile->opt_rr_sz = opt_rr_sz;
+	}
+	if (opt_rr_sz) {
+		_getdns_dns_req_settings_opt_rr(
+		    &profile->settings, profile->opt_rr);
+		profile->settings.opt_rr = profile->opt_rr;
+	}
+	profile->config_serial = context->config_serial;
+	return GETDNS_RETURN_GOOD;
+}
+
+/* The settings of profile for the current configuration of its context */
+static getdns_return_t
+profile_settings(getdns_context *context, getdns_request_profile *profile,
+    const getdns_dns_req_settings **settings)
+{
+	getdns_return_t r;
+
+	if (profile->context != context)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	if (profile->config_serial != context->config_serial &&
+	    (r = profile_refresh(profile)))
+		return r;
+
+	*settings = &profile->settings;
+	return GETDNS_RETURN_GOOD;
+}
+
+/* Warm connections are kept on the extension event loop.  They are opened
+ * with the first asynchronous request, by which the application shows that
+ * it runs that loop.  With synchronous requests only it never does.
+ */
+static void
+upstreams_warm_on_extension(getdns_context *context)
+{
+	if (context->tls_warm_loop_used)
+		return;
+	context->tls_warm_loop_used = 1;
+	_getdns_upstreams_warm(context);
+}
+
 static getdns_return_t
 getdns_general_ns(getdns_context *context, getdns_eventloop *loop,
     const char *name, uint16_t request_type, getdns_dict *extensions,
+    getdns_request_profile *profile,
     void *userarg, getdns_network_req **return_netreq_p,
     getdns_callback_t callbackfn, internal_cb_t internal_cb, int usenamespaces)
 {
 	int r = GETDNS_RETURN_GOOD;
-	getdns_network_req *netreq, **netreq_p;
 	getdns_dns_req *req;
 	getdns_dict *localnames_response;
+	const getdns_dns_req_settings *settings;
 	size_t i;
 
 	if (!context || !name || (!callbackfn && !internal_cb))
@@ -437,7 +531,14 @@ getdns_general_ns(getdns_context *context, getdns_eventloop *loop,
 		return r;
 
 	/* create the request */
-	if (!(req = _getdns_dns_req_new(
+	if (profile) {
+		if ((r = profile_settings(context, profile, &settings)))
+			return r;
+		if (!(req = _getdns_dns_req_new_in(context, loop,
+		    name, request_type, settings, NULL)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+
+	} else if (!(req = _getdns_dns_req_new(
 	    context, loop, name, request_type, extensions)))
 		return GETDNS_RETURN_MEMORY_ERROR;
 
@@ -445,28 +546,22 @@ getdns_general_ns(getdns_context *context, getdns_eventloop *loop,
 	req->user_callback = callbackfn;
 	req->internal_cb = internal_cb;
 	req->is_sync_request = loop == &context->sync_eventloop.loop;
+	if (!req->is_sync_request)
+		upstreams_warm_on_extension(context);
 
 	if (return_netreq_p)
 		*return_netreq_p = req->netreqs[0];
 
 	_getdns_context_track_outbound_request(req);
 
-	if (!usenamespaces)
+	if (!usenamespaces) {
 		/* issue all network requests */
-		for ( netreq_p = req->netreqs
-		    ; !r && (netreq = *netreq_p)
-		    ; netreq_p++) {
-			if ((r = _getdns_submit_netreq(netreq))) {
-				if (r == DNS_REQ_FINISHED) {
-					if (return_netreq_p)
-						*return_netreq_p = NULL;
-					return GETDNS_RETURN_GOOD;
-				}
-				netreq->state = NET_REQ_FINISHED;
-			}
+		if ((r = submit_dns_req(req)) == DNS_REQ_FINISHED) {
+			if (return_netreq_p)
+				*return_netreq_p = NULL;
+			return GETDNS_RETURN_GOOD;
 		}
-
-	else for (i = 0; i < context->namespace_count; i++) {
+	} else for (i = 0; i < context->namespace_count; i++) {
 		if (context->namespaces[i] == GETDNS_NAMESPACE_LOCALNAMES) {
 
 			if (!(r = _getdns_context_local_namespace_resolve(
@@ -482,18 +577,10 @@ getdns_general_ns(getdns_context *context, getdns_eventloop *loop,
 			   the name is not found (NXDOMAIN). We should consider
 			   if this means we go onto the next namespace instead
 			   of returning */
-			r = GETDNS_RETURN_GOOD;
-			for ( netreq_p = req->netreqs
-			    ; !r && (netreq = *netreq_p)
-			    ; netreq_p++) {
-				if ((r = _getdns_submit_netreq(netreq))) {
-					if (r == DNS_REQ_FINISHED) {
-						if (return_netreq_p)
-							*return_netreq_p = NULL;
-						return GETDNS_RETURN_GOOD;
-					}
-					netreq->state = NET_REQ_FINISHED;
-				}
+			if ((r = submit_dns_req(req)) == DNS_REQ_FINISHED) {
+				if (return_netreq_p)
+					*return_netreq_p = NULL;
+				return GETDNS_RETURN_GOOD;
 			}
 			break;
 		} else
@@ -515,7 +602,7 @@ _getdns_general_loop(getdns_context *context, getdns_eventloop *loop,
     getdns_callback_t callback, internal_cb_t internal_cb)
 {
 	return getdns_general_ns(context, loop,
-	    name, request_type, extensions,
+	    name, request_type, extensions, NULL,
 	    userarg, netreq_p, callback, internal_cb, 0);
 
 }				/* getdns_general_loop */
@@ -543,7 +630,7 @@ _getdns_address_loop(getdns_context *context, getdns_eventloop *loop,
 		return r;
 
 	r = getdns_general_ns(context, loop,
-	    name, GETDNS_RRTYPE_AAAA, my_extensions,
+	    name, GETDNS_RRTYPE_AAAA, my_extensions, NULL,
 	    userarg, &netreq, callback, NULL, 1);
 	if (netreq && transaction_id)
 		*transaction_id = netreq->owner->trans_id;
@@ -652,7 +739,7 @@ _getdns_service_loop(getdns_context *context, getdns_eventloop *loop,
 	getdns_return_t r;
 	getdns_network_req *netreq = NULL;
 	r = getdns_general_ns(context, loop, name, GETDNS_RRTYPE_SRV,
-	    extensions, userarg, &netreq, callback, NULL, 1);
+	    extensions, NULL, userarg, &netreq, callback, NULL, 1);
 	if (netreq && transaction_id)
 		*transaction_id = netreq->owner->trans_id;
 	return r;
@@ -679,6 +766,300 @@ getdns_general(getdns_context *context,
 	return r;
 }				/* getdns_general */
 
+/* A batch of requests made with getdns_general_bulk().  The requests are
+ * allocated in the same region, after the slots.
+ */
+typedef struct getdns_bulk getdns_bulk;
+typedef struct getdns_bulk_slot {
+	getdns_bulk            *bulk;
+	getdns_callback_type_t  callback_type;
+	getdns_dict            *response;
+} getdns_bulk_slot;
+
+struct getdns_bulk {
+	getdns_context       *context;
+	getdns_callback_t     callbackfn;
+	void                 *userarg;
+	getdns_transaction_t  trans_id;
+	size_t                n_queries;
+	size_t                n_pending;
+	getdns_bulk_slot      slots[];
+};
+
+static void
+bulk_done(getdns_bulk *bulk)
+{
+	getdns_context *context = bulk->context;
+	getdns_callback_t cb = bulk->callbackfn;
+	void *userarg = bulk->userarg;
+	getdns_transaction_t trans_id = bulk->trans_id;
+	getdns_dict *result = getdns_dict_create_with_context(context);
+	getdns_list *responses = getdns_list_create_with_context(context);
+	getdns_dict *entry;
+	getdns_bulk_slot *slot;
+	size_t i;
+
+	for (i = 0; i < bulk->n_queries; i++) {
+		slot = &bulk->slots[i];
+		entry = NULL;
+		if (!result || !responses
+		    || !(entry = getdns_dict_create_with_context(context))
+		    || getdns_dict_set_int(entry, "callback_type",
+		                           slot->callback_type)
+		    || (slot->response && _getdns_dict_set_this_dict(
+		        entry, "response", slot->response)))
+			getdns_dict_destroy(slot->response);
+
+		else if (!_getdns_list_append_this_dict(responses, entry))
+			continue;
+
+		/* Out of memory, but still consume all responses */
+		getdns_dict_destroy(entry);
+		getdns_dict_destroy(result);
+		result = NULL;
+	}
+	if (result && _getdns_dict_set_this_list(
+	    result, "responses", responses)) {
+		getdns_dict_destroy(result);
+		result = NULL;
+	}
+	if (!result)
+		getdns_list_destroy(responses);
+
+	GETDNS_FREE(context->mf, bulk);
+
+	context->processing = 1;
+	cb(context, (result ? GETDNS_CALLBACK_COMPLETE : GETDNS_CALLBACK_ERROR),
+	    result, userarg, trans_id);
+	context->processing = 0;
+}
+
+static void
+bulk_callback(getdns_context *context, getdns_callback_type_t callback_type,
+    getdns_dict *response, void *userarg, getdns_transaction_t trans_id)
+{
+	getdns_bulk_slot *slot = (getdns_bulk_slot *)userarg;
+
+	(void)context; (void)trans_id;
+	slot->callback_type = callback_type;
+	slot->response = response;
+	if (--slot->bulk->n_pending == 0)
+		bulk_done(slot->bulk);
+}
+
+static getdns_return_t
+general_bulk(getdns_context *context,
+    size_t n_queries, const getdns_bulk_query *queries,
+    getdns_dict *extensions, getdns_request_profile *profile, void *userarg,
+    getdns_transaction_t *transaction_id, getdns_callback_t callbackfn)
+{
+	getdns_return_t r;
+	getdns_dns_req_settings settings_spc;
+	const getdns_dns_req_settings *settings = &settings_spc;
+	getdns_bulk *bulk;
+	getdns_dns_req *req;
+	size_t i, slots_sz, opt_rr_sz, region_sz;
+	uint8_t *region;
+
+	if (!context || !n_queries || !queries || !callbackfn)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	for (i = 0; i < n_queries; i++) {
+		if (!queries[i].name)
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		if ((r = _getdns_validate_dname(queries[i].name)))
+			return r;
+	}
+	if (extensions && (r = validate_extensions(extensions)))
+		return r;
+
+	if ((r = _getdns_context_prepare_for_resolution(context, 0)))
+		return r;
+
+	/* Interpret the extensions once for all requests.  The settings are
+	 * copied, because callbacks fired during submission may reconfigure
+	 * the context and with that refresh the profile.
+	 */
+	if (!profile)
+		_getdns_dns_req_settings_init(&settings_spc, context, extensions);
+
+	else if ((r = profile_settings(context, profile, &settings)))
+		return r;
+	else {
+		settings_spc = *settings;
+		settings = &settings_spc;
+	}
+	/* One region for the batch, its OPT RR and all its requests */
+	slots_sz = (sizeof(getdns_bulk)
+	         + n_queries * sizeof(getdns_bulk_slot) + 7) / 8 * 8;
+	opt_rr_sz = settings->with_opt
+	          ? (11 + settings->opt_options_size + 7) / 8 * 8 : 0;
+	for (region_sz = slots_sz + opt_rr_sz, i = 0; i < n_queries; i++)
+		region_sz += _getdns_dns_req_size(
+		    context, settings, queries[i].request_type);
+
+	if (!(region = GETDNS_XMALLOC(context->mf, uint8_t, region_sz)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	bulk = (getdns_bulk *)region;
+	bulk->context = context;
+	bulk->callbackfn = callbackfn;
+	bulk->userarg = userarg;
+	bulk->trans_id = (((uint64_t)arc4random()) << 32) |
+	                  ((uint64_t)arc4random());
+	bulk->n_queries = n_queries;
+	/* One extra, so the batch cannot finish before all are submitted */
+	bulk->n_pending = n_queries + 1;
+	for (i = 0; i < n_queries; i++) {
+		bulk->slots[i].bulk = bulk;
+		bulk->slots[i].callback_type = GETDNS_CALLBACK_ERROR;
+		bulk->slots[i].response = NULL;
+	}
+	if (transaction_id)
+		*transaction_id = bulk->trans_id;
+
+	/* Submit each request as soon as it is created, so the first queries
+	 * are on the wire (or queued on a connection) while the others are
+	 * still being prepared.
+	 */
+	region += slots_sz;
+	if (opt_rr_sz) {
+		_getdns_dns_req_settings_opt_rr(settings, region);
+		settings_spc.opt_rr = region;
+		region += opt_rr_sz;
+	}
+	if (context->extension != &context->sync_eventloop.loop)
+		upstreams_warm_on_extension(context);
+	for (i = 0; i < n_queries; i++) {
+		if (!(req = _getdns_dns_req_new_in(context, context->extension,
+		    queries[i].name, queries[i].request_type, settings,
+		    region))) {
+			bulk->n_pending--;
+			continue;
+		}
+		region += _getdns_dns_req_size(
+		    context, settings, queries[i].request_type);
+
+		req->user_pointer = &bulk->slots[i];
+		req->user_callback = bulk_callback;
+		req->internal_cb = NULL;
+		req->is_sync_request =
+		    context->extension == &context->sync_eventloop.loop;
+
+		_getdns_context_track_outbound_request(req);
+
+		if ((r = submit_dns_req(req)) > 0) {
+			_getdns_context_clear_outbound_request(req);
+			_getdns_dns_req_free(req);
+			bulk->n_pending--;
+		}
+	}
+	if (--bulk->n_pending == 0)
+		bulk_done(bulk);
+
+	return GETDNS_RETURN_GOOD;
+}
+
+/*
+ * getdns_general_bulk
+ */
+getdns_return_t
+getdns_general_bulk(getdns_context *context,
+    size_t n_queries, const getdns_bulk_query *queries,
+    getdns_dict *extensions, void *userarg,
+    getdns_transaction_t *transaction_id, getdns_callback_t callbackfn)
+{
+	return general_bulk(context, n_queries, queries, extensions, NULL,
+	    userarg, transaction_id, callbackfn);
+}				/* getdns_general_bulk */
+
+/*
+ * getdns_request_profile_create
+ */
+getdns_return_t
+getdns_request_profile_create(getdns_context *context,
+    const getdns_dict *extensions, getdns_request_profile **profile)
+{
+	getdns_request_profile *p;
+	getdns_return_t r;
+
+	if (!context || !profile)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	if (extensions && (r = validate_extensions((getdns_dict *)extensions)))
+		return r;
+
+	if (!(p = GETDNS_MALLOC(context->mf, getdns_request_profile)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	p->context = context;
+	p->mf = context->mf;
+	p->extensions = NULL;
+	p->opt_rr = NULL;
+	p->opt_rr_sz = 0;
+	if ((extensions && (r = _getdns_dict_copy(extensions, &p->extensions)))
+	    || (r = profile_refresh(p))) {
+		getdns_request_profile_destroy(p);
+		return r;
+	}
+	*profile = p;
+	return GETDNS_RETURN_GOOD;
+}				/* getdns_request_profile_create */
+
+/*
+ * getdns_request_profile_destroy
+ */
+void
+getdns_request_profile_destroy(getdns_request_profile *profile)
+{
+	if (!profile)
+		return;
+
+	getdns_dict_destroy(profile->extensions);
+	if (profile->opt_rr)
+		GETDNS_FREE(profile->mf, profile->opt_rr);
+	GETDNS_FREE(profile->mf, profile);
+}				/* getdns_request_profile_destroy */
+
+/*
+ * getdns_general_with_profile
+ */
+getdns_return_t
+getdns_general_with_profile(getdns_context *context,
+    const char *name, uint16_t request_type, getdns_request_profile *profile,
+    void *userarg, getdns_transaction_t *transaction_id,
+    getdns_callback_t callbackfn)
+{
+	getdns_return_t r;
+	getdns_network_req *netreq = NULL;
+
+	if (!context || !profile)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	r = getdns_general_ns(context, context->extension,
+	    name, request_type, NULL, profile,
+	    userarg, &netreq, callbackfn, NULL, 0);
+	if (netreq && transaction_id)
+		*transaction_id = netreq->owner->trans_id;
+	return r;
+}				/* getdns_general_with_profile */
+
+/*
+ * getdns_general_bulk_with_profile
+ */
+getdns_return_t
+getdns_general_bulk_with_profile(getdns_context *context,
+    size_t n_queries, const getdns_bulk_query *queries,
+    getdns_request_profile *profile, void *userarg,
+    getdns_transaction_t *transaction_id, getdns_callback_t callbackfn)
+{
+	if (!profile)
+		return GETDNS_RETURN_INVALID_PARAMETER;
+
+	return general_bulk(context, n_queries, queries, NULL, profile,
+	    userarg, transaction_id, callbackfn);
+}				/* getdns_general_bulk_with_profile */
+
 /*
  * getdns_address
  *
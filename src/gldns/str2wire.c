@@ -978,10 +978,37 @@ int gldns_str2wire_rdf_buf(const char* str, uint8_t* rd, size_t* len,
 	return GLDNS_WIREPARSE_ERR_GENERAL;
 }
 
+/** parse a string of at most 9 decimal digits (so it cannot overflow),
+ * returns 0 when the string is something else, for the callers to fall
+ * back to the more general strtol */
+static int str2wire_digits(const char* str, uint32_t* v)
+{
+	const char* s = str;
+	uint32_t r = 0;
+	while(*s >= '0' && *s <= '9' && s - str < 9)
+		r = r * 10 + (uint32_t)(*s++ - '0');
+	if(s == str || *s != 0)
+		return 0;
+	*v = r;
+	return 1;
+}
+
+/** value of two decimal digits */
+#define DIGITS2(s) (((s)[0] - '0') * 10 + ((s)[1] - '0'))
+
 int gldns_str2wire_int8_buf(const char* str, uint8_t* rd, size_t* len)
 {
 	char* end;
-	uint8_t r = (uint8_t)strtol((char*)str, &end, 10);
+	uint8_t r;
+	uint32_t v;
+	if(str2wire_digits(str, &v)) {
+		if(*len < 1)
+			return GLDNS_WIREPARSE_ERR_BUFFER_TOO_SMALL;
+		rd[0] = (uint8_t)v;
+		*len = 1;
+		return GLDNS_WIREPARSE_ERR_OK;
+	}
+	r = (uint8_t)strtol((char*)str, &end, 10);
 	if(*end != 0)
 		return RET_ERR(GLDNS_WIREPARSE_ERR_SYNTAX_INT, end-(char*)str);
 	if(*len < 1)
@@ -994,7 +1021,16 @@ int gldns_str2wire_int8_buf(const char* str, uint8_t* rd, size_t* len)
 int gldns_str2wire_int16_buf(const char* str, uint8_t* rd, size_t* len)
 {
 	char* end;
-	uint16_t r = (uint16_t)strtol((char*)str, &end, 10);
+	uint16_t r;
+	uint32_t v;
+	if(str2wire_digits(str, &v)) {
+		if(*len < 2)
+			return GLDNS_WIREPARSE_ERR_BUFFER_TOO_SMALL;
+		gldns_write_uint16(rd, (uint16_t)v);
+		*len = 2;
+		return GLDNS_WIREPARSE_ERR_OK;
+	}
+	r = (uint16_t)strtol((char*)str, &end, 10);
 	if(*end != 0)
 		return RET_ERR(GLDNS_WIREPARSE_ERR_SYNTAX_INT, end-(char*)str);
 	if(*len < 2)
@@ -1008,6 +1044,13 @@ int gldns_str2wire_int32_buf(const char* str, uint8_t* rd, size_t* len)
 {
 	char* end;
 	uint32_t r;
+	if(str2wire_digits(str, &r)) {
+		if(*len < 4)
+			return GLDNS_WIREPARSE_ERR_BUFFER_TOO_SMALL;
+		gldns_write_uint32(rd, r);
+		*len = 4;
+		return GLDNS_WIREPARSE_ERR_OK;
+	}
 	errno = 0; /* must set to zero before call,
 			note race condition on errno */
 	if(*str == '-')
@@ -1024,9 +1067,41 @@ int gldns_str2wire_int32_buf(const char* str, uint8_t* rd, size_t* len)
 	return GLDNS_WIREPARSE_ERR_OK;
 }
 
+/** parse the plain dotted quad form of an IPv4 address, without leading
+ * zeroes, returns 0 for anything else */
+static int str2wire_ip4(const char* s, uint8_t* a)
+{
+	int i;
+	for(i=0; i<4; i++) {
+		unsigned v;
+		if(i && *s++ != '.')
+			return 0;
+		if(*s < '0' || *s > '9')
+			return 0;
+		v = (unsigned)(*s++ - '0');
+		if(v && *s >= '0' && *s <= '9') {
+			v = v * 10 + (unsigned)(*s++ - '0');
+			if(*s >= '0' && *s <= '9')
+				v = v * 10 + (unsigned)(*s++ - '0');
+		}
+		if(v > 255)
+			return 0;
+		a[i] = (uint8_t)v;
+	}
+	return *s == 0;
+}
+
 int gldns_str2wire_a_buf(const char* str, uint8_t* rd, size_t* len)
 {
 	struct in_addr address;
+	uint8_t a[4];
+	if(str2wire_ip4(str, a)) {
+		if(*len < sizeof(a))
+			return GLDNS_WIREPARSE_ERR_BUFFER_TOO_SMALL;
+		memcpy(rd, a, sizeof(a));
+		*len = sizeof(a);
+		return GLDNS_WIREPARSE_ERR_OK;
+	}
 	if(inet_pton(AF_INET, (char*)str, &address) != 1)
 		return GLDNS_WIREPARSE_ERR_SYNTAX_IP4;
 	if(*len < sizeof(address))
@@ -1345,14 +1420,25 @@ int gldns_str2wire_time_buf(const char* str, uint8_t* rd, size_t* len)
 {
 	/* convert a time YYYYDDMMHHMMSS to wireformat */
 	struct tm tm;
+	int scanned = 0;
 	if(*len < 4)
 		return GLDNS_WIREPARSE_ERR_BUFFER_TOO_SMALL;
 
 	/* Try to scan the time... */
 	memset(&tm, 0, sizeof(tm));
-	if (strlen(str) == 14 && sscanf(str, "%4d%2d%2d%2d%2d%2d",
+	if (strlen(str) == 14 && strspn(str, "0123456789") == 14) {
+		tm.tm_year = DIGITS2(str) * 100 + DIGITS2(str + 2);
+		tm.tm_mon  = DIGITS2(str + 4);
+		tm.tm_mday = DIGITS2(str + 6);
+		tm.tm_hour = DIGITS2(str + 8);
+		tm.tm_min  = DIGITS2(str + 10);
+		tm.tm_sec  = DIGITS2(str + 12);
+		scanned = 1;
+	} else if (strlen(str) == 14 && sscanf(str, "%4d%2d%2d%2d%2d%2d",
 		&tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour,
-		&tm.tm_min, &tm.tm_sec) == 6) {
+		&tm.tm_min, &tm.tm_sec) == 6)
+		scanned = 1;
+	if (scanned) {
 	   	tm.tm_year -= 1900;
 	   	tm.tm_mon--;
 	   	/* Check values */
@@ -303,14 +303,71 @@ int gldns_str_print(char** str, size_t* slen, const char* format, ...)
 	return w;
 }
 
+/** print len characters, with the same result as gldns_str_print would
+ * have, but without the format string interpretation */
+static int str_print_chars(char** s, size_t* slen, const char* str, size_t len)
+{
+	if(len < *slen) {
+		memcpy(*s, str, len);
+		(*s)[len] = 0;
+		*s += len;
+		*slen -= len;
+		return (int)len;
+	}
+	if(*slen) {
+		memcpy(*s, str, *slen - 1);
+		(*s)[*slen - 1] = 0;
+	}
+	*s = NULL;
+	*slen = 0;
+	return (int)len;
+}
+
+static int str_print_char(char** s, size_t* slen, char c)
+{
+	return str_print_chars(s, slen, &c, 1);
+}
+
+static int str_print_str(char** s, size_t* slen, const char* str)
+{
+	return str_print_chars(s, slen, str, strlen(str));
+}
+
+/** print unsigned decimal integer */
+static int str_print_uint(char** s, size_t* slen, uint64_t v)
+{
+	char buf[20], *p = buf + sizeof(buf);
+	do {
+		*--p = (char)('0' + v % 10);
+		v /= 10;
+	} while(v);
+	return str_print_chars(s, slen, p, buf + sizeof(buf) - p);
+}
+
+/** copy characters that need no escaping, like the plain printout of
+ * dname_char_print and str_char_print: not zero terminated */
+static void str_print_plain(char** s, size_t* slen, const uint8_t* p,
+	size_t len)
+{
+	if(len > *slen)
+		len = *slen;
+	memcpy(*s, p, len);
+	*s += len;
+	*slen -= len;
+}
+
 /** print hex format into text buffer for specified length */
 static int print_hex_buf(char** s, size_t* slen, uint8_t* buf, size_t len)
 {
 	const char* hex = "0123456789ABCDEF";
-	size_t i;
-	for(i=0; i<len; i++) {
-		(void)gldns_str_print(s, slen, "%c%c", hex[(buf[i]&0xf0)>>4],
-			hex[buf[i]&0x0f]);
+	char chunk[128];
+	size_t i, j;
+	for(i=0; i<len; ) {
+		for(j=0; i<len && j<sizeof(chunk); i++) {
+			chunk[j++] = hex[(buf[i]&0xf0)>>4];
+			chunk[j++] = hex[buf[i]&0x0f];
+		}
+		(void)str_print_chars(s, slen, chunk, j);
 	}
 	return (int)len*2;
 }
@@ -405,9 +462,10 @@ static int gldns_rr_tcttl_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 	ttl = gldns_read_uint32((*d)+4);
 	(*d)+=8;
 	(*dl)-=8;
-	w += gldns_str_print(s, sl, "%lu\t", (unsigned long)ttl);
+	w += str_print_uint(s, sl, ttl);
+	w += str_print_char(s, sl, '\t');
 	w += gldns_wire2str_class_print(s, sl, c);
-	w += gldns_str_print(s, sl, "\t");
+	w += str_print_char(s, sl, '\t');
 	w += gldns_wire2str_type_print(s, sl, t);
 	return w;
 }
@@ -429,7 +487,7 @@ int gldns_wire2str_rr_scan(uint8_t** d, size_t* dlen, char** s, size_t* slen,
 	/* try to scan the rdata with pretty-printing, but if that fails, then
 	 * scan the rdata as an unknown RR type */
 	w += gldns_wire2str_dname_scan(d, dlen, s, slen, pkt, pktlen);
-	w += gldns_str_print(s, slen, "\t");
+	w += str_print_char(s, slen, '\t');
 	dname_off = rrlen-(*dlen);
 	if(*dlen == 4) {
 		/* like a question-RR */
@@ -451,7 +509,7 @@ int gldns_wire2str_rr_scan(uint8_t** d, size_t* dlen, char** s, size_t* slen,
 	}
 	rrtype = gldns_read_uint16(*d);
 	w += gldns_rr_tcttl_scan(d, dlen, s, slen);
-	w += gldns_str_print(s, slen, "\t");
+	w += str_print_char(s, slen, '\t');
 
 	/* rdata */
 	if(*dlen < 2) {
@@ -478,7 +536,7 @@ int gldns_wire2str_rr_scan(uint8_t** d, size_t* dlen, char** s, size_t* slen,
 	/* default comment */
 	w += gldns_wire2str_rr_comment_print(s, slen, rr, rrlen, dname_off,
 		rrtype);
-	w += gldns_str_print(s, slen, "\n");
+	w += str_print_char(s, slen, '\n');
 	return w;
 }
 
@@ -587,8 +645,9 @@ static int rr_comment_rrsig(char** s, size_t* slen, uint8_t* rr,
 	if(rrlen < dname_off + 10 + rdlen) return 0;
 	rdata = rr + dname_off + 10;
 	if(rdlen < 18) return 0;
-	return gldns_str_print(s, slen, " ;{id = %d}",
-		(int)gldns_read_uint16(rdata+16));
+	return str_print_chars(s, slen, " ;{id = ", 8)
+		+ str_print_uint(s, slen, gldns_read_uint16(rdata+16))
+		+ str_print_char(s, slen, '}');
 }
 
 /** print rr comment for type NSEC3 */
@@ -686,7 +745,7 @@ int gldns_wire2str_rdata_scan(uint8_t** d, size_t* dlen, char** s,
 		}
 		rdftype = gldns_rr_descriptor_field_type(desc, r_cnt);
 		if(r_cnt != 0)
-			w += gldns_str_print(s, slen, " ");
+			w += str_print_char(s, slen, ' ');
 		n = gldns_wire2str_rdf_scan(d, dlen, s, slen, rdftype,
 			pkt, pktlen);
 		if(n == -1) {
@@ -722,13 +781,28 @@ int gldns_wire2str_rdata_unknown_scan(uint8_t** d, size_t* dlen, char** s,
 	return w;
 }
 
+/** whether a domain dname character can be printed without escape */
+static int dname_char_plain(uint8_t c)
+{
+	return c > 0x20 && c < 0x7f && c != '.' && c != ';' && c != '('
+		&& c != ')' && c != '\\';
+}
+
 /** print and escape one character for a domain dname */
 static int dname_char_print(char** s, size_t* slen, uint8_t c)
 {
-	if(c == '.' || c == ';' || c == '(' || c == ')' || c == '\\')
-		return gldns_str_print(s, slen, "\\%c", c);
-	else if(!(isascii((unsigned char)c) && isgraph((unsigned char)c)))
-		return gldns_str_print(s, slen, "\\%03u", (unsigned)c);
+	char esc[4];
+	if(c == '.' || c == ';' || c == '(' || c == ')' || c == '\\') {
+		esc[0] = '\\';
+		esc[1] = (char)c;
+		return str_print_chars(s, slen, esc, 2);
+	} else if(!(isascii((unsigned char)c) && isgraph((unsigned char)c))) {
+		esc[0] = '\\';
+		esc[1] = (char)('0' + c / 100);
+		esc[2] = (char)('0' + c / 10 % 10);
+		esc[3] = (char)('0' + c % 10);
+		return str_print_chars(s, slen, esc, 4);
+	}
 	/* plain printout */
 	if(*slen) {
 		**s = (char)c;
@@ -793,15 +867,26 @@ int gldns_wire2str_dname_scan(uint8_t** d, size_t* dlen, char** s, size_t* slen,
 			labellen = (uint8_t)*dlen;
 		else if(!in_buf && pos+(size_t)labellen > pkt+pktlen)
 			labellen = (uint8_t)(pkt + pktlen - pos);
-		for(i=0; i<(unsigned)labellen; i++) {
-			w += dname_char_print(s, slen, *pos++);
+		for(i=0; i<(unsigned)labellen; ) {
+			/* runs of plain characters are copied at once */
+			unsigned j = i;
+			while(j < (unsigned)labellen && dname_char_plain(pos[j]))
+				j++;
+			if(j > i) {
+				if(*s) str_print_plain(s, slen, pos+i, j-i);
+				w += (int)(j-i);
+				i = j;
+				continue;
+			}
+			w += dname_char_print(s, slen, pos[i++]);
 		}
+		pos += labellen;
 		if(in_buf) {
 			(*d) += labellen;
 			(*dlen) -= labellen;
 			if(*dlen == 0) break;
 		}
-		w += gldns_str_print(s, slen, ".");
+		w += str_print_char(s, slen, '.');
 	}
 	/* skip over final root label */
 	if(in_buf && *dlen > 0) { (*d)++; (*dlen)--; }
@@ -832,8 +917,10 @@ int gldns_wire2str_class_print(char** s, size_t* slen, uint16_t rrclass)
 {
 	gldns_lookup_table *lt = gldns_lookup_by_id(gldns_rr_classes,
 		(int)rrclass);
+	if (rrclass == GLDNS_RR_CLASS_IN)
+		return str_print_chars(s, slen, "IN", 2);
 	if (lt && lt->name) {
-		return gldns_str_print(s, slen, "%s", lt->name);
+		return str_print_str(s, slen, lt->name);
 	}
 	return gldns_str_print(s, slen, "CLASS%u", (unsigned)rrclass);
 }
@@ -842,7 +929,7 @@ int gldns_wire2str_type_print(char** s, size_t* slen, uint16_t rrtype)
 {
 	const gldns_rr_descriptor *descriptor = gldns_rr_descript(rrtype);
 	if (descriptor && descriptor->_name) {
-		return gldns_str_print(s, slen, "%s", descriptor->_name);
+		return str_print_str(s, slen, descriptor->_name);
 	}
 	return gldns_str_print(s, slen, "TYPE%u", (unsigned)rrtype);
 }
@@ -888,7 +975,7 @@ int gldns_wire2str_ttl_scan(uint8_t** d, size_t* dlen, char** s, size_t* slen)
 	ttl = gldns_read_uint32(*d);
 	(*d)+=4;
 	(*dlen)-=4;
-	return gldns_str_print(s, slen, "%u", (unsigned)ttl);
+	return str_print_uint(s, slen, ttl);
 }
 
 int gldns_wire2str_rdf_scan(uint8_t** d, size_t* dlen, char** s, size_t* slen,
@@ -977,7 +1064,7 @@ int gldns_wire2str_int8_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 {
 	int w;
 	if(*dl < 1) return -1;
-	w = gldns_str_print(s, sl, "%u", (unsigned)**d);
+	w = str_print_uint(s, sl, **d);
 	(*d)++;
 	(*dl)--;
 	return w;
@@ -987,7 +1074,7 @@ int gldns_wire2str_int16_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 {
 	int w;
 	if(*dl < 2) return -1;
-	w = gldns_str_print(s, sl, "%lu", (unsigned long)gldns_read_uint16(*d));
+	w = str_print_uint(s, sl, gldns_read_uint16(*d));
 	(*d)+=2;
 	(*dl)-=2;
 	return w;
@@ -997,7 +1084,7 @@ int gldns_wire2str_int32_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 {
 	int w;
 	if(*dl < 4) return -1;
-	w = gldns_str_print(s, sl, "%lu", (unsigned long)gldns_read_uint32(*d));
+	w = str_print_uint(s, sl, gldns_read_uint32(*d));
 	(*d)+=4;
 	(*dl)-=4;
 	return w;
@@ -1007,7 +1094,7 @@ int gldns_wire2str_period_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 {
 	int w;
 	if(*dl < 4) return -1;
-	w = gldns_str_print(s, sl, "%u", (unsigned)gldns_read_uint32(*d));
+	w = str_print_uint(s, sl, gldns_read_uint32(*d));
 	(*d)+=4;
 	(*dl)-=4;
 	return w;
@@ -1027,24 +1114,76 @@ int gldns_wire2str_tsigtime_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 	d4 = (*d)[4];
 	d5 = (*d)[5];
 	tsigtime = (d0<<40) | (d1<<32) | (d2<<24) | (d3<<16) | (d4<<8) | d5;
-#ifndef USE_WINSOCK
-	w = gldns_str_print(s, sl, "%llu", (long long)tsigtime);
-#else
-	w = gldns_str_print(s, sl, "%I64u", (long long)tsigtime);
-#endif
+	w = str_print_uint(s, sl, tsigtime);
 	(*d)+=6;
 	(*dl)-=6;
 	return w;
 }
 
+/** write the dotted quad of an IPv4 address, returns the end */
+static char* ip4_ntop(const uint8_t* a, char* p)
+{
+	int i;
+	for(i=0; i<4; i++) {
+		if(i) *p++ = '.';
+		if(a[i] >= 100) *p++ = (char)('0' + a[i] / 100);
+		if(a[i] >= 10)  *p++ = (char)('0' + a[i] / 10 % 10);
+		*p++ = (char)('0' + a[i] % 10);
+	}
+	return p;
+}
+
+/** write an IPv6 address (as inet_ntop would, RFC 5952 style with
+ * embedded IPv4 for compatible and mapped addresses), returns the end */
+static char* ip6_ntop(const uint8_t* a, char* p)
+{
+	const char* hex = "0123456789abcdef";
+	int i, best_base = -1, best_len = 0, cur_base = -1, cur_len = 0;
+	uint16_t words[8];
+
+	for(i=0; i<8; i++) {
+		words[i] = gldns_read_uint16(a + 2*i);
+		if(words[i] == 0) {
+			if(cur_base == -1) {
+				cur_base = i;
+				cur_len = 0;
+			}
+			if(++cur_len > best_len) {
+				best_base = cur_base;
+				best_len = cur_len;
+			}
+		} else	cur_base = -1;
+	}
+	if(best_len < 2)
+		best_base = -1;
+
+	for(i=0; i<8; i++) {
+		if(best_base != -1 && i >= best_base && i < best_base+best_len) {
+			if(i == best_base)
+				*p++ = ':';
+			continue;
+		}
+		if(i) *p++ = ':';
+		if(i == 6 && best_base == 0 && (best_len == 6 ||
+			(best_len == 7 && words[7] != 0x0001) ||
+			(best_len == 5 && words[5] == 0xffff)))
+			return ip4_ntop(a + 12, p);
+		if(words[i] >= 0x1000) *p++ = hex[words[i] >> 12];
+		if(words[i] >= 0x100)  *p++ = hex[(words[i] >> 8) & 0xf];
+		if(words[i] >= 0x10)   *p++ = hex[(words[i] >> 4) & 0xf];
+		*p++ = hex[words[i] & 0xf];
+	}
+	if(best_base != -1 && best_base+best_len == 8)
+		*p++ = ':';
+	return p;
+}
+
 int gldns_wire2str_a_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 {
-	char buf[32];
+	char buf[16];
 	int w;
 	if(*dl < 4) return -1;
-	if(!inet_ntop(AF_INET, *d, buf, (socklen_t)sizeof(buf)))
-		return -1;
-	w = gldns_str_print(s, sl, "%s", buf);
+	w = str_print_chars(s, sl, buf, ip4_ntop(*d, buf) - buf);
 	(*d)+=4;
 	(*dl)-=4;
 	return w;
@@ -1052,19 +1191,21 @@ int gldns_wire2str_a_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 
 int gldns_wire2str_aaaa_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 {
-#ifdef AF_INET6
-	char buf[64];
+	char buf[48];
 	int w;
 	if(*dl < 16) return -1;
-	if(!inet_ntop(AF_INET6, *d, buf, (socklen_t)sizeof(buf)))
-		return -1;
-	w = gldns_str_print(s, sl, "%s", buf);
+	w = str_print_chars(s, sl, buf, ip6_ntop(*d, buf) - buf);
 	(*d)+=16;
 	(*dl)-=16;
 	return w;
-#else
-	return -1;
-#endif
+}
+
+/** whether a TYPE_STR character can be printed without escape */
+static int str_char_plain(uint8_t c)
+{
+	if(c >= 0x20 && c < 0x7f)
+		return c != '\"' && c != '\\';
+	return c == '\t' || (c >= 0x80 && isprint((unsigned char)c));
 }
 
 /** printout escaped TYPE_STR character */
@@ -1092,10 +1233,21 @@ int gldns_wire2str_str_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 	if(*dl < 1+len) return -1;
 	(*d)++;
 	(*dl)--;
-	w += gldns_str_print(s, sl, "\"");
-	for(i=0; i<len; i++)
-		w += str_char_print(s, sl, (*d)[i]);
-	w += gldns_str_print(s, sl, "\"");
+	w += str_print_char(s, sl, '"');
+	for(i=0; i<len; ) {
+		/* runs of plain characters are copied at once */
+		size_t j = i;
+		while(j < len && str_char_plain((*d)[j]))
+			j++;
+		if(j > i) {
+			if(*s) str_print_plain(s, sl, (*d)+i, j-i);
+			w += (int)(j-i);
+			i = j;
+			continue;
+		}
+		w += str_char_print(s, sl, (*d)[i++]);
+	}
+	w += str_print_char(s, sl, '"');
 	(*d)+=len;
 	(*dl)-=len;
 	return w;
@@ -1297,8 +1449,28 @@ int gldns_wire2str_time_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
 	if(*dl < 4) return -1;
 	t = gldns_read_uint32(*d);
 	date_buf[15]=0;
-	if(gldns_serial_arithmitics_gmtime_r(t, time(NULL), &tm) &&
-		strftime(date_buf, 15, "%Y%m%d%H%M%S", &tm)) {
+	if(!gldns_serial_arithmitics_gmtime_r(t, time(NULL), &tm))
+		return -1;
+	if(tm.tm_year >= 1000-1900 && tm.tm_year <= 9999-1900) {
+		/* the common four digit years are printed without strftime */
+		int i, v[7];
+		char* p = date_buf;
+		v[0] = (tm.tm_year + 1900) / 100;
+		v[1] = (tm.tm_year + 1900) % 100;
+		v[2] = tm.tm_mon + 1;
+		v[3] = tm.tm_mday;
+		v[4] = tm.tm_hour;
+		v[5] = tm.tm_min;
+		v[6] = tm.tm_sec;
+		for(i=0; i<7; i++) {
+			*p++ = (char)('0' + v[i] / 10);
+			*p++ = (char)('0' + v[i] % 10);
+		}
+		(*d) += 4;
+		(*dl) -= 4;
+		return str_print_chars(s, sl, date_buf, 14);
+	}
+	if(strftime(date_buf, 15, "%Y%m%d%H%M%S", &tm)) {
 		(*d) += 4;
 		(*dl) -= 4;
 		return gldns_str_print(s, sl, "%s", date_buf);
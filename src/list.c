@@ -110,8 +110,7 @@ _getdns_list_remove_name(getdns_list *list, const char *name)
 		switch (i->dtype) {
 		case t_dict   : getdns_dict_destroy(i->data.dict); break;
 		case t_list   : getdns_list_destroy(i->data.list); break;
-		case t_bindata: _getdns_bindata_destroy(
-		                    &list->mf, i->data.bindata);
+		case t_bindata: _getdns_item_bindata_destroy(&list->mf, i);
 		default       : break;
 		}
 		if (index < list->numinuse - 1)
@@ -165,6 +164,7 @@ _getdns_list_find_and_add(
 		}
 		list->numinuse++;
 		i = &list->items[index];
+		i->borrowed = 0;
 
 		if (!*next) {
 			i->dtype = t_int;
@@ -189,11 +189,12 @@ _getdns_list_find_and_add(
 		switch (i->dtype) {
 		case t_dict   : getdns_dict_destroy(i->data.dict); break;
 		case t_list   : getdns_list_destroy(i->data.list); break;
-		case t_bindata: _getdns_bindata_destroy(
-		                      &list->mf, i->data.bindata); break;
+		case t_bindata: _getdns_item_bindata_destroy(
+		                      &list->mf, i); break;
 		default       : break;
 		}
 		i->dtype = t_int;
+		i->borrowed = 0;
 		i->data.n = 33355555;
 		*item = i;
 		return GETDNS_RETURN_GOOD;
@@ -452,8 +453,7 @@ _getdns_list_destroy_item(struct getdns_list *list, size_t index)
 		break;
 
 	case t_bindata:
-		_getdns_bindata_destroy(&list->mf,
-			list->items[index].data.bindata);
+		_getdns_item_bindata_destroy(&list->mf, &list->items[index]);
 		break;
 	default:
 		break;
@@ -490,11 +490,12 @@ _getdns_list_request_index(getdns_list *list, size_t index)
 
 	if (index < list->numinuse) {
 		_getdns_list_destroy_item(list, index);
+		list->items[index].borrowed = 0;
 		return GETDNS_RETURN_GOOD;
 
 	}
 	if (list->numalloc > list->numinuse) {
-		list->numinuse++;
+		list->items[list->numinuse++].borrowed = 0;
 		return GETDNS_RETURN_GOOD;
 	}
 	if (!(newlist = GETDNS_XREALLOC(list->mf, list->items,
@@ -502,8 +503,8 @@ _getdns_list_request_index(getdns_list *list, size_t index)
 
 		return GETDNS_RETURN_MEMORY_ERROR;
 
-	list->numinuse++;
 	list->items = newlist;
+	list->items[list->numinuse++].borrowed = 0;
 	list->numalloc += GETDNS_LIST_BLOCKSZ;
 
 	return GETDNS_RETURN_GOOD;
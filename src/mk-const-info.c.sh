@@ -14,62 +14,157 @@ cat > const-info.c << END_OF_HEAD
 static struct const_info consts_info[] = {
 	{   -1, NULL, "/* <unknown getdns value> */" },
 END_OF_HEAD
-gawk '/^[ 	]+GETDNS_[A-Z_]+[ 	]+=[ 	]+[0-9]+/{ key = sprintf("%4d", $3); consts[key] = $1; }/^#define GETDNS_[A-Z_]+[ 	]+[0-9]+/ && !/^#define GETDNS_RRTYPE/ && !/^#define GETDNS_RRCLASS/ && !/^#define GETDNS_OPCODE/  && !/^#define GETDNS_RCODE/ && !/_TEXT/{ key = sprintf("%4d", $3); consts[key] = $2; }/^#define GETDNS_[A-Z_]+[ 	]+\(\(getdns_(return|append_name)_t) [0-9]+ \)/{ key = sprintf("%4d", $4); consts[key] = $2; }END{ n = asorti(consts, const_vals); for ( i = 1; i <= n; i++) { val = const_vals[i]; name = consts[val]; print "\t{ "val", \""name"\", "name"_TEXT },"}}' getdns/getdns.h.in getdns/getdns_extra.h.in | sed 's/,,/,/g' >> const-info.c
+gawk '/^[ 	]+GETDNS_[A-Z_]+[ 	]+=[ 	]+[0-9]+/{ key = sprintf("%4d", $3); consts[key] = $1; }/^#define GETDNS_[A-Z_]+[ 	]+[0-9]+/ && !/^#define GETDNS_RRTYPE/ && !/^#define GETDNS_RRCLASS/ && !/^#define GETDNS_OPCODE/  && !/^#define GETDNS_RCODE/ && !/_TEXT/{ key = sprintf("%4d", $3); consts[key] = $2; }/^#define GETDNS_[A-Z_]+[ 	]+\(\(getdns_(return|append_name)_t) [0-9]+ \)/{ key = sprintf("%4d", $4); consts[key] = $2; }END{ n = asorti(consts, const_vals); for ( i = 1; i <= n; i++) { val = const_vals[i]; name = consts[val]; print "\t{ "val", \""name"\", "name"_TEXT },"}}' getdns/getdns.h.in getdns/getdns_extra.h.in | sed 's/,,/,/g' > const-info.tmp
+cat const-info.tmp >> const-info.c
 cat >> const-info.c << END_OF_TAIL
 };
 
-static int const_info_cmp(const void *a, const void *b)
-{
-	return ((struct const_info *) a)->code - ((struct const_info *) b)->code;
-}
+/* Index in consts_info by code, 0 for codes without constant */
+END_OF_TAIL
+# A direct index on the (small, non negative) code values
+awk 'BEGIN { FS = "[{,]" }
+{ code = $2 + 0; idx[code] = NR; if (code > max) max = code }
+END {
+	if (NR > 65535) { print "too many constants" > "/dev/stderr"; exit 1 }
+	printf "#define CONSTS_INFO_IDX_SZ %d\n", max + 1
+	printf "static const uint16_t consts_info_idx[CONSTS_INFO_IDX_SZ] = {"
+	for (c = 0; c <= max; c++)
+		printf "%s%3d,", (c % 16 ? "" : "\n\t"), (c in idx) ? idx[c] : 0
+	printf "\n};\n"
+}' const-info.tmp >> const-info.c
+cat >> const-info.c << END_OF_TAIL
+
 struct const_info *
 _getdns_get_const_info(int value)
 {
-	struct const_info key = { value, "", "" };
-	struct const_info *i = bsearch(&key, consts_info,
-	    sizeof(consts_info) / sizeof(struct const_info),
-	    sizeof(struct const_info), const_info_cmp);
-	if (i)
-		return i;
+	if (value >= 0 && value < CONSTS_INFO_IDX_SZ)
+		return &consts_info[consts_info_idx[value]];
 	return consts_info;
 }
 
 const char *
 getdns_get_errorstr_by_id(uint16_t err)
 {
-	struct const_info key = { (int)err, "", "" };
-	struct const_info *i = bsearch(&key, consts_info,
-	    sizeof(consts_info) / sizeof(struct const_info),
-	    sizeof(struct const_info), const_info_cmp);
-	if (i)
-		return i->text;
+	if (err < CONSTS_INFO_IDX_SZ && consts_info_idx[err])
+		return consts_info[consts_info_idx[err]].text;
 	else
 		return NULL;
 }
 
 static struct const_name_info consts_name_info[] = {
 END_OF_TAIL
-gawk '/^[ 	]+GETDNS_[A-Z_]+[ 	]+=[ 	]+[0-9]+/{ key = sprintf("%d", $3); consts[$1] = key; }/^#define GETDNS_[A-Z_]+[ 	]+[0-9]+/ && !/_TEXT/{ key = sprintf("%d", $3); consts[$2] = key; }/^#define GETDNS_[A-Z_]+[ 	]+\(\(getdns_(return|append_name)_t) [0-9]+ \)/{ key = sprintf("%d", $4); consts[$2] = key; }END{ n = asorti(consts, const_vals); for ( i = 1; i <= n; i++) { val = const_vals[i]; name = consts[val]; print "\t{ \""val"\", "name" },"}}' getdns/getdns.h.in getdns/getdns_extra.h.in | sed 's/,,/,/g' >> const-info.c
+gawk '/^[ 	]+GETDNS_[A-Z_]+[ 	]+=[ 	]+[0-9]+/{ key = sprintf("%d", $3); consts[$1] = key; }/^#define GETDNS_[A-Z_]+[ 	]+[0-9]+/ && !/_TEXT/{ key = sprintf("%d", $3); consts[$2] = key; }/^#define GETDNS_[A-Z_]+[ 	]+\(\(getdns_(return|append_name)_t) [0-9]+ \)/{ key = sprintf("%d", $4); consts[$2] = key; }END{ n = asorti(consts, const_vals); for ( i = 1; i <= n; i++) { val = const_vals[i]; name = consts[val]; print "\t{ \""val"\", "name" },"}}' getdns/getdns.h.in getdns/getdns_extra.h.in | sed 's/,,/,/g' > const-info.tmp
+cat const-info.tmp >> const-info.c
 cat >> const-info.c << END_OF_TAIL
 };
 
-static int const_name_info_cmp(const void *a, const void *b)
+/* Perfect hash on the constant names.  The bucket, selected by the top bits
+ * of the name's hash, gives the displacement with which the hash is moved to
+ * a slot with the index in consts_name_info (plus one).
+ */
+END_OF_TAIL
+# Keys of a bucket are placed together with the smallest displacement that
+# gives each a free slot, largest buckets first.  Must match the hash and
+# slot calculation in _getdns_get_const_name_info below.
+awk 'function mul(a, b) {
+	# a * b modulo 2^32, without exceeding the precision of a double
+	return (a * (b % 65536) + (a * int(b / 65536)) % 65536 * 65536) \
+	    % 4294967296
+}
+function hash(s,    n, h, i, j, w) {
+	n = length(s); h = n
+	for (i = 1; i <= n; i += 4) {
+		w = 0
+		for (j = i + 3; j >= i; j--)
+			w = w * 256 + (j <= n ? ord[substr(s, j, 1)] : 0)
+		h = mul((h + w) % 4294967296, 2654435761)
+	}
+	return (h + int(h / 65536)) % 4294967296
+}
+function place(M,    b, s, k, m, d, j, p, ok, taken) {
+	for (p in slot) delete slot[p]
+	for (s = NR; s > 0; s--) for (b = 0; b < B; b++) if (size[b] == s) {
+		k = split(members[b], m, " ")
+		for (d = 0; d < 256; d++) {
+			ok = 1
+			for (p in taken) delete taken[p]
+			for (j = 1; j <= k && ok; j++) {
+				p = (g[m[j]] + d * step[m[j]]) % M
+				if ((p in slot) || (p in taken)) ok = 0
+				taken[p] = m[j]
+			}
+			if (ok) break
+		}
+		if (!ok) return 0
+		disp[b] = d
+		for (p in taken) slot[p] = taken[p] + 1
+	}
+	return 1
+}
+BEGIN { for (i = 32; i < 127; i++) ord[sprintf("%c", i)] = i }
 {
-	return strcmp( ((struct const_name_info *) a)->name
-	             , ((struct const_name_info *) b)->name );
+	name = $0; sub(/^[^"]*"/, "", name); sub(/".*$/, "", name)
+	i = NR - 1; g[i] = hash(name)
+	step[i] = int(g[i] / 65536); step[i] += 1 - step[i] % 2
 }
+END {
+	if (NR > 65535) { print "too many constant names" > "/dev/stderr"; exit 1 }
+	for (B = 1; B < NR / 2; B *= 2) ;
+	for (i = 0; i < NR; i++) {
+		b = int(g[i] / 16777216) % B
+		members[b] = members[b] " " i; size[b]++
+	}
+	for (M = 1; M < NR; M *= 2) ;
+	while (!place(M))
+		if ((M *= 2) > 1048576) {
+			print "no perfect hash for the constant names" > "/dev/stderr"
+			exit 1
+		}
+	printf "#define CONSTS_NAME_BUCKETS %d\n", B
+	printf "static const uint8_t consts_name_disp[CONSTS_NAME_BUCKETS] = {"
+	for (b = 0; b < B; b++)
+		printf "%s%3d,", (b % 16 ? "" : "\n\t"), (b in disp) ? disp[b] : 0
+	printf "\n};\n\n"
+	printf "#define CONSTS_NAME_SLOTS %d\n", M
+	printf "static const uint16_t consts_name_slot[CONSTS_NAME_SLOTS] = {"
+	for (p = 0; p < M; p++)
+		printf "%s%3d,", (p % 16 ? "" : "\n\t"), (p in slot) ? slot[p] : 0
+	printf "\n};\n"
+}' const-info.tmp >> const-info.c
+rm -f const-info.tmp
+cat >> const-info.c << END_OF_TAIL
 
 int
 _getdns_get_const_name_info(const char *name, uint32_t *code)
 {
-	struct const_name_info key = { name, 0 };
-	struct const_name_info *i = bsearch(&key, consts_name_info,
-	    sizeof(consts_name_info) / sizeof(struct const_name_info),
-	    sizeof(struct const_name_info), const_name_info_cmp);
-	if (!i)
+	const uint8_t *s = (const uint8_t *)name;
+	size_t len = strlen(name), i;
+	uint32_t h = (uint32_t)len;
+	uint16_t slot;
+
+	/* Four octets at a time, because the multiplications are on the
+	 * critical path
+	 */
+	for (i = 0; i + 4 <= len; i += 4)
+		h = (h + (s[i] | s[i + 1] << 8 | s[i + 2] << 16
+		    | (uint32_t)s[i + 3] << 24)) * 2654435761U;
+	switch (len - i) {
+	case 3: h = (h + (s[i] | s[i + 1] << 8 | s[i + 2] << 16))
+	            * 2654435761U;
+	        break;
+	case 2: h = (h + (s[i] | s[i + 1] << 8)) * 2654435761U;
+	        break;
+	case 1: h = (h + s[i]) * 2654435761U;
+	        break;
+	}
+	h += h >> 16;
+
+	slot = consts_name_slot[(h + consts_name_disp[(h >> 24)
+	    % CONSTS_NAME_BUCKETS] * ((h >> 16) | 1)) % CONSTS_NAME_SLOTS];
+	if (!slot || strcmp(consts_name_info[slot - 1].name, name))
 		return 0;
 	if (code)
-		*code = i->code;
+		*code = consts_name_info[slot - 1].code;
 	return 1;
 }
 END_OF_TAIL
@@ -360,6 +360,17 @@ _getdns_upstream_from_x509_store(X509_STORE_CTX *store)
 	 * might call ERR_get_error (see CRYPTO_set_ex_data(3ssl))*/
 }
 
+getdns_upstream*
+_getdns_upstream_from_SSL(SSL *ssl)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000 || defined(HAVE_LIBRESSL)
+	int uidx = _get_ssl_getdns_upstream_idx();
+#else
+	int uidx = _get_ssl_getdns_upstream_idx(SSL_CTX_get_cert_store(SSL_get_SSL_CTX(ssl)));
+#endif
+	return (getdns_upstream*) SSL_get_ex_data(ssl, uidx);
+}
+
 getdns_return_t
 _getdns_associate_upstream_with_SSL(SSL *ssl,
 				    getdns_upstream *upstream)
@@ -55,6 +55,8 @@ _getdns_get_pubkey_pinset_list(getdns_context *ctx,
 getdns_upstream*
 _getdns_upstream_from_x509_store(X509_STORE_CTX *store);
 
+getdns_upstream*
+_getdns_upstream_from_SSL(SSL *ssl);
 
 getdns_return_t
 _getdns_associate_upstream_with_SSL(SSL *ssl,
@@ -34,6 +34,10 @@
  */
 
 #include "config.h"
+#ifdef HAVE_EVP_MAC_CTX_NEW
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
 #include "types-internal.h"
 #include "util-internal.h"
 #include "gldns/rrdef.h"
@@ -101,14 +105,25 @@ is_extension_set(getdns_dict *extensions, const char *name, int default_value)
 	                               : default_value;
 }
 
+/* Return the answer to the buffer pool, when one was received */
+static void
+netreq_release_response(getdns_network_req *net_req)
+{
+	_getdns_rr_index_destroy(&net_req->owner->my_mf, net_req->response_index);
+	net_req->response_index = NULL;
+	if (net_req->response && (net_req->response < net_req->wire_data ||
+	    net_req->response > net_req->wire_data+ net_req->wire_data_sz))
+		_getdns_buf_pool_release(
+		    &net_req->owner->context->buf_pool, net_req->response);
+	net_req->response = NULL;
+}
+
 static void
 network_req_cleanup(getdns_network_req *net_req)
 {
 	assert(net_req);
 
-	if (net_req->response && (net_req->response < net_req->wire_data ||
-	    net_req->response > net_req->wire_data+ net_req->wire_data_sz))
-		GETDNS_FREE(net_req->owner->my_mf, net_req->response);
+	netreq_release_response(net_req);
 }
 
 static uint8_t *
@@ -126,6 +141,9 @@ netreq_reset(getdns_network_req *net_req)
 	/* Some fields to record info for return_call_reporting */
 	net_req->debug_start_time = 0;
 	net_req->debug_end_time = 0;
+	net_req->udp_deadline = 0;
+	net_req->hedge_fd = -1;
+	net_req->hedge_upstream = NULL;
 	if (!net_req->query)
 		return NULL;
 
@@ -138,30 +156,68 @@ netreq_reset(getdns_network_req *net_req)
 	return buf + 4;
 }
 
-static int
-network_req_init(getdns_network_req *net_req, getdns_dns_req *owner,
-    uint16_t request_type, int dnssec_extension_set, int with_opt,
-    int edns_maximum_udp_payload_size,
-    uint8_t edns_extended_rcode, uint8_t edns_version, int edns_do_bit,
-    uint16_t opt_options_size, size_t noptions, getdns_list *options,
-    size_t wire_data_sz, size_t max_query_sz, getdns_dict *extensions)
+/* Write the OPT RR for the settings to buf, which must have space for
+ * 11 + settings->opt_options_size octets.
+ */
+void
+_getdns_dns_req_settings_opt_rr(
+    const getdns_dns_req_settings *settings, uint8_t *buf)
 {
-	uint8_t *buf;
 	getdns_dict    *option;
 	uint32_t        option_code;
 	getdns_bindata *option_data;
 	size_t i;
+
+	buf[0] = 0; /* dname for . */
+	gldns_write_uint16(buf + 1, GLDNS_RR_TYPE_OPT);
+	gldns_write_uint16(buf + 3,
+	    settings->edns_maximum_udp_payload_size != -1
+	    ? settings->edns_maximum_udp_payload_size : 1432);
+	buf[5] = settings->edns_extended_rcode;
+	buf[6] = settings->edns_version;
+	buf[7] = settings->edns_do_bit ? 0x80 : 0;
+	buf[8] = 0;
+	gldns_write_uint16(buf + 9, settings->opt_options_size);
+	buf += 11;
+	for (i = 0; i < settings->noptions; i++) {
+		if (getdns_list_get_dict(settings->options, i, &option))
+			continue;
+		if (getdns_dict_get_int(
+		    option, "option_code", &option_code))
+			continue;
+		if (getdns_dict_get_bindata(
+		    option, "option_data", &option_data))
+			continue;
+
+		gldns_write_uint16(buf, (uint16_t) option_code);
+		gldns_write_uint16(buf + 2,
+		    (uint16_t) option_data->size);
+		(void) memcpy(buf + 4, option_data->data,
+		    option_data->size);
+
+		buf += option_data->size + 4;
+	}
+}
+
+static int
+network_req_init(getdns_network_req *net_req, getdns_dns_req *owner,
+    uint16_t request_type, const getdns_dns_req_settings *settings,
+    size_t wire_data_sz)
+{
+	uint8_t *buf;
 	int r = 0;
-	gldns_buffer gbuf;
 
 	/* variables that stay the same on reinit, don't touch
 	 */
 	net_req->request_type = request_type;
 	net_req->owner = owner;
-	net_req->edns_maximum_udp_payload_size = edns_maximum_udp_payload_size;
-	net_req->max_udp_payload_size = edns_maximum_udp_payload_size != -1
-	                              ? edns_maximum_udp_payload_size : 1432;
-        net_req->base_query_option_sz = opt_options_size;
+	net_req->edns_maximum_udp_payload_size =
+	    settings->edns_maximum_udp_payload_size;
+	net_req->max_udp_payload_size =
+	    settings->edns_maximum_udp_payload_size != -1
+	    ? settings->edns_maximum_udp_payload_size : 1432;
+        net_req->base_query_option_sz = settings->opt_options_size;
+	net_req->upstream_option_space = settings->upstream_option_space;
 	net_req->wire_data_sz = wire_data_sz;
 
 	net_req->transport_count = owner->context->dns_transport_count;
@@ -177,16 +233,18 @@ network_req_init(getdns_network_req *net_req, getdns_dns_req *owner,
 	net_req->fd = -1;
 	net_req->transport_current = 0;
 	memset(&net_req->event, 0, sizeof(net_req->event));
+	memset(&net_req->hedge_event, 0, sizeof(net_req->hedge_event));
 	net_req->keepalive_sent = 0;
 	net_req->write_queue_tail = NULL;
 	/* Some fields to record info for return_call_reporting */
 	net_req->debug_tls_auth_status = GETDNS_AUTH_NONE;
 	net_req->debug_udp = 0;
+	net_req->response_index = NULL;
 
-	if (max_query_sz == 0) {
+	if (settings->max_query_sz == 0) {
 		net_req->query    = NULL;
 		net_req->opt      = NULL;
-		net_req->response = net_req->wire_data;
+		net_req->response = NULL;
 		netreq_reset(net_req);
 		return r;
 	}
@@ -194,54 +252,21 @@ network_req_init(getdns_network_req *net_req, getdns_dns_req *owner,
 	net_req->query = net_req->wire_data + 2;
 
 	buf = net_req->query;
-	gldns_write_uint16(buf + 2, 0); /* reset all flags */
-	GLDNS_RD_SET(buf);
-	GLDNS_OPCODE_SET(buf, GLDNS_PACKET_QUERY);
+	(void) memcpy(buf, settings->query_header, 4); /* ID and flags */
 	gldns_write_uint16(buf + GLDNS_QDCOUNT_OFF, 1); /* 1 query */
 	gldns_write_uint16(buf + GLDNS_ANCOUNT_OFF, 0); /* 0 answers */
 	gldns_write_uint16(buf + GLDNS_NSCOUNT_OFF, 0); /* 0 authorities */
-	gldns_write_uint16(buf + GLDNS_ARCOUNT_OFF, with_opt ? 1 : 0);
+	gldns_write_uint16(buf + GLDNS_ARCOUNT_OFF, settings->with_opt ? 1 : 0);
 
 	buf = netreq_reset(net_req);
-	gldns_buffer_init_frm_data(
-	    &gbuf, net_req->query, net_req->wire_data_sz - 2);
-	if (owner->context->header)
-		_getdns_reply_dict2wire(owner->context->header, &gbuf, 1);
-	gldns_buffer_rewind(&gbuf);
-	_getdns_reply_dict2wire(extensions, &gbuf, 1);
-	if (dnssec_extension_set) /* We will do validation ourselves */
-		GLDNS_CD_SET(net_req->query);
-
-	if (with_opt) {
+	if (settings->with_opt) {
 		net_req->opt = buf;
-		buf[0] = 0; /* dname for . */
-		gldns_write_uint16(buf + 1, GLDNS_RR_TYPE_OPT);
-		gldns_write_uint16(net_req->opt + 3,
-		    net_req->max_udp_payload_size);
-		buf[5] = edns_extended_rcode;
-		buf[6] = edns_version;
-		buf[7] = edns_do_bit ? 0x80 : 0;
-		buf[8] = 0;
-		gldns_write_uint16(buf + 9, opt_options_size);
-		buf += 11;
-		for (i = 0; i < noptions; i++) {
-			if (getdns_list_get_dict(options, i, &option))
-				continue;
-			if (getdns_dict_get_int(
-			    option, "option_code", &option_code))
-				continue;
-			if (getdns_dict_get_bindata(
-			    option, "option_data", &option_data))
-				continue;
-
-			gldns_write_uint16(buf, (uint16_t) option_code);
-			gldns_write_uint16(buf + 2,
-			    (uint16_t) option_data->size);
-			(void) memcpy(buf + 4, option_data->data,
-			    option_data->size);
-
-			buf += option_data->size + 4;
-		}
+		if (settings->opt_rr)
+			(void) memcpy(buf, settings->opt_rr,
+			    11 + settings->opt_options_size);
+		else
+			_getdns_dns_req_settings_opt_rr(settings, buf);
+		buf += 11 + settings->opt_options_size;
 	} else
 		net_req->opt = NULL;
 
@@ -264,6 +289,8 @@ _getdns_network_req_clear_upstream_options(getdns_network_req * req)
   if (req->opt) {
 	  gldns_write_uint16(req->opt + 9, (uint16_t) req->base_query_option_sz);
 	  req->response = req->opt + 11 + req->base_query_option_sz;
+	  /* Remove TSIG (if any) */
+	  gldns_write_uint16(req->query + GLDNS_ARCOUNT_OFF, 1);
 	  pktlen = req->response - req->query;
 	  gldns_write_uint16(req->query - 2, (uint16_t) pktlen);
   }
@@ -275,6 +302,7 @@ _getdns_netreq_reinit(getdns_network_req *netreq)
 	uint8_t *base_opt_backup;
 	size_t base_opt_rr_sz;
 
+	netreq_release_response(netreq);
 	if (!netreq->query) {
 		(void) netreq_reset(netreq);
 		return;
@@ -301,11 +329,29 @@ _getdns_netreq_reinit(getdns_network_req *netreq)
 	    netreq->response - netreq->query);
 }
 
+_getdns_rr_index *
+_getdns_netreq_rr_index(getdns_network_req *netreq)
+{
+	_getdns_rr_index *index = netreq->response_index;
 
-/* add_upstream_option appends an option that is derived at send time.
-    (you can send data as NULL and it will fill with all zeros) */
-getdns_return_t
-_getdns_network_req_add_upstream_option(getdns_network_req * req, uint16_t code, uint16_t sz, const void* data)
+	if (index && (index->pkt     != netreq->response ||
+	              index->pkt_len != netreq->response_len)) {
+		_getdns_rr_index_destroy(&netreq->owner->my_mf, index);
+		netreq->response_index = index = NULL;
+	}
+	if (!index && netreq->response && netreq->response_len)
+		netreq->response_index = index = _getdns_rr_index_create(
+		    &netreq->owner->my_mf, netreq->response,
+		    netreq->response_len);
+	return index;
+}
+
+
+/* Make room for sz more octets of upstream options in the OPT RR of req.
+ * Returns where they are to be written, or NULL when they do not fit.
+ */
+static uint8_t *
+upstream_options_grow(getdns_network_req *req, size_t sz)
 {
   uint16_t oldlen;
   uint32_t newlen;
@@ -314,34 +360,27 @@ _getdns_network_req_add_upstream_option(getdns_network_req * req, uint16_t code,
 
   /* if no options are set, we can't add upstream options */
   if (!req->opt)
-	  return GETDNS_RETURN_GENERIC_ERROR;
+	  return NULL;
   
   /* if TCP, no overflow allowed for length field
      https://tools.ietf.org/html/rfc1035#section-4.2.2 */
   pktlen = req->response - req->query;
-  pktlen += 4 + sz;
+  pktlen += sz;
   if (pktlen > UINT16_MAX)
-    return GETDNS_RETURN_GENERIC_ERROR;
+    return NULL;
   
   /* no overflow allowed for OPT size either (maybe this is overkill
      given the above check?) */
   oldlen = gldns_read_uint16(req->opt + 9);
-  newlen = oldlen + 4 + sz;
+  newlen = oldlen + sz;
   if (newlen > UINT16_MAX)
-    return GETDNS_RETURN_GENERIC_ERROR;
+    return NULL;
 
-  /* avoid overflowing MAXIMUM_UPSTREAM_OPTION_SPACE */
+  /* avoid overflowing the space reserved for upstream options */
   cur_upstream_option_sz = (size_t)oldlen - req->base_query_option_sz;
-  if (cur_upstream_option_sz  + 4 + sz > MAXIMUM_UPSTREAM_OPTION_SPACE)
-    return GETDNS_RETURN_GENERIC_ERROR;
+  if (cur_upstream_option_sz  + sz > req->upstream_option_space)
+    return NULL;
 
-  /* actually add the option: */
-  gldns_write_uint16(req->opt + 11 + oldlen, code);
-  gldns_write_uint16(req->opt + 11 + oldlen + 2, sz);
-  if (data != NULL)
-	  memcpy(req->opt + 11 + oldlen + 4, data, sz);
-  else
-	  memset(req->opt + 11 + oldlen + 4, 0, sz);
   gldns_write_uint16(req->opt + 9, newlen);
 
   /* the response should start right after the options end: */
@@ -350,50 +389,184 @@ _getdns_network_req_add_upstream_option(getdns_network_req * req, uint16_t code,
   /* for TCP, adjust the size of the wire format itself: */
   gldns_write_uint16(req->query - 2, pktlen);
   
+  return req->opt + 11 + oldlen;
+}
+
+/* add_upstream_option appends an option that is derived at send time.
+    (you can send data as NULL and it will fill with all zeros) */
+getdns_return_t
+_getdns_network_req_add_upstream_option(getdns_network_req * req, uint16_t code, uint16_t sz, const void* data)
+{
+  uint8_t *option;
+
+  if (!(option = upstream_options_grow(req, 4 + (size_t)sz)))
+    return GETDNS_RETURN_GENERIC_ERROR;
+
+  /* actually add the option: */
+  gldns_write_uint16(option, code);
+  gldns_write_uint16(option + 2, sz);
+  if (data != NULL)
+	  memcpy(option + 4, data, sz);
+  else
+	  memset(option + 4, 0, sz);
+  
   return GETDNS_RETURN_GOOD;
 }
 
-size_t
-_getdns_network_req_add_tsig(getdns_network_req *req)
+/* add_upstream_options appends options that are already in wire format,
+   i.e. prepared once for an upstream. */
+getdns_return_t
+_getdns_network_req_add_upstream_options(getdns_network_req * req, const uint8_t *options, size_t sz)
 {
-	getdns_upstream *upstream = req->upstream;
-	gldns_buffer gbuf;
-	uint16_t arcount;
-	const getdns_tsig_info *tsig_info;
-	uint8_t md_buf[EVP_MAX_MD_SIZE];
-	unsigned int md_len = EVP_MAX_MD_SIZE;
-	const EVP_MD *digester;
+  uint8_t *option;
 
-	/* Should only be called when in stub mode */
-	assert(req->query);
+  if (!(option = upstream_options_grow(req, sz)))
+    return GETDNS_RETURN_GENERIC_ERROR;
 
-	if (upstream->tsig_alg == GETDNS_NO_TSIG || !upstream->tsig_dname_len)
-		return req->response - req->query;
+  memcpy(option, options, sz);
+  return GETDNS_RETURN_GOOD;
+}
 
-	arcount = gldns_read_uint16(req->query + 10);
+/* The HMAC operations for TSIG, with EVP_MAC when available.  The key is
+ * given only once, to tsig_hmac_new().  tsig_hmac_reset() restores the
+ * state right after that, for the next message.
+ */
+#ifdef HAVE_EVP_MAC_CTX_NEW
+static _getdns_tsig_hmac *
+tsig_hmac_new(getdns_upstream *upstream, const EVP_MD *digester)
+{
+	EVP_MAC *mac;
+	EVP_MAC_CTX *ctx;
+	OSSL_PARAM params[2];
 
-#if defined(STUB_DEBUG) && STUB_DEBUG
-	/* TSIG should not have been written yet. */
-	if (req->opt) {
-		assert(arcount == 1);
-		assert(req->opt + 11 + gldns_read_uint16(req->opt + 9)
-		    == req->response);
-	} else
-		assert(arcount == 0);
+	if (!(mac = EVP_MAC_fetch(NULL, "HMAC", NULL)))
+		return NULL;
+	ctx = EVP_MAC_CTX_new(mac);
+	EVP_MAC_free(mac); /* ctx keeps its own reference */
+	if (!ctx)
+		return NULL;
+
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	    (char *)EVP_MD_get0_name(digester), 0);
+	params[1] = OSSL_PARAM_construct_end();
+	if (!EVP_MAC_init(ctx, upstream->tsig_key, upstream->tsig_size,
+	    params)) {
+		EVP_MAC_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void
+tsig_hmac_free(getdns_upstream *upstream, _getdns_tsig_hmac *ctx)
+{
+	(void)upstream;
+	EVP_MAC_CTX_free(ctx);
+}
+
+static void
+tsig_hmac_reset(_getdns_tsig_hmac *ctx)
+{
+	(void) EVP_MAC_init(ctx, NULL, 0, NULL);
+}
+
+static void
+tsig_hmac_update(_getdns_tsig_hmac *ctx, const uint8_t *data, size_t len)
+{
+	(void) EVP_MAC_update(ctx, data, len);
+}
+
+static void
+tsig_hmac_final(_getdns_tsig_hmac *ctx, uint8_t *md, size_t *md_len)
+{
+	if (!EVP_MAC_final(ctx, md, md_len, EVP_MAX_MD_SIZE))
+		*md_len = 0;
+}
+#else
+static void
+tsig_hmac_free(getdns_upstream *upstream, _getdns_tsig_hmac *ctx)
+{
+#ifdef HAVE_HMAC_CTX_FREE
+	(void)upstream;
+	HMAC_CTX_free(ctx);
+#else
+	HMAC_CTX_cleanup(ctx);
+	GETDNS_FREE(upstream->upstreams->mf, ctx);
 #endif
-	tsig_info = _getdns_get_tsig_info(upstream->tsig_alg);
-
-	gldns_buffer_init_frm_data(&gbuf, req->response, MAXIMUM_TSIG_SPACE);
-	gldns_buffer_write(&gbuf,
-	    upstream->tsig_dname, upstream->tsig_dname_len);	/* Name */
-	gldns_buffer_write_u16(&gbuf, GETDNS_RRCLASS_ANY);	/* Class */
-	gldns_buffer_write_u32(&gbuf, 0);			/* TTL */
-	gldns_buffer_write(&gbuf,
-	    tsig_info->dname, tsig_info->dname_len);	/* Algorithm Name */
-	gldns_buffer_write_u48(&gbuf, time(NULL));	/* Time Signed */
-	gldns_buffer_write_u16(&gbuf, 300);		/* Fudge */
-	gldns_buffer_write_u16(&gbuf, 0);		/* Error */
-	gldns_buffer_write_u16(&gbuf, 0);		/* Other len */
+}
+
+static _getdns_tsig_hmac *
+tsig_hmac_new(getdns_upstream *upstream, const EVP_MD *digester)
+{
+	HMAC_CTX *ctx;
+
+#ifdef HAVE_HMAC_CTX_NEW
+	if (!(ctx = HMAC_CTX_new()))
+		return NULL;
+#else
+	if (!(ctx = GETDNS_MALLOC(upstream->upstreams->mf, HMAC_CTX)))
+		return NULL;
+	HMAC_CTX_init(ctx);
+#endif
+	if (!HMAC_Init_ex(ctx, upstream->tsig_key, upstream->tsig_size,
+	    digester, NULL)) {
+		tsig_hmac_free(upstream, ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void
+tsig_hmac_reset(_getdns_tsig_hmac *ctx)
+{
+	(void) HMAC_Init_ex(ctx, NULL, 0, NULL, NULL);
+}
+
+static void
+tsig_hmac_update(_getdns_tsig_hmac *ctx, const uint8_t *data, size_t len)
+{
+	(void) HMAC_Update(ctx, data, len);
+}
+
+static void
+tsig_hmac_final(_getdns_tsig_hmac *ctx, uint8_t *md, size_t *md_len)
+{
+	unsigned int len = EVP_MAX_MD_SIZE;
+
+	if (!HMAC_Final(ctx, md, &len))
+		len = 0;
+	*md_len = len;
+}
+#endif
+
+void
+_getdns_upstream_tsig_hmac_free(getdns_upstream *upstream)
+{
+	if (upstream->tsig_hmac) {
+		tsig_hmac_free(upstream, upstream->tsig_hmac);
+		upstream->tsig_hmac = NULL;
+	}
+}
+
+/* The keyed HMAC for the TSIG key of upstream, set up on first use.  Each
+ * message restores this state with tsig_hmac_reset(), so that the key does
+ * not have to be hashed and padded again.  The TSIG RR, up to and including
+ * the Algorithm Name, is prepared along with it.
+ * Returns NULL when the TSIG algorithm is not supported.
+ */
+static _getdns_tsig_hmac *
+upstream_tsig_hmac(getdns_upstream *upstream)
+{
+	const getdns_tsig_info *tsig_info;
+	const EVP_MD *digester;
+	_getdns_tsig_hmac *ctx;
+	uint8_t *rr;
+
+	if (upstream->conn_primary)
+		upstream = upstream->conn_primary;
+
+	if (upstream->tsig_hmac)
+		return upstream->tsig_hmac;
 
 	switch (upstream->tsig_alg) {
 #ifdef HAVE_EVP_MD5
@@ -414,38 +587,101 @@ _getdns_network_req_add_tsig(getdns_network_req *req)
 #ifdef HAVE_EVP_SHA512
 	case GETDNS_HMAC_SHA512: digester = EVP_sha512(); break;
 #endif
-	default                : return req->response - req->query;
+	default                : return NULL;
 	}
+	if (!(tsig_info = _getdns_get_tsig_info(upstream->tsig_alg)))
+		return NULL;
 
-	(void) HMAC(digester, upstream->tsig_key, upstream->tsig_size,
-	    (void *)req->query, gldns_buffer_current(&gbuf) - req->query,
-	    md_buf, &md_len);
-
-	gldns_buffer_rewind(&gbuf);
-	gldns_buffer_write(&gbuf,
-	    upstream->tsig_dname, upstream->tsig_dname_len);	/* Name */
-	gldns_buffer_write_u16(&gbuf, GETDNS_RRTYPE_TSIG);	/* Type*/
-	gldns_buffer_write_u16(&gbuf, GETDNS_RRCLASS_ANY);	/* Class */
-	gldns_buffer_write_u32(&gbuf, 0);			/* TTL */
-	gldns_buffer_write_u16(&gbuf,
-	    (uint16_t)(tsig_info->dname_len + 10 + md_len + 6));	/* RdLen */
-	gldns_buffer_write(&gbuf,
-	    tsig_info->dname, tsig_info->dname_len);	/* Algorithm Name */
-	gldns_buffer_write_u48(&gbuf, time(NULL));	/* Time Signed */
-	gldns_buffer_write_u16(&gbuf, 300);		/* Fudge */
-	gldns_buffer_write_u16(&gbuf, md_len);		/* MAC Size */
-	gldns_buffer_write(&gbuf, md_buf, md_len);	/* MAC*/
-	gldns_buffer_write(&gbuf, req->query, 2);	/* Original ID */
-	gldns_buffer_write_u16(&gbuf, 0);		/* Error */
-	gldns_buffer_write_u16(&gbuf, 0);		/* Other len */
+	if (!(ctx = tsig_hmac_new(upstream, digester)))
+		return NULL;
+	upstream->tsig_mac_len = EVP_MD_size(digester);
+
+	rr = upstream->tsig_rr;
+	(void) memcpy(rr, upstream->tsig_dname, upstream->tsig_dname_len);
+	rr += upstream->tsig_dname_len;				/* Name */
+	gldns_write_uint16(rr, GETDNS_RRTYPE_TSIG);		/* Type */
+	gldns_write_uint16(rr + 2, GETDNS_RRCLASS_ANY);		/* Class */
+	gldns_write_uint32(rr + 4, 0);				/* TTL */
+	gldns_write_uint16(rr + 8, (uint16_t)(tsig_info->dname_len
+	    + 10 + upstream->tsig_mac_len + 6));		/* RdLen */
+	rr += 10;
+	(void) memcpy(rr, tsig_info->dname, tsig_info->dname_len);
+	rr += tsig_info->dname_len;			/* Algorithm Name */
+	upstream->tsig_rr_len = rr - upstream->tsig_rr;
+
+	return (upstream->tsig_hmac = ctx);
+}
+
+size_t
+_getdns_network_req_add_tsig(getdns_network_req *req)
+{
+	static const uint8_t error_other_len[4] = { 0, 0, 0, 0 };
+	getdns_upstream *upstream = req->upstream;
+	uint16_t arcount;
+	_getdns_tsig_hmac *ctx;
+	const uint8_t *rr;
+	size_t name_len;
+	uint8_t time_fudge[8];
+	uint8_t *pos;
+	uint8_t md_buf[EVP_MAX_MD_SIZE];
+	size_t md_len;
+
+	/* Should only be called when in stub mode */
+	assert(req->query);
+
+	if (upstream->tsig_alg == GETDNS_NO_TSIG || !upstream->tsig_dname_len)
+		return req->response - req->query;
+
+	arcount = gldns_read_uint16(req->query + 10);
 
-	if (gldns_buffer_position(&gbuf) > gldns_buffer_limit(&gbuf))
+#if defined(STUB_DEBUG) && STUB_DEBUG
+	/* TSIG should not have been written yet. */
+	if (req->opt) {
+		assert(arcount == 1);
+		assert(req->opt + 11 + gldns_read_uint16(req->opt + 9)
+		    == req->response);
+	} else
+		assert(arcount == 0);
+#endif
+	if (!(ctx = upstream_tsig_hmac(upstream)))
+		return req->response - req->query;
+	if (upstream->conn_primary)
+		upstream = upstream->conn_primary;
+
+	rr = upstream->tsig_rr;
+	name_len = upstream->tsig_dname_len;
+	gldns_write_uint48(time_fudge, time(NULL));	/* Time Signed */
+	gldns_write_uint16(time_fudge + 6, 300);	/* Fudge */
+
+	tsig_hmac_reset(ctx);
+	tsig_hmac_update(ctx, req->query, req->response - req->query);
+	tsig_hmac_update(ctx, rr, name_len);			/* Name */
+	tsig_hmac_update(ctx, rr + name_len + 2, 6);	/* Class & TTL */
+	tsig_hmac_update(ctx, rr + name_len + 10,
+	    upstream->tsig_rr_len - name_len - 10);	/* Algorithm Name */
+	tsig_hmac_update(ctx, time_fudge, sizeof(time_fudge));
+	tsig_hmac_update(ctx, error_other_len, sizeof(error_other_len));
+	tsig_hmac_final(ctx, md_buf, &md_len);
+
+	if (md_len != upstream->tsig_mac_len)
 		return req->response - req->query;
 
+	pos = req->response;
+	(void) memcpy(pos, rr, upstream->tsig_rr_len);
+	pos += upstream->tsig_rr_len;
+	(void) memcpy(pos, time_fudge, sizeof(time_fudge));
+	pos += sizeof(time_fudge);
+	gldns_write_uint16(pos, md_len);		/* MAC Size */
+	(void) memcpy(pos + 2, md_buf, md_len);		/* MAC */
+	pos += 2 + md_len;
+	(void) memcpy(pos, req->query, 2);		/* Original ID */
+	(void) memcpy(pos + 2, error_other_len, sizeof(error_other_len));
+	pos += 2 + sizeof(error_other_len);
+
 	DEBUG_STUB("Sending with TSIG, mac length: %d\n", (int)md_len);
 	req->tsig_status = GETDNS_DNSSEC_INSECURE;
 	gldns_write_uint16(req->query + 10, arcount + 1);
-	req->response = gldns_buffer_current(&gbuf);
+	req->response = pos;
 	return req->response - req->query;
 }
 
@@ -466,17 +702,17 @@ _getdns_network_validate_tsig(getdns_network_req *req)
 	uint16_t  response_mac_len;
 	uint8_t   other_len;
 	uint8_t   result_mac[EVP_MAX_MD_SIZE];
-	unsigned int result_mac_len = EVP_MAX_MD_SIZE;
+	size_t    result_mac_len;
 	uint16_t original_id;
-	const EVP_MD *digester;
-	HMAC_CTX *ctx;
-#ifndef HAVE_HMAC_CTX_NEW
-	HMAC_CTX ctx_space;
-#endif
+	_getdns_tsig_hmac *ctx;
 
 	DEBUG_STUB("%s %-35s: Validate TSIG\n", STUB_DEBUG_TSIG, __FUNC__);
+	/* req->response points to the reply now, so the end of the query
+	 * is not known here.  The iterator stops after the last RR counted
+	 * in the header anyway.
+	 */
 	for ( rr = _getdns_rr_iter_init(&rr_spc, req->query,
-	                                (req->response - req->query))
+	            (req->wire_data + req->wire_data_sz) - req->query)
 	    ; rr
 	    ; rr = _getdns_rr_iter_next(rr)) {
 
@@ -575,43 +811,18 @@ _getdns_network_validate_tsig(getdns_network_req *req)
 	DEBUG_STUB("%s %-35s: TSIG found, original ID: %d\n",
 	           STUB_DEBUG_TSIG, __FUNC__, (int)original_id);
 
+	if (!(ctx = upstream_tsig_hmac(req->upstream)))
+		return;
+
 	gldns_write_uint16(req->response + 10,
 	    gldns_read_uint16(req->response + 10) - 1);
 	gldns_write_uint16(req->response, original_id);
 
-	switch (req->upstream->tsig_alg) {
-#ifdef HAVE_EVP_MD5
-	case GETDNS_HMAC_MD5   : digester = EVP_md5()   ; break;
-#endif
-#ifdef HAVE_EVP_SHA1
-	case GETDNS_HMAC_SHA1  : digester = EVP_sha1()  ; break;
-#endif
-#ifdef HAVE_EVP_SHA224
-	case GETDNS_HMAC_SHA224: digester = EVP_sha224(); break;
-#endif
-#ifdef HAVE_EVP_SHA256
-	case GETDNS_HMAC_SHA256: digester = EVP_sha256(); break;
-#endif
-#ifdef HAVE_EVP_SHA384
-	case GETDNS_HMAC_SHA384: digester = EVP_sha384(); break;
-#endif
-#ifdef HAVE_EVP_SHA512
-	case GETDNS_HMAC_SHA512: digester = EVP_sha512(); break;
-#endif
-	default                : return;
-	}
-#ifdef HAVE_HMAC_CTX_NEW
-	ctx = HMAC_CTX_new();
-#else
-	ctx = &ctx_space;
-	HMAC_CTX_init(ctx);
-#endif	
-	(void) HMAC_Init_ex(ctx, req->upstream->tsig_key,
-	    req->upstream->tsig_size, digester, NULL);
-	(void) HMAC_Update(ctx, request_mac - 2, request_mac_len + 2);
-	(void) HMAC_Update(ctx, req->response, rr->pos - req->response);
-	(void) HMAC_Update(ctx, tsig_vars, gldns_buffer_position(&gbuf));
-	HMAC_Final(ctx, result_mac, &result_mac_len);
+	tsig_hmac_reset(ctx);
+	tsig_hmac_update(ctx, request_mac - 2, request_mac_len + 2);
+	tsig_hmac_update(ctx, req->response, rr->pos - req->response);
+	tsig_hmac_update(ctx, tsig_vars, gldns_buffer_position(&gbuf));
+	tsig_hmac_final(ctx, result_mac, &result_mac_len);
 
 	DEBUG_STUB("%s %-35s: Result MAC length: %d\n",
 	           STUB_DEBUG_TSIG, __FUNC__, (int)(result_mac_len));
@@ -619,11 +830,6 @@ _getdns_network_validate_tsig(getdns_network_req *req)
 	    memcmp(result_mac, response_mac, result_mac_len) == 0)
 		req->tsig_status = GETDNS_DNSSEC_SECURE;
 
-#ifdef HAVE_HMAC_CTX_FREE
-	HMAC_CTX_free(ctx);
-#else
-	HMAC_CTX_cleanup(ctx);
-#endif
 	gldns_write_uint16(req->response, gldns_read_uint16(req->query));
 	gldns_write_uint16(req->response + 10,
 	    gldns_read_uint16(req->response + 10) + 1);
@@ -650,15 +856,15 @@ _getdns_dns_req_free(getdns_dns_req * req)
 	}
 	if (req->freed)
 		*req->freed = 1;
-	GETDNS_FREE(req->my_mf, req);
+	if (!req->in_slab)
+		GETDNS_FREE(req->my_mf, req);
 }
 
 static const uint8_t no_suffixes[] = { 1, 0 };
 
-/* create a new dns req to be submitted */
-getdns_dns_req *
-_getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
-    const char *name, uint16_t request_type, getdns_dict *extensions)
+void
+_getdns_dns_req_settings_init(getdns_dns_req_settings *settings,
+    getdns_context *context, getdns_dict *extensions)
 {
 	int dnssec_return_status                 = is_extension_set(
 	    extensions, "dnssec_return_status",
@@ -718,19 +924,18 @@ _getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
 
 	int with_opt;
 
-	getdns_dns_req *result = NULL;
-        uint32_t klass = context->specify_class;
-	int a_aaaa_query = is_extension_set(extensions,
-	    "return_both_v4_and_v6", context->return_both_v4_and_v6) &&
-	    ( request_type == GETDNS_RRTYPE_A ||
-	      request_type == GETDNS_RRTYPE_AAAA );
-	/* Reserve for the buffer at least one more byte
-	 * (to test for udp overflow) (hence the + 1),
-	 * And align on the 8 byte boundry  (hence the (x + 7) / 8 * 8)
-	 */
-	size_t max_query_sz, max_response_sz, netreq_sz, dnsreq_base_sz;
-	uint8_t *region, *suffixes;
-	
+	size_t upstream_option_space, tsig_space;
+
+	uint8_t header[GLDNS_HEADER_SIZE];
+	gldns_buffer gbuf;
+
+	settings->return_both_v4_and_v6 = is_extension_set(extensions,
+	    "return_both_v4_and_v6", context->return_both_v4_and_v6);
+	settings->return_call_reporting = is_extension_set(extensions,
+	    "return_call_reporting"  , context->return_call_reporting);
+	settings->add_warning_for_bad_dns = is_extension_set(extensions,
+	    "add_warning_for_bad_dns", context->add_warning_for_bad_dns);
+
 	if (extensions == dnssec_ok_checking_disabled ||
 	    extensions == dnssec_ok_checking_disabled_roadblock_avoidance ||
 	    extensions == dnssec_ok_checking_disabled_avoid_roadblocks)
@@ -789,7 +994,7 @@ _getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
 #else
 	if (context->resolution_type == GETDNS_RESOLUTION_RECURSING)
 #endif
-		max_query_sz = 0;
+		settings->max_query_sz = upstream_option_space = 0;
 	else {
 		for (i = 0; i < noptions; i++) {
 			if (getdns_list_get_dict(options, i, &option)) continue;
@@ -803,26 +1008,121 @@ _getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
 			    + 2 /* option-length */
 			    ;
 		}
-		max_query_sz = ( GLDNS_HEADER_SIZE
+		/* Only reserve for the upstream options that can be sent
+		 * with the settings of this request.
+		 */
+		upstream_option_space = 4 /* keepalive */
+		    + (edns_cookies ? 4 + 8 + 32 : 0)
+		    + (context->edns_client_subnet_private ? 4 + 4 : 0)
+		    + (context->tls_query_padding_blocksize > 1
+		      ? 4 + context->tls_query_padding_blocksize - 1 : 0);
+		if (upstream_option_space > MAXIMUM_UPSTREAM_OPTION_SPACE)
+			upstream_option_space = MAXIMUM_UPSTREAM_OPTION_SPACE;
+
+		tsig_space = 0;
+		if (context->upstreams) {
+			for (i = 0; i < context->upstreams->count; i++) {
+				if (context->upstreams->upstreams[i].tsig_alg
+				    != GETDNS_NO_TSIG) {
+					tsig_space = MAXIMUM_TSIG_SPACE;
+					break;
+				}
+			}
+		}
+		settings->max_query_sz = ( 2 /* query length (for tcp) */
+		    + GLDNS_HEADER_SIZE
 		    + 256 + 4 /* dname maximum 255 bytes (256 with mdns)*/
 		    + 12 + opt_options_size /* space needed for OPT (if needed) */
-		    + MAXIMUM_UPSTREAM_OPTION_SPACE
-		    + MAXIMUM_TSIG_SPACE
+		    + upstream_option_space
+		    + tsig_space
+		    + 11 + opt_options_size /* OPT backup space for reinit */
 		    + 7) / 8 * 8;
 	}
-	max_response_sz = (( edns_maximum_udp_payload_size != -1
-	                   ? edns_maximum_udp_payload_size : 1432
-	                   ) + 1 /* +1 for udp overflow detection */
-	                     + 7 ) / 8 * 8;
-
-	netreq_sz = ( sizeof(getdns_network_req)
-	            + max_query_sz + max_response_sz  + 7 ) / 8 * 8;
-	dnsreq_base_sz = (( sizeof(getdns_dns_req) 
-	                  + (a_aaaa_query ? 3 : 2) * sizeof(getdns_network_req*)
-			  + context->suffixes_len
-			  ) + 7) / 8 * 8;
-
-	if (! (region = GETDNS_XMALLOC(context->mf, uint8_t, 
+	settings->dnssec_extension_set           = dnssec_extension_set;
+	settings->dnssec_return_status           = dnssec_return_status;
+	settings->dnssec_return_only_secure      = dnssec_return_only_secure;
+	settings->dnssec_return_all_statuses     = dnssec_return_all_statuses;
+	settings->dnssec_return_full_validation_chain =
+		dnssec_return_full_validation_chain;
+	settings->dnssec_return_validation_chain = dnssec_return_validation_chain
+	     || dnssec_return_full_validation_chain;
+	settings->edns_cookies                   = edns_cookies;
+#ifdef DNSSEC_ROADBLOCK_AVOIDANCE
+	settings->dnssec_roadblock_avoidance     = dnssec_roadblock_avoidance;
+	settings->avoid_dnssec_roadblocks        = avoid_dnssec_roadblocks;
+#endif
+	settings->with_opt                       = with_opt;
+	settings->edns_maximum_udp_payload_size  = edns_maximum_udp_payload_size;
+	settings->edns_extended_rcode            = edns_extended_rcode;
+	settings->edns_version                   = edns_version;
+	settings->edns_do_bit                    = edns_do_bit != 0;
+	settings->options                        = options;
+	settings->noptions                       = noptions;
+	settings->opt_options_size               = opt_options_size;
+	settings->upstream_option_space          = upstream_option_space;
+
+	/* check the specify_class extension */
+	settings->request_class = context->specify_class;
+	(void) getdns_dict_get_int(extensions, "specify_class",
+	    &settings->request_class);
+
+	/* ID and flags of the queries, with the header settings from
+	 * the context and the extensions applied.
+	 */
+	(void) memset(header, 0, sizeof(header));
+	GLDNS_RD_SET(header);
+	GLDNS_OPCODE_SET(header, GLDNS_PACKET_QUERY);
+	if (context->header || extensions) {
+		gldns_buffer_init_frm_data(&gbuf, header, sizeof(header));
+		if (context->header)
+			_getdns_reply_dict2wire(context->header, &gbuf, 1);
+		gldns_buffer_rewind(&gbuf);
+		_getdns_reply_dict2wire(extensions, &gbuf, 1);
+	}
+	if (dnssec_extension_set) /* We will do validation ourselves */
+		GLDNS_CD_SET(header);
+	(void) memcpy(settings->query_header, header, 4);
+	settings->opt_rr = NULL;
+}
+
+/* Answers are received in buffers from the context's buf_pool,
+ * so only the query is allocated together with the request.
+ * Align on the 8 byte boundry  (hence the (x + 7) / 8 * 8)
+ */
+#define NETREQ_SZ(settings) \
+	((sizeof(getdns_network_req) + (settings)->max_query_sz + 7) / 8 * 8)
+#define DNSREQ_BASE_SZ(context, a_aaaa_query) \
+	(((sizeof(getdns_dns_req) \
+	  + ((a_aaaa_query) ? 3 : 2) * sizeof(getdns_network_req*) \
+	  + (context)->suffixes_len) + 7) / 8 * 8)
+#define IS_A_AAAA_QUERY(settings, request_type) \
+	((settings)->return_both_v4_and_v6 && \
+	 ( (request_type) == GETDNS_RRTYPE_A || \
+	   (request_type) == GETDNS_RRTYPE_AAAA ))
+
+size_t
+_getdns_dns_req_size(getdns_context *context,
+    const getdns_dns_req_settings *settings, uint16_t request_type)
+{
+	int a_aaaa_query = IS_A_AAAA_QUERY(settings, request_type);
+
+	return DNSREQ_BASE_SZ(context, a_aaaa_query)
+	    + (a_aaaa_query ? 2 : 1) * NETREQ_SZ(settings);
+}
+
+getdns_dns_req *
+_getdns_dns_req_new_in(getdns_context *context, getdns_eventloop *loop,
+    const char *name, uint16_t request_type,
+    const getdns_dns_req_settings *settings, uint8_t *region)
+{
+	getdns_dns_req *result = NULL;
+	int a_aaaa_query = IS_A_AAAA_QUERY(settings, request_type);
+	size_t netreq_sz = NETREQ_SZ(settings);
+	size_t dnsreq_base_sz = DNSREQ_BASE_SZ(context, a_aaaa_query);
+	int in_slab = region != NULL;
+	uint8_t *suffixes;
+
+	if (!region && !(region = GETDNS_XMALLOC(context->mf, uint8_t,
 	    dnsreq_base_sz + (a_aaaa_query ? 2 : 1) * netreq_sz)))
 		return NULL;
 
@@ -836,6 +1136,7 @@ _getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
 		result->netreqs[1] = NULL;
 
 	result->my_mf = context->mf;
+	result->in_slab = in_slab;
 	
 	suffixes = region + dnsreq_base_sz - context->suffixes_len;
 	assert(context->suffixes);
@@ -856,7 +1157,8 @@ _getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
 	}
 	result->name_len = sizeof(result->name);
 	if (gldns_str2wire_dname_buf(name, result->name, &result->name_len)) {
-		GETDNS_FREE(result->my_mf, result);
+		if (!in_slab)
+			GETDNS_FREE(result->my_mf, result);
 		return NULL;
 	}
 	if (result->append_name == GETDNS_APPEND_NAME_ALWAYS ||
@@ -890,33 +1192,29 @@ _getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
 	result->canceled = 0;
 	result->trans_id = (((uint64_t)arc4random()) << 32) |
 	                    ((uint64_t)arc4random());
-	result->dnssec_return_status           = dnssec_return_status;
-	result->dnssec_return_only_secure      = dnssec_return_only_secure;
-	result->dnssec_return_all_statuses     = dnssec_return_all_statuses;
+	result->dnssec_return_status           = settings->dnssec_return_status;
+	result->dnssec_return_only_secure      = settings->dnssec_return_only_secure;
+	result->dnssec_return_all_statuses     = settings->dnssec_return_all_statuses;
 	result->dnssec_return_full_validation_chain =
-		dnssec_return_full_validation_chain;
-	result->dnssec_return_validation_chain = dnssec_return_validation_chain
-	     || dnssec_return_full_validation_chain;
-	result->edns_cookies                   = edns_cookies;
+		settings->dnssec_return_full_validation_chain;
+	result->dnssec_return_validation_chain =
+		settings->dnssec_return_validation_chain;
+	result->edns_cookies                   = settings->edns_cookies;
 #ifdef DNSSEC_ROADBLOCK_AVOIDANCE
-	result->dnssec_roadblock_avoidance     = dnssec_roadblock_avoidance;
-	result->avoid_dnssec_roadblocks        = avoid_dnssec_roadblocks;
+	result->dnssec_roadblock_avoidance     = settings->dnssec_roadblock_avoidance;
+	result->avoid_dnssec_roadblocks        = settings->avoid_dnssec_roadblocks;
 #endif
 	result->edns_client_subnet_private     = context->edns_client_subnet_private;
 	result->tls_query_padding_blocksize    = context->tls_query_padding_blocksize;
-	result->return_call_reporting          = is_extension_set(extensions,
-	    "return_call_reporting"  , context->return_call_reporting);
-	result->add_warning_for_bad_dns        = is_extension_set(extensions,
-	    "add_warning_for_bad_dns", context->add_warning_for_bad_dns);
+	result->return_call_reporting          = settings->return_call_reporting;
+	result->add_warning_for_bad_dns        = settings->add_warning_for_bad_dns;
 	
 	/* will be set by caller */
 	result->user_pointer = NULL;
 	result->user_callback = NULL;
 	memset(&result->timeout, 0, sizeof(result->timeout));
 
-        /* check the specify_class extension */
-        (void) getdns_dict_get_int(extensions, "specify_class", &klass);
-	result->request_class = klass;
+	result->request_class = settings->request_class;
         
 	result->upstreams = context->upstreams;
 	if (result->upstreams)
@@ -926,24 +1224,26 @@ _getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
 	result->freed = NULL;
 	result->validating = 0;
 
-	network_req_init(result->netreqs[0], result,
-	    request_type, dnssec_extension_set, with_opt,
-	    edns_maximum_udp_payload_size,
-	    edns_extended_rcode, edns_version, edns_do_bit,
-	    (uint16_t) opt_options_size, noptions, options,
-	    netreq_sz - sizeof(getdns_network_req), max_query_sz,
-	    extensions);
+	network_req_init(result->netreqs[0], result, request_type,
+	    settings, netreq_sz - sizeof(getdns_network_req));
 
 	if (a_aaaa_query)
 		network_req_init(result->netreqs[1], result,
 		    ( request_type == GETDNS_RRTYPE_A
 		    ? GETDNS_RRTYPE_AAAA : GETDNS_RRTYPE_A ),
-		    dnssec_extension_set, with_opt,
-		    edns_maximum_udp_payload_size,
-		    edns_extended_rcode, edns_version, edns_do_bit,
-		    (uint16_t) opt_options_size, noptions, options,
-		    netreq_sz - sizeof(getdns_network_req), max_query_sz,
-		    extensions);
+		    settings, netreq_sz - sizeof(getdns_network_req));
 
 	return result;
 }
+
+/* create a new dns req to be submitted */
+getdns_dns_req *
+_getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
+    const char *name, uint16_t request_type, getdns_dict *extensions)
+{
+	getdns_dns_req_settings settings;
+
+	_getdns_dns_req_settings_init(&settings, context, extensions);
+	return _getdns_dns_req_new_in(
+	    context, loop, name, request_type, &settings, NULL);
+}
@@ -33,22 +33,7 @@
 #include "config.h"
 #include <ctype.h>
 #include "gldns/rrdef.h"
-
-int
-_getdns_dname_equal(const uint8_t *s1, const uint8_t *s2)
-{
-	uint8_t i;
-	for (;;) {
-		if (*s1 != *s2)
-			return 0;
-		else if (!*s1)
-			return 1;
-		for (i = *s1++, s2++; i > 0; i--, s1++, s2++)
-			if (*s1 != *s2 && tolower((unsigned char)*s1)
-			               != tolower((unsigned char)*s2))
-				return 0;
-	}
-}
+#include "types-internal.h"
 
 static void
 rr_iter_find_nxt(_getdns_rr_iter *i)
@@ -274,7 +259,8 @@ _getdns_initialized_rrset_answer(_getdns_rrset_spc *query_rrset)
 }
 
 _getdns_rrset *
-_getdns_rrset_answer(_getdns_rrset_spc *spc, const uint8_t *pkt, size_t len)
+_getdns_rrset_answer(_getdns_rrset_spc *spc, const uint8_t *pkt, size_t len,
+    _getdns_rr_index *index)
 {
 	_getdns_rr_iter rr_spc, *rr;
 
@@ -294,6 +280,7 @@ _getdns_rrset_answer(_getdns_rrset_spc *spc, const uint8_t *pkt, size_t len)
 	spc->rrset.pkt = pkt;
 	spc->rrset.pkt_len = len;
 	spc->rrset.sections = SECTION_ANSWER;
+	spc->rrset.index = index;
 	return _getdns_initialized_rrset_answer(spc);
 }
 
@@ -309,6 +296,202 @@ static int rr_owner_equal(_getdns_rr_iter *rr, const uint8_t *name)
 	    && name && _getdns_dname_equal(owner, name);
 }
 
+/* Hash of the canonical (lower cased) form of an uncompressed dname */
+static uint32_t
+rr_index_dname_hash(const uint8_t *dname)
+{
+	uint32_t hash = 2166136261u; /* FNV-1a */
+	uint8_t i;
+
+	for (;;) {
+		hash = (hash ^ *dname) * 16777619u;
+		if (!*dname)
+			return hash;
+		for (i = *dname++; i > 0; i--, dname++)
+			hash = (hash ^ _getdns_dname_lower[*dname]) * 16777619u;
+	}
+}
+
+static inline size_t
+rr_index_slot(const _getdns_rr_index *index,
+    uint32_t hash, uint16_t rr_class, uint16_t rr_type, int rrsigs)
+{
+	hash ^= ((uint32_t)rr_class << 16 | rr_type) * 2654435761u;
+	hash ^= rrsigs ? 0x5bd1e995 : 0;
+	hash ^= hash >> 15;
+	return (size_t)hash & index->mask;
+}
+
+static int
+rr_index_owner_equal(const _getdns_rr_index *index,
+    const _getdns_rr_index_rr *rr, const uint8_t *name)
+{
+	uint8_t owner_spc[256];
+	const uint8_t *owner;
+	size_t  owner_len = sizeof(owner_spc);
+
+	return (owner = dname_if_or_as_decompressed(index->pkt,
+	    index->pkt + index->pkt_len, rr->pos, owner_spc, &owner_len, 0))
+	    && _getdns_dname_equal(owner, name);
+}
+
+/* Returns the first RR of the RRset with name/class/type, or with rrsigs,
+ * the first RRSIG covering that RRset.  _GETDNS_RR_INDEX_END if not found.
+ */
+static uint32_t
+rr_index_lookup(const _getdns_rr_index *index, const uint8_t *name,
+    uint16_t rr_class, uint16_t rr_type, int rrsigs)
+{
+	uint32_t hash;
+	size_t slot;
+	const _getdns_rr_index_rr *rr;
+
+	if (!name)
+		return _GETDNS_RR_INDEX_END;
+
+	hash = rr_index_dname_hash(name);
+	for ( slot = rr_index_slot(index, hash, rr_class, rr_type, rrsigs)
+	    ; index->slots[slot].head != _GETDNS_RR_INDEX_END
+	    ; slot = (slot + 1) & index->mask) {
+
+		rr = &index->rrs[index->slots[slot].head];
+		if (   rr->hash == hash && rr->rr_class == rr_class
+		    && (rrsigs ? rr->type    == GETDNS_RRTYPE_RRSIG
+		              && rr->covered == rr_type
+		               : rr->type    == rr_type)
+		    && rr_index_owner_equal(index, rr, name))
+			return index->slots[slot].head;
+	}
+	return _GETDNS_RR_INDEX_END;
+}
+
+_getdns_rr_index *
+_getdns_rr_index_create(
+    struct mem_funcs *mf, const uint8_t *pkt, size_t pkt_len)
+{
+	_getdns_rr_index *index;
+	_getdns_rr_index_rr *rr, *head;
+	_getdns_rr_iter rr_spc, *i;
+	size_t max_rrs, n_slots, slot;
+	uint8_t owner_spc[256];
+	const uint8_t *owner;
+	size_t owner_len;
+	int rrsigs;
+
+	if (!pkt || pkt_len < GLDNS_HEADER_SIZE + 5)
+		return NULL;
+
+	/* The smallest (question) RR takes 5 octets */
+	max_rrs = (size_t)GLDNS_QDCOUNT(pkt) + GLDNS_ANCOUNT(pkt)
+	        + GLDNS_NSCOUNT(pkt) + GLDNS_ARCOUNT(pkt);
+	if (max_rrs > (pkt_len - GLDNS_HEADER_SIZE) / 5)
+		max_rrs = (pkt_len - GLDNS_HEADER_SIZE) / 5;
+
+	for (n_slots = 8; n_slots < max_rrs * 2; n_slots <<= 1)
+		; /* pass */
+
+	if (!(index = (void *)GETDNS_XMALLOC(*mf, uint8_t, sizeof(*index)
+	    + max_rrs * sizeof(_getdns_rr_index_rr)
+	    + n_slots * sizeof(_getdns_rr_index_slot))))
+		return NULL;
+
+	index->pkt = pkt;
+	index->pkt_len = pkt_len;
+	index->n_rrs = 0;
+	index->mask = n_slots - 1;
+	index->slots = (void *)&index->rrs[max_rrs];
+	(void) memset(index->slots, 0xFF, n_slots * sizeof(*index->slots));
+
+	for ( i = _getdns_rr_iter_init(&rr_spc, pkt, pkt_len)
+	    ; i && index->n_rrs < max_rrs
+	    ; i = _getdns_rr_iter_next(i)) {
+
+		rr = &index->rrs[index->n_rrs];
+		rr->pos      = i->pos;
+		rr->rr_type  = i->rr_type;
+		rr->nxt      = i->nxt;
+		rr->type     = rr_iter_type(i);
+		rr->rr_class = rr_iter_class(i);
+		rr->covered  = rr->type == GETDNS_RRTYPE_RRSIG
+		            && i->rr_type + 12 <= i->nxt
+		             ? gldns_read_uint16(i->rr_type + 10) : 0;
+		rr->section  = _getdns_rr_iter_section(i);
+		rr->set      = (uint32_t)index->n_rrs;
+		rr->next     = _GETDNS_RR_INDEX_END;
+		rr->hash     = 0;
+
+		owner_len = sizeof(owner_spc);
+		rr->owner_ok = (owner = _getdns_owner_if_or_as_decompressed(
+		    i, owner_spc, &owner_len)) != NULL;
+		index->n_rrs++;
+
+		/* RRSIGs without a type covered are never found */
+		if (!rr->owner_ok || (rr->type == GETDNS_RRTYPE_RRSIG
+		                   && i->rr_type + 12 > i->nxt))
+			continue;
+
+		rr->hash = rr_index_dname_hash(owner);
+		rrsigs = rr->type == GETDNS_RRTYPE_RRSIG;
+		for ( slot = rr_index_slot(index, rr->hash, rr->rr_class,
+		          rrsigs ? rr->covered : rr->type, rrsigs)
+		    ; index->slots[slot].head != _GETDNS_RR_INDEX_END
+		    ; slot = (slot + 1) & index->mask) {
+
+			head = &index->rrs[index->slots[slot].head];
+			if (   head->hash     == rr->hash
+			    && head->rr_class == rr->rr_class
+			    && head->type     == rr->type
+			    && head->covered  == rr->covered
+			    && rr_index_owner_equal(index, head, owner))
+				break;
+		}
+		if (index->slots[slot].head == _GETDNS_RR_INDEX_END)
+			index->slots[slot].head = rr->set;
+		else {
+			index->rrs[index->slots[slot].tail].next = rr->set;
+			rr->set = index->slots[slot].head;
+		}
+		index->slots[slot].tail = (uint32_t)(index->n_rrs - 1);
+	}
+	return index;
+}
+
+void
+_getdns_rr_index_destroy(struct mem_funcs *mf, _getdns_rr_index *index)
+{
+	if (index)
+		GETDNS_FREE(*mf, index);
+}
+
+/* Point rr at the n'th RR of the index, or the first next one within
+ * sections along the chain.
+ */
+static _getdns_rr_iter *
+rr_index_iter(_getdns_rr_iter *rr, const _getdns_rr_index *index,
+    uint32_t n, _getdns_section sections)
+{
+	while (n != _GETDNS_RR_INDEX_END && !(index->rrs[n].section & sections))
+		n = index->rrs[n].next;
+
+	if (n == _GETDNS_RR_INDEX_END) {
+		rr->pos = NULL;
+		return NULL;
+	}
+	rr->pkt     = index->pkt;
+	rr->pkt_end = index->pkt + index->pkt_len;
+	rr->n       = n;
+	rr->pos     = index->rrs[n].pos;
+	rr->rr_type = index->rrs[n].rr_type;
+	rr->nxt     = index->rrs[n].nxt;
+	return rr;
+}
+
+static inline uint32_t
+rr_index_next(const _getdns_rr_iter *rr, const _getdns_rr_index *index)
+{
+	return rr->pos ? index->rrs[rr->n].next : _GETDNS_RR_INDEX_END;
+}
+
 /* First a few filter functions that filter a RR iterator to point only
  * to RRs with certain constraints (and moves on otherwise).
  */
@@ -373,9 +556,18 @@ static _getdns_rr_iter *rr_iter_rrsig_covering(_getdns_rr_iter *rr,
 	return rr && rr->pos ? rr : NULL;
 }
 
+/* RRs of type RRSIG are only chained by the type they cover */
+#define rrset_indexed(rrset) \
+	((rrset)->index && (rrset)->rr_type != GETDNS_RRTYPE_RRSIG)
+
 _getdns_rrtype_iter *
 _getdns_rrtype_iter_next(_getdns_rrtype_iter *i)
 {
+	if (rrset_indexed(i->rrset))
+		return (_getdns_rrtype_iter *) rr_index_iter(&i->rr_i,
+		    i->rrset->index, rr_index_next(&i->rr_i, i->rrset->index),
+		    i->rrset->sections);
+
 	return (_getdns_rrtype_iter *) rr_iter_name_class_type(
 	    _getdns_rr_iter_next(&i->rr_i),
 	    i->rrset->name, i->rrset->rr_class, i->rrset->rr_type,
@@ -386,6 +578,11 @@ _getdns_rrtype_iter *
 _getdns_rrtype_iter_init(_getdns_rrtype_iter *i, _getdns_rrset *rrset)
 {
 	i->rrset = rrset;
+	if (rrset_indexed(rrset))
+		return (_getdns_rrtype_iter *) rr_index_iter(&i->rr_i,
+		    rrset->index, rr_index_lookup(rrset->index, rrset->name,
+		    rrset->rr_class, rrset->rr_type, 0), rrset->sections);
+
 	return (_getdns_rrtype_iter *) rr_iter_name_class_type(
 	    _getdns_rr_iter_init(&i->rr_i, rrset->pkt, rrset->pkt_len ),
 	    i->rrset->name, i->rrset->rr_class, i->rrset->rr_type,
@@ -395,6 +592,11 @@ _getdns_rrtype_iter_init(_getdns_rrtype_iter *i, _getdns_rrset *rrset)
 _getdns_rrsig_iter *
 _getdns_rrsig_iter_next(_getdns_rrsig_iter *i)
 {
+	if (i->rrset->index)
+		return (_getdns_rrsig_iter *) rr_index_iter(&i->rr_i,
+		    i->rrset->index, rr_index_next(&i->rr_i, i->rrset->index),
+		    i->rrset->sections);
+
 	return (_getdns_rrsig_iter *) rr_iter_rrsig_covering(
 	    _getdns_rr_iter_next(&i->rr_i),
 	    i->rrset->name, i->rrset->rr_class, i->rrset->rr_type,
@@ -405,15 +607,51 @@ _getdns_rrsig_iter *
 _getdns_rrsig_iter_init(_getdns_rrsig_iter *i, _getdns_rrset *rrset)
 {
 	i->rrset = rrset;
+	if (rrset->index)
+		return (_getdns_rrsig_iter *) rr_index_iter(&i->rr_i,
+		    rrset->index, rr_index_lookup(rrset->index, rrset->name,
+		    rrset->rr_class, rrset->rr_type, 1), rrset->sections);
+
 	return (_getdns_rrsig_iter *) rr_iter_rrsig_covering(
 	    _getdns_rr_iter_init(&i->rr_i, rrset->pkt, rrset->pkt_len),
 	    i->rrset->name, i->rrset->rr_class, i->rrset->rr_type,
 	    i->rrset->sections);
 }
 
+/* Move the rrset iterator to the first RR from n onwards that starts
+ * another RRset than the current one (i.e. with RR number cur).
+ */
+static _getdns_rrset_iter *
+rrset_index_iter(_getdns_rrset_iter *i, size_t n, uint32_t cur)
+{
+	const _getdns_rr_index *index = i->rrset.index;
+	const _getdns_rr_index_rr *rr;
+
+	for (; n < index->n_rrs; n++) {
+		rr = &index->rrs[n];
+		if (!(rr->section & i->rrset.sections)
+		    || rr->type == GETDNS_RRTYPE_RRSIG
+		    || !rr->owner_ok
+		    || (cur != _GETDNS_RR_INDEX_END && rr->set == cur))
+			continue;
+
+		(void) rr_index_iter(&i->rr_i, index, (uint32_t)n, SECTION_ANY);
+		i->rrset.rr_type  = rr->type;
+		i->rrset.rr_class = rr->rr_class;
+		i->name_len = sizeof(i->name_spc);
+		if (!(i->rrset.name = _getdns_owner_if_or_as_decompressed(
+		    &i->rr_i, i->name_spc, &i->name_len)))
+			continue;
+		return i;
+	}
+	i->rr_i.pos = NULL;
+	return NULL;
+}
+
 _getdns_rrset_iter *
 _getdns_rrset_iter_init(_getdns_rrset_iter *i,
-    const uint8_t *pkt, size_t pkt_len, _getdns_section sections)
+    const uint8_t *pkt, size_t pkt_len, _getdns_rr_index *index,
+    _getdns_section sections)
 {
 	_getdns_rr_iter *rr;
 
@@ -421,8 +659,12 @@ _getdns_rrset_iter_init(_getdns_rrset_iter *i,
 	i->rrset.pkt = pkt;
 	i->rrset.pkt_len = pkt_len;
 	i->rrset.sections = sections;
+	i->rrset.index = index;
 	i->name_len = 0;
 
+	if (index)
+		return rrset_index_iter(i, 0, _GETDNS_RR_INDEX_END);
+
 	for ( rr = _getdns_rr_iter_init(&i->rr_i, pkt, pkt_len)
 	    ;(rr = rr_iter_section(rr, sections))
 	    ; rr = _getdns_rr_iter_next(rr)) {
@@ -449,6 +691,10 @@ _getdns_rrset_iter *_getdns_rrset_iter_next(_getdns_rrset_iter *i)
 	if (!(rr = i && i->rr_i.pos ? &i->rr_i : NULL))
 		return NULL;
 
+	if (i->rrset.index)
+		return rrset_index_iter(i, rr->n + 1,
+		    i->rrset.index->rrs[rr->n].set);
+
 	if (!(rr = rr_iter_not_name_class_type(rr,
 	    i->rrset.name, i->rrset.rr_class, i->rrset.rr_type,
 	    i->rrset.sections)))
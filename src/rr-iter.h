@@ -33,6 +33,7 @@
 #define RR_ITER_H_
 
 #include "rr-dict.h"
+#include "dname.h"
 #include "gldns/pkthdr.h"
 
 typedef enum _getdns_section {
@@ -45,8 +46,6 @@ typedef enum _getdns_section {
 	SECTION_NO_ADDITIONAL =  6
 } _getdns_section;
 
-int _getdns_dname_equal(const uint8_t *s1, const uint8_t *s2);
-
 typedef struct _getdns_rr_iter {
 	const uint8_t *pkt;
 	const uint8_t *pkt_end;
@@ -108,13 +107,60 @@ static inline uint16_t rr_iter_type(_getdns_rr_iter *rr)
 static inline uint16_t rr_iter_class(_getdns_rr_iter *rr)
 { return rr->rr_type + 4 <= rr->nxt ? gldns_read_uint16(rr->rr_type + 2) : 0; }
 
+/* The _getdns_rr_index is a per packet index of all the RRs in that packet,
+ * built in a single pass.  RRs with the same owner name, class and type are
+ * chained together (and so are the RRSIGs covering them), so that the
+ * rrtype, rrsig and rrset iterators can jump from one member to the next
+ * instead of rescanning (and decompressing) the whole packet every time.
+ */
+#define _GETDNS_RR_INDEX_END 0xFFFFFFFF
+
+typedef struct _getdns_rr_index_rr {
+	const uint8_t *pos;
+	const uint8_t *rr_type;
+	const uint8_t *nxt;
+
+	uint32_t hash;     /* Of the canonical (lower cased) owner name */
+	uint32_t set;      /* First RR of the RRset (or of its RRSIGs) */
+	uint32_t next;     /* Next RR of the RRset, or _GETDNS_RR_INDEX_END */
+	uint16_t type;
+	uint16_t rr_class;
+	uint16_t covered;  /* Type covered, for RRSIGs */
+	uint8_t  section;
+	uint8_t  owner_ok; /* Owner name could be decompressed */
+} _getdns_rr_index_rr;
+
+typedef struct _getdns_rr_index_slot {
+	uint32_t head;
+	uint32_t tail;
+} _getdns_rr_index_slot;
+
+typedef struct _getdns_rr_index {
+	const uint8_t         *pkt;
+	size_t                 pkt_len;
+	size_t                 n_rrs;
+	size_t                 mask;  /* Number of slots - 1 */
+	_getdns_rr_index_slot *slots; /* Open addressed, on set heads */
+	_getdns_rr_index_rr    rrs[];
+} _getdns_rr_index;
+
+struct mem_funcs;
+
+_getdns_rr_index *_getdns_rr_index_create(
+    struct mem_funcs *mf, const uint8_t *pkt, size_t pkt_len);
+
+void _getdns_rr_index_destroy(struct mem_funcs *mf, _getdns_rr_index *index);
+
 typedef struct _getdns_rrset {
-	const uint8_t  *name;
-	uint16_t        rr_class;
-	uint16_t        rr_type;
-	const uint8_t  *pkt;
-	size_t          pkt_len;
-	_getdns_section sections;
+	const uint8_t    *name;
+	uint16_t          rr_class;
+	uint16_t          rr_type;
+	const uint8_t    *pkt;
+	size_t            pkt_len;
+	_getdns_section   sections;
+
+	/* When not NULL, an index of pkt used to find the RRs and RRSIGs */
+	_getdns_rr_index *index;
 } _getdns_rrset;
 
 typedef struct _getdns_rrset_spc {
@@ -123,8 +169,8 @@ typedef struct _getdns_rrset_spc {
 	size_t        name_len;
 } _getdns_rrset_spc;
 
-_getdns_rrset *_getdns_rrset_answer(
-    _getdns_rrset_spc *rrset2init, const uint8_t *pkt, size_t pkt_len);
+_getdns_rrset *_getdns_rrset_answer(_getdns_rrset_spc *rrset2init,
+    const uint8_t *pkt, size_t pkt_len, _getdns_rr_index *index);
 
 _getdns_rrset *_getdns_initialized_rrset_answer(
     _getdns_rrset_spc *query_rrset);
@@ -172,7 +218,8 @@ typedef struct _getdns_rrset_iter {
 
 
 _getdns_rrset_iter *_getdns_rrset_iter_init(_getdns_rrset_iter *i,
-    const uint8_t *pkt, size_t pkt_len, _getdns_section sections);
+    const uint8_t *pkt, size_t pkt_len, _getdns_rr_index *index,
+    _getdns_section sections);
 _getdns_rrset_iter *_getdns_rrset_iter_next(_getdns_rrset_iter *i);
 
 
@@ -181,7 +228,7 @@ static inline _getdns_rrset *_getdns_rrset_iter_value(_getdns_rrset_iter *i)
 { return i && i->rr_i.pos ? &i->rrset : NULL; }
 
 static inline _getdns_rrset_iter *_getdns_rrset_iter_rewind(_getdns_rrset_iter *i)
-{ return i ? _getdns_rrset_iter_init(i, i->rrset.pkt, i->rrset.pkt_len, i->rrset.sections) : NULL; }
+{ return i ? _getdns_rrset_iter_init(i, i->rrset.pkt, i->rrset.pkt_len, i->rrset.index, i->rrset.sections) : NULL; }
 
 typedef struct _getdns_rdf_iter {
 	const uint8_t           *pkt;
@@ -37,6 +37,12 @@
 #include <openssl/conf.h>
 #include <openssl/x509v3.h>
 #include <fcntl.h>
+#ifndef USE_WINSOCK
+#include <sys/uio.h>
+#endif
+#ifdef USE_TCP_FASTOPEN
+#include <netinet/tcp.h>
+#endif
 #include "stub.h"
 #include "gldns/gbuffer.h"
 #include "gldns/pkthdr.h"
@@ -63,6 +69,7 @@ typedef u_short sa_family_t;
  * STUB_TCP_WOULDBLOCK added to deal with edge triggered event loops (versus
  * level triggered).  See also lines containing WSA TODO below...
  */
+#define STUB_NO_BATCH -9 /* Nothing coalesced, write queue head on its own */
 #define STUB_NO_AUTH -8 /* Existing TLS connection is not authenticated */
 #define STUB_CONN_GONE -7 /* Connection has failed, clear queue*/
 #define STUB_TCP_WOULDBLOCK -6
@@ -75,6 +82,16 @@ typedef u_short sa_family_t;
 #define TIMEOUT_TLS 2500
 /* Arbritray number of message for EDNS keepalive resend*/
 #define EDNS_KEEPALIVE_RESEND 5
+/* Adaptive UDP timeout (in ms) when an upstream has not been measured yet
+   and its bounds */
+#define RTT_INITIAL_TIMEOUT 1000
+#define RTT_MIN_TIMEOUT 250
+#define RTT_MAX_TIMEOUT 2000
+/* Send one in every RTT_EXPLORE UDP queries to a random healthy upstream
+   to keep the round trip time estimates of the others current */
+#define RTT_EXPLORE 20
+/* Lower bound (in ms) of the delay before a UDP query is hedged */
+#define RTT_MIN_HEDGE_DELAY 20
 
 static time_t secret_rollover_time = 0;
 static uint32_t secret = 0;
@@ -83,6 +100,10 @@ static uint32_t prev_secret = 0;
 static void upstream_read_cb(void *userarg);
 static void upstream_write_cb(void *userarg);
 static void upstream_idle_timeout_cb(void *userarg);
+static void upstream_warm_probe_cb(void *userarg);
+static int  upstream_warm_idle(getdns_upstream *upstream);
+static uint64_t upstream_warm_probe_interval(getdns_upstream *upstream);
+static void upstream_warm_close(getdns_upstream *upstream);
 static void upstream_schedule_netreq(getdns_upstream *upstream, 
                                      getdns_network_req *netreq);
 static void upstream_reschedule_events(getdns_upstream *upstream, 
@@ -96,7 +117,13 @@ static int  upstream_connect(getdns_upstream *upstream,
 static int  fallback_on_write(getdns_network_req *netreq);
 
 static void stub_timeout_cb(void *userarg);
+static void stub_udp_write_cb(void *userarg);
+static void stub_udp_hedge_cancel(getdns_network_req *netreq);
 static uint64_t _getdns_get_time_as_uintt64();
+static getdns_upstream *upstream_select(getdns_network_req *netreq);
+static void upstream_rtt_sample(getdns_upstream *upstream,
+                                uint64_t start, uint64_t end);
+static void upstream_rtt_timeout(getdns_upstream *upstream);
 /*****************************/
 /* General utility functions */
 /*****************************/
@@ -150,65 +177,81 @@ calc_new_cookie(getdns_upstream *upstream, uint8_t *cookie)
                 cookie[i % 8] ^= md_value[i];
 }
 
+/* see
+ * https://tools.ietf.org/html/draft-ietf-dnsop-edns-client-subnet-04#section-6 */
+/* all-zeros is a request to not leak the data further: */
+static const uint8_t edns_client_subnet_private_opt[] = {
+	0x00, GLDNS_EDNS_CLIENT_SUBNET,	/* OPTION-CODE */
+	0x00, 0x04,			/* OPTION-LENGTH: 4 */
+	0x00, 0x00,			/* FAMILY: 0 (because no address) */
+	0x00,				/* SOURCE PREFIX-LENGTH: 0 */
+	0x00				/* SCOPE PREFIX-LENGTH: 0 */
+};
+
 static getdns_return_t
 attach_edns_client_subnet_private(getdns_network_req *req)
 {
-	/* see
-	 * https://tools.ietf.org/html/draft-ietf-dnsop-edns-client-subnet-04#section-6 */
-	/* all-zeros is a request to not leak the data further: */
-	/* "\x00\x00"  FAMILY: 0 (because no address) */
-	/* "\x00"  SOURCE PREFIX-LENGTH: 0 */ 
-	/* "\x00";  SCOPE PREFIX-LENGTH: 0 */
-	return _getdns_network_req_add_upstream_option(req,
-						       GLDNS_EDNS_CLIENT_SUBNET,
-						       4, NULL);
+	return _getdns_network_req_add_upstream_options(req,
+	    edns_client_subnet_private_opt,
+	    sizeof(edns_client_subnet_private_opt));
 }
 
+/* Client always sends length 0, omits the timeout */
+static const uint8_t edns_keepalive_opt[] = {
+	0x00, GLDNS_EDNS_KEEPALIVE,	/* OPTION-CODE */
+	0x00, 0x00			/* OPTION-LENGTH: 0 */
+};
+
 static getdns_return_t
 attach_edns_keepalive(getdns_network_req *req)
 {
-    /* Client always sends length 0, omits the timeout */
-	return _getdns_network_req_add_upstream_option(req,
-						       GLDNS_EDNS_KEEPALIVE,
-						       0, NULL);
+	return _getdns_network_req_add_upstream_options(req,
+	    edns_keepalive_opt, sizeof(edns_keepalive_opt));
 }
 
 static getdns_return_t
 attach_edns_cookie(getdns_network_req *req)
 {
 	getdns_upstream *upstream = req->upstream;
-	uint16_t sz;
-	void* val;
-	uint8_t buf[8 + 32]; /* server cookies can be no larger than 32 bytes */
 	rollover_secret();
 
 	if (!upstream->has_client_cookie) {
 		calc_new_cookie(upstream, upstream->client_cookie);
 		upstream->secret = secret;
 		upstream->has_client_cookie = 1;
+		upstream->cookie_opt_len = 0;
+
+		return _getdns_network_req_add_upstream_option(
+		    req, EDNS_COOKIE_OPCODE, 8, upstream->client_cookie);
 
-		sz = 8;
-		val = upstream->client_cookie;
 	} else if (upstream->secret != secret) {
 		memcpy( upstream->prev_client_cookie
 		      , upstream->client_cookie, 8);
 		upstream->has_prev_client_cookie = 1;
 		calc_new_cookie(upstream, upstream->client_cookie);
 		upstream->secret = secret;
+		upstream->cookie_opt_len = 0;
 
-		sz = 8;
-		val = upstream->client_cookie;
-	} else if (!upstream->has_server_cookie) {
-		sz = 8;
-		val = upstream->client_cookie;
-	} else {
-		sz = 8 + upstream->server_cookie_len;
-		memcpy(buf, upstream->client_cookie, 8);
-		memcpy(buf+8, upstream->server_cookie, upstream->server_cookie_len);
-		val = buf;
+		return _getdns_network_req_add_upstream_option(
+		    req, EDNS_COOKIE_OPCODE, 8, upstream->client_cookie);
 	}
-	return _getdns_network_req_add_upstream_option(req, EDNS_COOKIE_OPCODE, sz, val);
-
+	if (!upstream->cookie_opt_len) {
+		/* Client cookie, followed by the server cookie if we have
+		 * one, in a single option.
+		 */
+		upstream->cookie_opt_len = 4 + 8 + (upstream->has_server_cookie
+		    ? upstream->server_cookie_len : 0);
+		gldns_write_uint16(upstream->cookie_opt, EDNS_COOKIE_OPCODE);
+		gldns_write_uint16(upstream->cookie_opt + 2,
+		    upstream->cookie_opt_len - 4);
+		memcpy(upstream->cookie_opt + 4, upstream->client_cookie, 8);
+		if (upstream->has_server_cookie)
+			memcpy(upstream->cookie_opt + 12,
+			    upstream->server_cookie,
+			    upstream->server_cookie_len);
+	}
+	return _getdns_network_req_add_upstream_options(
+	    req, upstream->cookie_opt, upstream->cookie_opt_len);
 }
 
 /* Will find a matching OPT RR, but leaves the caller to validate it
@@ -304,29 +347,36 @@ match_and_process_server_cookie(
 			return 1; /* Previous cookie didn't match either */
 
 		upstream->has_server_cookie = 0;
+		upstream->cookie_opt_len = 0;
 		return 0; /* Don't store server cookie, because it
 		           * is for our previous client cookie
 			   */
 	}
 	position += 8;
 	option_len -= 8;
-	upstream->has_server_cookie = 1;
-	upstream->server_cookie_len = option_len;
-	(void) memcpy(upstream->server_cookie, position, option_len);
+	if (!upstream->has_server_cookie ||
+	    upstream->server_cookie_len != option_len ||
+	    memcmp(upstream->server_cookie, position, option_len) != 0) {
+		upstream->has_server_cookie = 1;
+		upstream->server_cookie_len = option_len;
+		(void) memcpy(upstream->server_cookie, position, option_len);
+		upstream->cookie_opt_len = 0;
+	}
 	return 0;
 }
 
 static void
 process_keepalive(
-    getdns_upstream *upstream, getdns_network_req *netreq, 
+    getdns_upstream *upstream, int keepalive_sent,
     uint8_t *response, size_t response_len) 
 {
+	getdns_context *context = upstream->upstreams->context;
 	const uint8_t *position = NULL;
 	uint16_t option_len = 0;
 	int found = match_edns_opt_rr(GLDNS_EDNS_KEEPALIVE, response, 
 	                              response_len, &position, &option_len);
 	if (found != 2 || option_len != 2) {
-		if (netreq->keepalive_sent == 1) {
+		if (keepalive_sent == 1) {
 			/* For TCP if no keepalive sent back, then we must use 0 idle timeout
 			   as server does not support it. TLS allows idle connections without
 			   keepalive, according to RFC7858. */
@@ -335,7 +385,7 @@ process_keepalive(
 				upstream->keepalive_timeout = 0;
 			else
 #endif
-				upstream->keepalive_timeout = netreq->owner->context->idle_timeout;
+				upstream->keepalive_timeout = context->idle_timeout;
 		}
 		return;
 	}
@@ -345,8 +395,9 @@ process_keepalive(
 	DEBUG_STUB("%s %-35s: FD:  %d Server Keepalive recieved: %d ms\n",
            STUB_DEBUG_READ, __FUNC__, upstream->fd, 
            (int)server_keepalive);
-	if (netreq->owner->context->idle_timeout < server_keepalive)
-		upstream->keepalive_timeout = netreq->owner->context->idle_timeout;
+	upstream->server_keepalive = server_keepalive;
+	if (context->idle_timeout < server_keepalive)
+		upstream->keepalive_timeout = context->idle_timeout;
 	else {
 		if (server_keepalive == 0) {
 			/* This means the server wants us to shut the connection (sending no
@@ -380,10 +431,59 @@ getdns_sock_nonblock(int sockfd)
 #endif
 }
 
+#ifdef USE_TCP_FASTOPEN
+/* TCP Fast Open is decided on, and its outcome recorded with, the upstream
+ * in the upstreams array, because the cookie is shared by all connections
+ * to the address.
+ */
+static getdns_upstream *
+tfo_upstream(getdns_upstream *upstream)
+{
+	return upstream->conn_primary ? upstream->conn_primary : upstream;
+}
+#endif
+
+/* Record whether the data sent with the SYN of this connection was
+ * acknowledged.  Is called once the first response has been received, so
+ * that the handshake is complete.
+ */
+static void
+tfo_record_outcome(getdns_upstream *upstream)
+{
+#if defined(USE_TCP_FASTOPEN) && defined(TCP_INFO)
+	getdns_upstream *primary = tfo_upstream(upstream);
+	struct tcp_info info;
+	socklen_t len = (socklen_t)sizeof(info);
+
+	if (!upstream->tfo_attempted)
+		return;
+	upstream->tfo_attempted = 0;
+	if (getsockopt(upstream->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+		return;
+
+	if (info.tcpi_options & TCPI_OPT_SYN_DATA) {
+		primary->tfo_successes++;
+		primary->tfo_failures_in_row = 0;
+		return;
+	}
+	primary->tfo_failures++;
+	if (++primary->tfo_failures_in_row >= GETDNS_TFO_ATTEMPTS) {
+		DEBUG_STUB("%s %-35s: Disabling TCP Fast Open for %p\n",
+		           STUB_DEBUG_SETUP, __FUNC__, (void*)primary);
+		primary->tfo_disabled = 1;
+	}
+#else
+	upstream->tfo_attempted = 0;
+#endif
+}
+
 static int
 tcp_connect(getdns_upstream *upstream, getdns_transport_list_t transport) 
 {
 	int fd = -1;
+#ifdef USE_TCP_FASTOPEN_CONNECT
+	int on = 1;
+#endif
 	DEBUG_STUB("%s %-35s: Creating TCP connection:      %p\n", STUB_DEBUG_SETUP, 
 	           __FUNC__, (void*)upstream);
 	if ((fd = socket(upstream->addr.ss_family, SOCK_STREAM, IPPROTO_TCP)) == -1)
@@ -395,8 +495,20 @@ tcp_connect(getdns_upstream *upstream, getdns_transport_list_t transport)
 	   then or even the subsequent event depending on the error and platform.*/
 #ifdef USE_TCP_FASTOPEN
 	/* Leave the connect to the later call to sendto() if using TCP*/
-	if (transport == GETDNS_TRANSPORT_TCP)
+	if (transport == GETDNS_TRANSPORT_TCP &&
+	    !tfo_upstream(upstream)->tfo_disabled) {
+		upstream->tfo_attempted = 1;
 		return fd;
+	}
+# ifdef USE_TCP_FASTOPEN_CONNECT
+	/* With TLS the connect is deferred by the kernel, and the ClientHello
+	   written by SSL_do_handshake() is sent along with the SYN. */
+	if (transport == GETDNS_TRANSPORT_TLS &&
+	    !tfo_upstream(upstream)->tfo_disabled &&
+	    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+	    (void *)&on, sizeof(on)) == 0)
+		upstream->tfo_attempted = 1;
+# endif
 #elif USE_OSX_TCP_FASTOPEN
 	(void)transport;
 	sa_endpoints_t endpoints;
@@ -485,18 +597,16 @@ stub_cleanup(getdns_network_req *netreq)
 	getdns_dns_req *dnsreq = netreq->owner;
 	getdns_network_req *r, *prev_r;
 	getdns_upstream *upstream;
-	intptr_t query_id_intptr;
 
 	GETDNS_CLEAR_EVENT(dnsreq->loop, &netreq->event);
+	stub_udp_hedge_cancel(netreq);
 
 	/* Nothing globally scheduled? Then nothing queued */
 	if (!(upstream = netreq->upstream)->event.ev)
 		return;
 
 	/* Delete from upstream->netreq_by_query_id (if present) */
-	query_id_intptr = (intptr_t)netreq->query_id;
-	(void) _getdns_rbtree_delete(
-	    &upstream->netreq_by_query_id, (void *)query_id_intptr);
+	_getdns_qid_table_del(&upstream->netreq_by_query_id, netreq);
 
 	/* Delete from upstream->write_queue (if present) */
 	for (prev_r = NULL, r = upstream->write_queue; r;
@@ -512,6 +622,7 @@ stub_cleanup(getdns_network_req *netreq)
 				upstream->write_queue_last =
 				    prev_r ? prev_r : NULL;
 			netreq->write_queue_tail = NULL;
+			upstream->write_queue_len--;
 			break;
 		}
 	upstream_reschedule_events(upstream, upstream->keepalive_timeout);
@@ -542,13 +653,15 @@ upstream_failed(getdns_upstream *upstream, int during_setup)
 		if (!(upstream->transport == GETDNS_TRANSPORT_TLS &&
 		    upstream->tls_auth_state == GETDNS_AUTH_FAILED))
 			upstream->conn_setup_failed++;
+		/* Not kept warm until queries got answers from it again */
+		(upstream->conn_primary ? upstream->conn_primary
+		                        : upstream)->warm_skip = 1;
 	} else {
 		upstream->conn_shutdowns++;
 		/* [TLS1]TODO: Re-try these queries if possible.*/
 		getdns_network_req *netreq;
-		while (upstream->netreq_by_query_id.count) {
-			netreq = (getdns_network_req *)
-			    _getdns_rbtree_first(&upstream->netreq_by_query_id);
+		while ((netreq = _getdns_qid_table_any(
+		    &upstream->netreq_by_query_id))) {
 			stub_cleanup(netreq);
 			netreq->state = NET_REQ_FINISHED;
 			_getdns_check_dns_req_complete(netreq->owner);
@@ -573,6 +686,46 @@ _getdns_cancel_stub_request(getdns_network_req *netreq)
 	}
 }
 
+/* Schedule (re)sending netreq over UDP to upstream with socket fd */
+static void
+stub_udp_send_to(getdns_network_req *netreq, getdns_upstream *upstream,
+    int fd)
+{
+	getdns_dns_req *dnsreq = netreq->owner;
+	uint64_t        now = _getdns_get_time_as_uintt64();
+
+	netreq->upstream = upstream;
+	netreq->fd = fd;
+	GETDNS_CLEAR_EVENT(dnsreq->loop, &netreq->event);
+	GETDNS_SCHEDULE_EVENT(dnsreq->loop, netreq->fd,
+	    netreq->udp_deadline > now ? (netreq->udp_deadline - now) / 1000 : 1,
+	    getdns_eventloop_event_init(&netreq->event, netreq,
+	    NULL, stub_udp_write_cb, stub_timeout_cb));
+}
+
+/* Resend a timed out UDP query to the (now) best upstream, if there is
+ * still time left before netreq->udp_deadline.  Returns 1 when resent.
+ */
+static int
+stub_udp_retransmit(getdns_network_req *netreq)
+{
+	getdns_dns_req  *dnsreq = netreq->owner;
+	getdns_upstream *upstream;
+	uint64_t         now = _getdns_get_time_as_uintt64();
+	int              fd;
+
+	if (now + RTT_MIN_TIMEOUT * 1000 > netreq->udp_deadline)
+		return 0;
+	if (!(upstream = upstream_select(netreq)) ||
+	    (fd = upstream_connect(upstream, GETDNS_TRANSPORT_UDP, dnsreq)) == -1)
+		return 0;
+
+	DEBUG_STUB("%s %-35s: MSG: %p Retransmitting\n",
+	           STUB_DEBUG_WRITE, __FUNC__, (void*)netreq);
+	stub_udp_send_to(netreq, upstream, fd);
+	return 1;
+}
+
 static void
 stub_timeout_cb(void *userarg)
 {
@@ -580,7 +733,6 @@ stub_timeout_cb(void *userarg)
 	DEBUG_STUB("%s %-35s: MSG:  %p\n",
 	           STUB_DEBUG_CLEANUP, __FUNC__, (void*)netreq);
 	stub_cleanup(netreq);
-	netreq->state = NET_REQ_TIMED_OUT;
 	/* Handle upstream*/
 	if (netreq->fd >= 0) {
 #ifdef USE_WINSOCK
@@ -595,10 +747,14 @@ stub_timeout_cb(void *userarg)
 		             STUB_DEBUG_DAEMON, netreq->upstream->addr_str,
 		             (int)netreq->upstream->udp_responses, (int)netreq->upstream->udp_timeouts);
 #endif
+		upstream_rtt_timeout(netreq->upstream);
 		stub_next_upstream(netreq);
+		if (stub_udp_retransmit(netreq))
+			return;
 	} else {
 		netreq->upstream->responses_timeouts++;
 	}
+	netreq->state = NET_REQ_TIMED_OUT;
 	if (netreq->owner->user_callback) {
 		netreq->debug_end_time = _getdns_get_time_as_uintt64();
 		/* Note this calls cancel_request which calls stub_cleanup again....!*/
@@ -611,6 +767,8 @@ static void
 upstream_idle_timeout_cb(void *userarg)
 {
 	getdns_upstream *upstream = (getdns_upstream *)userarg;
+	getdns_context *context = upstream->upstreams->context;
+
 	DEBUG_STUB("%s %-35s: FD:  %d Closing connection\n",
 	           STUB_DEBUG_CLEANUP, __FUNC__, upstream->fd);
 	GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
@@ -618,6 +776,11 @@ upstream_idle_timeout_cb(void *userarg)
 	upstream->event.read_cb = NULL;
 	upstream->event.write_cb = NULL;
 	_getdns_upstream_shutdown(upstream);
+
+	/* Replace the connection if it was a warm one, or one that failed */
+	if (context->tls_warm_upstreams &&
+	    upstream->upstreams == context->upstreams)
+		_getdns_upstreams_warm(context);
 }
 
 static void
@@ -647,6 +810,9 @@ upstream_setup_timeout_cb(void *userarg)
 		while (upstream->write_queue)
 			upstream_write_cb(upstream);
 	}
+	/* Nothing waiting for this (warm) connection, so close it */
+	if (!upstream->write_queue && !upstream->netreq_by_query_id.count)
+		upstream_reschedule_events(upstream, 0);
 }
 
 
@@ -655,18 +821,17 @@ upstream_setup_timeout_cb(void *userarg)
 /****************************/
 
 static int
-stub_tcp_read(int fd, getdns_tcp_state *tcp, struct mem_funcs *mf)
+stub_tcp_read(int fd, getdns_tcp_state *tcp, _getdns_buf_pool *pool)
 {
 	ssize_t  read;
 	uint8_t *buf;
-	size_t   buf_size;
 
 	if (!tcp->read_buf) {
 		/* First time tcp read, create a buffer for reading */
-		if (!(tcp->read_buf = GETDNS_XMALLOC(*mf, uint8_t, 4096)))
+		if (!(tcp->read_buf = _getdns_buf_pool_alloc(
+		    pool, 2, &tcp->read_buf_len)))
 			return STUB_TCP_ERROR;
 
-		tcp->read_buf_len = 4096;
 		tcp->read_pos = tcp->read_buf;
 		tcp->to_read = 2; /* Packet size */
 	}
@@ -697,18 +862,14 @@ stub_tcp_read(int fd, getdns_tcp_state *tcp, struct mem_funcs *mf)
 		if (tcp->to_read < GLDNS_HEADER_SIZE)
 			return STUB_TCP_ERROR;
 
-		/* Resize our buffer if needed */
+		/* Swap for a buffer in the size class of the packet if needed */
 		if (tcp->to_read > tcp->read_buf_len) {
-			buf_size = tcp->read_buf_len;
-			while (tcp->to_read > buf_size)
-				buf_size *= 2;
-
-			if (!(buf = GETDNS_XREALLOC(*mf,
-			    tcp->read_buf, uint8_t, buf_size)))
+			if (!(buf = _getdns_buf_pool_alloc(
+			    pool, tcp->to_read, &tcp->read_buf_len)))
 				return STUB_TCP_ERROR;
 
+			_getdns_buf_pool_release(pool, tcp->read_buf);
 			tcp->read_buf = buf;
-			tcp->read_buf_len = buf_size;
 		}
 		/* Ready to start reading the packet */
 		tcp->read_pos = tcp->read_buf;
@@ -717,6 +878,79 @@ stub_tcp_read(int fd, getdns_tcp_state *tcp, struct mem_funcs *mf)
 	return GLDNS_ID_WIRE(tcp->read_buf);
 }
 
+/* stub_prepare_query(upstream, netreq, queries_sent, pkt_len)
+ * registers netreq by a fresh query_id with the upstream and attaches the
+ * EDNS0 options and TSIG that are determined at send time.  queries_sent is
+ * the position of the query on the connection (for keepalive requests).
+ * Returns the query_id, STUB_OUT_OF_OPTIONS, or STUB_TCP_ERROR when out of
+ * memory.
+ *
+ * Only the header and the OPT RR of the request itself are prepared in
+ * advance.  The cookie, client subnet and keepalive options are copied in
+ * from preformatted blocks, but are selected per query: which of them are
+ * sent depends on the request, the transport and queries_sent.  Padding
+ * and TSIG are computed per query, because they depend on its length and
+ * content.
+ */
+static int
+stub_prepare_query(getdns_upstream *upstream, getdns_network_req *netreq,
+    size_t queries_sent, size_t *pkt_len)
+{
+	int             query_id;
+	uint16_t        padding_sz;
+	int             tls = upstream->transport == GETDNS_TRANSPORT_TLS;
+
+	/* Find a unique query_id not already written (or in
+	 * the write_queue) for that upstream.  Register this netreq 
+	 * by query_id in the process.
+	 */
+	if ((query_id = _getdns_qid_table_add(&upstream->netreq_by_query_id,
+	    &upstream->upstreams->mf, netreq)) < 0)
+		return STUB_TCP_ERROR;
+
+	GLDNS_ID_SET(netreq->query, query_id);
+	/* TODO: Review if more EDNS0 handling can be centralised.*/
+	if (netreq->opt) {
+		_getdns_network_req_clear_upstream_options(netreq);
+		/* no limits on the max udp payload size with tcp */
+		gldns_write_uint16(netreq->opt + 3, 65535);
+		/* we do not edns_cookie over TLS, since TLS
+		 * provides stronger guarantees than cookies
+		 * already */
+		if (!tls && netreq->owner->edns_cookies)
+			if (attach_edns_cookie(netreq))
+				return STUB_OUT_OF_OPTIONS;
+		if (netreq->owner->edns_client_subnet_private)
+			if (attach_edns_client_subnet_private(netreq))
+				return STUB_OUT_OF_OPTIONS;
+		/* Add the keepalive option to the first query on a TCP
+		   connection and to every nth query on a TLS connection */
+		if ((tls ? queries_sent % EDNS_KEEPALIVE_RESEND == 0
+		         : queries_sent == 0) &&
+		    (netreq->owner->context->idle_timeout != 0 ||
+		     upstream->is_warm)) {
+			DEBUG_STUB("%s %-35s: FD:  %d Requesting keepalive \n",
+			           STUB_DEBUG_WRITE, __FUNC__, upstream->fd);
+			if (attach_edns_keepalive(netreq))
+				return STUB_OUT_OF_OPTIONS;
+			netreq->keepalive_sent = 1;
+		}
+		if (tls && netreq->owner->tls_query_padding_blocksize > 1) {
+			*pkt_len = netreq->response - netreq->query;
+			*pkt_len += 4; /* this accounts for the OPTION-CODE and OPTION-LENGTH of the padding */
+			padding_sz = *pkt_len % netreq->owner->tls_query_padding_blocksize;
+			if (padding_sz)
+				padding_sz = netreq->owner->tls_query_padding_blocksize - padding_sz;
+			if (_getdns_network_req_add_upstream_option(netreq,
+								    EDNS_PADDING_OPCODE,
+								    padding_sz, NULL))
+				return STUB_OUT_OF_OPTIONS;
+		}
+	}
+	*pkt_len = _getdns_network_req_add_tsig(netreq);
+	return query_id;
+}
+
 /* stub_tcp_write(fd, tcp, netreq)
  * will return STUB_TCP_AGAIN when we need to come back again,
  * STUB_TCP_ERROR on error and a query_id on successfull sent.
@@ -728,7 +962,6 @@ stub_tcp_write(int fd, getdns_tcp_state *tcp, getdns_network_req *netreq)
 	size_t          pkt_len;
 	ssize_t         written;
 	uint16_t        query_id;
-	intptr_t        query_id_intptr;
 
 	int q = tcp_connected(netreq->upstream);
 	if (q != 0)
@@ -739,49 +972,30 @@ stub_tcp_write(int fd, getdns_tcp_state *tcp, getdns_network_req *netreq)
 	if (! tcp->write_buf) {
 		/* No, this is an initial write. Try to send
 		 */
-		do {
-			query_id = arc4random();
-			query_id_intptr = (intptr_t)query_id;
-			netreq->node.key = (void *)query_id_intptr;
-
-		} while (!_getdns_rbtree_insert(
-		    &netreq->upstream->netreq_by_query_id, &netreq->node));
-
-		GLDNS_ID_SET(netreq->query, query_id);
-		if (netreq->opt) {
-			_getdns_network_req_clear_upstream_options(netreq);
-			/* no limits on the max udp payload size with tcp */
-			gldns_write_uint16(netreq->opt + 3, 65535);
-
-			if (netreq->owner->edns_cookies)
-				if (attach_edns_cookie(netreq))
-					return STUB_OUT_OF_OPTIONS;
-			if (netreq->owner->edns_client_subnet_private)
-				if (attach_edns_client_subnet_private(netreq))
-					return STUB_OUT_OF_OPTIONS;
-			if (netreq->upstream->queries_sent == 0 && 
-				netreq->owner->context->idle_timeout != 0) {
-				/* Add the keepalive option to the first query on this connection*/
-				DEBUG_STUB("%s %-35s: FD:  %d Requesting keepalive \n",
-				           STUB_DEBUG_WRITE, __FUNC__, fd);
-				if (attach_edns_keepalive(netreq))
-					return STUB_OUT_OF_OPTIONS;
-				netreq->keepalive_sent = 1;
-			}
-		}
-		pkt_len = _getdns_network_req_add_tsig(netreq);
+		if ((q = stub_prepare_query(netreq->upstream, netreq,
+		    netreq->upstream->queries_sent, &pkt_len)) < 0)
+			return q;
+		query_id = (uint16_t) q;
+
 		/* We have an initialized packet buffer.
 		 * Lets see how much of it we can write
 		 */
 		/* We use sendto() here which will do both a connect and send */
 #ifdef USE_TCP_FASTOPEN
-		written = sendto(fd, netreq->query - 2, pkt_len + 2,
-		    MSG_FASTOPEN, (struct sockaddr *)&(netreq->upstream->addr),
-		    netreq->upstream->addr_len);
-		/* If pipelining we will find that the connection is already up so 
-		   just fall back to a 'normal' write. */
-		if (written == -1 && errno == EISCONN) 
+		if (!netreq->upstream->tfo_attempted)
+			/* Connected without TFO, or the outcome is known */
 			written = write(fd, netreq->query - 2, pkt_len + 2);
+		else {
+			written = sendto(fd, netreq->query - 2, pkt_len + 2,
+			    MSG_FASTOPEN,
+			    (struct sockaddr *)&(netreq->upstream->addr),
+			    netreq->upstream->addr_len);
+			/* If pipelining we will find that the connection is
+			   already up so just fall back to a 'normal' write. */
+			if (written == -1 && errno == EISCONN) 
+				written = write(fd, netreq->query - 2,
+				    pkt_len + 2);
+		}
 #else
 		written = sendto(fd, (const char *)(netreq->query - 2),
 		    pkt_len + 2, 0,
@@ -921,10 +1135,9 @@ tls_verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
 }
 
 static SSL*
-tls_create_object(getdns_dns_req *dnsreq, int fd, getdns_upstream *upstream)
+tls_create_object(getdns_context *context, int fd, getdns_upstream *upstream)
 {
 	/* Create SSL instance */
-	getdns_context *context = dnsreq->context;
 	if (context->tls_ctx == NULL)
 		return NULL;
 	SSL* ssl = SSL_new(context->tls_ctx);
@@ -946,6 +1159,12 @@ tls_create_object(getdns_dns_req *dnsreq, int fd, getdns_upstream *upstream)
 	   multiple TLS handshakes before getting a usable connection. */
 
 	upstream->tls_fallback_ok = 0;
+	upstream->tls_ktls_send = 0;
+#ifdef SSL_OP_ENABLE_KTLS
+	/* Have the kernel take over the records after the handshake */
+	if (context->tls_kernel_offload)
+		(void) SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
 	/* If we have a hostname, always use it */
 	if (upstream->tls_auth_name[0] != '\0') {
 		/*Request certificate for the auth_name*/
@@ -959,7 +1178,7 @@ tls_create_object(getdns_dns_req *dnsreq, int fd, getdns_upstream *upstream)
 		X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
 		X509_VERIFY_PARAM_set1_host(param, upstream->tls_auth_name, 0);
 #else
-		if (dnsreq->netreqs[0]->tls_auth_min == GETDNS_AUTHENTICATION_REQUIRED) {
+		if (context->tls_auth_min == GETDNS_AUTHENTICATION_REQUIRED) {
 			DEBUG_STUB("%s %-35s: ERROR: TLS Authentication functionality not available\n",
 		           STUB_DEBUG_SETUP_TLS, __FUNC__);
 			upstream->tls_hs_state = GETDNS_HS_FAILED;
@@ -967,12 +1186,12 @@ tls_create_object(getdns_dns_req *dnsreq, int fd, getdns_upstream *upstream)
 		}
 #endif
 		/* Allow fallback to opportunistic if settings permit it*/
-		if (dnsreq->netreqs[0]->tls_auth_min != GETDNS_AUTHENTICATION_REQUIRED)
+		if (context->tls_auth_min != GETDNS_AUTHENTICATION_REQUIRED)
 			upstream->tls_fallback_ok = 1;
 	} else {
 		/* Lack of host name is OK unless only authenticated
 		 * TLS is specified and we have no pubkey_pinset */
-		if (dnsreq->netreqs[0]->tls_auth_min == GETDNS_AUTHENTICATION_REQUIRED) {
+		if (context->tls_auth_min == GETDNS_AUTHENTICATION_REQUIRED) {
 			if (upstream->tls_pubkey_pinset) {
 				DEBUG_STUB("%s %-35s: Proceeding with only pubkey pinning authentication\n",
 			           STUB_DEBUG_SETUP_TLS, __FUNC__);
@@ -1003,7 +1222,12 @@ tls_create_object(getdns_dns_req *dnsreq, int fd, getdns_upstream *upstream)
 
 	/* Session resumption. There are trade-offs here. Want to do it when
 	   possible only if we have the right type of connection. Note a change
-	   to the upstream auth info creates a new upstream so never re-uses.*/
+	   to the upstream auth info creates a new upstream so never re-uses.
+	   A new upstream (or an additional connection) can resume a session
+	   the context kept for an upstream with the same credentials. */
+	if (upstream->tls_session == NULL)
+		upstream->tls_session = _getdns_context_tls_session_fetch(
+		    context, upstream, &upstream->last_tls_auth_state);
 	if (upstream->tls_session != NULL) {
 		if ((upstream->tls_fallback_ok == 0 &&
 		     upstream->last_tls_auth_state == GETDNS_AUTH_OK) ||
@@ -1055,6 +1279,17 @@ tls_do_handshake(getdns_upstream *upstream)
 	upstream->tls_hs_state = GETDNS_HS_DONE;
 	upstream->conn_state = GETDNS_CONN_OPEN;
 	upstream->conn_completed++;
+#ifdef SSL_OP_ENABLE_KTLS
+	/* Queries can be written to the socket directly when the kernel does
+	   the encryption.  Reading stays with SSL_read(), which decrypts in
+	   the kernel too, but also handles the non application data records
+	   (like session tickets) that may follow the handshake. */
+	upstream->tls_ktls_send =
+	    BIO_get_ktls_send(SSL_get_wbio(upstream->tls_obj)) ? 1 : 0;
+	DEBUG_STUB("%s %-35s: FD:  %d Kernel TLS send %s\n",
+	           STUB_DEBUG_SETUP_TLS, __FUNC__, upstream->fd,
+	           upstream->tls_ktls_send ? "enabled" : "not available");
+#endif
 	/* A re-used session is not verified so need to fix up state in that case */
 	if (SSL_session_reused(upstream->tls_obj))
 		upstream->tls_auth_state = upstream->last_tls_auth_state;
@@ -1062,9 +1297,7 @@ tls_do_handshake(getdns_upstream *upstream)
 		         STUB_DEBUG_SETUP_TLS, __FUNC__, upstream->fd, 
 		         _getdns_auth_str(upstream->tls_auth_state),
 		         SSL_session_reused(upstream->tls_obj) ?"re-used":"new");
-	if (upstream->tls_session != NULL)
-	    SSL_SESSION_free(upstream->tls_session);
-	upstream->tls_session = SSL_get1_session(upstream->tls_obj);
+	/* New sessions are kept by the context's tls_new_session_cb */
 	/* Reset timeout on success*/
 	GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
 	upstream->event.read_cb = NULL;
@@ -1100,11 +1333,10 @@ tls_connected(getdns_upstream* upstream)
 
 static int
 stub_tls_read(getdns_upstream *upstream, getdns_tcp_state *tcp,
-              struct mem_funcs *mf)
+              _getdns_buf_pool *pool)
 {
 	ssize_t  read;
 	uint8_t *buf;
-	size_t   buf_size;
 	SSL* tls_obj = upstream->tls_obj;
 
 	int q = tls_connected(upstream);
@@ -1113,10 +1345,10 @@ stub_tls_read(getdns_upstream *upstream, getdns_tcp_state *tcp,
 
 	if (!tcp->read_buf) {
 		/* First time tls read, create a buffer for reading */
-		if (!(tcp->read_buf = GETDNS_XMALLOC(*mf, uint8_t, 4096)))
+		if (!(tcp->read_buf = _getdns_buf_pool_alloc(
+		    pool, 2, &tcp->read_buf_len)))
 			return STUB_TCP_ERROR;
 
-		tcp->read_buf_len = 4096;
 		tcp->read_pos = tcp->read_buf;
 		tcp->to_read = 2; /* Packet size */
 	}
@@ -1146,18 +1378,14 @@ stub_tls_read(getdns_upstream *upstream, getdns_tcp_state *tcp,
 		if (tcp->to_read < GLDNS_HEADER_SIZE)
 			return STUB_TCP_ERROR;
 
-		/* Resize our buffer if needed */
+		/* Swap for a buffer in the size class of the packet if needed */
 		if (tcp->to_read > tcp->read_buf_len) {
-			buf_size = tcp->read_buf_len;
-			while (tcp->to_read > buf_size)
-				buf_size *= 2;
-		
-			if (!(buf = GETDNS_XREALLOC(*mf,
-			    tcp->read_buf, uint8_t, buf_size)))
+			if (!(buf = _getdns_buf_pool_alloc(
+			    pool, tcp->to_read, &tcp->read_buf_len)))
 				return STUB_TCP_ERROR;
-		
+
+			_getdns_buf_pool_release(pool, tcp->read_buf);
 			tcp->read_buf = buf;
-			tcp->read_buf_len = buf_size;
 		}
 
 		/* Ready to start reading the packet */
@@ -1187,9 +1415,7 @@ stub_tls_write(getdns_upstream *upstream, getdns_tcp_state *tcp,
 	size_t          pkt_len;
 	ssize_t         written;
 	uint16_t        query_id;
-	intptr_t        query_id_intptr;
 	SSL* tls_obj = upstream->tls_obj;
-	uint16_t        padding_sz;
 
 	int q = tls_connected(upstream);
 	if (q != 0)
@@ -1201,59 +1427,19 @@ stub_tls_write(getdns_upstream *upstream, getdns_tcp_state *tcp,
 	if (!upstream_auth_status_ok(upstream, netreq))
 		return STUB_NO_AUTH;
 
+	/* The kernel encrypts, so write like with TCP */
+	if (upstream->tls_ktls_send)
+		return stub_tcp_write(upstream->fd, tcp, netreq);
+
 	/* Do we have remaining data that we could not write before?  */
 	if (! tcp->write_buf) {
 		/* No, this is an initial write. Try to send
 		 */
+		if ((q = stub_prepare_query(upstream, netreq,
+		    upstream->queries_sent, &pkt_len)) < 0)
+			return q;
+		query_id = (uint16_t) q;
 
-		 /* Find a unique query_id not already written (or in
-		 * the write_queue) for that upstream.  Register this netreq 
-		 * by query_id in the process.
-		 */
-		do {
-			query_id = arc4random();
-			query_id_intptr = (intptr_t)query_id;
-			netreq->node.key = (void *)query_id_intptr;
-
-		} while (!_getdns_rbtree_insert(
-		    &netreq->upstream->netreq_by_query_id, &netreq->node));
-
-		GLDNS_ID_SET(netreq->query, query_id);
-		/* TODO: Review if more EDNS0 handling can be centralised.*/
-		if (netreq->opt) {
-			_getdns_network_req_clear_upstream_options(netreq);
-			/* no limits on the max udp payload size with tcp */
-			gldns_write_uint16(netreq->opt + 3, 65535);
-			/* we do not edns_cookie over TLS, since TLS
-			 * provides stronger guarantees than cookies
-			 * already */
-			if (netreq->owner->edns_client_subnet_private)
-				if (attach_edns_client_subnet_private(netreq))
-					return STUB_OUT_OF_OPTIONS;
-			if (netreq->upstream->queries_sent % EDNS_KEEPALIVE_RESEND == 0 && 
-				netreq->owner->context->idle_timeout != 0) {
-				/* Add the keepalive option to every nth query on this 
-				   connection */
-				DEBUG_STUB("%s %-35s: FD:  %d Requesting keepalive \n",  
-			             STUB_DEBUG_SETUP, __FUNC__, upstream->fd);
-				if (attach_edns_keepalive(netreq))
-					return STUB_OUT_OF_OPTIONS;
-				netreq->keepalive_sent = 1;
-			}
-			if (netreq->owner->tls_query_padding_blocksize > 1) {
-				pkt_len = netreq->response - netreq->query;
-				pkt_len += 4; /* this accounts for the OPTION-CODE and OPTION-LENGTH of the padding */
-				padding_sz = pkt_len % netreq->owner->tls_query_padding_blocksize;
-				if (padding_sz)
-					padding_sz = netreq->owner->tls_query_padding_blocksize - padding_sz;
-				if (_getdns_network_req_add_upstream_option(netreq,
-									    EDNS_PADDING_OPCODE,
-									    padding_sz, NULL))
-					return STUB_OUT_OF_OPTIONS;
-			}
-		}
-
-		pkt_len = _getdns_network_req_add_tsig(netreq);
 		/* We have an initialized packet buffer.
 		 * Lets see how much of it we can write */
 		
@@ -1271,6 +1457,189 @@ stub_tls_write(getdns_upstream *upstream, getdns_tcp_state *tcp,
 	return STUB_TCP_ERROR;
 }
 
+/*********************************/
+/* Coalesced (batched) writes    */
+/*********************************/
+
+/* Whether the queries on the write_queue of upstream can be written in one
+ * go.  Only once the connection is fully established and the first query
+ * has gone out (which may carry the TCP Fast Open handshake), and not
+ * while a previous write is still unfinished.
+ */
+static int
+upstream_batch_ready(getdns_upstream *upstream)
+{
+	return upstream->write_queue &&
+	       upstream->write_queue->write_queue_tail &&
+	      !upstream->tcp.write_buf &&
+	      !upstream->tcp.write_batch &&
+	       upstream->conn_state == GETDNS_CONN_OPEN &&
+	       upstream->queries_sent > 0 &&
+	      (upstream->transport != GETDNS_TRANSPORT_TLS ||
+	       upstream->tls_hs_state == GETDNS_HS_DONE);
+}
+
+/* stub_write_batch_flush(upstream)
+ * continues writing the remainder of a coalesced write.  Returns 0 when
+ * done, STUB_TCP_AGAIN or STUB_TCP_WOULDBLOCK when we need to come back
+ * again and STUB_TCP_ERROR on error.
+ */
+static int
+stub_write_batch_flush(getdns_upstream *upstream)
+{
+	getdns_tcp_state *tcp = &upstream->tcp;
+	ssize_t written;
+	int err;
+
+	if (upstream->transport == GETDNS_TRANSPORT_TLS &&
+	    !upstream->tls_ktls_send) {
+		ERR_clear_error();
+		/* On SSL_ERROR_WANT_WRITE the same buffer and length are
+		 * offered again on the next attempt, as OpenSSL requires. */
+		written = SSL_write(upstream->tls_obj,
+		    tcp->write_batch     + tcp->write_batch_written,
+		    tcp->write_batch_len - tcp->write_batch_written);
+		if (written <= 0) {
+			err = SSL_get_error(upstream->tls_obj, (int)written);
+			return err == SSL_ERROR_WANT_WRITE ||
+			       err == SSL_ERROR_WANT_READ
+			     ? STUB_TCP_WOULDBLOCK : STUB_TCP_ERROR;
+		}
+	} else {
+#ifdef USE_WINSOCK
+		written = send(upstream->fd,
+		    tcp->write_batch     + tcp->write_batch_written,
+		    tcp->write_batch_len - tcp->write_batch_written, 0);
+#else
+		written = write(upstream->fd,
+		    tcp->write_batch     + tcp->write_batch_written,
+		    tcp->write_batch_len - tcp->write_batch_written);
+#endif
+		if (written == -1)
+			return _getdns_EWOULDBLOCK
+			     ? STUB_TCP_WOULDBLOCK : STUB_TCP_ERROR;
+	}
+	tcp->write_batch_written += written;
+	if (tcp->write_batch_written < tcp->write_batch_len)
+		/* Still more to send */
+		return STUB_TCP_AGAIN;
+
+	_getdns_buf_pool_release(upstream->upstreams->buf_pool,
+	    tcp->write_batch);
+	tcp->write_batch = NULL;
+	return 0;
+}
+
+/* Unqueue netreq, which must be at the head of the write_queue, after it
+ * has been handed to the connection with query_id.
+ */
+static void
+upstream_dequeue_written(getdns_upstream *upstream,
+    getdns_network_req *netreq, int query_id)
+{
+	/* Need this because auth status is reset on connection close */
+	netreq->debug_tls_auth_status = upstream->tls_auth_state;
+	upstream->queries_sent++;
+	netreq->query_id = (uint16_t) query_id;
+	upstream->write_queue_len--;
+	if (!(upstream->write_queue = netreq->write_queue_tail))
+		upstream->write_queue_last = NULL;
+}
+
+/* stub_write_batch(upstream)
+ * prepares the queries at the head of the write_queue of upstream (up to
+ * GETDNS_WRITE_BATCH_MAX queries and GETDNS_WRITE_BATCH_SZ bytes) and hands
+ * them to the connection with a single writev() (TCP and kernel TLS) or
+ * SSL_write() (TLS, so that they share as few records as possible).  Queries are padded and
+ * signed individually.  Whatever the socket did not accept is kept in
+ * upstream->tcp.write_batch and finished by stub_write_batch_flush().
+ * Returns 0, STUB_TCP_AGAIN or STUB_TCP_WOULDBLOCK once the queries are
+ * unqueued, STUB_TCP_ERROR on error or STUB_NO_BATCH when nothing could be
+ * prepared.
+ */
+static int
+stub_write_batch(getdns_upstream *upstream)
+{
+	getdns_network_req *batch[GETDNS_WRITE_BATCH_MAX], *netreq;
+	size_t   pkt_lens[GETDNS_WRITE_BATCH_MAX];
+	int      query_ids[GETDNS_WRITE_BATCH_MAX];
+	size_t   n, i, total = 0, written = 0, off;
+	getdns_tcp_state *tcp = &upstream->tcp;
+	int      tls = upstream->transport == GETDNS_TRANSPORT_TLS;
+	uint64_t now = _getdns_get_time_as_uintt64();
+#ifndef USE_WINSOCK
+	int      plain = !tls || upstream->tls_ktls_send;
+	struct iovec iov[GETDNS_WRITE_BATCH_MAX];
+	ssize_t  w;
+#endif
+
+	for ( n = 0, netreq = upstream->write_queue
+	    ; netreq && n < GETDNS_WRITE_BATCH_MAX
+	    ; netreq = netreq->write_queue_tail) {
+
+		/* wire_data_sz bounds the prepared query */
+		if (total + netreq->wire_data_sz > GETDNS_WRITE_BATCH_SZ)
+			break;
+		/* Leave it to the single query write to fail this one */
+		if (tls && !upstream_auth_status_ok(upstream, netreq))
+			break;
+		if ((query_ids[n] = stub_prepare_query(upstream, netreq,
+		    upstream->queries_sent + n, &pkt_lens[n])) < 0) {
+			/* Unregister; it will be prepared again on its own */
+			_getdns_qid_table_del(
+			    &upstream->netreq_by_query_id, netreq);
+			break;
+		}
+		netreq->debug_udp = 0;
+		netreq->debug_start_time = now;
+		batch[n++] = netreq;
+		total += pkt_lens[n - 1] + 2;
+	}
+	if (n == 0)
+		return STUB_NO_BATCH;
+
+	DEBUG_STUB("%s %-35s: FD:  %d Writing %d queries (%d bytes)\n",
+	           STUB_DEBUG_WRITE, __FUNC__, upstream->fd, (int)n, (int)total);
+
+	for (i = 0; i < n; i++)
+		upstream_dequeue_written(upstream, batch[i], query_ids[i]);
+
+#ifndef USE_WINSOCK
+	if (plain) {
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = batch[i]->query - 2;
+			iov[i].iov_len  = pkt_lens[i] + 2;
+		}
+		if ((w = writev(upstream->fd, iov, (int)n)) == -1) {
+			if (!_getdns_EWOULDBLOCK)
+				return STUB_TCP_ERROR;
+		} else
+			written = (size_t)w;
+		if (written == total)
+			return 0;
+	}
+#endif
+	/* Stage what is left (everything with user space TLS) in a single
+	 * buffer */
+	if (!(tcp->write_batch = _getdns_buf_pool_alloc(
+	    upstream->upstreams->buf_pool, total - written, NULL)))
+		return STUB_TCP_ERROR;
+	tcp->write_batch_len = total - written;
+	tcp->write_batch_written = 0;
+	for (i = 0, off = 0; i < n; off += pkt_lens[i++] + 2) {
+		if (off + pkt_lens[i] + 2 <= written)
+			continue;
+		if (off >= written)
+			(void) memcpy(tcp->write_batch + off - written,
+			    batch[i]->query - 2, pkt_lens[i] + 2);
+		else
+			(void) memcpy(tcp->write_batch,
+			    batch[i]->query - 2 + (written - off),
+			    pkt_lens[i] + 2 - (written - off));
+	}
+	return written ? STUB_TCP_AGAIN : stub_write_batch_flush(upstream);
+}
+
 static uint64_t
 _getdns_get_time_as_uintt64() {
 
@@ -1289,19 +1658,23 @@ _getdns_get_time_as_uintt64() {
 /* UDP callback functions */
 /**************************/
 
-static void
-stub_udp_read_cb(void *userarg)
+/* Receive an answer for netreq on fd, for the query with query_id that was
+ * sent to upstream.  Returns the answer in a buffer from the context's
+ * buf_pool (with its length in *read), or NULL when nothing acceptable
+ * could be read.
+ */
+static uint8_t *
+stub_udp_recv(getdns_network_req *netreq, int fd,
+    getdns_upstream *upstream, uint16_t query_id, ssize_t *read)
 {
-	getdns_network_req *netreq = (getdns_network_req *)userarg;
-	getdns_dns_req *dnsreq = netreq->owner;
-	getdns_upstream *upstream = netreq->upstream;
-	ssize_t       read;
-	DEBUG_STUB("%s %-35s: MSG: %p \n", STUB_DEBUG_READ, 
-	             __FUNC__, (void*)netreq);
+	_getdns_buf_pool *pool = &netreq->owner->context->buf_pool;
+	uint8_t      *buf;
 
-	GETDNS_CLEAR_EVENT(dnsreq->loop, &netreq->event);
+	if (!(buf = _getdns_buf_pool_alloc(
+	    pool, netreq->max_udp_payload_size + 1, NULL)))
+		return NULL;
 
-	read = recvfrom(netreq->fd, (void *)netreq->response,
+	*read = recvfrom(fd, (void *)buf,
 	    netreq->max_udp_payload_size + 1, /* If read == max_udp_payload_size
 	                                       * then all is good.  If read ==
 	                                       * max_udp_payload_size + 1, then
@@ -1309,26 +1682,58 @@ stub_udp_read_cb(void *userarg)
 	                                       * i.e. overflow
 	                                       */
 	    0, NULL, NULL);
-	if (read == -1 && _getdns_EWOULDBLOCK)
-		return;
+	if (*read == -1 && _getdns_EWOULDBLOCK)
+		goto discard;
 
-	if (read < GLDNS_HEADER_SIZE)
-		return; /* Not DNS */
+	if (*read < GLDNS_HEADER_SIZE)
+		goto discard; /* Not DNS */
 	
-	if (GLDNS_ID_WIRE(netreq->response) != netreq->query_id)
-		return; /* Cache poisoning attempt ;) */
+	if (GLDNS_ID_WIRE(buf) != query_id)
+		goto discard; /* Cache poisoning attempt ;) */
 
 	if (netreq->owner->edns_cookies && match_and_process_server_cookie(
-	    upstream, netreq->response, read))
-		return; /* Client cookie didn't match? */
+	    upstream, buf, *read))
+		goto discard; /* Client cookie didn't match? */
+
+	return buf;
+discard:
+	_getdns_buf_pool_release(pool, buf);
+	return NULL;
+}
+
+/* Abandon the hedged (duplicate) transmission of netreq, if any */
+static void
+stub_udp_hedge_cancel(getdns_network_req *netreq)
+{
+	if (netreq->hedge_fd == -1)
+		return;
+
+	GETDNS_CLEAR_EVENT(netreq->owner->loop, &netreq->hedge_event);
+#ifdef USE_WINSOCK
+	closesocket(netreq->hedge_fd);
+#else
+	close(netreq->hedge_fd);
+#endif
+	netreq->hedge_fd = -1;
+	netreq->hedge_upstream = NULL;
+}
+
+/* Process the (accepted) UDP answer in buf for netreq */
+static void
+stub_udp_answer(getdns_network_req *netreq, uint8_t *buf, ssize_t read)
+{
+	getdns_dns_req *dnsreq = netreq->owner;
+	getdns_upstream *upstream = netreq->upstream;
+	_getdns_buf_pool *pool = &dnsreq->context->buf_pool;
 
+	stub_udp_hedge_cancel(netreq);
 #ifdef USE_WINSOCK
 	closesocket(netreq->fd);
 #else
 	close(netreq->fd);
 	netreq->fd = -1;
 #endif
-	while (GLDNS_TC_WIRE(netreq->response)) {
+	while (GLDNS_TC_WIRE(buf)) {
 		DEBUG_STUB("%s %-35s: MSG: %p TC bit set in response \n", STUB_DEBUG_READ, 
 		             __FUNC__, (void*)netreq);
 		if (!(netreq->transport_current < netreq->transport_count))
@@ -1348,11 +1753,15 @@ stub_udp_read_cb(void *userarg)
 		    getdns_eventloop_event_init(&netreq->event,
 		    netreq, NULL, NULL, stub_timeout_cb));
 
-		return;
+		goto discard;
 	}
+	/* Move the answer to a buffer of the size class that fits */
+	netreq->response = _getdns_buf_pool_fit(pool, buf, read);
 	netreq->response_len = read;
 	dnsreq->upstreams->current_udp = 0;
 	netreq->debug_end_time = _getdns_get_time_as_uintt64();
+	upstream_rtt_sample(upstream,
+	    netreq->debug_start_time, netreq->debug_end_time);
 	netreq->state = NET_REQ_FINISHED;
 	upstream->udp_responses++;
 #if defined(DAEMON_DEBUG) && DAEMON_DEBUG
@@ -1363,6 +1772,172 @@ stub_udp_read_cb(void *userarg)
 		             (int)upstream->udp_responses, (int)upstream->udp_timeouts);
 #endif
 	_getdns_check_dns_req_complete(dnsreq);
+	return;
+discard:
+	_getdns_buf_pool_release(pool, buf);
+}
+
+static void
+stub_udp_read_cb(void *userarg)
+{
+	getdns_network_req *netreq = (getdns_network_req *)userarg;
+	uint8_t      *buf;
+	ssize_t       read;
+	DEBUG_STUB("%s %-35s: MSG: %p \n", STUB_DEBUG_READ, 
+	             __FUNC__, (void*)netreq);
+
+	GETDNS_CLEAR_EVENT(netreq->owner->loop, &netreq->event);
+
+	if ((buf = stub_udp_recv(netreq, netreq->fd, netreq->upstream,
+	    netreq->query_id, &read)))
+		stub_udp_answer(netreq, buf, read);
+}
+
+/* An answer arrived for the hedged transmission of netreq.  If acceptable,
+ * it wins from the primary transmission, which is abandoned.
+ */
+static void
+stub_udp_hedge_read_cb(void *userarg)
+{
+	getdns_network_req *netreq = (getdns_network_req *)userarg;
+	uint8_t         *buf;
+	ssize_t          read;
+	int              fd;
+	getdns_upstream *upstream;
+	uint16_t         query_id;
+	uint64_t         start_time;
+
+	DEBUG_STUB("%s %-35s: MSG: %p \n", STUB_DEBUG_READ, 
+	             __FUNC__, (void*)netreq);
+	if (!(buf = stub_udp_recv(netreq, netreq->hedge_fd,
+	    netreq->hedge_upstream, netreq->hedge_query_id, &read)))
+		return;
+
+	/* Swap the transmissions, so the losing one is cancelled */
+	GETDNS_CLEAR_EVENT(netreq->owner->loop, &netreq->event);
+	fd         = netreq->fd;
+	upstream   = netreq->upstream;
+	query_id   = netreq->query_id;
+	start_time = netreq->debug_start_time;
+	netreq->fd               = netreq->hedge_fd;
+	netreq->upstream         = netreq->hedge_upstream;
+	netreq->query_id         = netreq->hedge_query_id;
+	netreq->debug_start_time = netreq->hedge_start_time;
+	netreq->hedge_fd         = fd;
+	netreq->hedge_upstream   = upstream;
+	netreq->hedge_query_id   = query_id;
+	netreq->hedge_start_time = start_time;
+
+	stub_udp_answer(netreq, buf, read);
+}
+
+/* The hedged transmission of netreq went unanswered */
+static void
+stub_udp_hedge_timeout_cb(void *userarg)
+{
+	getdns_network_req *netreq = (getdns_network_req *)userarg;
+
+	DEBUG_STUB("%s %-35s: MSG: %p \n", STUB_DEBUG_CLEANUP, 
+	             __FUNC__, (void*)netreq);
+	netreq->hedge_upstream->udp_timeouts++;
+	upstream_rtt_timeout(netreq->hedge_upstream);
+	stub_udp_hedge_cancel(netreq);
+}
+
+/* The timeout (in ms) for a single UDP transmission of netreq: the
+ * adaptive retransmission timeout of its upstream, within the time left.
+ */
+static uint64_t
+stub_udp_timeout(getdns_network_req *netreq)
+{
+	getdns_upstream *upstream = netreq->upstream;
+	uint64_t now = _getdns_get_time_as_uintt64();
+	uint64_t timeout, left;
+
+	if (!upstream->rtt_srtt)
+		timeout = RTT_INITIAL_TIMEOUT;
+	else if ((timeout = ((uint64_t)upstream->rtt_srtt
+	    + 4 * (uint64_t)upstream->rtt_var) / 1000) < RTT_MIN_TIMEOUT)
+		timeout = RTT_MIN_TIMEOUT;
+	else if (timeout > RTT_MAX_TIMEOUT)
+		timeout = RTT_MAX_TIMEOUT;
+
+	left = netreq->udp_deadline > now
+	     ? (netreq->udp_deadline - now) / 1000 : 0;
+	/* Don't leave a remainder too short for another attempt */
+	return timeout + RTT_MIN_TIMEOUT > left ? (left ? left : 1) : timeout;
+}
+
+/* The delay (in ms) after which an unanswered UDP transmission of netreq
+ * (with timeout) is hedged, or 0 when it should not be.  Roughly the 95th
+ * percentile of the round trip times of its upstream.
+ */
+static uint64_t
+stub_udp_hedge_delay(getdns_network_req *netreq, uint64_t timeout)
+{
+	getdns_upstream *upstream = netreq->upstream;
+	uint64_t delay;
+
+	if (!netreq->owner->context->udp_hedging || netreq->hedge_fd != -1 ||
+	    netreq->owner->upstreams->count <= GETDNS_UPSTREAM_TRANSPORTS ||
+	    /* The outstanding query must remain verifiable */
+	    upstream->tsig_alg != GETDNS_NO_TSIG)
+		return 0;
+
+	delay = !upstream->rtt_srtt ? RTT_INITIAL_TIMEOUT / 4
+	      : ((uint64_t)upstream->rtt_srtt
+	         + 2 * (uint64_t)upstream->rtt_var) / 1000;
+	if (delay < RTT_MIN_HEDGE_DELAY)
+		delay = RTT_MIN_HEDGE_DELAY;
+	return delay < timeout ? delay : 0;
+}
+
+/* No answer for netreq within the hedge delay.  Keep the outstanding
+ * transmission as the hedge (with the remainder of its timeout) and send
+ * a duplicate to the fastest other upstream.
+ */
+static void
+stub_udp_hedge_cb(void *userarg)
+{
+	getdns_network_req *netreq = (getdns_network_req *)userarg;
+	getdns_dns_req     *dnsreq = netreq->owner;
+	getdns_upstream    *upstream, *u;
+	uint64_t            elapsed, timeout;
+	size_t              i;
+	int                 fd;
+
+	GETDNS_CLEAR_EVENT(dnsreq->loop, &netreq->event);
+	elapsed = (_getdns_get_time_as_uintt64()
+	        - netreq->debug_start_time) / 1000;
+	timeout = stub_udp_timeout(netreq);
+	timeout = timeout > elapsed ? timeout - elapsed : 1;
+
+	for (upstream = NULL, i = 0; i < dnsreq->upstreams->count;
+	     i += GETDNS_UPSTREAM_TRANSPORTS) {
+		u = &dnsreq->upstreams->upstreams[i];
+		if (u != netreq->upstream && u->to_retry > 0 &&
+		    (!upstream || u->rtt_srtt < upstream->rtt_srtt))
+			upstream = u;
+	}
+	if (!upstream || (fd = upstream_connect(
+	    upstream, GETDNS_TRANSPORT_UDP, dnsreq)) == -1) {
+		/* Nothing to hedge with, keep waiting */
+		GETDNS_SCHEDULE_EVENT(dnsreq->loop, netreq->fd, timeout,
+		    getdns_eventloop_event_init(&netreq->event, netreq,
+		    stub_udp_read_cb, NULL, stub_timeout_cb));
+		return;
+	}
+	DEBUG_STUB("%s %-35s: MSG: %p Hedging\n",
+	           STUB_DEBUG_WRITE, __FUNC__, (void*)netreq);
+	netreq->hedge_fd         = netreq->fd;
+	netreq->hedge_upstream   = netreq->upstream;
+	netreq->hedge_query_id   = netreq->query_id;
+	netreq->hedge_start_time = netreq->debug_start_time;
+	GETDNS_SCHEDULE_EVENT(dnsreq->loop, netreq->hedge_fd, timeout,
+	    getdns_eventloop_event_init(&netreq->hedge_event, netreq,
+	    stub_udp_hedge_read_cb, NULL, stub_udp_hedge_timeout_cb));
+
+	stub_udp_send_to(netreq, upstream, fd);
 }
 
 static void
@@ -1371,6 +1946,7 @@ stub_udp_write_cb(void *userarg)
 	getdns_network_req *netreq = (getdns_network_req *)userarg;
 	getdns_dns_req     *dnsreq = netreq->owner;
 	size_t             pkt_len;
+	uint64_t           timeout, delay;
 	DEBUG_STUB("%s %-35s: MSG: %p \n", STUB_DEBUG_WRITE, 
 	             __FUNC__, (void *)netreq);
 
@@ -1380,6 +1956,9 @@ stub_udp_write_cb(void *userarg)
 	netreq->debug_udp = 1;
 	netreq->query_id = arc4random();
 	GLDNS_ID_SET(netreq->query, netreq->query_id);
+	/* As in stub_prepare_query, the upstream options are selected for
+	 * each query and then copied in from preformatted blocks.
+	 */
 	if (netreq->opt) {
 		_getdns_network_req_clear_upstream_options(netreq);
 		if (netreq->edns_maximum_udp_payload_size == -1)
@@ -1406,10 +1985,15 @@ stub_udp_write_cb(void *userarg)
 #endif
 		return;
 	}
-	GETDNS_SCHEDULE_EVENT(
-	    dnsreq->loop, netreq->fd, dnsreq->context->timeout,
-	    getdns_eventloop_event_init(&netreq->event, netreq,
-	    stub_udp_read_cb, NULL, stub_timeout_cb));
+	timeout = stub_udp_timeout(netreq);
+	if ((delay = stub_udp_hedge_delay(netreq, timeout)))
+		GETDNS_SCHEDULE_EVENT(dnsreq->loop, netreq->fd, delay,
+		    getdns_eventloop_event_init(&netreq->event, netreq,
+		    stub_udp_read_cb, NULL, stub_udp_hedge_cb));
+	else
+		GETDNS_SCHEDULE_EVENT(dnsreq->loop, netreq->fd, timeout,
+		    getdns_eventloop_event_init(&netreq->event, netreq,
+		    stub_udp_read_cb, NULL, stub_timeout_cb));
 }
 
 /**************************/
@@ -1443,15 +2027,14 @@ upstream_read_cb(void *userarg)
 	getdns_network_req *netreq;
 	int q;
 	uint16_t query_id;
-	intptr_t query_id_intptr;
 	getdns_dns_req *dnsreq;
 
 	if (upstream->transport == GETDNS_TRANSPORT_TLS)
 		q = stub_tls_read(upstream, &upstream->tcp,
-		                 &upstream->upstreams->mf);
+		                 upstream->upstreams->buf_pool);
 	else
 		q = stub_tcp_read(upstream->fd, &upstream->tcp,
-		                 &upstream->upstreams->mf);
+		                 upstream->upstreams->buf_pool);
 
 	switch (q) {
 	case STUB_TCP_AGAIN:
@@ -1461,16 +2044,33 @@ upstream_read_cb(void *userarg)
 		return;
 	case STUB_SETUP_ERROR:  /* Can happen for TLS HS*/
 	case STUB_TCP_ERROR:
+		if (q == STUB_TCP_ERROR && upstream_warm_idle(upstream)) {
+			/* The upstream closed an idle warm connection */
+			upstream_warm_close(upstream);
+			return;
+		}
 		upstream_failed(upstream, (q == STUB_TCP_ERROR ? 0:1) );
 		return;
 
 	default:
 
-		/* Lookup netreq */
+		tfo_record_outcome(upstream);
 		query_id = (uint16_t) q;
-		query_id_intptr = (intptr_t) query_id;
-		netreq = (getdns_network_req *)_getdns_rbtree_delete(
-		    &upstream->netreq_by_query_id, (void *)query_id_intptr);
+		if (query_id == _GETDNS_QID_RESERVED && upstream->probe_sent) {
+			/* Answer to a probe to keep a warm connection open */
+			upstream->probe_sent = 0;
+			upstream->responses_received++;
+			process_keepalive(upstream, 1, upstream->tcp.read_buf,
+			    upstream->tcp.read_pos - upstream->tcp.read_buf);
+			upstream->tcp.read_pos = upstream->tcp.read_buf;
+			upstream->tcp.to_read = 2;
+			upstream_reschedule_events(
+			    upstream, upstream->keepalive_timeout);
+			return;
+		}
+		/* Lookup netreq */
+		netreq = _getdns_qid_table_remove(
+		    &upstream->netreq_by_query_id, query_id);
 		if (! netreq) /* maybe canceled */ {
 			/* reset read buffer */
 			upstream->tcp.read_pos = upstream->tcp.read_buf;
@@ -1486,6 +2086,8 @@ upstream_read_cb(void *userarg)
 		    upstream->tcp.read_pos - upstream->tcp.read_buf;
 		upstream->tcp.read_buf = NULL;
 		upstream->responses_received++;
+		(upstream->conn_primary ? upstream->conn_primary
+		                        : upstream)->warm_skip = 0;
 		
 		/* !THIS CODE NEEDS TESTING! */
 		if (netreq->owner->edns_cookies &&
@@ -1494,11 +2096,14 @@ upstream_read_cb(void *userarg)
 		    upstream->tcp.read_pos - upstream->tcp.read_buf))
 			return; /* Client cookie didn't match (or FORMERR) */
 
-		if (netreq->owner->context->idle_timeout != 0)
-		     process_keepalive(netreq->upstream, netreq, netreq->response,
-		                       netreq->response_len);
+		if (netreq->owner->context->idle_timeout != 0 ||
+		    upstream->is_warm)
+		     process_keepalive(netreq->upstream, netreq->keepalive_sent,
+		                       netreq->response, netreq->response_len);
 
 		netreq->debug_end_time = _getdns_get_time_as_uintt64();
+		upstream_rtt_sample(upstream,
+		    netreq->debug_start_time, netreq->debug_end_time);
 		/* This also reschedules events for the upstream*/
 		stub_cleanup(netreq);
 
@@ -1552,9 +2157,38 @@ upstream_write_cb(void *userarg)
 	getdns_network_req *netreq = upstream->write_queue;
 	int q;
 
+	if (upstream->tcp.write_batch) {
+		/* Finish a coalesced write before anything else */
+		if (upstream->conn_state == GETDNS_CONN_TEARDOWN)
+			q = STUB_CONN_GONE;
+		else
+			q = stub_write_batch_flush(upstream);
+		if (q == STUB_TCP_AGAIN || q == STUB_TCP_WOULDBLOCK)
+			return;
+		if (q != 0) {
+			_getdns_buf_pool_release(upstream->upstreams->buf_pool,
+			    upstream->tcp.write_batch);
+			upstream->tcp.write_batch = NULL;
+			if (q == STUB_TCP_ERROR)
+				upstream_failed(upstream, 0);
+		}
+		upstream_reschedule_events(upstream, upstream->keepalive_timeout);
+		return;
+	}
 	if (!netreq) {
-		GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
-		upstream->event.write_cb = NULL;
+		/* Nothing to write, but a connection opened ahead of queries
+		 * (see _getdns_upstreams_warm) may still be setting up */
+		if (upstream->conn_state == GETDNS_CONN_SETUP &&
+		    upstream->transport == GETDNS_TRANSPORT_TLS) {
+			q = tls_connected(upstream);
+			if (q == STUB_TCP_AGAIN || q == STUB_TCP_WOULDBLOCK)
+				return;
+			if (q != 0) {
+				upstream_failed(upstream, 1);
+				return;
+			}
+		}
+		upstream_reschedule_events(upstream, upstream->keepalive_timeout);
 		return;
 	}
 
@@ -1567,7 +2201,25 @@ upstream_write_cb(void *userarg)
 		q = STUB_CONN_GONE;
 	else if (!upstream_working_ok(upstream))
 		q = STUB_TCP_ERROR;
-	/* Seems ok, now try to write */
+	/* Seems ok, write all the pipelined queries in one go if we can */
+	else if (upstream_batch_ready(upstream) &&
+	    (q = stub_write_batch(upstream)) != STUB_NO_BATCH) {
+		if (q == STUB_TCP_ERROR) {
+			DEBUG_STUB("%s %-35s: Upstream: %p ERROR = %d\n",
+			    STUB_DEBUG_WRITE, __FUNC__, (void*)userarg, q);
+			if (upstream->tcp.write_batch) {
+				_getdns_buf_pool_release(
+				    upstream->upstreams->buf_pool,
+				    upstream->tcp.write_batch);
+				upstream->tcp.write_batch = NULL;
+			}
+			/* The queries are unqueued, so this fails them */
+			upstream_failed(upstream, 0);
+		}
+		upstream_reschedule_events(upstream, upstream->keepalive_timeout);
+		return;
+	}
+	/* Otherwise write the query at the head of the queue */
 	else if (tls_requested(netreq))
 		q = stub_tls_write(upstream, &upstream->tcp, netreq);
 	else
@@ -1605,13 +2257,9 @@ upstream_write_cb(void *userarg)
 		return;
 
 	default:
-		/* Need this because auth status is reset on connection close */
-		netreq->debug_tls_auth_status = netreq->upstream->tls_auth_state;
-		upstream->queries_sent++;
-		netreq->query_id = (uint16_t) q;
 		/* Unqueue the netreq from the write_queue */
-		if (!(upstream->write_queue = netreq->write_queue_tail)) {
-			upstream->write_queue_last = NULL;
+		upstream_dequeue_written(upstream, netreq, q);
+		if (!upstream->write_queue) {
 			GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
 			upstream->event.write_cb = NULL;
 			/* Reschedule (if already reading) to clear writable */
@@ -1672,6 +2320,55 @@ upstream_stats(getdns_upstream *upstream)
 	        - upstream->conn_shutdowns*GETDNS_TRANSPORT_FAIL_MULT);
 }
 
+/* Update the round trip time estimates of upstream (of the primary one when
+ * it is an additional connection) with a new measurement, as in section 2
+ * of RFC 6298.
+ */
+static void
+upstream_rtt_sample(getdns_upstream *upstream, uint64_t start, uint64_t end)
+{
+	uint32_t rtt, delta;
+
+	if (upstream->conn_primary)
+		upstream = upstream->conn_primary;
+	if (!start || end < start)
+		return;
+	rtt = end - start >= UINT32_MAX / 8 ? UINT32_MAX / 8
+	    : end - start ? (uint32_t)(end - start) : 1;
+
+	if (!upstream->rtt_srtt) {
+		upstream->rtt_srtt = rtt;
+		upstream->rtt_var  = rtt / 2;
+		return;
+	}
+	delta = rtt > upstream->rtt_srtt ? rtt - upstream->rtt_srtt
+	                                 : upstream->rtt_srtt - rtt;
+	upstream->rtt_var  = upstream->rtt_var  - upstream->rtt_var  / 4
+	                   + delta / 4;
+	upstream->rtt_srtt = upstream->rtt_srtt - upstream->rtt_srtt / 8
+	                   + rtt / 8;
+	if (!upstream->rtt_srtt)
+		upstream->rtt_srtt = 1;
+}
+
+/* Back off the round trip time estimates of upstream after a timeout, which
+ * doubles its retransmission timeout.
+ */
+static void
+upstream_rtt_timeout(getdns_upstream *upstream)
+{
+	if (upstream->conn_primary)
+		upstream = upstream->conn_primary;
+	if (!upstream->rtt_srtt) {
+		upstream->rtt_srtt = RTT_INITIAL_TIMEOUT * 1000;
+		upstream->rtt_var  = RTT_INITIAL_TIMEOUT * 1000 / 4;
+	} else if (upstream->rtt_srtt < UINT32_MAX / 16 &&
+	    upstream->rtt_var < UINT32_MAX / 16) {
+		upstream->rtt_srtt *= 2;
+		upstream->rtt_var  *= 2;
+	}
+}
+
 static int
 upstream_valid(getdns_upstream *upstream,
                           getdns_transport_list_t transport,
@@ -1706,10 +2403,52 @@ upstream_valid_and_open(getdns_upstream *upstream,
 	 return 1;
 }
 
+static size_t
+upstream_load(getdns_upstream *upstream)
+{
+	return upstream->netreq_by_query_id.count + upstream->write_queue_len;
+}
+
+/* Of the open connections to upstream, return the one with the fewest
+ * outstanding requests.  When all of them have more than
+ * GETDNS_CONN_QUEUE_THRESHOLD requests outstanding, a closed connection is
+ * returned instead (to be opened by upstream_connect), as long as there
+ * are fewer than max_upstream_connections connections to the upstream.
+ */
+static getdns_upstream *
+upstream_select_conn(getdns_upstream *upstream,
+                     getdns_transport_list_t transport,
+                     getdns_network_req *netreq)
+{
+	getdns_upstream *conn, *best = NULL, *closed = NULL;
+	size_t n_conns = 0;
+
+	for (conn = upstream; conn; conn = conn->conn_next, n_conns++) {
+		if (upstream_valid_and_open(conn, transport, netreq)) {
+			if (!best || upstream_load(conn) < upstream_load(best))
+				best = conn;
+		} else if (!closed && conn->conn_state == GETDNS_CONN_CLOSED)
+			closed = conn;
+	}
+	if (best && upstream_load(best) <= GETDNS_CONN_QUEUE_THRESHOLD)
+		return best;
+	if (upstream->conn_state == GETDNS_CONN_BACKOFF)
+		return best;
+	if (closed)
+		return closed;
+	if (n_conns >= netreq->owner->context->max_upstream_connections ||
+	    !(conn = _getdns_upstream_add_conn(upstream)))
+		return best;
+
+	DEBUG_STUB("%s %-35s: Adding connection %d to upstream: %p\n",
+	           STUB_DEBUG_SETUP, __FUNC__, (int)n_conns + 1, (void*)upstream);
+	return conn;
+}
+
 static getdns_upstream *
 upstream_select_stateful(getdns_network_req *netreq, getdns_transport_list_t transport)
 {
-	getdns_upstream *upstream = NULL;
+	getdns_upstream *upstream = NULL, *conn;
 	getdns_upstreams *upstreams = netreq->owner->upstreams;
 	size_t i;
 	time_t now = time(NULL);
@@ -1719,21 +2458,36 @@ upstream_select_stateful(getdns_network_req *netreq, getdns_transport_list_t tra
 
 	/* A check to re-instate backed-off upstreams after X amount of time*/
 	for (i = 0; i < upstreams->count; i++) {
-		if (upstreams->upstreams[i].conn_state == GETDNS_CONN_BACKOFF &&
-		    upstreams->upstreams[i].conn_retry_time < now) {
-			upstreams->upstreams[i].conn_state = GETDNS_CONN_CLOSED;
+		for ( conn = &upstreams->upstreams[i]
+		    ; conn ; conn = conn->conn_next) {
+			if (conn->conn_state == GETDNS_CONN_BACKOFF &&
+			    conn->conn_retry_time < now) {
+				conn->conn_state = GETDNS_CONN_CLOSED;
 #if defined(DAEMON_DEBUG) && DAEMON_DEBUG
-			DEBUG_DAEMON("%s %s : Re-instating upstream\n",
-		            STUB_DEBUG_DAEMON, upstreams->upstreams[i].addr_str);
+				DEBUG_DAEMON("%s %s : Re-instating upstream\n",
+				    STUB_DEBUG_DAEMON, conn->addr_str);
 #endif
+			}
 		}
 	}
 
-	/* First find if an open upstream has the correct properties and use that*/
+	/* First find if an open upstream has the correct properties and use
+	 * that (or one of the other connections to it).  Prefer the one with
+	 * the lowest smoothed round trip time.
+	 */
 	for (i = 0; i < upstreams->count; i++) {
-		if (upstream_valid_and_open(&upstreams->upstreams[i], transport, netreq)) 
-			return &upstreams->upstreams[i];
+		for ( conn = &upstreams->upstreams[i]
+		    ; conn ; conn = conn->conn_next) {
+			if (upstream_valid_and_open(conn, transport, netreq)) {
+				if (!upstream || upstreams->upstreams[i].rtt_srtt
+				    < upstream->rtt_srtt)
+					upstream = &upstreams->upstreams[i];
+				break;
+			}
+		}
 	}
+	if (upstream)
+		return upstream_select_conn(upstream, transport, netreq);
 
 	/* OK - we will have to open one. Choose the first one that has the best stats
 	   and the right properties, but because we completely back off failed 
@@ -1750,8 +2504,11 @@ upstream_select_stateful(getdns_network_req *netreq, getdns_transport_list_t tra
 	if (!upstream)
 		return NULL;
 	for (i++; i < upstreams->count; i++) {
-		if (upstream_valid(&upstreams->upstreams[i], transport, netreq) &&
-		    upstream_stats(&upstreams->upstreams[i]) > upstream_stats(upstream))
+		if (!upstream_valid(&upstreams->upstreams[i], transport, netreq))
+			continue;
+		if (upstream_stats(&upstreams->upstreams[i]) > upstream_stats(upstream) ||
+		    (upstream_stats(&upstreams->upstreams[i]) == upstream_stats(upstream) &&
+		     upstreams->upstreams[i].rtt_srtt < upstream->rtt_srtt))
 			upstream = &upstreams->upstreams[i];
 	}
 	return upstream;
@@ -1762,27 +2519,55 @@ upstream_select(getdns_network_req *netreq)
 {
 	getdns_upstream *upstream;
 	getdns_upstreams *upstreams = netreq->owner->upstreams;
-	size_t i;
+	size_t i, n_ok;
 
 	if (!upstreams->count)
 		return NULL;
 	/* First UPD/TCP upstream is always at i=0 and then start of each upstream block*/
 	/* TODO: Have direct access to sets of upstreams for different transports*/
 	for (i = 0; i < upstreams->count; i+=GETDNS_UPSTREAM_TRANSPORTS)
-		if (upstreams->upstreams[i].to_retry <= 0)
-			upstreams->upstreams[i].to_retry++;
-
+		if (upstreams->upstreams[i].to_retry <= 0 &&
+		    ++upstreams->upstreams[i].to_retry > 0)
+			/* Back in service, measure it again */
+			upstreams->upstreams[i].rtt_srtt = 0;
+
+	/* Of the upstreams that are not backed off, prefer the one with the
+	 * lowest smoothed round trip time.  Unmeasured upstreams go first,
+	 * starting from current_udp.  Every now and then a random one (that
+	 * did not just time out) is picked instead, to keep the estimates of
+	 * the others current.
+	 */
+	upstream = NULL;
+	n_ok = 0;
 	i = upstreams->current_udp;
 	do {
 		if (upstreams->upstreams[i].to_retry > 0) {
-			upstreams->current_udp = i;
-			return &upstreams->upstreams[i];
+			if (upstreams->upstreams[i].rtt_srtt
+			    < RTT_INITIAL_TIMEOUT * 1000)
+				n_ok++;
+			if (!upstream || upstreams->upstreams[i].rtt_srtt
+			    < upstream->rtt_srtt)
+				upstream = &upstreams->upstreams[i];
 		}
 		i+=GETDNS_UPSTREAM_TRANSPORTS;
-		if (i > upstreams->count)
+		if (i >= upstreams->count)
 			i = 0;
 	} while (i != upstreams->current_udp);
 
+	if (upstream && n_ok > 1 && arc4random_uniform(RTT_EXPLORE) == 0) {
+		n_ok = arc4random_uniform(n_ok);
+		for (i = 0; i < upstreams->count; i+=GETDNS_UPSTREAM_TRANSPORTS)
+			if (upstreams->upstreams[i].to_retry > 0 &&
+			    upstreams->upstreams[i].rtt_srtt
+			    < RTT_INITIAL_TIMEOUT * 1000 && !n_ok--)
+				break;
+		upstream = &upstreams->upstreams[i];
+	}
+	if (upstream) {
+		upstreams->current_udp = upstream - upstreams->upstreams;
+		return upstream;
+	}
+
 	upstream = upstreams->upstreams;
 	for (i = 0; i < upstreams->count; i+=GETDNS_UPSTREAM_TRANSPORTS)
 		if (upstreams->upstreams[i].back_off <
@@ -1791,7 +2576,7 @@ upstream_select(getdns_network_req *netreq)
 
 	upstream->back_off++;
 	upstream->to_retry = 1;
-	upstreams->current_udp = (upstream - upstreams->upstreams) / GETDNS_UPSTREAM_TRANSPORTS;
+	upstreams->current_udp = upstream - upstreams->upstreams;
 	return upstream;
 }
 
@@ -1824,7 +2609,7 @@ upstream_connect(getdns_upstream *upstream, getdns_transport_list_t transport,
 		upstream->is_sync_loop = dnsreq->is_sync_request;
 		upstream->fd = fd;
 		if (transport == GETDNS_TRANSPORT_TLS) {
-			upstream->tls_obj = tls_create_object(dnsreq, fd, upstream);
+			upstream->tls_obj = tls_create_object(dnsreq->context, fd, upstream);
 			if (upstream->tls_obj == NULL) {
 				upstream_failed(upstream, 1);
 #ifdef USE_WINSOCK
@@ -1934,10 +2719,12 @@ upstream_reschedule_events(getdns_upstream *upstream, uint64_t idle_timeout) {
 	DEBUG_STUB("%s %-35s: FD:  %d \n", STUB_DEBUG_SCHEDULE, 
 	             __FUNC__, upstream->fd);
 	GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
-	if (!upstream->write_queue && upstream->event.write_cb) {
+	if (!upstream->write_queue && !upstream->tcp.write_batch &&
+	    upstream->event.write_cb) {
 		upstream->event.write_cb = NULL;
 	}
-	if (upstream->write_queue && !upstream->event.write_cb) {
+	if ((upstream->write_queue || upstream->tcp.write_batch) &&
+	    !upstream->event.write_cb) {
 		upstream->event.write_cb = upstream_write_cb;
 	}
 	if (!upstream->netreq_by_query_id.count && upstream->event.read_cb) {
@@ -1949,7 +2736,18 @@ upstream_reschedule_events(getdns_upstream *upstream, uint64_t idle_timeout) {
 	if (upstream->event.read_cb || upstream->event.write_cb)
 		GETDNS_SCHEDULE_EVENT(upstream->loop,
 		    upstream->fd, TIMEOUT_FOREVER, &upstream->event);
-	else {
+	else if (upstream_warm_idle(upstream)) {
+		/* Keep a warm connection open on the asynchronous loop, to
+		 * notice the upstream closing it and to probe it in time */
+		if (upstream->is_sync_loop) {
+			upstream->loop = upstream->upstreams->context->extension;
+			upstream->is_sync_loop = 0;
+		}
+		upstream->event.read_cb = upstream_read_cb;
+		upstream->event.timeout_cb = upstream_warm_probe_cb;
+		GETDNS_SCHEDULE_EVENT(upstream->loop, upstream->fd,
+		    upstream_warm_probe_interval(upstream), &upstream->event);
+	} else {
 		DEBUG_STUB("%s %-35s: FD:  %d Connection idle - timeout is %d\n", 
 			    STUB_DEBUG_SCHEDULE, __FUNC__, upstream->fd, (int)idle_timeout);
 		upstream->event.timeout_cb = upstream_idle_timeout_cb;
@@ -1969,6 +2767,7 @@ upstream_schedule_netreq(getdns_upstream *upstream, getdns_network_req *netreq)
 	assert(upstream->loop);
 
 	/* Append netreq to write_queue */
+	upstream->write_queue_len++;
 	if (!upstream->write_queue) {
 		upstream->write_queue = upstream->write_queue_last = netreq;
 		GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
@@ -2031,6 +2830,8 @@ _getdns_submit_stub_request(getdns_network_req *netreq)
 	switch(transport) {
 	case GETDNS_TRANSPORT_UDP:
 		netreq->fd = fd;
+		netreq->udp_deadline = _getdns_get_time_as_uintt64()
+		    + dnsreq->context->timeout * 1000;
 		GETDNS_CLEAR_EVENT(dnsreq->loop, &netreq->event);
 		GETDNS_SCHEDULE_EVENT(
 		    dnsreq->loop, netreq->fd, dnsreq->context->timeout,
@@ -2118,4 +2919,294 @@ _getdns_submit_stub_request(getdns_network_req *netreq)
 	}
 }
 
+/*****************************/
+/* Warm TLS connections      */
+/*****************************/
+
+/* Probe interval of a warm connection when the upstream did not signal a
+ * keepalive timeout, and the shortest interval, in ms */
+#define WARM_PROBE_INTERVAL      5000
+#define WARM_PROBE_MIN_INTERVAL  1000
+
+static int
+upstream_warm_idle(getdns_upstream *upstream)
+{
+	return upstream->is_warm && upstream->conn_state == GETDNS_CONN_OPEN &&
+	    !upstream->keepalive_shutdown && !upstream->write_queue &&
+	    !upstream->tcp.write_batch && !upstream->netreq_by_query_id.count;
+}
+
+static uint64_t
+upstream_warm_probe_interval(getdns_upstream *upstream)
+{
+	/* Well within the idle timeout the upstream signalled */
+	if (!upstream->server_keepalive)
+		return WARM_PROBE_INTERVAL;
+	return upstream->server_keepalive / 2 < WARM_PROBE_MIN_INTERVAL
+	     ? WARM_PROBE_MIN_INTERVAL : upstream->server_keepalive / 2;
+}
+
+/* Close an idle warm connection.  upstream_idle_timeout_cb replaces it,
+ * with a connection to the same upstream when that answered on it.  An
+ * upstream that closes connections before answering is not kept warm
+ * until it answered a query again.
+ */
+static void
+upstream_warm_close(getdns_upstream *upstream)
+{
+	DEBUG_STUB("%s %-35s: FD:  %d Closing warm connection\n",
+	           STUB_DEBUG_CLEANUP, __FUNC__, upstream->fd);
+	if (!upstream->responses_received)
+		(upstream->conn_primary ? upstream->conn_primary
+		                        : upstream)->warm_skip = 1;
+	upstream_idle_timeout_cb(upstream);
+}
+
+/* Send a root SOA query with the EDNS0 TCP keepalive option over an idle
+ * warm connection.  It keeps the upstream from closing the connection and
+ * tells us its keepalive timeout.  The answer is recognized by its reserved
+ * query id.  When the previous probe was not answered in time, the
+ * connection is considered broken and replaced.
+ */
+static void
+upstream_warm_probe_cb(void *userarg)
+{
+	static const uint8_t probe[] = {
+	    0, 32,                        /* Length prefix */
+	    0, _GETDNS_QID_RESERVED,      /* ID */
+	    1, 0, 0, 1, 0, 0, 0, 0, 0, 1, /* RD, QD, AN, NS and AR counts */
+	    0, 0, 6, 0, 1,                /* . SOA IN */
+	    0, 0, 41, 0x10, 0, 0, 0, 0, 0, 0, 4, /* OPT, 4096 octets payload */
+	    0, 11, 0, 0                   /* edns-tcp-keepalive */
+	};
+	getdns_upstream *upstream = (getdns_upstream *)userarg;
+
+	GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
+	if (upstream->probe_sent ||
+	    upstream->upstreams != upstream->upstreams->context->upstreams) {
+		upstream_warm_close(upstream);
+		return;
+	}
+	ERR_clear_error();
+	if (SSL_write(upstream->tls_obj, probe, sizeof(probe))
+	    != (int)sizeof(probe)) {
+		upstream_warm_close(upstream);
+		return;
+	}
+	upstream->probe_sent = 1;
+	upstream_reschedule_events(upstream, upstream->keepalive_timeout);
+}
+
+/* Start a TLS connection to upstream ahead of queries.  The handshake is
+ * done by upstream_write_cb (or upstream_read_cb), with the usual setup
+ * timeout.
+ */
+static int
+upstream_warm_open(getdns_context *context, getdns_upstream *upstream)
+{
+	int fd;
+
+	if ((fd = tcp_connect(upstream, GETDNS_TRANSPORT_TLS)) == -1)
+		return -1;
+	if (!(upstream->tls_obj = tls_create_object(context, fd, upstream))) {
+		upstream->tls_hs_state = GETDNS_HS_NONE;
+#ifdef USE_WINSOCK
+		closesocket(fd);
+#else
+		close(fd);
+#endif
+		return -1;
+	}
+	DEBUG_STUB("%s %-35s: FD:  %d Opening warm connection to: %p\n",
+	           STUB_DEBUG_SETUP, __FUNC__, fd, (void*)upstream);
+	upstream->fd = fd;
+	upstream->loop = context->extension;
+	upstream->is_sync_loop = 0;
+	upstream->tls_hs_state = GETDNS_HS_WRITE;
+	upstream->conn_state = GETDNS_CONN_SETUP;
+	upstream->is_warm = 1;
+	GETDNS_SCHEDULE_EVENT(upstream->loop, fd, context->timeout / 2,
+	    getdns_eventloop_event_init(&upstream->event, upstream,
+	    NULL, upstream_write_cb, upstream_setup_timeout_cb));
+	return 0;
+}
+
+/* Whether a is a better upstream to keep warm than b: one that is
+ * connected already, or else the one with the lowest round trip time.
+ */
+static int
+upstream_warm_better(getdns_upstream *a, getdns_upstream *b)
+{
+	uint32_t a_srtt = a->rtt_srtt ? a->rtt_srtt : UINT32_MAX;
+	uint32_t b_srtt = b->rtt_srtt ? b->rtt_srtt : UINT32_MAX;
+
+	if ((a->fd != -1) != (b->fd != -1))
+		return a->fd != -1;
+	return a_srtt < b_srtt;
+}
+
+/* Make sure there are context->tls_warm_upstreams warm TLS connections.
+ * Upstreams that are connected already are made warm first, then new
+ * connections are opened to the upstreams with the lowest round trip
+ * times (or in the configured order before they are known).  Upstreams
+ * that are backed off, or that have warm_skip set, are passed over.
+ * This is done when warm connections are configured, when the upstreams
+ * change and when a connection is closed; not with every query.
+ */
+void
+_getdns_upstreams_warm(getdns_context *context)
+{
+	getdns_upstreams *upstreams = context->upstreams;
+	getdns_upstream *upstream, *best;
+	size_t i, n_warm = 0;
+
+	if (!context->tls_warm_upstreams || !context->tls_warm_loop_used ||
+	    !context->tls_ctx || !upstreams || context->destroying ||
+	    context->resolution_type != GETDNS_RESOLUTION_STUB)
+		return;
+
+	for (i = 0; i < context->dns_transport_count; i++)
+		if (context->dns_transports[i] == GETDNS_TRANSPORT_TLS)
+			break;
+	if (i == context->dns_transport_count)
+		return;
+
+	for (i = 0; i < upstreams->count; i++)
+		if (upstreams->upstreams[i].is_warm)
+			n_warm++;
+
+	while (n_warm < context->tls_warm_upstreams) {
+		best = NULL;
+		for (i = 0; i < upstreams->count; i++) {
+			upstream = &upstreams->upstreams[i];
+			if (upstream->transport != GETDNS_TRANSPORT_TLS ||
+			    upstream->is_warm || upstream->warm_skip ||
+			    !(upstream->conn_state == GETDNS_CONN_CLOSED ||
+			      upstream->conn_state == GETDNS_CONN_SETUP ||
+			      upstream->conn_state == GETDNS_CONN_OPEN) ||
+			    upstream->keepalive_shutdown ||
+			    (context->tls_auth_min ==
+			     GETDNS_AUTHENTICATION_REQUIRED &&
+			     upstream->best_tls_auth_state == GETDNS_AUTH_FAILED))
+				continue;
+			if (!best || upstream_warm_better(upstream, best))
+				best = upstream;
+		}
+		if (!best)
+			break;
+
+		if (best->fd != -1) {
+			best->is_warm = 1;
+			/* Stays open when idle from now on */
+			if (upstream_warm_idle(best))
+				upstream_reschedule_events(
+				    best, best->keepalive_timeout);
+
+		} else if (upstream_warm_open(context, best)) {
+			/* Try the next best, also in the passes to come */
+			best->is_warm = 0;
+			best->conn_setup_failed++;
+			best->warm_skip = 1;
+			continue;
+		}
+		n_warm++;
+	}
+}
+
+/* Carry the state of an upstream over to an equal upstream in a new set of
+ * upstreams (when resolv.conf is reloaded).  The history, cookies and TLS
+ * session are inherited.  An idle open connection is handed over too, so
+ * it can be reused straight away.  A connection with outstanding requests
+ * stays with the old upstream to finish them.
+ */
+void
+_getdns_upstream_inherit(getdns_upstream *to, getdns_upstream *from)
+{
+	to->to_retry = from->to_retry;
+	to->back_off = from->back_off;
+	to->udp_responses = from->udp_responses;
+	to->udp_timeouts = from->udp_timeouts;
+	to->rtt_srtt = from->rtt_srtt;
+	to->rtt_var = from->rtt_var;
+
+	to->conn_completed = from->conn_completed;
+	to->conn_shutdowns = from->conn_shutdowns;
+	to->conn_setup_failed = from->conn_setup_failed;
+	to->conn_retry_time = from->conn_retry_time;
+	to->conn_backoffs = from->conn_backoffs;
+	to->warm_skip = from->warm_skip;
+	to->total_responses = from->total_responses;
+	to->total_timeouts = from->total_timeouts;
+	to->tfo_successes = from->tfo_successes;
+	to->tfo_failures = from->tfo_failures;
+	to->tfo_failures_in_row = from->tfo_failures_in_row;
+	to->tfo_disabled = from->tfo_disabled;
+	to->best_tls_auth_state = from->best_tls_auth_state;
+	to->last_tls_auth_state = from->last_tls_auth_state;
+	if (from->conn_state == GETDNS_CONN_BACKOFF)
+		to->conn_state = GETDNS_CONN_BACKOFF;
+
+	to->secret = from->secret;
+	(void) memcpy(to->client_cookie, from->client_cookie,
+	    sizeof(to->client_cookie));
+	(void) memcpy(to->prev_client_cookie, from->prev_client_cookie,
+	    sizeof(to->prev_client_cookie));
+	(void) memcpy(to->server_cookie, from->server_cookie,
+	    sizeof(to->server_cookie));
+	to->has_client_cookie = from->has_client_cookie;
+	to->has_prev_client_cookie = from->has_prev_client_cookie;
+	to->has_server_cookie = from->has_server_cookie;
+	to->server_cookie_len = from->server_cookie_len;
+	to->cookie_opt_len = 0;
+
+	/* The SSL object of a busy connection holds its own reference */
+	to->tls_session = from->tls_session;
+	from->tls_session = NULL;
+
+	if (from->conn_state != GETDNS_CONN_OPEN || from->fd == -1 ||
+	    !from->loop || from->write_queue ||
+	    from->netreq_by_query_id.count || from->finished_dnsreqs ||
+	    from->probe_sent ||
+	    (from->event.timeout_cb != upstream_idle_timeout_cb &&
+	     from->event.timeout_cb != upstream_warm_probe_cb))
+		return;
+
+	DEBUG_STUB("%s %-35s: FD:  %d Handing over idle connection\n",
+	           STUB_DEBUG_SCHEDULE, __FUNC__, from->fd);
+	GETDNS_CLEAR_EVENT(from->loop, &from->event);
+	from->event.read_cb = NULL;
+	from->event.timeout_cb = NULL;
+
+	to->fd = from->fd;
+	to->loop = from->loop;
+	to->is_sync_loop = from->is_sync_loop;
+	to->tcp = from->tcp;
+	to->conn_state = GETDNS_CONN_OPEN;
+	to->queries_sent = from->queries_sent;
+	to->responses_received = from->responses_received;
+	to->responses_timeouts = from->responses_timeouts;
+	to->keepalive_shutdown = from->keepalive_shutdown;
+	to->keepalive_timeout = from->keepalive_timeout;
+	to->server_keepalive = from->server_keepalive;
+	to->is_warm = from->is_warm;
+	to->tls_obj = from->tls_obj;
+	to->tls_hs_state = from->tls_hs_state;
+	to->tls_auth_state = from->tls_auth_state;
+	to->tls_fallback_ok = from->tls_fallback_ok;
+	to->tls_ktls_send = from->tls_ktls_send;
+
+	from->fd = -1;
+	from->tls_obj = NULL;
+	from->tls_hs_state = GETDNS_HS_NONE;
+	(void) memset(&from->tcp, 0, sizeof(from->tcp));
+	from->conn_state = GETDNS_CONN_CLOSED;
+	from->is_warm = 0;
+
+	/* New sessions and verification now concern the new upstream */
+	if (to->tls_obj)
+		(void) _getdns_associate_upstream_with_SSL(to->tls_obj, to);
+
+	upstream_reschedule_events(to, to->keepalive_timeout);
+}
+
 /* stub.c */
@@ -41,6 +41,11 @@ getdns_return_t _getdns_submit_stub_request(getdns_network_req *netreq);
 
 void _getdns_cancel_stub_request(getdns_network_req *netreq);
 
+void _getdns_upstream_inherit(
+    struct getdns_upstream *to, struct getdns_upstream *from);
+
+void _getdns_upstreams_warm(struct getdns_context *context);
+
 #endif
 
 /* stub.h */
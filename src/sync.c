@@ -91,6 +91,37 @@ getdns_sync_data_init(getdns_context *context, getdns_sync_data *data)
 	return GETDNS_RETURN_GOOD;
 }
 
+/* If a statefull upstream has events scheduled against the sync loop,
+ * reschedule against the async loop.
+ */
+static void
+upstream_sync_cleanup(getdns_sync_data *data, getdns_upstream *upstream)
+{
+	if (upstream->loop != &data->context->sync_eventloop.loop)
+		return;
+	if (upstream->event.read_cb || upstream->event.write_cb) {
+		GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
+
+	} else if (upstream->event.timeout_cb) {
+		/* Timeout's at upstream are idle-timeouts only.
+		 * They should be fired on completion of the
+		 * synchronous request.
+		 */
+		GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
+		(*upstream->event.timeout_cb)(upstream->event.userarg);
+
+		/* This should have cleared the event */
+		assert(!upstream->event.read_cb &&
+		       !upstream->event.write_cb &&
+		       !upstream->event.timeout_cb);
+	}
+	upstream->loop = data->context->extension;
+	upstream->is_sync_loop = 0;
+	if (upstream->event.read_cb || upstream->event.write_cb)
+		GETDNS_SCHEDULE_EVENT(upstream->loop, upstream->fd,
+		    TIMEOUT_FOREVER, &upstream->event);
+}
+
 static void
 getdns_sync_data_cleanup(getdns_sync_data *data)
 {
@@ -107,34 +138,13 @@ getdns_sync_data_cleanup(getdns_sync_data *data)
 		data->context->sync_eventloop.loop.vmt->clear(
 		    &data->context->sync_eventloop.loop, &data->ub_event);
 #endif
-	/* If statefull upstream have events scheduled against the sync loop,
-	 * reschedule against the async loop.
-	 */
+	/* Without upstreams, when answered from the local namespace */
+	if (!ctxt->upstreams)
+		return;
 	for (i = 0; i < ctxt->upstreams->count; i++) {
-		upstream = &ctxt->upstreams->upstreams[i];
-		if (upstream->loop != &data->context->sync_eventloop.loop)
-			continue;
-		if (upstream->event.read_cb || upstream->event.write_cb) {
-			GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
-
-		} else if (upstream->event.timeout_cb) {
-			/* Timeout's at upstream are idle-timeouts only.
-			 * They should be fired on completion of the
-			 * synchronous request.
-			 */
-			GETDNS_CLEAR_EVENT(upstream->loop, &upstream->event);
-			(*upstream->event.timeout_cb)(upstream->event.userarg);
-
-			/* This should have cleared the event */
-			assert(!upstream->event.read_cb &&
-			       !upstream->event.write_cb &&
-			       !upstream->event.timeout_cb);
-		}
-		upstream->loop = data->context->extension;
-		upstream->is_sync_loop = 0;
-		if (upstream->event.read_cb || upstream->event.write_cb)
-			GETDNS_SCHEDULE_EVENT(upstream->loop, upstream->fd,
-			    TIMEOUT_FOREVER, &upstream->event);
+		for ( upstream = &ctxt->upstreams->upstreams[i]
+		    ; upstream ; upstream = upstream->conn_next)
+			upstream_sync_cleanup(data, upstream);
 	}
 }
 
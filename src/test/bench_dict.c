@@ -0,0 +1,289 @@
+/**
+ * \file
+ * \brief Benchmark of the constant lookups in dict conversions
+ *
+ * Times the lookups of getdns constants by code (as done when pretty
+ * printing dicts) and by name (as done when converting JSON-like text to
+ * dicts) with the tables generated in const-info.c, against binary searches
+ * over the same constants, as they were done before.  Both are checked to
+ * give the same result for every code and every name.
+ *
+ * Then getdns_str2dict of a configuration and a response using constants,
+ * and getdns_pretty_print_dict of the response are timed.  The response
+ * is checked to survive a round trip through JSON.
+ *
+ * Usage: bench_dict [ <iterations> ]
+ */
+/*
+ * Copyright (c) 2013, NLnet Labs, Verisign, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "getdns/getdns.h"
+#include "getdns/getdns_extra.h"
+#include "const-info.h"
+
+/* The constants for the binary searches.  The functions are renamed, so
+ * that the ones from the library are timed.
+ */
+#define _getdns_get_const_info      bench_get_const_info
+#define _getdns_get_const_name_info bench_get_const_name_info
+#define getdns_get_errorstr_by_id   bench_get_errorstr_by_id
+#include "const-info.c"
+#undef _getdns_get_const_info
+#undef _getdns_get_const_name_info
+#undef getdns_get_errorstr_by_id
+
+#define N_CONSTS (sizeof(consts_info) / sizeof(*consts_info))
+#define N_NAMES (sizeof(consts_name_info) / sizeof(*consts_name_info))
+
+/* Lookups that must fail; close to existing names to have long strcmps */
+static const char *miss_names[] = {
+	"GETDNS_RETURN_GOOF", "GETDNS_TRANSPORT_TLS_", "GETDNS_RRTYPE_AA",
+	"getdns_return_good", "GETDNS_", "GETDNS_DNSSEC_SECUR",
+	"GETDNS_EXTENSION_FALSE_", "TRANSPORT_UDP", ""
+};
+#define N_MISS_NAMES (sizeof(miss_names) / sizeof(*miss_names))
+
+static const char *config_str =
+"{ resolution_type: GETDNS_RESOLUTION_STUB"
+", dns_transport_list: [ GETDNS_TRANSPORT_TLS, GETDNS_TRANSPORT_TCP ]"
+", tls_authentication: GETDNS_AUTHENTICATION_REQUIRED"
+", tls_query_padding_blocksize: 128"
+", edns_client_subnet_private: 1"
+", idle_timeout: 10000"
+", round_robin_upstreams: 1"
+", dnssec_return_status: GETDNS_EXTENSION_TRUE"
+", return_both_v4_and_v6: GETDNS_EXTENSION_TRUE"
+", add_warning_for_bad_dns: GETDNS_EXTENSION_FALSE"
+", upstream_recursive_servers:"
+"  [ { address_data: 145.100.185.15, tls_auth_name: \"dnsovertls.sinodun.com\" }"
+"  , { address_data: 2001:610:1:40ba:145:100:185:15"
+"    , tls_auth_name: \"dnsovertls.sinodun.com\" } ] }";
+
+static const char *response_str =
+"{ answer_type: GETDNS_NAMETYPE_DNS"
+", canonical_name: www.example.com."
+", status: GETDNS_RESPSTATUS_GOOD"
+", replies_tree:"
+"  [ { answer_type: GETDNS_NAMETYPE_DNS"
+"    , dnssec_status: GETDNS_DNSSEC_SECURE"
+"    , question: { qclass: GETDNS_RRCLASS_IN, qname: www.example.com."
+"                , qtype: GETDNS_RRTYPE_A }"
+"    , answer:"
+"      [ { class: GETDNS_RRCLASS_IN, name: www.example.com."
+"        , rdata: { ipv4_address: 192.0.2.1 }"
+"        , ttl: 300, type: GETDNS_RRTYPE_A }"
+"      , { class: GETDNS_RRCLASS_IN, name: www.example.com."
+"        , rdata: { algorithm: 13, labels: 3, original_ttl: 300"
+"                 , signature_expiration: 1706745600"
+"                 , signature_inception: 1704067200, key_tag: 12345"
+"                 , signers_name: example.com."
+"                 , type_covered: GETDNS_RRTYPE_A }"
+"        , ttl: 300, type: GETDNS_RRTYPE_RRSIG } ]"
+"    , header: { id: 0, qr: 1, opcode: GETDNS_OPCODE_QUERY, rd: 1, ra: 1"
+"              , rcode: GETDNS_RCODE_NOERROR, qdcount: 1, ancount: 2 } } ]"
+", just_address_answers:"
+"  [ { address_data: 192.0.2.1, address_type: \"IPv4\"} ] }";
+
+static double now(void)
+{
+	struct timespec ts;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The lookups as they were before the generated tables */
+
+static int const_info_cmp(const void *a, const void *b)
+{
+	return ((struct const_info *) a)->code - ((struct const_info *) b)->code;
+}
+
+static struct const_info *ref_get_const_info(int value)
+{
+	struct const_info key = { value, "", "" };
+	struct const_info *i = bsearch(&key, consts_info, N_CONSTS,
+	    sizeof(struct const_info), const_info_cmp);
+	if (i)
+		return i;
+	return consts_info;
+}
+
+static int const_name_info_cmp(const void *a, const void *b)
+{
+	return strcmp( ((struct const_name_info *) a)->name
+	             , ((struct const_name_info *) b)->name );
+}
+
+static int ref_get_const_name_info(const char *name, uint32_t *code)
+{
+	struct const_name_info key = { name, 0 };
+	struct const_name_info *i = bsearch(&key, consts_name_info, N_NAMES,
+	    sizeof(struct const_name_info), const_name_info_cmp);
+	if (!i)
+		return 0;
+	if (code)
+		*code = i->code;
+	return 1;
+}
+
+/* Compare by returned text, because the library has its own consts_info */
+static int check_lookups(void)
+{
+	uint32_t ref_code, new_code;
+	size_t i;
+	int c, mismatches = 0;
+
+	for (c = -100; c <= 70000; c++)
+		if (strcmp(ref_get_const_info(c)->text,
+		           _getdns_get_const_info(c)->text))
+			mismatches++;
+	for (i = 0; i < N_NAMES; i++)
+		if (!ref_get_const_name_info(consts_name_info[i].name,
+		                             &ref_code) ||
+		    !_getdns_get_const_name_info(consts_name_info[i].name,
+		                                 &new_code) ||
+		    ref_code != new_code)
+			mismatches++;
+	for (i = 0; i < N_MISS_NAMES; i++)
+		if (ref_get_const_name_info(miss_names[i], NULL) ||
+		    _getdns_get_const_name_info(miss_names[i], NULL))
+			mismatches++;
+	return mismatches;
+}
+
+static double time_str2dict(const char *str, long iterations)
+{
+	getdns_dict *dict;
+	double t0;
+	long it;
+
+	t0 = now();
+	for (it = 0; it < iterations; it++) {
+		if (getdns_str2dict(str, &dict))
+			return -1;
+		getdns_dict_destroy(dict);
+	}
+	return (now() - t0) * 1e9 / iterations;
+}
+
+int main(int argc, char **argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 20000;
+	long it, n;
+	size_t i, sum_ref = 0, sum_new = 0;
+	uint32_t code;
+	double t0, t1, t2, t_config, t_response, t_print;
+	getdns_dict *response, *response2;
+	char *json, *json2;
+	int mismatches, errors = 0;
+
+	mismatches = check_lookups();
+
+	/* The constants in a scattered order, the unknown one left out */
+	printf("%-14s %13s %13s %8s\n", "", "bsearch", "table", "speedup");
+	n = iterations * 10;
+	t0 = now();
+	for (it = 0; it < n; it++)
+		for (i = 1; i < N_CONSTS; i++)
+			sum_ref += (size_t)ref_get_const_info(
+			    consts_info[i * 7 % (N_CONSTS - 1) + 1].code)->name[7];
+	t1 = now();
+	for (it = 0; it < n; it++)
+		for (i = 1; i < N_CONSTS; i++)
+			sum_new += (size_t)_getdns_get_const_info(
+			    consts_info[i * 7 % (N_CONSTS - 1) + 1].code)->name[7];
+	t2 = now();
+	printf("%-14s %10.1f ns %10.1f ns %7.2fx%s\n", "code to const",
+	    (t1 - t0) * 1e9 / ((double)n * (N_CONSTS - 1)),
+	    (t2 - t1) * 1e9 / ((double)n * (N_CONSTS - 1)),
+	    (t1 - t0) / (t2 - t1), sum_ref != sum_new ? "  MISMATCH!" : "");
+
+	n = iterations;
+	sum_ref = sum_new = 0;
+	t0 = now();
+	for (it = 0; it < n; it++)
+		for (i = 0; i < N_NAMES; i++)
+			if (ref_get_const_name_info(
+			    consts_name_info[i * 7 % N_NAMES].name, &code))
+				sum_ref += code;
+	t1 = now();
+	for (it = 0; it < n; it++)
+		for (i = 0; i < N_NAMES; i++)
+			if (_getdns_get_const_name_info(
+			    consts_name_info[i * 7 % N_NAMES].name, &code))
+				sum_new += code;
+	t2 = now();
+	printf("%-14s %10.1f ns %10.1f ns %7.2fx%s\n", "name to code",
+	    (t1 - t0) * 1e9 / ((double)n * N_NAMES),
+	    (t2 - t1) * 1e9 / ((double)n * N_NAMES), (t1 - t0) / (t2 - t1),
+	    sum_ref != sum_new ? "  MISMATCH!" : "");
+	if (mismatches) {
+		printf("%d lookups differ from the binary searches\n",
+		    mismatches);
+		errors++;
+	}
+
+	if (getdns_str2dict(response_str, &response)) {
+		fprintf(stderr, "Could not parse the response\n");
+		return EXIT_FAILURE;
+	}
+	json = getdns_print_json_dict(response, 0);
+	if (getdns_str2dict(json, &response2)) {
+		fprintf(stderr, "Could not parse the response as JSON\n");
+		return EXIT_FAILURE;
+	}
+	json2 = getdns_print_json_dict(response2, 0);
+	if (strcmp(json, json2)) {
+		printf("Response did not survive the round trip\n");
+		errors++;
+	}
+	free(json);
+	free(json2);
+	getdns_dict_destroy(response2);
+
+	t_config = time_str2dict(config_str, iterations);
+	t_response = time_str2dict(response_str, iterations);
+	t0 = now();
+	for (it = 0; it < iterations; it++)
+		free(getdns_pretty_print_dict(response));
+	t_print = (now() - t0) * 1e9 / iterations;
+	getdns_dict_destroy(response);
+	if (t_config < 0 || t_response < 0) {
+		fprintf(stderr, "getdns_str2dict failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("\n%-27s %10.1f ns\n", "getdns_str2dict config", t_config);
+	printf("%-27s %10.1f ns\n", "getdns_str2dict response", t_response);
+	printf("%-27s %10.1f ns\n", "getdns_pretty_print_dict", t_print);
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
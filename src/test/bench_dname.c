@@ -0,0 +1,288 @@
+/**
+ * \file
+ * \brief Microbenchmark of the domain name functions in dname.c
+ *
+ * Times case folding, equality, canonical ordering, parent checks and label
+ * counting against the octet at a time implementations they replaced, over
+ * a set of names resembling what a validating stub sees: short hostnames,
+ * deep names under a few popular zones, NSEC3 hashed owners and a tail of
+ * long names.  The names come in mixed case and most comparisons are
+ * between names that share (part of) their labels.
+ *
+ * Usage: bench_dname [ <iterations> ]
+ */
+/*
+ * Copyright (c) 2013, NLnet Labs, Verisign, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "dname.h"
+
+#define N_NAMES 4096
+
+static uint8_t names[N_NAMES][256];
+static uint8_t buf[256];
+
+/* The octet at a time implementations, as they were before dname.c */
+
+static int ref_equal(const uint8_t *s1, const uint8_t *s2)
+{
+	uint8_t i;
+	for (;;) {
+		if (*s1 != *s2)
+			return 0;
+		else if (!*s1)
+			return 1;
+		for (i = *s1++, s2++; i > 0; i--, s1++, s2++)
+			if (*s1 != *s2 && tolower((unsigned char)*s1)
+			               != tolower((unsigned char)*s2))
+				return 0;
+	}
+}
+
+static void ref_fold(const uint8_t *src, uint8_t *dst)
+{
+	const uint8_t *next_label;
+
+	while (*src) {
+		next_label = src + *src + 1;
+		*dst++ = *src++;
+		while (src < next_label)
+			*dst++ = (uint8_t)tolower((unsigned char)*src++);
+	}
+	*dst = 0;
+}
+
+static int ref_is_parent(const uint8_t *parent, const uint8_t *subdomain)
+{
+	while (*subdomain) {
+		if (ref_equal(parent, subdomain))
+			return 1;
+
+		subdomain += *subdomain + 1;
+	}
+	return *parent == 0;
+}
+
+static const uint8_t **reverse_labels(
+    const uint8_t *dname, const uint8_t **labels)
+{
+	if (*dname)
+		labels = reverse_labels(dname + *dname + 1, labels);
+	*labels = dname;
+	return labels + 1;
+}
+
+static int ref_canonical_cmp(const uint8_t *left, const uint8_t *right)
+{
+	const uint8_t *llabels[128], *rlabels[128], **last_llabel, **last_rlabel,
+		**llabel, **rlabel, *l, *r;
+	uint8_t lsz, rsz;
+
+	last_llabel = reverse_labels(left, llabels);
+	last_rlabel = reverse_labels(right, rlabels);
+
+	for ( llabel = llabels, rlabel = rlabels
+	    ; llabel < last_llabel
+	    ; llabel++, rlabel++ ) {
+
+		if (rlabel == last_rlabel)
+			return 1;
+
+		for ( l = *llabel, lsz = *l++, r = *rlabel, rsz = *r++
+		    ; lsz; l++, r++, lsz--, rsz-- ) {
+			if (!rsz)
+				return 1;
+			if (*l != *r && tolower((unsigned char)*l) !=
+					tolower((unsigned char)*r)) {
+				if (tolower((unsigned char)*l) <
+				    tolower((unsigned char)*r))
+					return -1;
+				return 1;
+			}
+		}
+		if (rsz)
+			return -1;
+	}
+	return rlabel == last_rlabel ? 0 : -1;
+}
+
+static size_t ref_label_count(const uint8_t *name)
+{
+	size_t c;
+	for (c = 0; *name; name += *name + 1, c++)
+		/* pass */
+		;
+	return c;
+}
+
+/* Name generation */
+
+static const char *zones[] = { "com", "net", "org", "nl", "co.uk",
+    "example.com", "getdnsapi.net", "cloudfront.net", "akamaiedge.net" };
+static const char *hosts[] = { "www", "mail", "api", "cdn", "ns1", "_443._tcp",
+    "static-content", "e1234", "a", "login" };
+
+static void str2dname(const char *str, uint8_t *dname)
+{
+	uint8_t *len = dname++;
+
+	for (*len = 0; *str; str++) {
+		if (*str == '.') {
+			len = dname++;
+			*len = 0;
+		} else {
+			*dname++ = (rand() % 4 == 0)
+			    ? (uint8_t)toupper((unsigned char)*str) : *str;
+			(*len)++;
+		}
+	}
+	*dname = 0;
+}
+
+static void make_name(uint8_t *dname)
+{
+	char str[256];
+	int kind = rand() % 100, i, n;
+
+	if (kind < 50)
+		(void) snprintf(str, sizeof(str), "%s.%s",
+		    hosts[rand() % 10], zones[rand() % 9]);
+
+	else if (kind < 80)
+		(void) snprintf(str, sizeof(str), "%s%d.%s.%s",
+		    hosts[rand() % 10], rand() % 100,
+		    hosts[rand() % 10], zones[rand() % 9]);
+
+	else if (kind < 95) {
+		/* NSEC3 owner: 32 base32hex characters */
+		for (i = 0; i < 32; i++)
+			str[i] = "0123456789abcdefghijklmnopqrstuv"[rand() % 32];
+		(void) snprintf(str + 32, sizeof(str) - 32, ".%s",
+		    zones[rand() % 9]);
+	} else {
+		n = snprintf(str, sizeof(str), "%s", zones[rand() % 9]);
+		for (i = 0; i < 8 && n < 180; i++) {
+			(void) memmove(str + 21, str, n + 1);
+			(void) memcpy(str, "some-much-longer-lbl.", 21);
+			n += 21;
+		}
+	}
+	str2dname(str, dname);
+}
+
+/* The same name in a different case: the first letter and about half of
+ * the others have their case swapped.
+ */
+static void make_case_variant(const uint8_t *dname, uint8_t *variant)
+{
+	const uint8_t *next_label;
+	int swapped = 0;
+
+	while (*dname) {
+		next_label = dname + *dname + 1;
+		*variant++ = *dname++;
+		for (; dname < next_label; dname++, variant++)
+			*variant = isalpha(*dname) && (!swapped++ || rand() % 2)
+			         ? *dname ^ 0x20 : *dname;
+	}
+	*variant = 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Partner of name i in comparisons, next to its case variant name i ^ 1:
+ * a random other name, which often shares (part of) the zone.
+ */
+static const uint8_t *partner(size_t i)
+{
+	return names[(i * 2654435761u) % N_NAMES];
+}
+
+#define BENCH(label, ref_expr, new_expr) do { \
+	double t0, t1, t2; long s_ref = 0, s_new = 0; \
+	t0 = now(); \
+	for (it = 0; it < iterations; it++) \
+		for (i = 0; i < N_NAMES; i++) s_ref += (ref_expr); \
+	t1 = now(); \
+	for (it = 0; it < iterations; it++) \
+		for (i = 0; i < N_NAMES; i++) s_new += (new_expr); \
+	t2 = now(); \
+	printf("%-16s %8.1f ns %8.1f ns %6.2fx%s\n", label, \
+	    (t1 - t0) * 1e9 / ((double)iterations * N_NAMES), \
+	    (t2 - t1) * 1e9 / ((double)iterations * N_NAMES), \
+	    (t1 - t0) / (t2 - t1), s_ref == s_new ? "" : "  MISMATCH!"); \
+	if (s_ref != s_new) errors++; \
+	} while (0)
+
+int main(int argc, char **argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 500;
+	long it;
+	size_t i;
+	int errors = 0;
+
+	srand(42);
+	for (i = 0; i < N_NAMES; i += 2) {
+		make_name(names[i]);
+		make_case_variant(names[i], names[i + 1]);
+	}
+	printf("%-16s %11s %11s %7s\n", "", "octet", "dname.c", "speedup");
+
+	BENCH("fold", (ref_fold(names[i], buf), buf[1]),
+	    (_getdns_dname_fold(buf, names[i],
+	     _getdns_dname_len(names[i])), buf[1]));
+
+	BENCH("equal", ref_equal(names[i], names[i ^ 1])
+	             + ref_equal(names[i], partner(i)),
+	    _getdns_dname_equal(names[i], names[i ^ 1])
+	  + _getdns_dname_equal(names[i], partner(i)));
+
+	BENCH("canonical_cmp", ref_canonical_cmp(names[i], partner(i))
+	                     + ref_canonical_cmp(names[i], names[i ^ 1]),
+	    _getdns_dname_canonical_cmp(names[i], partner(i))
+	  + _getdns_dname_canonical_cmp(names[i], names[i ^ 1]));
+
+	BENCH("is_parent", ref_is_parent(partner(i) + *partner(i) + 1, names[i])
+	                 + ref_is_parent(names[i ^ 1] + *names[i] + 1, names[i]),
+	    _getdns_dname_is_parent(partner(i) + *partner(i) + 1, names[i])
+	  + _getdns_dname_is_parent(names[i ^ 1] + *names[i] + 1, names[i]));
+
+	BENCH("label_count", (long)ref_label_count(names[i]),
+	    (long)_getdns_dname_label_count(names[i]));
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
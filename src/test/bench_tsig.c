@@ -0,0 +1,271 @@
+/**
+ * \file
+ * \brief Throughput benchmark of TSIG signing of queries
+ *
+ * Signs a set of queries, resembling the SOA, IXFR and UPDATE style traffic
+ * to TSIG authenticated upstreams, with each of the supported algorithms.
+ * It compares the one shot HMAC over a freshly built set of TSIG variables,
+ * as _getdns_network_req_add_tsig did it before, with
+ * _getdns_network_req_add_tsig itself, on the network requests of a context
+ * with a TSIG upstream.  Both must produce the exact same signed messages.
+ *
+ * Usage: bench_tsig [ <iterations> ]
+ */
+/*
+ * Copyright (c) 2013, NLnet Labs, Verisign, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "context.h"
+#include "gldns/gbuffer.h"
+#include "gldns/pkthdr.h"
+
+#define N_QUERIES 1024
+#define TIME_SIGNED 1500000000
+
+static const uint8_t key[] = "0123456789abcdef0123456789abcdef";
+static const uint8_t key_name[] = "\x08tsig-key\x07" "example";
+
+static const struct tsig_alg {
+	const char      *name;
+	getdns_tsig_algo alg;
+	const EVP_MD  *(*md)(void);
+} algs[] = {
+#ifdef HAVE_EVP_MD5
+	  { "hmac-md5"   , GETDNS_HMAC_MD5   , EVP_md5    },
+#endif
+#ifdef HAVE_EVP_SHA1
+	  { "hmac-sha1"  , GETDNS_HMAC_SHA1  , EVP_sha1   },
+#endif
+#ifdef HAVE_EVP_SHA256
+	  { "hmac-sha256", GETDNS_HMAC_SHA256, EVP_sha256 },
+#endif
+#ifdef HAVE_EVP_SHA512
+	  { "hmac-sha512", GETDNS_HMAC_SHA512, EVP_sha512 },
+#endif
+	  { NULL         , GETDNS_NO_TSIG    , NULL       }
+};
+
+static getdns_dns_req *reqs[N_QUERIES];
+
+static uint8_t ref_buf[N_QUERIES][1024];
+static uint8_t new_buf[N_QUERIES][1024];
+
+/* A stub resolution context with a single upstream, for which all queries
+ * are signed with the TSIG algorithm of info.
+ */
+static getdns_context *create_context(const getdns_tsig_info *info)
+{
+	getdns_context *context;
+	getdns_dict *upstream = getdns_dict_create();
+	getdns_list *upstreams = getdns_list_create();
+	getdns_bindata localhost = { 4, (uint8_t *)"\x7f\x00\x00\x01" };
+	getdns_bindata secret = { sizeof(key) - 1, (uint8_t *)key };
+
+	if (getdns_context_create(&context, 0) ||
+	    getdns_context_set_resolution_type(context, GETDNS_RESOLUTION_STUB)
+	    || getdns_dict_util_set_string(upstream, "address_type", "IPv4")
+	    || getdns_dict_set_bindata(upstream, "address_data", &localhost)
+	    || getdns_dict_util_set_string(upstream, "tsig_name",
+	        "tsig-key.example.")
+	    || getdns_dict_util_set_string(upstream, "tsig_algorithm",
+	        (char *)info->name)
+	    || getdns_dict_set_bindata(upstream, "tsig_secret", &secret)
+	    || getdns_list_set_dict(upstreams, 0, upstream)
+	    || getdns_context_set_upstream_recursive_servers(context, upstreams)
+	    || _getdns_context_prepare_for_resolution(context, 0)) {
+		fprintf(stderr, "Could not create a context for %s\n",
+		    info->name);
+		exit(EXIT_FAILURE);
+	}
+	getdns_list_destroy(upstreams);
+	getdns_dict_destroy(upstream);
+	return context;
+}
+
+/* The network request of the i-th query, made for upstream */
+static getdns_network_req *make_query(getdns_context *context,
+    getdns_upstream *upstream, size_t i)
+{
+	static const char *zones[] = { "example", "example.com",
+	    "internal.example.net", "10.in-addr.arpa" };
+	/* SOA, IXFR, UPDATE (SOA in the zone section) and A */
+	static const uint16_t types[] = { 6, 251, 6, 1 };
+	char str[128];
+	getdns_network_req *netreq;
+
+	if (i % 4 == 3)
+		(void) snprintf(str, sizeof(str), "host%d.%s",
+		    (int)(i % 997), zones[(i / 4) % 4]);
+	else
+		(void) snprintf(str, sizeof(str), "%s", zones[(i / 4) % 4]);
+
+	if (!(reqs[i] = _getdns_dns_req_new(
+	    context, context->extension, str, types[i % 4], NULL))) {
+		fprintf(stderr, "Could not create a request\n");
+		exit(EXIT_FAILURE);
+	}
+	netreq = reqs[i]->netreqs[0];
+	netreq->upstream = upstream;
+	GLDNS_ID_SET(netreq->query, (uint16_t)(i * 2654435761u));
+	if (i % 4 == 2)
+		GLDNS_OPCODE_SET(netreq->query, GLDNS_PACKET_UPDATE);
+	return netreq;
+}
+
+/* As _getdns_network_req_add_tsig was: Write the TSIG variables after the
+ * query, do a one shot HMAC over it all and then write the TSIG RR over
+ * the variables.
+ */
+static size_t ref_sign(const struct tsig_alg *alg,
+    const getdns_tsig_info *info, const uint8_t *query, size_t query_len,
+    uint64_t time_signed, uint8_t *buf)
+{
+	uint8_t md_buf[EVP_MAX_MD_SIZE];
+	unsigned int md_len = EVP_MAX_MD_SIZE;
+	gldns_buffer gbuf;
+
+	(void) memcpy(buf, query, query_len);
+	gldns_buffer_init_frm_data(&gbuf, buf + query_len, 1024 - query_len);
+	gldns_buffer_write(&gbuf, key_name, sizeof(key_name));	/* Name */
+	gldns_buffer_write_u16(&gbuf, 255);			/* Class */
+	gldns_buffer_write_u32(&gbuf, 0);			/* TTL */
+	gldns_buffer_write(&gbuf, info->dname, info->dname_len);
+	gldns_buffer_write_u48(&gbuf, time_signed);	/* Time Signed */
+	gldns_buffer_write_u16(&gbuf, 300);		/* Fudge */
+	gldns_buffer_write_u16(&gbuf, 0);		/* Error */
+	gldns_buffer_write_u16(&gbuf, 0);		/* Other len */
+
+	(void) HMAC(alg->md(), key, sizeof(key) - 1, buf,
+	    gldns_buffer_current(&gbuf) - buf, md_buf, &md_len);
+
+	gldns_buffer_rewind(&gbuf);
+	gldns_buffer_write(&gbuf, key_name, sizeof(key_name));	/* Name */
+	gldns_buffer_write_u16(&gbuf, 250);			/* Type*/
+	gldns_buffer_write_u16(&gbuf, 255);			/* Class */
+	gldns_buffer_write_u32(&gbuf, 0);			/* TTL */
+	gldns_buffer_write_u16(&gbuf,
+	    (uint16_t)(info->dname_len + 10 + md_len + 6));	/* RdLen */
+	gldns_buffer_write(&gbuf, info->dname, info->dname_len);
+	gldns_buffer_write_u48(&gbuf, time_signed);	/* Time Signed */
+	gldns_buffer_write_u16(&gbuf, 300);		/* Fudge */
+	gldns_buffer_write_u16(&gbuf, md_len);		/* MAC Size */
+	gldns_buffer_write(&gbuf, md_buf, md_len);	/* MAC*/
+	gldns_buffer_write(&gbuf, buf, 2);		/* Original ID */
+	gldns_buffer_write_u16(&gbuf, 0);		/* Error */
+	gldns_buffer_write_u16(&gbuf, 0);		/* Other len */
+
+	gldns_write_uint16(buf + 10, gldns_read_uint16(buf + 10) + 1);
+	return gldns_buffer_current(&gbuf) - buf;
+}
+
+/* Sign the query of netreq, as the stub does before every send */
+static size_t new_sign(getdns_network_req *netreq)
+{
+	_getdns_network_req_clear_upstream_options(netreq);
+	return _getdns_network_req_add_tsig(netreq);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 200;
+	long it;
+	size_t i, n = (size_t)iterations * N_QUERIES;
+	size_t query_len[N_QUERIES], ref_len, new_len, mac_len;
+	const struct tsig_alg *alg;
+	const getdns_tsig_info *info;
+	getdns_context *context;
+	getdns_network_req *netreqs[N_QUERIES];
+	uint8_t *time_signed;
+	double t0, t1, t2;
+	int errors = 0, mismatch;
+
+	printf("%-12s %23s %23s %7s\n", "", "one shot", "keyed", "speedup");
+	for (alg = algs; alg->name; alg++) {
+		info = _getdns_get_tsig_info(alg->alg);
+		context = create_context(info);
+		for (i = 0; i < N_QUERIES; i++) {
+			netreqs[i] = make_query(context,
+			    &context->upstreams->upstreams[0], i);
+			query_len[i] = netreqs[i]->response - netreqs[i]->query;
+		}
+		t0 = now();
+		for (it = 0; it < iterations; it++)
+			for (i = 0; i < N_QUERIES; i++)
+				(void) ref_sign(alg, info, netreqs[i]->query,
+				    query_len[i], TIME_SIGNED, ref_buf[i]);
+		t1 = now();
+		for (it = 0; it < iterations; it++)
+			for (i = 0; i < N_QUERIES; i++)
+				(void) new_sign(netreqs[i]);
+		t2 = now();
+
+		/* Compare with the reference, signed at the same time */
+		mac_len = EVP_MD_size(alg->md());
+		for (mismatch = 0, i = 0; i < N_QUERIES; i++) {
+			new_len = new_sign(netreqs[i]);
+			if (new_len < query_len[i] + 16 + mac_len) {
+				mismatch = 1;
+				continue;
+			}
+			(void) memcpy(new_buf[i], netreqs[i]->query, new_len);
+			_getdns_network_req_clear_upstream_options(netreqs[i]);
+
+			time_signed = new_buf[i] + new_len - 16 - mac_len;
+			ref_len = ref_sign(alg, info, netreqs[i]->query,
+			    query_len[i], (uint64_t)gldns_read_uint16(
+			    time_signed) << 32 | gldns_read_uint32(
+			    time_signed + 2), ref_buf[i]);
+			if (ref_len != new_len ||
+			    memcmp(ref_buf[i], new_buf[i], ref_len))
+				mismatch = 1;
+		}
+		errors += mismatch;
+
+		printf("%-12s %8.1f ns %6.0f kq/s %8.1f ns %6.0f kq/s %6.2fx%s\n",
+		    alg->name, (t1 - t0) * 1e9 / n, n / (t1 - t0) / 1e3,
+		    (t2 - t1) * 1e9 / n, n / (t2 - t1) / 1e3,
+		    (t1 - t0) / (t2 - t1), mismatch ? "  MISMATCH!" : "");
+
+		for (i = 0; i < N_QUERIES; i++)
+			_getdns_dns_req_free(reqs[i]);
+		getdns_context_destroy(context);
+	}
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,294 @@
+/**
+ * \file
+ * \brief Throughput benchmark of the presentation format conversions
+ *
+ * Converts a corpus of resource records of the types dominating log exports
+ * (A, AAAA, CNAME, NS, MX, TXT, SOA, RRSIG and DS) from wireformat to
+ * presentation format with gldns_wire2str_rr_buf and back again with
+ * gldns_str2wire_rr_buf, and reports the time per RR and the throughput of
+ * the presentation format text for each type.  Every round trip is checked
+ * to reproduce the original wireformat.
+ *
+ * The hand written formatting of addresses, times and hex is then timed
+ * against the inet_ntop, strftime and printf based code it replaced, and
+ * checked to give the same output.
+ *
+ * Usage: bench_wire2str [ <iterations> ]
+ */
+/*
+ * Copyright (c) 2013, NLnet Labs, Verisign, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "gldns/wire2str.h"
+#include "gldns/str2wire.h"
+#include "gldns/parseutil.h"
+#include "gldns/gbuffer.h"
+
+#define N_RRS 1024
+#define N_FIELDS 1024
+
+/* The records in presentation format.  They are converted to wireformat
+ * once to create the corpus, so they are in their canonical presentation.
+ */
+static const char *corpus[] = {
+	"www.example.com. 300 IN A 192.0.2.1",
+	"cdn-42.edge.example.net. 20 IN A 203.0.113.254",
+	"www.example.com. 300 IN AAAA 2001:db8::1",
+	"ns1.example.net. 86400 IN AAAA 2001:db8:4860:4802:32:0:0:a",
+	"www.example.org. 3600 IN CNAME www.example.org.cdn.cloudflare.net.",
+	"example.com. 172800 IN NS a.iana-servers.net.",
+	"example.com. 3600 IN MX 10 mail.example.com.",
+	"example.com. 3600 IN TXT \"v=spf1 ip4:192.0.2.0/24 include:_spf.example.net ~all\"",
+	"_dmarc.example.com. 3600 IN TXT \"v=DMARC1; p=reject; rua=mailto:dmarc@example.com\"",
+	"example.com. 3600 IN SOA ns.icann.org. noc.dns.icann.org. 2024010101 7200 3600 1209600 3600",
+	"example.com. 3600 IN RRSIG A 13 2 300 20240201000000 20240101000000 12345 example.com. "
+	    "aGVsbG8gd29ybGQgdGhpcyBpcyBhIHNpZ25hdHVyZSBvZiBzaXh0eSBmb3VyIGJ5dGVzIGxvbmcgISEhISEhIQ==",
+	"example.com. 86400 IN DS 31589 8 2 CDE0D742D6998AA554A92D890F8184C698CFAC8A26FA59875A990C03E576343C",
+};
+#define N_CORPUS (sizeof(corpus) / sizeof(*corpus))
+
+static struct rr {
+	uint8_t wire[512];
+	size_t  len;
+	size_t  type;
+} rrs[N_RRS];
+
+static double now(void)
+{
+	struct timespec ts;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The formatters as they were before wire2str.c printed these by hand */
+
+static int ref_a_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
+{
+	char buf[32];
+	int w;
+	if(*dl < 4) return -1;
+	if(!inet_ntop(AF_INET, *d, buf, (socklen_t)sizeof(buf)))
+		return -1;
+	w = gldns_str_print(s, sl, "%s", buf);
+	(*d)+=4;
+	(*dl)-=4;
+	return w;
+}
+
+static int ref_aaaa_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
+{
+	char buf[64];
+	int w;
+	if(*dl < 16) return -1;
+	if(!inet_ntop(AF_INET6, *d, buf, (socklen_t)sizeof(buf)))
+		return -1;
+	w = gldns_str_print(s, sl, "%s", buf);
+	(*d)+=16;
+	(*dl)-=16;
+	return w;
+}
+
+static int ref_time_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
+{
+	struct tm tm;
+	char date_buf[16];
+	uint32_t t;
+	memset(&tm, 0, sizeof(tm));
+	if(*dl < 4) return -1;
+	t = gldns_read_uint32(*d);
+	date_buf[15]=0;
+	if(gldns_serial_arithmitics_gmtime_r(t, time(NULL), &tm) &&
+		strftime(date_buf, 15, "%Y%m%d%H%M%S", &tm)) {
+		(*d) += 4;
+		(*dl) -= 4;
+		return gldns_str_print(s, sl, "%s", date_buf);
+	}
+	return -1;
+}
+
+static int ref_hex_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
+{
+	const char* hex = "0123456789ABCDEF";
+	size_t i;
+	int w = gldns_str_print(s, sl, "%s", "");
+	for(i=0; i<*dl; i++) {
+		(void)gldns_str_print(s, sl, "%c%c", hex[((*d)[i]&0xf0)>>4],
+			hex[(*d)[i]&0x0f]);
+	}
+	w += (int)*dl*2;
+	*d += *dl;
+	*dl = 0;
+	return w;
+}
+
+typedef int (*scan_func)(uint8_t** d, size_t* dl, char** s, size_t* sl);
+
+/* Time formatting N_FIELDS fields of field_len octets with ref and with
+ * new, after checking that both give the same output for each of them.
+ */
+static int bench_field(const char *label, scan_func ref, scan_func new,
+    const uint8_t *fields, size_t field_len, long iterations)
+{
+	char ref_str[256], new_str[256], *s;
+	uint8_t *d;
+	size_t i, dl, sl;
+	long it, s_ref = 0, s_new = 0;
+	int mismatches = 0;
+	double t0, t1, t2;
+
+	for (i = 0; i < N_FIELDS; i++) {
+		d = (uint8_t *)fields + i * field_len; dl = field_len;
+		s = ref_str; sl = sizeof(ref_str);
+		s_ref = ref(&d, &dl, &s, &sl);
+		d = (uint8_t *)fields + i * field_len; dl = field_len;
+		s = new_str; sl = sizeof(new_str);
+		s_new = new(&d, &dl, &s, &sl);
+		if (s_ref != s_new || strcmp(ref_str, new_str))
+			mismatches++;
+	}
+	s_ref = s_new = 0;
+	t0 = now();
+	for (it = 0; it < iterations; it++)
+		for (i = 0; i < N_FIELDS; i++) {
+			d = (uint8_t *)fields + i * field_len; dl = field_len;
+			s = ref_str; sl = sizeof(ref_str);
+			s_ref += ref(&d, &dl, &s, &sl);
+		}
+	t1 = now();
+	for (it = 0; it < iterations; it++)
+		for (i = 0; i < N_FIELDS; i++) {
+			d = (uint8_t *)fields + i * field_len; dl = field_len;
+			s = new_str; sl = sizeof(new_str);
+			s_new += new(&d, &dl, &s, &sl);
+		}
+	t2 = now();
+	printf("%-6s %10.1f ns %10.1f ns %7.2fx%s\n", label,
+	    (t1 - t0) * 1e9 / ((double)iterations * N_FIELDS),
+	    (t2 - t1) * 1e9 / ((double)iterations * N_FIELDS),
+	    (t1 - t0) / (t2 - t1),
+	    mismatches || s_ref != s_new ? "  MISMATCH!" : "");
+	return mismatches || s_ref != s_new;
+}
+
+int main(int argc, char **argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 200;
+	long it;
+	size_t i, t, n, chars, dname_len;
+	char str[1024];
+	uint8_t wire[512];
+	static uint8_t fields[N_FIELDS * 32];
+	double t0, t1, t2, tot_w2s = 0, tot_s2w = 0;
+	int errors = 0;
+
+	for (i = 0; i < N_RRS; i++) {
+		rrs[i].type = i % N_CORPUS;
+		rrs[i].len = sizeof(rrs[i].wire);
+		if (gldns_str2wire_rr_buf(corpus[rrs[i].type], rrs[i].wire,
+		    &rrs[i].len, &dname_len, 3600, NULL, 0, NULL, 0)) {
+			fprintf(stderr, "Could not parse \"%s\"\n",
+			    corpus[rrs[i].type]);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("%-6s %13s %13s %13s\n", "", "wire2str", "str2wire", "text");
+	for (t = 0; t < N_CORPUS; t++) {
+		const char *type = strchr(strstr(corpus[t], " IN ") + 4, ' ');
+
+		chars = n = 0;
+		t0 = now();
+		for (it = 0; it < iterations; it++)
+			for (i = 0; i < N_RRS; i++)
+				if (rrs[i].type == t) {
+					chars += gldns_wire2str_rr_buf(
+					    rrs[i].wire, rrs[i].len,
+					    str, sizeof(str));
+					n++;
+				}
+		t1 = now();
+		for (it = 0; it < iterations; it++)
+			for (i = 0; i < N_RRS; i++)
+				if (rrs[i].type == t) {
+					size_t len = sizeof(wire);
+
+					(void) gldns_wire2str_rr_buf(
+					    rrs[i].wire, rrs[i].len,
+					    str, sizeof(str));
+					if (gldns_str2wire_rr_buf(str, wire,
+					    &len, &dname_len, 3600,
+					    NULL, 0, NULL, 0)
+					 || len != rrs[i].len
+					 || memcmp(wire, rrs[i].wire, len))
+						errors++;
+				}
+		t2 = now();
+		/* str2wire time without the wire2str part */
+		t2 -= t1 - t0;
+		tot_w2s += t1 - t0;
+		tot_s2w += t2 - t1;
+		printf("%-6.*s %10.1f ns %10.1f ns %8.1f MB/s\n",
+		    (int)(type - strstr(corpus[t], " IN ") - 4),
+		    strstr(corpus[t], " IN ") + 4,
+		    (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n,
+		    chars / (t1 - t0) / 1e6);
+	}
+	n = (size_t)iterations * N_RRS;
+	printf("%-6s %10.1f ns %10.1f ns %8.1f kRR/s%s\n", "all",
+	    tot_w2s * 1e9 / n, tot_s2w * 1e9 / n, n / tot_w2s / 1e3,
+	    errors ? "  ROUNDTRIP MISMATCH!" : "");
+
+	/* Fields as found in the corpus: addresses with and without zero
+	 * runs, RRSIG times around now and DS digests.
+	 */
+	srand(42);
+	for (i = 0; i < N_FIELDS * 32; i++)
+		fields[i] = (uint8_t)rand();
+	for (i = 0; i < N_FIELDS; i++)
+		if (i % 2)
+			(void) memset(fields + i * 16 + 4, 0, 8 + i % 3);
+	printf("\n%-6s %13s %13s %8s\n", "", "libc", "wire2str.c", "speedup");
+	errors += bench_field("A", ref_a_scan, gldns_wire2str_a_scan,
+	    fields, 4, iterations);
+	errors += bench_field("AAAA", ref_aaaa_scan, gldns_wire2str_aaaa_scan,
+	    fields, 16, iterations);
+	for (i = 0; i < N_FIELDS; i++)
+		gldns_write_uint32(fields + i * 4,
+		    (uint32_t)time(NULL) + rand() % 5000000 - 2500000);
+	errors += bench_field("time", ref_time_scan, gldns_wire2str_time_scan,
+	    fields, 4, iterations);
+	for (i = 0; i < N_FIELDS * 32; i++)
+		fields[i] = (uint8_t)rand();
+	errors += bench_field("hex", ref_hex_scan, gldns_wire2str_hex_scan,
+	    fields, 32, iterations);
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
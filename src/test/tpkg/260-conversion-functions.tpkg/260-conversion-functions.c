@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <ctype.h>
+#include <string.h>
 #include <getdns/getdns.h>
 #include <getdns/getdns_extra.h>
 
@@ -73,6 +74,15 @@ int main(int argc, char const * const argv[])
 	int             available;
 	char            str_buf[10000];
 	int             str_len = sizeof(str_buf);
+	char            direct_buf[10000];
+	size_t          len, first_len, n_rrs = 0, rrs_len, sz;
+	uint8_t         msg_buf[12 + sizeof(wire_buf)];
+	const uint8_t  *msg;
+	size_t          msg_len;
+	getdns_dict    *msg_dict;
+	char           *msg_str;
+	static const size_t too_small[] = { 0, 1, 20, 0 /* needed - 1 */,
+	                                    0 /* needed */ };
 
 	/* Convert string to rr_dict
 	 */
@@ -321,5 +331,140 @@ int main(int argc, char const * const argv[])
 	/* Print the entire buffer */
 	printf("%s", str_buf);
 
+	/* Converting the same wireformat straight to text, without the
+	 * rr_dicts, must give exactly the same text.
+	 */
+	wire_len = wire - wire_buf;
+	wire = wire_buf;
+
+	str = direct_buf;
+	str_len = sizeof(direct_buf);
+
+	while (wire_len > 0 && str_len > 0) {
+		if ((r = getdns_wire2rr_str_scan(
+		    (const uint8_t **)&wire, &wire_len, &str, &str_len)))
+			FAIL_r("getdns_wire2rr_str_scan");
+		n_rrs++;
+	}
+	if (strcmp(direct_buf, str_buf))
+		FAIL("getdns_wire2rr_str_scan gave different text");
+
+	rrs_len = wire - wire_buf;
+
+	/* getdns_wire2rr_str_buf converts the first rr only
+	 */
+	first_len = strchr(str_buf, '\n') - str_buf + 1;
+	wire_len = rrs_len;
+	len = sizeof(direct_buf);
+	if ((r = getdns_wire2rr_str_buf(wire_buf, &wire_len, direct_buf, &len)))
+		FAIL_r("getdns_wire2rr_str_buf");
+	if (len != first_len || strncmp(direct_buf, str_buf, len) ||
+	    direct_buf[len])
+		FAIL("getdns_wire2rr_str_buf gave different text");
+	printf("getdns_wire2rr_str_buf: %d characters from %d octets\n",
+	    (int)len, (int)wire_len);
+
+	/* Too small buffers give NEED_MORE_SPACE with the size needed,
+	 * and nothing is written beyond the buffer.
+	 */
+	for (i = 0; i < sizeof(too_small) / sizeof(*too_small); i++) {
+		sz = i < 3 ? too_small[i] : first_len - 4 + i;
+		(void) memset(direct_buf, 'X', sizeof(direct_buf));
+		wire_len = rrs_len;
+		len = sz;
+		if ((r = getdns_wire2rr_str_buf(
+		    wire_buf, &wire_len, direct_buf, &len))
+		    != GETDNS_RETURN_NEED_MORE_SPACE)
+			FAIL_r("getdns_wire2rr_str_buf with a too small buffer");
+		if (len != first_len || direct_buf[sz] != 'X')
+			FAIL("getdns_wire2rr_str_buf needed %d for a buffer "
+			    "of %d", (int)len, (int)sz);
+
+		wire = wire_buf;
+		wire_len = rrs_len;
+		str = direct_buf;
+		str_len = (int)sz;
+		if ((r = getdns_wire2rr_str_scan((const uint8_t **)&wire,
+		    &wire_len, &str, &str_len))
+		    != GETDNS_RETURN_NEED_MORE_SPACE)
+			FAIL_r("getdns_wire2rr_str_scan with a too small buffer");
+		if (str != direct_buf + first_len ||
+		    str_len != (int)sz - (int)first_len ||
+		    direct_buf[sz] != 'X')
+			FAIL("getdns_wire2rr_str_scan needed %d for a buffer "
+			    "of %d", (int)(str - direct_buf), (int)sz);
+	}
+	printf("getdns_wire2rr_str_buf and _scan: NEED_MORE_SPACE sizes ok\n");
+
+	/* A message with the rrs as answers converts straight to the same
+	 * text as it does via the msg_dict.
+	 */
+	(void) memset(msg_buf, 0, 12);
+	msg_buf[2] = 0x81; /* QR and RD */
+	msg_buf[3] = 0x80; /* RA */
+	msg_buf[6] = (uint8_t)(n_rrs >> 8);
+	msg_buf[7] = (uint8_t)n_rrs;
+	(void) memcpy(msg_buf + 12, wire_buf, rrs_len);
+	msg_len = 12 + rrs_len;
+
+	wire_len = msg_len;
+	if ((r = getdns_wire2msg_dict(msg_buf, wire_len, &msg_dict)))
+		FAIL_r("getdns_wire2msg_dict");
+	if ((r = getdns_msg_dict2str(msg_dict, &msg_str)))
+		FAIL_r("getdns_msg_dict2str");
+	getdns_dict_destroy(msg_dict);
+
+	len = sizeof(str_buf);
+	if ((r = getdns_wire2msg_str_buf(msg_buf, &wire_len, str_buf, &len)))
+		FAIL_r("getdns_wire2msg_str_buf");
+	if (wire_len != msg_len || len != strlen(msg_str) ||
+	    strcmp(str_buf, msg_str))
+		FAIL("getdns_wire2msg_str_buf gave different text");
+	printf("getdns_wire2msg_str_buf: %d characters from %d octets\n",
+	    (int)len, (int)wire_len);
+
+	msg = msg_buf;
+	wire_len = msg_len;
+	str = direct_buf;
+	str_len = sizeof(direct_buf);
+	if ((r = getdns_wire2msg_str_scan(&msg, &wire_len, &str, &str_len)))
+		FAIL_r("getdns_wire2msg_str_scan");
+	if (msg != msg_buf + msg_len || wire_len != 0 ||
+	    str != direct_buf + len ||
+	    str_len != (int)(sizeof(direct_buf) - len) ||
+	    strcmp(direct_buf, msg_str))
+		FAIL("getdns_wire2msg_str_scan gave different text");
+	printf("getdns_wire2msg_str_scan: same text\n");
+
+	for (i = 0; i < sizeof(too_small) / sizeof(*too_small); i++) {
+		sz = i < 3 ? too_small[i] : strlen(msg_str) - 4 + i;
+		(void) memset(direct_buf, 'X', sizeof(direct_buf));
+		wire_len = msg_len;
+		len = sz;
+		if ((r = getdns_wire2msg_str_buf(
+		    msg_buf, &wire_len, direct_buf, &len))
+		    != GETDNS_RETURN_NEED_MORE_SPACE)
+			FAIL_r("getdns_wire2msg_str_buf with a too small buffer");
+		if (len != strlen(msg_str) || direct_buf[sz] != 'X')
+			FAIL("getdns_wire2msg_str_buf needed %d for a buffer "
+			    "of %d", (int)len, (int)sz);
+
+		msg = msg_buf;
+		wire_len = msg_len;
+		str = direct_buf;
+		str_len = (int)sz;
+		if ((r = getdns_wire2msg_str_scan(
+		    &msg, &wire_len, &str, &str_len))
+		    != GETDNS_RETURN_NEED_MORE_SPACE)
+			FAIL_r("getdns_wire2msg_str_scan with a too small buffer");
+		if (str != direct_buf + strlen(msg_str) ||
+		    str_len != (int)sz - (int)strlen(msg_str) ||
+		    direct_buf[sz] != 'X')
+			FAIL("getdns_wire2msg_str_scan needed %d for a buffer "
+			    "of %d", (int)(str - direct_buf), (int)sz);
+	}
+	printf("getdns_wire2msg_str_buf and _scan: NEED_MORE_SPACE sizes ok\n");
+	free(msg_str);
+
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+int main()
+{
+	getdns_return_t r;
+	getdns_dict    *dict, *copy, *borrowed;
+	getdns_list    *list, *list_copy;
+	uint8_t        *bin, bin_buf[16];
+	size_t          bin_sz, bin_buf_sz = sizeof(bin_buf);
+	char           *str, *str2;
+	getdns_bindata *bindata;
+
+	if ((r = getdns_str2dict(
+	    "{ upstream_recursive_servers:"
+	    "  [ { address_data: 185.49.141.37, tls_auth_name: \"getdnsapi.net\" }"
+	    "  , { address_data: 2a04:b900:0:100::37, tls_port: 853 } ]"
+	    ", timeout: 2000, empty: \"\", suffix: [], opt: {}"
+	    ", long: 0x000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+	    "}", &dict)))
+		FAIL_r("getdns_str2dict");
+
+	if ((r = getdns_dict2bin(dict, &bin, &bin_sz)))
+		FAIL_r("getdns_dict2bin");
+	printf("binary size: %d\n", (int)bin_sz);
+
+	if ((r = getdns_dict2bin_buf(dict, bin_buf, &bin_buf_sz))
+	    != GETDNS_RETURN_NEED_MORE_SPACE)
+		FAIL("Expected GETDNS_RETURN_NEED_MORE_SPACE, got %d", (int)r);
+	if (bin_buf_sz != bin_sz)
+		FAIL("Expected needed size of %d, got %d",
+		    (int)bin_sz, (int)bin_buf_sz);
+
+	if ((r = getdns_bin2dict(bin, bin_sz, &copy)))
+		FAIL_r("getdns_bin2dict");
+	if ((r = getdns_bin2dict_borrow(bin, bin_sz, &borrowed)))
+		FAIL_r("getdns_bin2dict_borrow");
+
+	str  = getdns_print_json_dict(dict, 0);
+	str2 = getdns_print_json_dict(copy, 0);
+	printf("%s\n", str2);
+	if (strcmp(str, str2))
+		FAIL("Copied dict differs from the original");
+	free(str2);
+
+	str2 = getdns_print_json_dict(borrowed, 0);
+	if (strcmp(str, str2))
+		FAIL("Borrowed dict differs from the original");
+	free(str2);
+	free(str);
+
+	if ((r = getdns_dict_get_bindata(borrowed, "long", &bindata)))
+		FAIL_r("getdns_dict_get_bindata");
+	if (bindata->data < bin || bindata->data >= bin + bin_sz)
+		FAIL("Borrowed bindata does not point into the binary buffer");
+
+	/* Overwriting borrowed data must leave the binary buffer alone */
+	if ((r = getdns_dict_set_int(borrowed, "long", 1)))
+		FAIL_r("getdns_dict_set_int");
+
+	if (getdns_bin2dict(bin, bin_sz - 1, &copy) == GETDNS_RETURN_GOOD)
+		FAIL("Truncated binary data was accepted");
+	if (getdns_bin2list(bin, bin_sz, &list) == GETDNS_RETURN_GOOD)
+		FAIL("Binary dict was accepted as list");
+	getdns_dict_destroy(borrowed);
+	getdns_dict_destroy(copy);
+	free(bin);
+
+	if ((r = getdns_dict_get_list(
+	    dict, "upstream_recursive_servers", &list)))
+		FAIL_r("getdns_dict_get_list");
+	if ((r = getdns_list2bin(list, &bin, &bin_sz)))
+		FAIL_r("getdns_list2bin");
+	if ((r = getdns_bin2list_borrow(bin, bin_sz, &list_copy)))
+		FAIL_r("getdns_bin2list_borrow");
+
+	str = getdns_print_json_list(list_copy, 0);
+	printf("%s\n", str);
+	free(str);
+
+	getdns_list_destroy(list_copy);
+	getdns_dict_destroy(dict);
+	free(bin);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+static const char zone[] =
+"$TTL 3600\n"
+"; A comment\n"
+"@	IN	SOA	ns.example. hostmaster.example. 1 7200 3600 1209600 3600\n"
+"	IN	NS	ns.example.\n"
+"\n"
+"www	300	IN	A	192.0.2.1\n"
+"	IN	AAAA	2001:db8::1\n"
+"$ORIGIN sub.example.\n"
+"mail	IN	MX	10 mx.example.\n";
+
+int main()
+{
+	getdns_return_t r;
+	FILE           *in;
+	getdns_fp2wire_iter *iter;
+	const uint8_t  *rr;
+	size_t          rr_sz, n = 0;
+	uint8_t        *wire;
+	const uint8_t  *scan;
+	size_t          wire_sz, scan_sz, rr_count;
+	getdns_list    *rr_list;
+	getdns_dict    *rr_dict;
+	char           *str, *str2;
+
+	if (!(in = tmpfile()))
+		FAIL("Could not create temporary file");
+	(void) fputs(zone, in);
+
+	rewind(in);
+	if ((r = getdns_fp2wire_iter_create(in, &iter, "example.", 0)))
+		FAIL_r("getdns_fp2wire_iter_create");
+
+	while (!(r = getdns_fp2wire_iter_next(iter, &rr, &rr_sz)) && rr) {
+		if ((r = getdns_wire2rr_dict(rr, rr_sz, &rr_dict)))
+			FAIL_r("getdns_wire2rr_dict");
+		if ((r = getdns_rr_dict2str(rr_dict, &str)))
+			FAIL_r("getdns_rr_dict2str");
+		printf("%d: %s", (int)++n, str);
+		free(str);
+		getdns_dict_destroy(rr_dict);
+	}
+	if (r)
+		FAIL_r("getdns_fp2wire_iter_next");
+	if (rr_sz)
+		FAIL("Expected rr_sz 0 at end of file");
+	getdns_fp2wire_iter_destroy(iter);
+
+	rewind(in);
+	if ((r = getdns_fp2wire_rrs(in, &wire, &wire_sz, &rr_count,
+	    "example.", 0)))
+		FAIL_r("getdns_fp2wire_rrs");
+	if (rr_count != n)
+		FAIL("Expected %d RRs in the arena, got %d", (int)n, (int)rr_count);
+
+	rewind(in);
+	if ((r = getdns_fp2rr_list(in, &rr_list, "example.", 0)))
+		FAIL_r("getdns_fp2rr_list");
+
+	for (scan = wire, scan_sz = wire_sz, n = 0; scan_sz > 0; n++) {
+		getdns_dict *from_list;
+
+		if ((r = getdns_wire2rr_dict_scan(&scan, &scan_sz, &rr_dict)))
+			FAIL_r("getdns_wire2rr_dict_scan");
+		if ((r = getdns_list_get_dict(rr_list, n, &from_list)))
+			FAIL_r("getdns_list_get_dict");
+		str = getdns_print_json_dict(rr_dict, 1);
+		str2 = getdns_print_json_dict(from_list, 1);
+		if (strcmp(str, str2))
+			FAIL("RR %d from arena differs from getdns_fp2rr_list", (int)n);
+		free(str);
+		free(str2);
+		getdns_dict_destroy(rr_dict);
+	}
+	printf("arena: %d RRs in %d octets\n", (int)rr_count, (int)wire_sz);
+
+	free(wire);
+	getdns_list_destroy(rr_list);
+	fclose(in);
+
+	in = tmpfile();
+	(void) fputs("www IN A 192.0.2.1\nwww IN A not-an-address\n", in);
+	rewind(in);
+	if ((r = getdns_fp2wire_iter_create(in, &iter, "example.", 3600)))
+		FAIL_r("getdns_fp2wire_iter_create");
+	if ((r = getdns_fp2wire_iter_next(iter, &rr, &rr_sz)) || !rr)
+		FAIL("Expected a first RR");
+	if (!(r = getdns_fp2wire_iter_next(iter, &rr, &rr_sz)))
+		FAIL("Expected a parse error");
+	printf("parse error: %s\n", getdns_get_errorstr_by_id(r));
+	getdns_fp2wire_iter_destroy(iter);
+	fclose(in);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,201 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "gldns/wire2str.h"
+#include "gldns/parseutil.h"
+#include "gldns/gbuffer.h"
+
+/* The formatters as they were before the hand written ones in wire2str.c.
+ * The new ones should give byte identical results, also when the output
+ * is truncated.
+ */
+
+static int ref_a_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
+{
+	char buf[32];
+	int w;
+	if(*dl < 4) return -1;
+	if(!inet_ntop(AF_INET, *d, buf, (socklen_t)sizeof(buf)))
+		return -1;
+	w = gldns_str_print(s, sl, "%s", buf);
+	(*d)+=4;
+	(*dl)-=4;
+	return w;
+}
+
+static int ref_aaaa_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
+{
+	char buf[64];
+	int w;
+	if(*dl < 16) return -1;
+	if(!inet_ntop(AF_INET6, *d, buf, (socklen_t)sizeof(buf)))
+		return -1;
+	w = gldns_str_print(s, sl, "%s", buf);
+	(*d)+=16;
+	(*dl)-=16;
+	return w;
+}
+
+static int ref_time_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
+{
+	struct tm tm;
+	char date_buf[16];
+	uint32_t t;
+	memset(&tm, 0, sizeof(tm));
+	if(*dl < 4) return -1;
+	t = gldns_read_uint32(*d);
+	date_buf[15]=0;
+	if(gldns_serial_arithmitics_gmtime_r(t, time(NULL), &tm) &&
+		strftime(date_buf, 15, "%Y%m%d%H%M%S", &tm)) {
+		(*d) += 4;
+		(*dl) -= 4;
+		return gldns_str_print(s, sl, "%s", date_buf);
+	}
+	return -1;
+}
+
+static int ref_hex_scan(uint8_t** d, size_t* dl, char** s, size_t* sl)
+{
+	const char* hex = "0123456789ABCDEF";
+	size_t i;
+	int w = gldns_str_print(s, sl, "%s", "");
+	for(i=0; i<*dl; i++) {
+		(void)gldns_str_print(s, sl, "%c%c", hex[((*d)[i]&0xf0)>>4],
+			hex[(*d)[i]&0x0f]);
+	}
+	w += (int)*dl*2;
+	*d += *dl;
+	*dl = 0;
+	return w;
+}
+
+typedef int (*scan_func)(uint8_t** d, size_t* dl, char** s, size_t* sl);
+
+/* Deterministic, so that the same inputs are checked everywhere */
+static uint32_t rnd_state = 42;
+static uint32_t rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+static const size_t buf_sizes[] = { 0, 1, 2, 3, 7, 8, 9, 14, 15, 16, 17,
+    24, 31, 32, 39, 40, 41, 45, 46, 64, 600, 0 /* with a NULL buffer */ };
+#define N_BUF_SIZES (sizeof(buf_sizes) / sizeof(*buf_sizes))
+
+/* Format data with ref and with new into buffers of all sizes in
+ * buf_sizes, and compare return values, all state and the buffers.
+ */
+static int check(const char *name, scan_func ref, scan_func new,
+    uint8_t *data, size_t len)
+{
+	char ref_buf[600], new_buf[600], *ref_s, *new_s;
+	uint8_t *ref_d, *new_d;
+	size_t ref_dl, new_dl, ref_sl, new_sl, i;
+	int ref_w, new_w;
+
+	for (i = 0; i < N_BUF_SIZES; i++) {
+		(void) memset(ref_buf, 'x', sizeof(ref_buf));
+		(void) memset(new_buf, 'x', sizeof(new_buf));
+		ref_d = new_d = data;
+		ref_dl = new_dl = len;
+		ref_s = i == N_BUF_SIZES - 1 ? NULL : ref_buf;
+		new_s = i == N_BUF_SIZES - 1 ? NULL : new_buf;
+		ref_sl = new_sl = buf_sizes[i];
+
+		ref_w = ref(&ref_d, &ref_dl, &ref_s, &ref_sl);
+		new_w = new(&new_d, &new_dl, &new_s, &new_sl);
+
+		if (ref_w != new_w || ref_d - data != new_d - data ||
+		    ref_dl != new_dl || ref_sl != new_sl ||
+		    (ref_s ? ref_s - ref_buf : -1) !=
+		    (new_s ? new_s - new_buf : -1) ||
+		    memcmp(ref_buf, new_buf, sizeof(ref_buf))) {
+			printf("%s: mismatch with a buffer of %d octets, "
+			    "\"%.*s\" (%d) != \"%.*s\" (%d)\n", name,
+			    (int)buf_sizes[i], (int)buf_sizes[i], ref_buf,
+			    ref_w, (int)buf_sizes[i], new_buf, new_w);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* An IPv6 address with runs of zero words of varying lengths, words of
+ * varying widths, and the IPv4 compatible and mapped forms.
+ */
+static void make_ip6(uint8_t *a)
+{
+	int i;
+	uint32_t r = rnd();
+
+	for (i = 0; i < 8; i++) {
+		uint16_t w;
+
+		switch (rnd() % 6) {
+		case 0:
+		case 1:
+		case 2: w = 0; break;
+		case 3: w = rnd() & 0xf; break;
+		case 4: w = rnd() & 0xfff; break;
+		default: w = rnd() & 0xffff; break;
+		}
+		gldns_write_uint16(a + 2 * i, w);
+	}
+	if (r % 8 == 0) {
+		(void) memset(a, 0, 10);
+		a[10] = a[11] = (r & 8) ? 0xff : 0;
+	} else if (r % 8 == 1)
+		(void) memset(a, 0, 12 + (r & 0x30 ? 0 : 3));
+}
+
+int main()
+{
+	static const uint32_t times[] = { 0, 1, 0x7fffffff, 0x80000000,
+	    0xffffffff, 946684799, 946684800, 951782400, 4102444800u };
+	uint8_t data[300];
+	size_t i, len;
+	int errors = 0;
+	uint32_t now = (uint32_t)time(NULL);
+
+	for (i = 0; i < 100000; i++) {
+		gldns_write_uint32(data, rnd() ^ (rnd() << 24));
+		errors += check("A", ref_a_scan, gldns_wire2str_a_scan, data, 4);
+	}
+	printf("A: checked 100000 addresses\n");
+
+	for (i = 0; i < 200000; i++) {
+		make_ip6(data);
+		errors += check("AAAA", ref_aaaa_scan,
+		    gldns_wire2str_aaaa_scan, data, 16);
+	}
+	printf("AAAA: checked 200000 addresses\n");
+
+	for (i = 0; i < sizeof(times) / sizeof(*times); i++) {
+		gldns_write_uint32(data, times[i]);
+		errors += check("time", ref_time_scan,
+		    gldns_wire2str_time_scan, data, 4);
+	}
+	for (i = 0; i < 100000; i++) {
+		/* Mostly around now, as in RRSIGs */
+		gldns_write_uint32(data, i % 2 ? rnd() ^ (rnd() << 24)
+		                               : now + rnd() % 200000000 - 100000000);
+		errors += check("time", ref_time_scan,
+		    gldns_wire2str_time_scan, data, 4);
+	}
+	printf("time: checked 100009 times\n");
+
+	for (i = 0; i < 20000; i++) {
+		for (len = rnd() % sizeof(data); len > 0; len--)
+			data[len - 1] = (uint8_t)rnd();
+		len = i % 300;
+		errors += check("hex", ref_hex_scan,
+		    gldns_wire2str_hex_scan, data, len);
+	}
+	printf("hex: checked 20000 strings\n");
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,379 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "dname.h"
+
+/* The octet at a time implementations, as they were before dname.c.  The
+ * new ones should give the same results, also for names with compression
+ * pointers, which they handle octet by octet too.
+ */
+
+static int ref_equal(const uint8_t *s1, const uint8_t *s2)
+{
+	uint8_t i;
+	for (;;) {
+		if (*s1 != *s2)
+			return 0;
+		else if (!*s1)
+			return 1;
+		for (i = *s1++, s2++; i > 0; i--, s1++, s2++)
+			if (*s1 != *s2 && tolower((unsigned char)*s1)
+			               != tolower((unsigned char)*s2))
+				return 0;
+	}
+}
+
+static void ref_fold(const uint8_t *src, uint8_t *dst, size_t len)
+{
+	for (; len; len--)
+		*dst++ = (uint8_t)tolower((unsigned char)*src++);
+}
+
+static int ref_fold_cmp(const uint8_t *l, const uint8_t *r, size_t len)
+{
+	for (; len; len--, l++, r++)
+		if (tolower((unsigned char)*l) != tolower((unsigned char)*r))
+			return tolower((unsigned char)*l)
+			     - tolower((unsigned char)*r);
+	return 0;
+}
+
+static int ref_is_parent(const uint8_t *parent, const uint8_t *subdomain)
+{
+	while (*subdomain) {
+		if (ref_equal(parent, subdomain))
+			return 1;
+
+		subdomain += *subdomain + 1;
+	}
+	return *parent == 0;
+}
+
+static const uint8_t **reverse_labels(
+    const uint8_t *dname, const uint8_t **labels)
+{
+	if (*dname)
+		labels = reverse_labels(dname + *dname + 1, labels);
+	*labels = dname;
+	return labels + 1;
+}
+
+static int ref_canonical_cmp(const uint8_t *left, const uint8_t *right)
+{
+	const uint8_t *llabels[128], *rlabels[128], **last_llabel, **last_rlabel,
+		**llabel, **rlabel, *l, *r;
+	uint8_t lsz, rsz;
+
+	last_llabel = reverse_labels(left, llabels);
+	last_rlabel = reverse_labels(right, rlabels);
+
+	for ( llabel = llabels, rlabel = rlabels
+	    ; llabel < last_llabel
+	    ; llabel++, rlabel++ ) {
+
+		if (rlabel == last_rlabel)
+			return 1;
+
+		for ( l = *llabel, lsz = *l++, r = *rlabel, rsz = *r++
+		    ; lsz; l++, r++, lsz--, rsz-- ) {
+			if (!rsz)
+				return 1;
+			if (*l != *r && tolower((unsigned char)*l) !=
+					tolower((unsigned char)*r)) {
+				if (tolower((unsigned char)*l) <
+				    tolower((unsigned char)*r))
+					return -1;
+				return 1;
+			}
+		}
+		if (rsz)
+			return -1;
+	}
+	return rlabel == last_rlabel ? 0 : -1;
+}
+
+/* Deterministic, so that the same inputs are checked everywhere */
+static uint32_t rnd_state = 42;
+static uint32_t rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+/* The octets around the upper and lower case letters, and ones with the
+ * high bit set (negative as signed chars) that equal letters in the low
+ * bits.
+ */
+static const uint8_t octets[] = { 0x40, 'A', 'M', 'Z', 0x5B, 0x60, 'a', 'm',
+    'z', 0x7B, 0x7F, 0x80, 0xC1, 0xDA, 0xE1, 0xFA, 0xFF, 0x00, '0', '-' };
+
+static uint8_t rnd_octet(void)
+{
+	return rnd() % 4 ? octets[rnd() % sizeof(octets)] : (uint8_t)rnd();
+}
+
+/* Names live in zeroed buffers at varying alignments.  A compression
+ * pointer is followed as a label of 192 octets, by both implementations,
+ * so a buffer has room for the longest name and such a label after it.
+ */
+#define BUF_SIZE 768
+typedef struct name_buf {
+	uint8_t buf[16 + BUF_SIZE];
+	uint8_t *dname;
+} name_buf;
+
+static void name_init(name_buf *n)
+{
+	(void) memset(n->buf, 0, sizeof(n->buf));
+	n->dname = n->buf + rnd() % 16;
+}
+
+/* Length of the name on the wire, up to and including the root label or
+ * the compression pointer
+ */
+static size_t wire_len(const uint8_t *dname)
+{
+	const uint8_t *p;
+
+	for (p = dname; *p && !(*p & 0xC0); p += *p + 1)
+		; /* pass */
+	return p - dname + (*p ? 2 : 1);
+}
+
+/* A name with short and long labels, of up to 255 octets, and ending in a
+ * compression pointer once in a while
+ */
+static void make_name(name_buf *n)
+{
+	size_t max_len = rnd() % 4 ? 1 + rnd() % 255 : 255, label_len, i;
+	size_t max_label_len = rnd() % 2 ? 63 : 1 + rnd() % 16;
+	int pointer = rnd() % 16 == 0;
+	uint8_t *p;
+
+	name_init(n);
+	if (pointer)
+		max_len--;
+	for (p = n->dname; (size_t)(p - n->dname) + 2 < max_len; ) {
+		label_len = 1 + rnd() % max_label_len;
+		if (label_len > max_len - (p - n->dname) - 2)
+			label_len = max_len - (p - n->dname) - 2;
+		*p++ = (uint8_t)label_len;
+		for (i = 0; i < label_len; i++)
+			*p++ = rnd_octet();
+	}
+	if (pointer) {
+		*p++ = 0xC0;
+		*p = (uint8_t)rnd();
+	}
+}
+
+/* A copy of src with the case of letters swapped at random, and sometimes
+ * a changed octet, an octet more or less in a label, or a label more.
+ */
+static void make_variant(const uint8_t *src, name_buf *n)
+{
+	size_t len = wire_len(src), n_labels, i;
+	uint8_t *p, *label;
+
+	name_init(n);
+	(void) memcpy(n->dname, src, len);
+	for (p = n->dname, n_labels = 0; *p && !(*p & 0xC0); p += *p + 1) {
+		n_labels++;
+		for (i = 1; i <= *p; i++)
+			if (isalpha(p[i]) && rnd() % 2)
+				p[i] ^= 0x20;
+	}
+	if (!n_labels || rnd() % 4 == 0)
+		return;
+
+	/* A random label */
+	for (label = n->dname, i = rnd() % n_labels; i; i--)
+		label += *label + 1;
+
+	switch (rnd() % 8) {
+	case 0: /* Another label length */
+		if (*label > 1 && rnd() % 2) {
+			(void) memmove(label + *label, label + *label + 1,
+			    len - (label + *label + 1 - n->dname));
+			(*label)--;
+			n->dname[len - 1] = 0;
+		} else if (len < 255 && *label < 63) {
+			(void) memmove(label + *label + 2, label + *label + 1,
+			    len - (label + *label + 1 - n->dname));
+			label[*label + 1] = rnd_octet();
+			(*label)++;
+		}
+		break;
+
+	case 1: /* A label more */
+		if (len < 254) {
+			(void) memmove(label + 2, label,
+			    len - (label - n->dname));
+			label[0] = 1;
+			label[1] = rnd_octet();
+		}
+		break;
+
+	default: /* An octet that differs in more than case (or only in
+		  * case, for letters), or a random one
+		  */
+		i = 1 + rnd() % *label;
+		label[i] = rnd() % 2 ? label[i] ^ 0x20 : rnd_octet();
+		break;
+	}
+}
+
+static void print_dname(const uint8_t *dname)
+{
+	size_t i;
+
+	for (; *dname && !(*dname & 0xC0); dname += *dname + 1) {
+		for (i = 1; i <= *dname; i++)
+			if (isalnum(dname[i]) || dname[i] == '-')
+				printf("%c", dname[i]);
+			else
+				printf("\\%.3d", (int)dname[i]);
+		printf(".");
+	}
+	if (*dname)
+		printf("<pointer %d>", (int)dname[1]);
+	printf("\n");
+}
+
+static int mismatch(const char *name, const uint8_t *l, const uint8_t *r,
+    int ref, int new)
+{
+	printf("%s: mismatch, %d != %d for\n  ", name, ref, new);
+	print_dname(l);
+	if (r) {
+		printf("  ");
+		print_dname(r);
+	}
+	return 1;
+}
+
+static int sign(int x)
+{
+	return x < 0 ? -1 : x > 0 ? 1 : 0;
+}
+
+/* Fold and compare octet strings of up to 80 octets, so the blocks of 16
+ * at all alignments, with differences at all positions.
+ */
+static int check_fold(void)
+{
+	uint8_t l[96], r[96], ref_buf[96], new_buf[96], *lp, *rp;
+	size_t len, i, j;
+	int ref, new, errors = 0;
+
+	for (i = 0; i < 200000; i++) {
+		lp = l + rnd() % 16;
+		rp = r + rnd() % 16;
+		len = rnd() % 81;
+		for (j = 0; j < len; j++) {
+			lp[j] = rnd_octet();
+			rp[j] = isalpha(lp[j]) && rnd() % 2 ? lp[j] ^ 0x20 : lp[j];
+		}
+		if (len && rnd() % 2) {
+			j = rnd() % len;
+			rp[j] = rnd() % 2 ? rp[j] ^ 0x20 : rnd_octet();
+		}
+
+		ref_fold(lp, ref_buf, len);
+		_getdns_dname_fold(new_buf, lp, len);
+		if (memcmp(ref_buf, new_buf, len)) {
+			printf("fold: mismatch for %d octets\n", (int)len);
+			errors++;
+		}
+		(void) memcpy(new_buf, lp, len);
+		_getdns_dname_fold(new_buf, new_buf, len);
+		if (memcmp(ref_buf, new_buf, len)) {
+			printf("fold: mismatch in place for %d octets\n",
+			    (int)len);
+			errors++;
+		}
+		ref = ref_fold_cmp(lp, rp, len);
+		new = _getdns_dname_fold_cmp(lp, rp, len);
+		if (sign(ref) != sign(new)) {
+			printf("fold_cmp: mismatch, %d != %d for %d octets\n",
+			    ref, new, (int)len);
+			errors++;
+		}
+		if ((ref == 0) != _getdns_dname_fold_equal(lp, rp, len)) {
+			printf("fold_equal: mismatch for %d octets\n",
+			    (int)len);
+			errors++;
+		}
+	}
+	printf("fold, fold_cmp and fold_equal: checked 200000 strings\n");
+	return errors;
+}
+
+static int check_dnames(void)
+{
+	static name_buf names[3], parent;
+	const uint8_t *name, *variant, *other, *p;
+	size_t i, n_labels, n_pointers = 0;
+	int ref, new, errors = 0;
+
+	for (i = 0; i < 200000; i++) {
+		make_name(&names[0]);
+		make_variant(names[0].dname, &names[1]);
+		make_name(&names[2]);
+		name    = names[0].dname;
+		variant = names[1].dname;
+		other   = names[2].dname;
+		if (name[wire_len(name) - 1] || variant[wire_len(variant) - 1])
+			n_pointers++;
+
+		if ((ref = ref_equal(name, variant))
+		    != (new = _getdns_dname_equal(name, variant)))
+			errors += mismatch("equal", name, variant, ref, new);
+
+		if ((ref = ref_canonical_cmp(name, variant))
+		    != (new = _getdns_dname_canonical_cmp(name, variant)))
+			errors += mismatch("canonical_cmp",
+			    name, variant, ref, new);
+		if ((ref = ref_canonical_cmp(variant, name))
+		    != (new = _getdns_dname_canonical_cmp(variant, name)))
+			errors += mismatch("canonical_cmp",
+			    variant, name, ref, new);
+		if ((ref = ref_canonical_cmp(name, other))
+		    != (new = _getdns_dname_canonical_cmp(name, other)))
+			errors += mismatch("canonical_cmp",
+			    name, other, ref, new);
+
+		/* A (case variant of a) parent of name, possibly changed,
+		 * or of the other name
+		 */
+		other = rnd() % 4 ? variant : other;
+		for (p = other, n_labels = 0; *p && !(*p & 0xC0); p += *p + 1)
+			n_labels++;
+		for (p = other, n_labels = rnd() % (n_labels + 1); n_labels;
+		    n_labels--)
+			p += *p + 1;
+		if (rnd() % 4 == 0) {
+			make_variant(p, &parent);
+			p = parent.dname;
+		}
+		if ((ref = ref_is_parent(p, name))
+		    != (new = _getdns_dname_is_parent(p, name)))
+			errors += mismatch("is_parent", p, name, ref, new);
+	}
+	printf("equal, canonical_cmp and is_parent: checked 200000 names\n");
+	if (n_pointers < 10000)
+		printf("only %d names with compression pointers\n",
+		    (int)n_pointers);
+	return errors;
+}
+
+int main()
+{
+	int errors = 0;
+
+	errors += check_fold();
+	errors += check_dnames();
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include "context.h"
+#include "pubkey-pinning.h"
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+#define CACHE_FILE "280-tls-session-cache.sessions"
+
+static const unsigned char master_key[48] = "0123456789abcdef0123456789abcdef0123456789abcde";
+
+static getdns_context *create_context()
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_list *upstreams;
+	getdns_transport_list_t tls = GETDNS_TRANSPORT_TLS;
+
+	if ((r = getdns_context_create(&context, 0)))
+		FAIL_r("getdns_context_create");
+	if ((r = getdns_context_set_resolution_type(
+	    context, GETDNS_RESOLUTION_STUB)))
+		FAIL_r("getdns_context_set_resolution_type");
+	if ((r = getdns_context_set_dns_transport_list(context, 1, &tls)))
+		FAIL_r("getdns_context_set_dns_transport_list");
+	if ((r = getdns_str2list("[ { address_data: 192.0.2.1"
+	    ", tls_auth_name: \"dns.example\" } ]", &upstreams)))
+		FAIL_r("getdns_str2list");
+	if ((r = getdns_context_set_upstream_recursive_servers(
+	    context, upstreams)))
+		FAIL_r("getdns_context_set_upstream_recursive_servers");
+	getdns_list_destroy(upstreams);
+	if ((r = getdns_context_set_tls_session_cache_file(context, CACHE_FILE)))
+		FAIL_r("getdns_context_set_tls_session_cache_file");
+	if ((r = _getdns_context_prepare_for_resolution(context, 0)))
+		FAIL_r("_getdns_context_prepare_for_resolution");
+	return context;
+}
+
+static getdns_upstream *tls_upstream(getdns_context *context)
+{
+	size_t i;
+
+	for (i = 0; i < context->upstreams->count; i++)
+		if (context->upstreams->upstreams[i].transport
+		    == GETDNS_TRANSPORT_TLS)
+			return &context->upstreams->upstreams[i];
+	FAIL("No TLS upstream");
+	return NULL;
+}
+
+static int cache_file_exists()
+{
+	FILE *fh;
+
+	if (!(fh = fopen(CACHE_FILE, "rb")))
+		return 0;
+	(void) fclose(fh);
+	return 1;
+}
+
+int main()
+{
+	getdns_context *context;
+	getdns_upstream *upstream;
+	SSL *ssl;
+	SSL_SESSION *session;
+	int (*new_session_cb)(SSL *, SSL_SESSION *);
+	getdns_auth_state_t auth_state = GETDNS_AUTH_NONE;
+	unsigned char key[sizeof(master_key)];
+
+	(void) remove(CACHE_FILE);
+
+	/* Hand a new session to the context the way OpenSSL does after
+	 * a handshake with the upstream.
+	 */
+	context = create_context();
+	upstream = tls_upstream(context);
+	upstream->tls_auth_state = GETDNS_AUTH_OK;
+
+	if (!(ssl = SSL_new(context->tls_ctx)))
+		FAIL("SSL_new");
+	if (_getdns_associate_upstream_with_SSL(ssl, upstream))
+		FAIL("_getdns_associate_upstream_with_SSL");
+	if (!(session = SSL_SESSION_new()) ||
+	    !SSL_SESSION_set_protocol_version(session, TLS1_2_VERSION) ||
+	    !SSL_SESSION_set_cipher(session,
+	        SSL_CIPHER_find(ssl, (const unsigned char *)"\xc0\x2f")) ||
+	    !SSL_SESSION_set1_master_key(session, master_key,
+	        sizeof(master_key)) ||
+	    !SSL_SESSION_set_time(session, time(NULL)) ||
+	    !SSL_SESSION_set_timeout(session, 3600))
+		FAIL("Could not create session");
+	if (!(new_session_cb = SSL_CTX_sess_get_new_cb(context->tls_ctx)))
+		FAIL("No new session callback");
+	if (!new_session_cb(ssl, session))
+		FAIL("Session not taken by the new session callback");
+	SSL_free(ssl);
+	printf("session stored\n");
+	printf("cache file %s before destroy\n",
+	    cache_file_exists() ? "written" : "not written");
+
+	getdns_context_destroy(context);
+	printf("cache file %s after destroy\n",
+	    cache_file_exists() ? "written" : "not written");
+
+	/* A new context with the same upstream resumes the saved session */
+	context = create_context();
+	upstream = tls_upstream(context);
+	if (!(session = _getdns_context_tls_session_fetch(
+	    context, upstream, &auth_state)))
+		FAIL("Session not loaded from the cache file");
+	if (SSL_SESSION_get_master_key(session, key, sizeof(key))
+	    != sizeof(master_key) || memcmp(key, master_key, sizeof(key)))
+		FAIL("Loaded session differs from the stored session");
+	printf("session loaded, %s\n",
+	    auth_state == GETDNS_AUTH_OK ? "authenticated" : "not authenticated");
+	SSL_SESSION_free(session);
+	getdns_context_destroy(context);
+
+	(void) remove(CACHE_FILE);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,107 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+/* Two upstreams without a TLS service, so that all connections fail */
+static getdns_context *create_context()
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_list *upstreams;
+	getdns_transport_list_t tls = GETDNS_TRANSPORT_TLS;
+
+	if ((r = getdns_context_create(&context, 0)))
+		FAIL_r("getdns_context_create");
+	if ((r = getdns_context_set_resolution_type(
+	    context, GETDNS_RESOLUTION_STUB)))
+		FAIL_r("getdns_context_set_resolution_type");
+	if ((r = getdns_context_set_dns_transport_list(context, 1, &tls)))
+		FAIL_r("getdns_context_set_dns_transport_list");
+	if ((r = getdns_str2list("[ { address_data: 127.0.0.1, tls_port: 1 }"
+	    ", { address_data: 127.0.0.2, tls_port: 1 } ]", &upstreams)))
+		FAIL_r("getdns_str2list");
+	if ((r = getdns_context_set_upstream_recursive_servers(
+	    context, upstreams)))
+		FAIL_r("getdns_context_set_upstream_recursive_servers");
+	getdns_list_destroy(upstreams);
+	if ((r = getdns_context_set_timeout(context, 2000)))
+		FAIL_r("getdns_context_set_timeout");
+	if ((r = getdns_context_set_tls_warm_upstreams(context, 2)))
+		FAIL_r("getdns_context_set_tls_warm_upstreams");
+	return context;
+}
+
+static void print_warm(getdns_context *context, const char *when)
+{
+	size_t i, n_warm = 0, n_skip = 0, n_open = 0;
+	getdns_upstream *upstream;
+
+	for (i = 0; i < context->upstreams->count; i++) {
+		upstream = &context->upstreams->upstreams[i];
+		if (upstream->transport != GETDNS_TRANSPORT_TLS)
+			continue;
+		n_warm += upstream->is_warm;
+		n_skip += upstream->warm_skip;
+		n_open += upstream->fd != -1;
+	}
+	printf("%s: %d warm, %d skipped, %d open\n", when,
+	    (int)n_warm, (int)n_skip, (int)n_open);
+}
+
+static void callbackfn(getdns_context *context,
+    getdns_callback_type_t callback_type, getdns_dict *response,
+    void *userarg, getdns_transaction_t transaction_id)
+{
+	(void)context; (void)userarg; (void)transaction_id;
+	printf("callback type %d\n", (int)callback_type);
+	getdns_dict_destroy(response);
+}
+
+int main()
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_dict *response;
+
+	/* The extension event loop is not run with synchronous requests
+	 * only, so no warm connections should be opened on it.
+	 */
+	context = create_context();
+	if ((r = _getdns_context_prepare_for_resolution(context, 0)))
+		FAIL_r("_getdns_context_prepare_for_resolution");
+	print_warm(context, "prepared");
+	response = NULL;
+	/* Fails, because the upstreams cannot be reached */
+	(void) getdns_general_sync(context, "example.",
+	    GETDNS_RRTYPE_A, NULL, &response);
+	getdns_dict_destroy(response);
+	print_warm(context, "synchronous request");
+	getdns_context_destroy(context);
+
+	/* With an asynchronous request, connections are opened to both
+	 * upstreams.  Once they have failed, neither is tried again, and
+	 * the loop finishes.
+	 */
+	context = create_context();
+	if ((r = getdns_general(context, "example.",
+	    GETDNS_RRTYPE_A, NULL, NULL, NULL, callbackfn)))
+		FAIL_r("getdns_general");
+	print_warm(context, "asynchronous request");
+	getdns_context_run(context);
+	print_warm(context, "finished");
+	getdns_context_destroy(context);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+static const getdns_bulk_query queries[] = {
+	{ "a.bulk.test", GETDNS_RRTYPE_A },
+	{ "b.bulk.test", GETDNS_RRTYPE_A },
+	{ "c.bulk.test", GETDNS_RRTYPE_A },
+	{ "d.bulk.test", GETDNS_RRTYPE_A }
+};
+#define N_QUERIES (sizeof(queries) / sizeof(*queries))
+
+static int submitting = 0;
+static int called_back = 0;
+
+/* A stub upstream in this process.  It answers a query for <x>.bulk.test
+ * with 192.0.2.<x>, when and in the order the test tells it to.
+ */
+static int server_fd = -1;
+static struct query {
+	uint8_t                 wire[512];
+	size_t                  len;
+	struct sockaddr_storage from;
+	socklen_t               from_len;
+} received[N_QUERIES];
+static size_t n_received = 0;
+
+static uint16_t server_start()
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		FAIL("socket");
+	(void) memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    getsockname(server_fd, (struct sockaddr *)&addr, &addr_len))
+		FAIL("bind");
+	return ntohs(addr.sin_port);
+}
+
+static void server_receive()
+{
+	struct query *q = &received[n_received];
+	ssize_t len;
+
+	q->from_len = sizeof(q->from);
+	while (n_received < N_QUERIES && (len = recvfrom(server_fd, q->wire,
+	    sizeof(q->wire), MSG_DONTWAIT, (struct sockaddr *)&q->from,
+	    &q->from_len)) > 12) {
+		q->len = len;
+		q = &received[++n_received];
+		q->from_len = sizeof(q->from);
+	}
+}
+
+static void server_answer(char x)
+{
+	static const uint8_t answer[] = { 0xc0, 0x0c, 0, 1, 0, 1,
+	    0, 0, 0x01, 0x2c, 0, 4, 192, 0, 2 };
+	uint8_t *wire;
+	size_t i, qlen;
+
+	for (i = 0; i < n_received; i++)
+		if (received[i].wire[13] == x)
+			break;
+	if (i == n_received)
+		FAIL("No query for %c.bulk.test", x);
+	wire = received[i].wire;
+
+	/* Header and question (without the OPT RR) and the answer */
+	for (qlen = 12; wire[qlen]; qlen += wire[qlen] + 1)
+		;
+	qlen += 5;
+	wire[2] |= 0x80; /* QR */
+	wire[3] = 0;
+	wire[6] = 0; wire[7] = 1; /* ANCOUNT */
+	wire[8] = 0; wire[9] = 0;
+	wire[10] = 0; wire[11] = 0;
+	(void) memcpy(wire + qlen, answer, sizeof(answer));
+	wire[qlen + sizeof(answer)] = (uint8_t)(x - 'a' + 1);
+	if (sendto(server_fd, wire, qlen + sizeof(answer) + 1, 0,
+	    (struct sockaddr *)&received[i].from, received[i].from_len) < 0)
+		FAIL("sendto");
+}
+
+static getdns_context *create_context(getdns_transport_list_t transport,
+    const char *address, uint16_t port)
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_dict *upstream;
+	getdns_list *upstreams;
+	getdns_bindata address_data = { 4, NULL };
+	struct in_addr addr;
+
+	if ((r = getdns_context_create(&context, 0)))
+		FAIL_r("getdns_context_create");
+	if ((r = getdns_context_set_resolution_type(
+	    context, GETDNS_RESOLUTION_STUB)))
+		FAIL_r("getdns_context_set_resolution_type");
+	if ((r = getdns_context_set_dns_transport_list(context, 1, &transport)))
+		FAIL_r("getdns_context_set_dns_transport_list");
+	if (inet_pton(AF_INET, address, &addr) != 1)
+		FAIL("Bad address %s", address);
+	address_data.data = (uint8_t *)&addr;
+	if (!(upstream = getdns_dict_create()) ||
+	    !(upstreams = getdns_list_create()))
+		FAIL("Could not create upstreams");
+	if ((r = getdns_dict_util_set_string(upstream, "address_type", "IPv4")) ||
+	    (r = getdns_dict_set_bindata(upstream, "address_data", &address_data)) ||
+	    (r = getdns_dict_set_int(upstream,
+	        transport == GETDNS_TRANSPORT_TLS ? "tls_port" : "port", port)) ||
+	    (r = getdns_list_set_dict(upstreams, 0, upstream)))
+		FAIL_r("Setting upstream");
+	if ((r = getdns_context_set_upstream_recursive_servers(
+	    context, upstreams)))
+		FAIL_r("getdns_context_set_upstream_recursive_servers");
+	getdns_list_destroy(upstreams);
+	getdns_dict_destroy(upstream);
+	if ((r = getdns_context_set_timeout(context, 10000)))
+		FAIL_r("getdns_context_set_timeout");
+	return context;
+}
+
+static const char *callback_type_str(uint32_t callback_type)
+{
+	switch (callback_type) {
+	case GETDNS_CALLBACK_COMPLETE: return "complete";
+	case GETDNS_CALLBACK_CANCEL  : return "cancel";
+	case GETDNS_CALLBACK_TIMEOUT : return "timeout";
+	case GETDNS_CALLBACK_ERROR   : return "error";
+	default                      : return "unknown";
+	}
+}
+
+static void callbackfn(getdns_context *context,
+    getdns_callback_type_t callback_type, getdns_dict *response,
+    void *userarg, getdns_transaction_t transaction_id)
+{
+	getdns_list *responses;
+	getdns_dict *entry;
+	getdns_bindata *qname, *address;
+	uint32_t entry_type;
+	size_t i, n;
+	char *str;
+
+	(void)context; (void)userarg; (void)transaction_id;
+	called_back = 1;
+	printf("callback %s%s\n", callback_type_str(callback_type),
+	    submitting ? " during submission" : "");
+	if (callback_type != GETDNS_CALLBACK_COMPLETE)
+		FAIL("Unexpected callback type %d", (int)callback_type);
+	if (getdns_dict_get_list(response, "responses", &responses) ||
+	    getdns_list_get_length(responses, &n))
+		FAIL("No responses list");
+	if (n != N_QUERIES)
+		FAIL("%d responses for %d queries", (int)n, (int)N_QUERIES);
+
+	for (i = 0; i < n; i++) {
+		if (getdns_list_get_dict(responses, i, &entry) ||
+		    getdns_dict_get_int(entry, "callback_type", &entry_type))
+			FAIL("No callback_type for query %d", (int)i);
+
+		printf("  %s: %s", queries[i].name, callback_type_str(entry_type));
+		if (entry_type != GETDNS_CALLBACK_COMPLETE) {
+			printf("\n");
+			continue;
+		}
+		if (getdns_dict_get_bindata(entry,
+		    "/response/replies_tree/0/question/qname", &qname) ||
+		    getdns_dict_get_bindata(entry,
+		    "/response/just_address_answers/0/address_data", &address))
+			FAIL("Incomplete response for query %d", (int)i);
+		if (getdns_convert_dns_name_to_fqdn(qname, &str))
+			FAIL("Could not convert qname");
+		printf(", %s", str);
+		free(str);
+		if (!(str = getdns_display_ip_address(address)))
+			FAIL("Could not display address");
+		printf(" %s\n", str);
+		free(str);
+	}
+	getdns_dict_destroy(response);
+}
+
+static void bulk(getdns_context *context)
+{
+	getdns_return_t r;
+
+	called_back = 0;
+	submitting = 1;
+	if ((r = getdns_general_bulk(context, N_QUERIES, queries, NULL,
+	    NULL, NULL, callbackfn)))
+		FAIL_r("getdns_general_bulk");
+	submitting = 0;
+}
+
+/* Run the context's loop (without blocking) until the upstream has all
+ * queries
+ */
+static void wait_for_queries(getdns_context *context)
+{
+	getdns_eventloop *loop;
+	int i;
+
+	if (getdns_context_get_eventloop(context, &loop))
+		FAIL("getdns_context_get_eventloop");
+	n_received = 0;
+	for (i = 0; i < 1000 && n_received < N_QUERIES; i++) {
+		loop->vmt->run_once(loop, 0);
+		server_receive();
+		usleep(1000);
+	}
+	if (n_received < N_QUERIES)
+		FAIL("Only %d of %d queries received",
+		    (int)n_received, (int)N_QUERIES);
+}
+
+int main()
+{
+	getdns_context *context;
+	uint16_t port = server_start();
+
+	/* A TLS connection to a multicast address fails right away, so all
+	 * requests are finished during submission, and so is the batch.
+	 */
+	printf("finished during submission\n");
+	context = create_context(GETDNS_TRANSPORT_TLS, "224.0.0.1", 853);
+	bulk(context);
+	if (!called_back)
+		FAIL("Not called back during submission");
+	getdns_context_destroy(context);
+
+	/* Responses are in query order, not in the order of the answers */
+	printf("answered in reverse order\n");
+	context = create_context(GETDNS_TRANSPORT_UDP, "127.0.0.1", port);
+	bulk(context);
+	wait_for_queries(context);
+	server_answer('d');
+	server_answer('c');
+	server_answer('b');
+	server_answer('a');
+	getdns_context_run(context);
+	if (!called_back)
+		FAIL("Not called back");
+	getdns_context_destroy(context);
+
+	/* Outstanding queries are cancelled, and the callback still called */
+	printf("destroyed with half of the queries answered\n");
+	context = create_context(GETDNS_TRANSPORT_UDP, "127.0.0.1", port);
+	bulk(context);
+	wait_for_queries(context);
+	server_answer('c');
+	server_answer('a');
+	/* Until the answers have been processed */
+	for (n_received = 0; n_received < 100; n_received++) {
+		getdns_context_process_async(context);
+		usleep(1000);
+	}
+	if (called_back)
+		FAIL("Called back before all queries were done");
+	getdns_context_destroy(context);
+	if (!called_back)
+		FAIL("Not called back on destroy");
+
+	(void) close(server_fd);
+	exit(EXIT_SUCCESS);
+}
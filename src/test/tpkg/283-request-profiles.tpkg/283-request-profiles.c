@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+static const char *extensions_strs[] = {
+	NULL,
+	"{ dnssec_return_status: GETDNS_EXTENSION_TRUE }",
+	"{ add_opt_parameters: { maximum_udp_payload_size: 1232, do_bit: 1"
+	", options: [ { option_code: 65001, option_data: 0x0102 } ] } }",
+	"{ header: { cd: 1 }, specify_class: GETDNS_RRCLASS_CH }"
+};
+#define N_EXTENSIONS (sizeof(extensions_strs) / sizeof(*extensions_strs))
+
+static const getdns_bulk_query query = { "profile.test", GETDNS_RRTYPE_A };
+
+/* A stub upstream in this process that only receives the queries */
+#define MAX_QUERIES 3
+static int server_fd = -1;
+static struct query {
+	uint8_t wire[512];
+	size_t  len;
+} received[MAX_QUERIES];
+static size_t n_received = 0;
+
+static uint16_t server_start()
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		FAIL("socket");
+	(void) memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    getsockname(server_fd, (struct sockaddr *)&addr, &addr_len))
+		FAIL("bind");
+	return ntohs(addr.sin_port);
+}
+
+static void server_receive()
+{
+	ssize_t len;
+
+	while (n_received < MAX_QUERIES && (len = recv(server_fd,
+	    received[n_received].wire, sizeof(received[n_received].wire),
+	    MSG_DONTWAIT)) > 12)
+		received[n_received++].len = len;
+}
+
+static getdns_context *create_context(uint16_t port)
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_dict *upstream;
+	getdns_list *upstreams;
+	getdns_bindata localhost = { 4, (uint8_t *)"\x7f\x00\x00\x01" };
+	getdns_transport_list_t udp = GETDNS_TRANSPORT_UDP;
+
+	if ((r = getdns_context_create(&context, 0)))
+		FAIL_r("getdns_context_create");
+	if ((r = getdns_context_set_resolution_type(
+	    context, GETDNS_RESOLUTION_STUB)))
+		FAIL_r("getdns_context_set_resolution_type");
+	if ((r = getdns_context_set_dns_transport_list(context, 1, &udp)))
+		FAIL_r("getdns_context_set_dns_transport_list");
+	if (!(upstream = getdns_dict_create()) ||
+	    !(upstreams = getdns_list_create()))
+		FAIL("Could not create upstreams");
+	if ((r = getdns_dict_util_set_string(upstream, "address_type", "IPv4")) ||
+	    (r = getdns_dict_set_bindata(upstream, "address_data", &localhost)) ||
+	    (r = getdns_dict_set_int(upstream, "port", port)) ||
+	    (r = getdns_list_set_dict(upstreams, 0, upstream)))
+		FAIL_r("Setting upstream");
+	if ((r = getdns_context_set_upstream_recursive_servers(
+	    context, upstreams)))
+		FAIL_r("getdns_context_set_upstream_recursive_servers");
+	getdns_list_destroy(upstreams);
+	getdns_dict_destroy(upstream);
+	if ((r = getdns_context_set_timeout(context, 10000)))
+		FAIL_r("getdns_context_set_timeout");
+	return context;
+}
+
+static void callbackfn(getdns_context *context,
+    getdns_callback_type_t callback_type, getdns_dict *response,
+    void *userarg, getdns_transaction_t transaction_id)
+{
+	(void)context; (void)callback_type; (void)userarg; (void)transaction_id;
+	getdns_dict_destroy(response);
+}
+
+/* Run the context's loop (without blocking) until the upstream has
+ * MAX_QUERIES queries
+ */
+static void wait_for_queries(getdns_context *context)
+{
+	getdns_eventloop *loop;
+	int i;
+
+	if (getdns_context_get_eventloop(context, &loop))
+		FAIL("getdns_context_get_eventloop");
+	for (i = 0; i < 1000 && n_received < MAX_QUERIES; i++) {
+		loop->vmt->run_once(loop, 0);
+		server_receive();
+		usleep(1000);
+	}
+	if (n_received < MAX_QUERIES)
+		FAIL("Only %d of %d queries received",
+		    (int)n_received, (int)MAX_QUERIES);
+}
+
+/* Print the header flags, the class and the OPT RR of a query */
+static void print_query(const struct query *q)
+{
+	size_t i = 12, rdlen;
+
+	printf("flags %.2x%.2x", (int)q->wire[2], (int)q->wire[3]);
+	while (i < q->len && q->wire[i])
+		i += q->wire[i] + 1;
+	i += 5;
+	if (i > q->len)
+		FAIL("Malformed query");
+	printf(", class %d", (int)(q->wire[i - 2] << 8 | q->wire[i - 1]));
+	if (!q->wire[11]) {
+		printf(", no OPT RR\n");
+		return;
+	}
+	if (i + 11 > q->len)
+		FAIL("Malformed OPT RR");
+	printf(", OPT udp %d, rcode %d, version %d, do %d, options",
+	    (int)(q->wire[i + 3] << 8 | q->wire[i + 4]), (int)q->wire[i + 5],
+	    (int)q->wire[i + 6], (int)(q->wire[i + 7] >> 7));
+	rdlen = q->wire[i + 9] << 8 | q->wire[i + 10];
+	for (i += 11; rdlen >= 4 && i + 4 <= q->len; ) {
+		size_t opt_len = q->wire[i + 2] << 8 | q->wire[i + 3];
+
+		printf(" %d", (int)(q->wire[i] << 8 | q->wire[i + 1]));
+		i += 4 + opt_len;
+		rdlen -= rdlen < 4 + opt_len ? rdlen : 4 + opt_len;
+	}
+	printf("\n");
+}
+
+/* The same query with the extensions dict, with the profile and with the
+ * profile in a batch, should give the same queries (apart from the ID).
+ */
+static void check(getdns_context *context, const char *extensions_str,
+    getdns_dict *extensions, getdns_request_profile *profile)
+{
+	getdns_return_t r;
+	size_t i;
+
+	n_received = 0;
+	if ((r = getdns_general(context, query.name, query.request_type,
+	    extensions, NULL, NULL, callbackfn)))
+		FAIL_r("getdns_general");
+	if ((r = getdns_general_with_profile(context, query.name,
+	    query.request_type, profile, NULL, NULL, callbackfn)))
+		FAIL_r("getdns_general_with_profile");
+	if ((r = getdns_general_bulk_with_profile(context, 1, &query,
+	    profile, NULL, NULL, callbackfn)))
+		FAIL_r("getdns_general_bulk_with_profile");
+	wait_for_queries(context);
+
+	for (i = 1; i < MAX_QUERIES; i++)
+		if (received[i].len != received[0].len ||
+		    memcmp(received[i].wire + 2, received[0].wire + 2,
+		    received[0].len - 2))
+			FAIL("Query %d differs with %s", (int)i,
+			    extensions_str ? extensions_str : "no extensions");
+	printf("  ");
+	print_query(&received[0]);
+}
+
+int main()
+{
+	getdns_return_t r;
+	getdns_context *context, *other_context;
+	getdns_dict *extensions[N_EXTENSIONS], *config;
+	getdns_request_profile *profiles[N_EXTENSIONS];
+	uint16_t port = server_start();
+	size_t i;
+
+	context = create_context(port);
+	for (i = 0; i < N_EXTENSIONS; i++) {
+		extensions[i] = NULL;
+		if (extensions_strs[i] && (r = getdns_str2dict(
+		    extensions_strs[i], &extensions[i])))
+			FAIL_r("getdns_str2dict");
+		if ((r = getdns_request_profile_create(
+		    context, extensions[i], &profiles[i])))
+			FAIL_r("getdns_request_profile_create");
+	}
+	printf("with the initial configuration\n");
+	for (i = 0; i < N_EXTENSIONS; i++)
+		check(context, extensions_strs[i], extensions[i], profiles[i]);
+
+	/* The profiles pick up the new configuration with their first
+	 * request, also for settings that are not dispatched.
+	 */
+	if ((r = getdns_context_set_edns_maximum_udp_payload_size(
+	    context, 1400)))
+		FAIL_r("getdns_context_set_edns_maximum_udp_payload_size");
+	if ((r = getdns_context_set_edns_do_bit(context, 1)))
+		FAIL_r("getdns_context_set_edns_do_bit");
+	if ((r = getdns_str2dict("{ header: { rd: 0 }, add_opt_parameters: "
+	    "{ options: [ { option_code: 65002, option_data: 0x03 } ] } }",
+	    &config)))
+		FAIL_r("getdns_str2dict");
+	if ((r = getdns_context_config(context, config)))
+		FAIL_r("getdns_context_config");
+	getdns_dict_destroy(config);
+	printf("with the changed configuration\n");
+	for (i = 0; i < N_EXTENSIONS; i++)
+		check(context, extensions_strs[i], extensions[i], profiles[i]);
+
+	/* A profile can only be used with the context it was created for */
+	other_context = create_context(port);
+	if (getdns_general_with_profile(other_context, query.name,
+	    query.request_type, profiles[0], NULL, NULL, callbackfn)
+	    != GETDNS_RETURN_INVALID_PARAMETER)
+		FAIL("Profile used with another context");
+	getdns_context_destroy(other_context);
+
+	for (i = 0; i < N_EXTENSIONS; i++) {
+		getdns_request_profile_destroy(profiles[i]);
+		getdns_dict_destroy(extensions[i]);
+	}
+	getdns_context_destroy(context);
+	(void) close(server_fd);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,272 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "context.h"
+#include "gldns/gbuffer.h"
+#include "gldns/pkthdr.h"
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+static const struct tsig_alg {
+	getdns_tsig_algo alg;
+	const EVP_MD  *(*md)(void);
+} algs[] = {
+#ifdef HAVE_EVP_MD5
+	  { GETDNS_HMAC_MD5   , EVP_md5    },
+#endif
+#ifdef HAVE_EVP_SHA1
+	  { GETDNS_HMAC_SHA1  , EVP_sha1   },
+#endif
+#ifdef HAVE_EVP_SHA224
+	  { GETDNS_HMAC_SHA224, EVP_sha224 },
+#endif
+#ifdef HAVE_EVP_SHA256
+	  { GETDNS_HMAC_SHA256, EVP_sha256 },
+#endif
+#ifdef HAVE_EVP_SHA384
+	  { GETDNS_HMAC_SHA384, EVP_sha384 },
+#endif
+#ifdef HAVE_EVP_SHA512
+	  { GETDNS_HMAC_SHA512, EVP_sha512 },
+#endif
+	  { GETDNS_NO_TSIG    , NULL       }
+};
+
+static const uint8_t key_name[] = "\x08tsig-key\x07" "example";
+
+/* A key shorter than, and one longer than the block size of all digests,
+ * which the HMAC hashes first.
+ */
+static uint8_t key[200];
+static const size_t key_sizes[] = { 16, sizeof(key) };
+#define N_KEY_SIZES (sizeof(key_sizes) / sizeof(*key_sizes))
+
+static getdns_context *create_context(
+    const getdns_tsig_info *info, size_t key_size)
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_dict *upstream;
+	getdns_list *upstreams;
+	getdns_bindata localhost = { 4, (uint8_t *)"\x7f\x00\x00\x01" };
+	getdns_bindata secret = { 0, key };
+
+	secret.size = key_size;
+	if ((r = getdns_context_create(&context, 0)))
+		FAIL_r("getdns_context_create");
+	if ((r = getdns_context_set_resolution_type(
+	    context, GETDNS_RESOLUTION_STUB)))
+		FAIL_r("getdns_context_set_resolution_type");
+	if (!(upstream = getdns_dict_create()) ||
+	    !(upstreams = getdns_list_create()))
+		FAIL("Could not create upstreams");
+	if ((r = getdns_dict_util_set_string(upstream, "address_type", "IPv4")) ||
+	    (r = getdns_dict_set_bindata(upstream, "address_data", &localhost)) ||
+	    (r = getdns_dict_util_set_string(upstream, "tsig_name",
+	        "tsig-key.example.")) ||
+	    (r = getdns_dict_util_set_string(upstream, "tsig_algorithm",
+	        (char *)info->name)) ||
+	    (r = getdns_dict_set_bindata(upstream, "tsig_secret", &secret)) ||
+	    (r = getdns_list_set_dict(upstreams, 0, upstream)))
+		FAIL_r("Setting upstream");
+	if ((r = getdns_context_set_upstream_recursive_servers(
+	    context, upstreams)))
+		FAIL_r("getdns_context_set_upstream_recursive_servers");
+	getdns_list_destroy(upstreams);
+	getdns_dict_destroy(upstream);
+	if ((r = _getdns_context_prepare_for_resolution(context, 0)))
+		FAIL_r("_getdns_context_prepare_for_resolution");
+	return context;
+}
+
+/* Append a TSIG RR to the message of len octets in buf, the way RFC 8945
+ * describes it, independently from the library.  With request_mac for a
+ * response.  Returns the length of the signed message.
+ */
+static size_t tsig_sign(const struct tsig_alg *alg,
+    const getdns_tsig_info *info, size_t key_size,
+    const uint8_t *request_mac, size_t request_mac_len,
+    uint8_t *buf, size_t len, uint64_t time_signed)
+{
+	uint8_t data[2048], md_buf[EVP_MAX_MD_SIZE];
+	unsigned int md_len = EVP_MAX_MD_SIZE;
+	gldns_buffer gbuf;
+
+	gldns_buffer_init_frm_data(&gbuf, data, sizeof(data));
+	if (request_mac) {
+		gldns_buffer_write_u16(&gbuf, request_mac_len);
+		gldns_buffer_write(&gbuf, request_mac, request_mac_len);
+	}
+	gldns_buffer_write(&gbuf, buf, len);
+	gldns_buffer_write(&gbuf, key_name, sizeof(key_name));	/* Name */
+	gldns_buffer_write_u16(&gbuf, GETDNS_RRCLASS_ANY);	/* Class */
+	gldns_buffer_write_u32(&gbuf, 0);			/* TTL */
+	gldns_buffer_write(&gbuf, info->dname, info->dname_len);
+	gldns_buffer_write_u48(&gbuf, time_signed);	/* Time Signed */
+	gldns_buffer_write_u16(&gbuf, 300);		/* Fudge */
+	gldns_buffer_write_u16(&gbuf, 0);		/* Error */
+	gldns_buffer_write_u16(&gbuf, 0);		/* Other len */
+	(void) HMAC(alg->md(), key, key_size, data,
+	    gldns_buffer_position(&gbuf), md_buf, &md_len);
+
+	gldns_buffer_init_frm_data(&gbuf, buf + len, 1024 - len);
+	gldns_buffer_write(&gbuf, key_name, sizeof(key_name));	/* Name */
+	gldns_buffer_write_u16(&gbuf, GETDNS_RRTYPE_TSIG);	/* Type */
+	gldns_buffer_write_u16(&gbuf, GETDNS_RRCLASS_ANY);	/* Class */
+	gldns_buffer_write_u32(&gbuf, 0);			/* TTL */
+	gldns_buffer_write_u16(&gbuf,
+	    (uint16_t)(info->dname_len + 10 + md_len + 6));	/* RdLen */
+	gldns_buffer_write(&gbuf, info->dname, info->dname_len);
+	gldns_buffer_write_u48(&gbuf, time_signed);	/* Time Signed */
+	gldns_buffer_write_u16(&gbuf, 300);		/* Fudge */
+	gldns_buffer_write_u16(&gbuf, md_len);		/* MAC Size */
+	gldns_buffer_write(&gbuf, md_buf, md_len);	/* MAC */
+	gldns_buffer_write(&gbuf, buf, 2);		/* Original ID */
+	gldns_buffer_write_u16(&gbuf, 0);		/* Error */
+	gldns_buffer_write_u16(&gbuf, 0);		/* Other len */
+
+	gldns_write_uint16(buf + GLDNS_ARCOUNT_OFF, GLDNS_ARCOUNT(buf) + 1);
+	return len + gldns_buffer_position(&gbuf);
+}
+
+static const char *tsig_status_str(int tsig_status)
+{
+	switch (tsig_status) {
+	case GETDNS_DNSSEC_SECURE       : return "secure";
+	case GETDNS_DNSSEC_BOGUS        : return "bogus";
+	case GETDNS_DNSSEC_INSECURE     : return "insecure";
+	case GETDNS_DNSSEC_INDETERMINATE: return "indeterminate";
+	default                         : return "unknown";
+	}
+}
+
+/* Validate response with netreq as the stub does, and return the status */
+static const char *validate(getdns_network_req *netreq,
+    uint8_t *response, size_t response_len)
+{
+	uint8_t *query_response = netreq->response;
+	size_t query_response_len = netreq->response_len;
+	const char *status;
+
+	netreq->tsig_status = GETDNS_DNSSEC_INSECURE;
+	netreq->response = response;
+	netreq->response_len = response_len;
+	_getdns_network_validate_tsig(netreq);
+	status = tsig_status_str(netreq->tsig_status);
+	netreq->response = query_response;
+	netreq->response_len = query_response_len;
+	return status;
+}
+
+/* Sign a query with the upstream's key, check the signature and validate
+ * a response to it with the library.
+ */
+static void sign_and_verify(const struct tsig_alg *alg,
+    const getdns_tsig_info *info, size_t key_size,
+    getdns_network_req *netreq)
+{
+	uint8_t ref[1024], response[1024], *time_signed;
+	size_t query_len, len, ref_len, response_len, mac_len;
+	uint64_t t;
+
+	_getdns_network_req_clear_upstream_options(netreq);
+	query_len = netreq->response - netreq->query;
+	len = _getdns_network_req_add_tsig(netreq);
+	mac_len = EVP_MD_size(alg->md());
+	if (len != query_len + sizeof(key_name) + 10 + info->dname_len
+	    + 16 + mac_len)
+		FAIL("Unexpected signed query length %d", (int)len);
+	if (netreq->tsig_status != GETDNS_DNSSEC_INSECURE)
+		FAIL("Query not marked as signed");
+
+	/* The same as signed from scratch, at the same time */
+	time_signed = netreq->query + len - 16 - mac_len;
+	t = (uint64_t)gldns_read_uint16(time_signed) << 32
+	  | gldns_read_uint32(time_signed + 2);
+	if (t + 300 < (uint64_t)time(NULL) || t > (uint64_t)time(NULL) + 300)
+		FAIL("Time signed is off");
+	(void) memcpy(ref, netreq->query, query_len);
+	gldns_write_uint16(ref + GLDNS_ARCOUNT_OFF, GLDNS_ARCOUNT(ref) - 1);
+	ref_len = tsig_sign(alg, info, key_size, NULL, 0, ref, query_len, t);
+	printf("  query %s", ref_len == len &&
+	    memcmp(ref, netreq->query, len) == 0 ? "signed" : "MISMATCH");
+
+	/* A response, signed by the upstream */
+	(void) memcpy(response, ref, query_len);
+	gldns_write_uint16(response + GLDNS_ARCOUNT_OFF, GLDNS_ARCOUNT(response) - 1);
+	GLDNS_QR_SET(response);
+	GLDNS_RA_SET(response);
+	response_len = tsig_sign(alg, info, key_size,
+	    netreq->query + len - 6 - mac_len, mac_len,
+	    response, query_len, (uint64_t)time(NULL));
+	printf(", response %s", validate(netreq, response, response_len));
+
+	/* Changed after signing */
+	GLDNS_RA_CLR(response);
+	printf(", changed %s", validate(netreq, response, response_len));
+	GLDNS_RA_SET(response);
+
+	/* Without TSIG */
+	gldns_write_uint16(response + GLDNS_ARCOUNT_OFF, GLDNS_ARCOUNT(response) - 1);
+	printf(", unsigned %s", validate(netreq, response, query_len));
+	gldns_write_uint16(response + GLDNS_ARCOUNT_OFF, GLDNS_ARCOUNT(response) + 1);
+
+	/* For another request */
+	(void) memcpy(response, ref, query_len);
+	gldns_write_uint16(response + GLDNS_ARCOUNT_OFF, GLDNS_ARCOUNT(response) - 1);
+	GLDNS_QR_SET(response);
+	response_len = tsig_sign(alg, info, key_size,
+	    (const uint8_t *)"0123456789abcdef0123456789abcdef"
+	    "0123456789abcdef0123456789abcdef", mac_len,
+	    response, query_len, (uint64_t)time(NULL));
+	printf(", other request %s\n", validate(netreq, response, response_len));
+}
+
+int main()
+{
+	const struct tsig_alg *alg;
+	const getdns_tsig_info *info;
+	getdns_context *context;
+	getdns_dns_req *req;
+	size_t i, j;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = (uint8_t)(i * 7 + 1);
+
+	for (alg = algs; alg->md; alg++) {
+		if (!(info = _getdns_get_tsig_info(alg->alg)))
+			FAIL("No TSIG info for algorithm %d", (int)alg->alg);
+		for (i = 0; i < N_KEY_SIZES; i++) {
+			printf("%s with a %d octet key\n",
+			    info->name, (int)key_sizes[i]);
+			context = create_context(info, key_sizes[i]);
+			if (!(req = _getdns_dns_req_new(context,
+			    context->extension, "example.", GETDNS_RRTYPE_SOA,
+			    NULL)))
+				FAIL("Could not create request");
+			req->netreqs[0]->upstream =
+			    &context->upstreams->upstreams[0];
+
+			/* Twice, because the keyed state is reused */
+			for (j = 0; j < 2; j++)
+				sign_and_verify(alg, info, key_sizes[i],
+				    req->netreqs[0]);
+
+			_getdns_dns_req_free(req);
+			getdns_context_destroy(context);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
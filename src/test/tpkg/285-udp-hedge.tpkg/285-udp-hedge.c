@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+/* Lower bound (in ms) of the delay before a UDP query is hedged, as in
+ * stub.c
+ */
+#define MIN_HEDGE_DELAY 20
+
+static int called_back = 0;
+
+/* Two stub upstreams in this process.  Which one is queried first is up to
+ * the upstream selection, so their roles are assigned on arrival: the
+ * first one to receive the query is the primary and stays silent until the
+ * test tells it to answer, the other one receives the hedge.  An upstream
+ * answers with 192.0.2.<n>, where <n> is its number in the upstreams list.
+ */
+static struct server {
+	int                     fd;
+	uint16_t                port;
+	int                     received;
+	uint8_t                 wire[512];
+	size_t                  len;
+	struct sockaddr_storage from;
+	socklen_t               from_len;
+	uint64_t                time;
+} servers[2];
+static struct server *primary, *hedge;
+
+static uint64_t now_ms()
+{
+	struct timeval tv;
+
+	(void) gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void server_start(struct server *s)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if ((s->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		FAIL("socket");
+	(void) memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    getsockname(s->fd, (struct sockaddr *)&addr, &addr_len))
+		FAIL("bind");
+	s->port = ntohs(addr.sin_port);
+}
+
+static void server_receive(struct server *s)
+{
+	ssize_t len;
+
+	s->from_len = sizeof(s->from);
+	while ((len = recvfrom(s->fd, s->wire, sizeof(s->wire), MSG_DONTWAIT,
+	    (struct sockaddr *)&s->from, &s->from_len)) > 12) {
+		s->len = len;
+		s->received++;
+		s->time = now_ms();
+		if (!primary)
+			primary = s;
+		else if (s != primary && !hedge)
+			hedge = s;
+		s->from_len = sizeof(s->from);
+	}
+}
+
+static void server_answer(struct server *s)
+{
+	static const uint8_t answer[] = { 0xc0, 0x0c, 0, 1, 0, 1,
+	    0, 0, 0x01, 0x2c, 0, 4, 192, 0, 2 };
+	uint8_t *wire = s->wire;
+	size_t qlen;
+
+	/* Header and question (without the OPT RR) and the answer */
+	for (qlen = 12; wire[qlen]; qlen += wire[qlen] + 1)
+		;
+	qlen += 5;
+	wire[2] |= 0x80; /* QR */
+	wire[3] = 0;
+	wire[6] = 0; wire[7] = 1; /* ANCOUNT */
+	wire[8] = 0; wire[9] = 0;
+	wire[10] = 0; wire[11] = 0;
+	(void) memcpy(wire + qlen, answer, sizeof(answer));
+	wire[qlen + sizeof(answer)] = (uint8_t)(s - servers + 1);
+	if (sendto(s->fd, wire, qlen + sizeof(answer) + 1, 0,
+	    (struct sockaddr *)&s->from, s->from_len) < 0)
+		FAIL("sendto");
+}
+
+static getdns_context *create_context()
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_dict *upstream;
+	getdns_list *upstreams;
+	getdns_bindata localhost = { 4, (uint8_t *)"\x7f\x00\x00\x01" };
+	getdns_transport_list_t udp = GETDNS_TRANSPORT_UDP;
+	size_t i;
+
+	if ((r = getdns_context_create(&context, 0)))
+		FAIL_r("getdns_context_create");
+	if ((r = getdns_context_set_resolution_type(
+	    context, GETDNS_RESOLUTION_STUB)))
+		FAIL_r("getdns_context_set_resolution_type");
+	if ((r = getdns_context_set_dns_transport_list(context, 1, &udp)))
+		FAIL_r("getdns_context_set_dns_transport_list");
+	if (!(upstreams = getdns_list_create()))
+		FAIL("Could not create upstreams");
+	for (i = 0; i < 2; i++) {
+		if (!(upstream = getdns_dict_create()))
+			FAIL("Could not create upstream");
+		if ((r = getdns_dict_util_set_string(
+		        upstream, "address_type", "IPv4")) ||
+		    (r = getdns_dict_set_bindata(
+		        upstream, "address_data", &localhost)) ||
+		    (r = getdns_dict_set_int(
+		        upstream, "port", servers[i].port)) ||
+		    (r = getdns_list_set_dict(upstreams, i, upstream)))
+			FAIL_r("Setting upstream");
+		getdns_dict_destroy(upstream);
+	}
+	if ((r = getdns_context_set_upstream_recursive_servers(
+	    context, upstreams)))
+		FAIL_r("getdns_context_set_upstream_recursive_servers");
+	getdns_list_destroy(upstreams);
+	if ((r = getdns_context_set_timeout(context, 10000)))
+		FAIL_r("getdns_context_set_timeout");
+	if ((r = getdns_context_set_udp_hedging(context, 1)))
+		FAIL_r("getdns_context_set_udp_hedging");
+	return context;
+}
+
+/* The number of open file descriptors of this process */
+static int count_fds()
+{
+	int fd, n = 0;
+
+	for (fd = 0; fd < 1024; fd++)
+		if (fcntl(fd, F_GETFD) != -1)
+			n++;
+	return n;
+}
+
+static const char *callback_type_str(uint32_t callback_type)
+{
+	switch (callback_type) {
+	case GETDNS_CALLBACK_COMPLETE: return "complete";
+	case GETDNS_CALLBACK_CANCEL  : return "cancel";
+	case GETDNS_CALLBACK_TIMEOUT : return "timeout";
+	case GETDNS_CALLBACK_ERROR   : return "error";
+	default                      : return "unknown";
+	}
+}
+
+static void callbackfn(getdns_context *context,
+    getdns_callback_type_t callback_type, getdns_dict *response,
+    void *userarg, getdns_transaction_t transaction_id)
+{
+	getdns_bindata *address;
+	char *str;
+
+	(void)context; (void)userarg; (void)transaction_id;
+	called_back++;
+	printf("  callback %s", callback_type_str(callback_type));
+	if (callback_type == GETDNS_CALLBACK_COMPLETE) {
+		if (getdns_dict_get_bindata(response,
+		    "/just_address_answers/0/address_data", &address))
+			FAIL("No address in the response");
+		if (!(str = getdns_display_ip_address(address)))
+			FAIL("Could not display address");
+		printf(", %s from the %s upstream", str,
+		    str[strlen(str) - 1] - '1' == primary - servers
+		    ? "primary" : "hedge");
+		free(str);
+	}
+	printf("\n");
+	getdns_dict_destroy(response);
+}
+
+/* Run the context's loop (without blocking) for at most max_ms ms, or
+ * until done returns true
+ */
+static void run(getdns_context *context, int max_ms, int (*done)())
+{
+	getdns_eventloop *loop;
+	uint64_t end = now_ms() + max_ms;
+
+	if (getdns_context_get_eventloop(context, &loop))
+		FAIL("getdns_context_get_eventloop");
+	while ((!done || !done()) && now_ms() < end) {
+		loop->vmt->run_once(loop, 0);
+		server_receive(&servers[0]);
+		server_receive(&servers[1]);
+		usleep(1000);
+	}
+}
+
+static int is_hedged()
+{
+	return hedge != NULL;
+}
+
+static int is_called_back()
+{
+	return called_back > 0;
+}
+
+/* Submit a query and wait until it is hedged */
+static getdns_transaction_t hedged_query(getdns_context *context)
+{
+	getdns_return_t r;
+	getdns_transaction_t transaction_id;
+
+	called_back = 0;
+	primary = hedge = NULL;
+	servers[0].received = servers[1].received = 0;
+	if ((r = getdns_general(context, "hedge.test", GETDNS_RRTYPE_A,
+	    NULL, NULL, &transaction_id, callbackfn)))
+		FAIL_r("getdns_general");
+	run(context, 3000, is_hedged);
+	if (!hedge)
+		FAIL("Not hedged");
+	if (hedge->time - primary->time < MIN_HEDGE_DELAY)
+		FAIL("Hedged after %d ms", (int)(hedge->time - primary->time));
+	if (primary->received != 1 || hedge->received != 1)
+		FAIL("Received %d queries by the primary and %d by the hedge"
+		    " upstream", primary->received, hedge->received);
+	if (primary->len != hedge->len ||
+	    memcmp(primary->wire + 2, hedge->wire + 2, primary->len - 2))
+		FAIL("The hedge differs from the query");
+	if (called_back)
+		FAIL("Called back before an answer");
+	printf("  hedged\n");
+	return transaction_id;
+}
+
+/* The first answer is delivered, exactly once.  Both transmissions are
+ * then closed, so the answer to the other one is not delivered either.
+ */
+static void answered(int by_hedge)
+{
+	getdns_context *context = create_context();
+	int fds = count_fds();
+
+	(void) hedged_query(context);
+	if (count_fds() != fds + 2)
+		FAIL("%d file descriptors for two transmissions",
+		    count_fds() - fds);
+	server_answer(by_hedge ? hedge : primary);
+	run(context, 1000, is_called_back);
+	if (called_back != 1)
+		FAIL("Called back %d times", called_back);
+	if (count_fds() != fds)
+		FAIL("%d file descriptors left open", count_fds() - fds);
+
+	server_answer(by_hedge ? primary : hedge);
+	run(context, 100, NULL);
+	if (called_back != 1)
+		FAIL("Called back %d times", called_back);
+	printf("  late answer discarded\n");
+	getdns_context_destroy(context);
+}
+
+int main()
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_transaction_t transaction_id;
+	int fds;
+
+	server_start(&servers[0]);
+	server_start(&servers[1]);
+
+	/* The hedge wins by answering on the new transmission */
+	printf("answered by the hedge upstream\n");
+	answered(1);
+
+	/* The primary still wins by answering on the (now hedged) original
+	 * transmission
+	 */
+	printf("answered by the primary upstream after hedging\n");
+	answered(0);
+
+	printf("cancelled while hedging\n");
+	context = create_context();
+	fds = count_fds();
+	transaction_id = hedged_query(context);
+	if ((r = getdns_cancel_callback(context, transaction_id)))
+		FAIL_r("getdns_cancel_callback");
+	if (called_back != 1)
+		FAIL("Called back %d times", called_back);
+	if (count_fds() != fds)
+		FAIL("%d file descriptors left open", count_fds() - fds);
+	getdns_context_destroy(context);
+
+	printf("destroyed while hedging\n");
+	context = create_context();
+	fds = count_fds();
+	(void) hedged_query(context);
+	getdns_context_destroy(context);
+	if (called_back != 1)
+		FAIL("Called back %d times", called_back);
+	if (count_fds() > fds)
+		FAIL("%d file descriptors left open", count_fds() - fds);
+
+	(void) close(servers[0].fd);
+	(void) close(servers[1].fd);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,229 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "util-internal.h"
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+#define N_IDS 65536
+
+static struct mem_funcs *mf;
+static _getdns_qid_table table;
+
+/* The network requests the table should have, by query id */
+static getdns_network_req *registered[N_IDS];
+static size_t n_registered = 0;
+
+/* The table only uses the query_id of the network requests */
+static getdns_network_req *netreqs;
+
+static void add(getdns_network_req *netreq)
+{
+	int query_id;
+
+	if ((query_id = _getdns_qid_table_add(&table, mf, netreq)) < 0)
+		FAIL("Could not add a network request");
+	if (query_id != netreq->query_id)
+		FAIL("Query id %d returned, but %d set",
+		    query_id, (int)netreq->query_id);
+	if (query_id == _GETDNS_QID_RESERVED)
+		FAIL("The reserved query id handed out");
+	if (registered[query_id])
+		FAIL("Query id %d handed out twice", query_id);
+	registered[query_id] = netreq;
+	n_registered++;
+}
+
+static void remove_id(uint16_t query_id)
+{
+	getdns_network_req *netreq = _getdns_qid_table_remove(&table, query_id);
+
+	if (netreq != registered[query_id])
+		FAIL("Query id %d removed %p instead of %p", (int)query_id,
+		    (void *)netreq, (void *)registered[query_id]);
+	if (netreq) {
+		registered[query_id] = NULL;
+		n_registered--;
+	}
+}
+
+static void del(getdns_network_req *netreq)
+{
+	_getdns_qid_table_del(&table, netreq);
+	if (registered[netreq->query_id] == netreq) {
+		registered[netreq->query_id] = NULL;
+		n_registered--;
+	}
+}
+
+/* Check that every registered network request can be found from the home
+ * slot of its query id without passing an empty slot, and that nothing
+ * else is in the table.
+ * Returns the number of network requests that wrapped around the end of
+ * the slots.
+ */
+static size_t check()
+{
+	size_t i, j, n = 0, wrapped = 0;
+	getdns_network_req *netreq;
+
+	if (table.count != n_registered)
+		FAIL("Count %d for %d registered",
+		    (int)table.count, (int)n_registered);
+	if (!table.slots)
+		return 0;
+	if (table.count * 2 > table.mask + 1 &&
+	    table.mask + 1 != _GETDNS_QID_TABLE_MAX_SLOTS)
+		FAIL("%d network requests in %d slots",
+		    (int)table.count, (int)table.mask + 1);
+
+	for (i = 0; i <= table.mask; i++) {
+		if (!(netreq = table.slots[i]))
+			continue;
+		n++;
+		if (registered[netreq->query_id] != netreq)
+			FAIL("Unregistered query id %d in the table",
+			    (int)netreq->query_id);
+		for (j = netreq->query_id & table.mask; j != i;
+		    j = (j + 1) & table.mask)
+			if (!table.slots[j])
+				FAIL("Query id %d is unreachable",
+				    (int)netreq->query_id);
+		if (i < (netreq->query_id & table.mask))
+			wrapped++;
+	}
+	if (n != n_registered)
+		FAIL("%d network requests in the table for %d registered",
+		    (int)n, (int)n_registered);
+	return wrapped;
+}
+
+/* A registered query id, picked at random */
+static uint16_t any_registered()
+{
+	uint16_t query_id;
+
+	do query_id = (uint16_t)arc4random();
+	while (!registered[query_id]);
+	return query_id;
+}
+
+static void clear()
+{
+	_getdns_qid_table_clear(&table, mf);
+	(void) memset(registered, 0, sizeof(registered));
+	n_registered = 0;
+}
+
+int main()
+{
+	getdns_return_t r;
+	getdns_context *context;
+	size_t i, n_ops, n_wrapped_removes;
+	uint16_t query_id;
+
+	if ((r = getdns_context_create(&context, 0)))
+		FAIL_r("getdns_context_create");
+	mf = &context->mf;
+	if (!(netreqs = calloc(N_IDS, sizeof(getdns_network_req))))
+		FAIL("Out of memory");
+
+	printf("empty table\n");
+	_getdns_qid_table_init(&table);
+	if (_getdns_qid_table_any(&table))
+		FAIL("Network request in an empty table");
+	remove_id(_GETDNS_QID_RESERVED);
+	remove_id(1);
+	del(&netreqs[0]);
+	(void) check();
+
+	/* Removal shifts back the rest of the probe run, so there are no
+	 * tombstones and freed slots are reused.  With at most half of the
+	 * minimum number of slots in use, the table never grows.  Runs that
+	 * wrap around the end of the slots must be removed from as well.
+	 */
+	printf("random adds and removes in %d slots\n",
+	    _GETDNS_QID_TABLE_MIN_SLOTS);
+	n_wrapped_removes = 0;
+	for (n_ops = 0; n_ops < 1000000 && n_wrapped_removes < 1000; n_ops++) {
+		/* Toggle the registration of one of the network requests */
+		i = arc4random_uniform(_GETDNS_QID_TABLE_MIN_SLOTS / 2 - 1);
+		if (registered[netreqs[i].query_id] != &netreqs[i])
+			add(&netreqs[i]);
+		else {
+			if (check())
+				n_wrapped_removes++;
+			if (n_ops % 2)
+				remove_id(netreqs[i].query_id);
+			else
+				del(&netreqs[i]);
+		}
+		(void) check();
+		if (table.mask + 1 != _GETDNS_QID_TABLE_MIN_SLOTS)
+			FAIL("Grown to %d slots with %d network requests",
+			    (int)table.mask + 1, (int)n_registered);
+		if (!n_registered != !_getdns_qid_table_any(&table))
+			FAIL("_getdns_qid_table_any with %d network requests",
+			    (int)n_registered);
+	}
+	if (n_wrapped_removes < 1000)
+		FAIL("Only %d removes from wrapped runs", (int)n_wrapped_removes);
+	clear();
+
+	/* Only the network request registered under a query id is deleted */
+	printf("delete an unregistered network request\n");
+	add(&netreqs[0]);
+	netreqs[1].query_id = netreqs[0].query_id;
+	del(&netreqs[1]);
+	if (_getdns_qid_table_any(&table) != &netreqs[0])
+		FAIL("Registered network request deleted");
+	netreqs[1].query_id = _GETDNS_QID_RESERVED;
+	del(&netreqs[1]);
+	remove_id(_GETDNS_QID_RESERVED);
+	(void) check();
+	del(&netreqs[0]);
+	if (_getdns_qid_table_any(&table))
+		FAIL("Network request left after delete");
+	clear();
+
+	/* Every query id but the reserved one is handed out once */
+	printf("full table\n");
+	for (i = 0; i < N_IDS - 1; i++)
+		add(&netreqs[i]);
+	(void) check();
+	if (registered[_GETDNS_QID_RESERVED])
+		FAIL("The reserved query id handed out");
+	if (_getdns_qid_table_add(&table, mf, &netreqs[N_IDS - 1]) != -1)
+		FAIL("Network request added to a full table");
+	(void) check();
+
+	/* And a freed one is handed out again */
+	query_id = any_registered();
+	remove_id(query_id);
+	add(&netreqs[N_IDS - 1]);
+	if (netreqs[N_IDS - 1].query_id != query_id)
+		FAIL("Query id %d handed out, where only %d was free",
+		    (int)netreqs[N_IDS - 1].query_id, (int)query_id);
+	(void) check();
+	for (i = 0; i < N_IDS; i++)
+		if (registered[i])
+			remove_id(i);
+	if (_getdns_qid_table_any(&table))
+		FAIL("Network request left after removing all");
+	(void) check();
+	clear();
+
+	free(netreqs);
+	getdns_context_destroy(context);
+	exit(EXIT_SUCCESS);
+}
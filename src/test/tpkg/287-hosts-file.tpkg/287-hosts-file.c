@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+#define HOSTS_FN "hosts"
+
+/* A label of 64 octets, one more than allowed */
+#define LABEL64 "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijkl"
+
+/* With CRLF and LF line ends, tabs, comments, aliases, duplicate names,
+ * bad addresses and names, and without a newline at the end.
+ */
+static const char hosts[] =
+	"# The hosts file for 287-hosts-file\r\n"
+	"127.0.0.1\tlocalhost\r\n"
+	"\r\n"
+	"192.0.2.1 www.example.test www # an alias and a comment\n"
+	"  192.0.2.2\t\tmail.example.test\tMAIL.Example.TEST\n"
+	"2001:db8::1\twww.example.test\n"
+	"192.0.2.3 www.example.test\n"
+	"#192.0.2.9 commented.example.test\n"
+	"192.0.2.4 " LABEL64 ".example.test ok.example.test\n"
+	"192.0.2.5 toolong" LABEL64 LABEL64 LABEL64 LABEL64 LABEL64 LABEL64
+	           LABEL64 LABEL64 LABEL64 LABEL64 LABEL64 LABEL64 LABEL64
+	           LABEL64 LABEL64 LABEL64 ".example.test\n"
+	"192.0.2.6 nameless\tsame-address.example.test\n"
+	"192.0.2.6 same-address.example.test\n"
+	"192.0.2.7.8 bad-address.example.test\n"
+	"::ffff:192.0.2.10 last.example.test\n"
+	"192.0.2.11 last.example.test";
+
+static const char *names[] = {
+	"localhost",
+	"www.example.test",
+	"WWW.EXAMPLE.TEST.",
+	"www",
+	"mail.example.test",
+	"commented.example.test",
+	"ok.example.test",
+	LABEL64 ".example.test",
+	"same-address.example.test",
+	"bad-address.example.test",
+	"last.example.test",
+	"nonexistent.example.test"
+};
+#define N_NAMES (sizeof(names) / sizeof(*names))
+
+static void write_hosts()
+{
+	FILE *fh;
+
+	if (!(fh = fopen(HOSTS_FN, "wb")))
+		FAIL("Could not create %s", HOSTS_FN);
+	if (fwrite(hosts, 1, sizeof(hosts) - 1, fh) != sizeof(hosts) - 1)
+		FAIL("Could not write %s", HOSTS_FN);
+	(void) fclose(fh);
+}
+
+static void lookup(getdns_context *context, const char *name)
+{
+	getdns_return_t r;
+	getdns_dict *response;
+	getdns_list *addresses;
+	getdns_dict *entry;
+	getdns_bindata *address;
+	size_t i, n;
+	char *str;
+
+	printf("  %.40s:", name);
+	if ((r = getdns_address_sync(context, name, NULL, &response))) {
+		if (r == GETDNS_RETURN_BAD_DOMAIN_NAME)
+			printf(" bad domain name\n");
+		else if (r == GETDNS_RETURN_GENERIC_ERROR)
+			printf(" not found\n");
+		else
+			FAIL_r("getdns_address_sync");
+		return;
+	}
+	if (getdns_dict_get_list(response, "just_address_answers", &addresses)
+	    || getdns_list_get_length(addresses, &n))
+		FAIL("No just_address_answers");
+	for (i = 0; i < n; i++) {
+		if (getdns_list_get_dict(addresses, i, &entry) ||
+		    getdns_dict_get_bindata(entry, "address_data", &address))
+			FAIL("No address_data in just_address_answers");
+		if (!(str = getdns_display_ip_address(address)))
+			FAIL("Could not display address");
+		printf(" %s", str);
+		free(str);
+	}
+	printf("\n");
+	getdns_dict_destroy(response);
+}
+
+int main()
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_list *upstreams;
+	getdns_namespace_t localnames = GETDNS_NAMESPACE_LOCALNAMES;
+	const char *fn;
+	size_t i;
+
+	write_hosts();
+	if ((r = getdns_context_create(&context, 0)))
+		FAIL_r("getdns_context_create");
+	if ((r = getdns_context_set_resolution_type(
+	    context, GETDNS_RESOLUTION_STUB)))
+		FAIL_r("getdns_context_set_resolution_type");
+	/* Not queried, as only the local names are looked at */
+	if ((r = getdns_str2list("[ 127.0.0.1 ]", &upstreams)))
+		FAIL_r("getdns_str2list");
+	if ((r = getdns_context_set_upstream_recursive_servers(
+	    context, upstreams)))
+		FAIL_r("getdns_context_set_upstream_recursive_servers");
+	getdns_list_destroy(upstreams);
+	if ((r = getdns_context_set_namespaces(context, 1, &localnames)))
+		FAIL_r("getdns_context_set_namespaces");
+	if ((r = getdns_context_set_hosts(context, HOSTS_FN)))
+		FAIL_r("getdns_context_set_hosts");
+	if ((r = getdns_context_get_hosts(context, &fn)))
+		FAIL_r("getdns_context_get_hosts");
+	printf("hosts file %s\n", fn);
+	for (i = 0; i < N_NAMES; i++)
+		lookup(context, names[i]);
+
+	/* An unreadable hosts file is refused, and the current one kept */
+	if (getdns_context_set_hosts(context, "nonexistent/hosts")
+	    != GETDNS_RETURN_GENERIC_ERROR)
+		FAIL("Nonexistent hosts file set");
+	if ((r = getdns_context_get_hosts(context, &fn)))
+		FAIL_r("getdns_context_get_hosts");
+	printf("hosts file %s after setting a nonexistent one\n", fn);
+	lookup(context, "localhost");
+
+	getdns_context_destroy(context);
+	(void) remove(HOSTS_FN);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,401 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include "context.h"
+
+#define FAIL(...) do { \
+	fprintf(stderr, "ERROR in %s:%d, ", __FILE__, __LINE__); \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(EXIT_FAILURE); \
+	} while (0)
+
+#define FAIL_r(function_name) FAIL( "%s returned %d: %s", function_name \
+                                  , (int)r, getdns_get_errorstr_by_id(r));
+
+/* Two self-signed certificates, with their own keys, for both names */
+#define SUBJECT_ALT_NAMES "DNS:dns.example,DNS:dns2.example"
+static EVP_PKEY *keys[2];
+static X509 *certs[2];
+
+/* A DNS over TLS upstream in this process.  It serves one connection at a
+ * time, with the certificate selected by cert, and closes it after the
+ * answer so that every query needs a new connection (and a full handshake,
+ * because it hands out no sessions to resume).
+ */
+static struct server {
+	int      listen_fd;
+	uint16_t port;
+	SSL_CTX *ctx;
+	int      fd;
+	SSL     *ssl;
+	int      cert;
+	uint8_t  wire[514];
+	size_t   len;
+} server = { -1, 0, NULL, -1, NULL, 0, { 0 }, 0 };
+
+/* The stores the context trusts certificates with.  In the untrusted
+ * store, only certificates that were verified before are accepted.
+ */
+static X509_STORE *trusted, *untrusted;
+
+static int called_back = 0;
+static char auth_status[32];
+
+static uint64_t now_ms()
+{
+	struct timeval tv;
+
+	(void) gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void create_cert(int i)
+{
+	EVP_PKEY_CTX *pctx;
+	X509_NAME *name;
+	X509_EXTENSION *ext;
+
+	if (!(pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) ||
+	    EVP_PKEY_keygen_init(pctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(
+	        pctx, NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(pctx, &keys[i]) <= 0)
+		FAIL("Could not create key");
+	EVP_PKEY_CTX_free(pctx);
+
+	if (!(certs[i] = X509_new()) ||
+	    !X509_set_version(certs[i], 2) ||
+	    !ASN1_INTEGER_set(X509_get_serialNumber(certs[i]), i + 1) ||
+	    !X509_gmtime_adj(X509_get_notBefore(certs[i]), -3600) ||
+	    !X509_gmtime_adj(X509_get_notAfter(certs[i]), 3600) ||
+	    !X509_set_pubkey(certs[i], keys[i]) ||
+	    !(name = X509_get_subject_name(certs[i])) ||
+	    !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	        (const unsigned char *)"dns.example", -1, -1, 0) ||
+	    !X509_set_issuer_name(certs[i], name) ||
+	    !(ext = X509V3_EXT_conf_nid(NULL, NULL,
+	        NID_subject_alt_name, SUBJECT_ALT_NAMES)) ||
+	    !X509_add_ext(certs[i], ext, -1) ||
+	    !X509_sign(certs[i], keys[i], EVP_sha256()))
+		FAIL("Could not create certificate");
+	X509_EXTENSION_free(ext);
+}
+
+static void server_start()
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if ((server.listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		FAIL("socket");
+	(void) memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    getsockname(server.listen_fd, (struct sockaddr *)&addr, &addr_len) ||
+	    listen(server.listen_fd, 4) ||
+	    fcntl(server.listen_fd, F_SETFL, O_NONBLOCK) == -1)
+		FAIL("bind");
+	server.port = ntohs(addr.sin_port);
+
+	if (!(server.ctx = SSL_CTX_new(TLS_server_method())))
+		FAIL("SSL_CTX_new");
+	(void) SSL_CTX_set_options(server.ctx, SSL_OP_NO_TICKET);
+	(void) SSL_CTX_set_session_cache_mode(server.ctx, SSL_SESS_CACHE_OFF);
+#ifdef TLS1_3_VERSION
+	(void) SSL_CTX_set_num_tickets(server.ctx, 0);
+#endif
+}
+
+static void server_close()
+{
+	if (server.ssl) {
+		(void) SSL_shutdown(server.ssl);
+		SSL_free(server.ssl);
+		server.ssl = NULL;
+	}
+	if (server.fd != -1) {
+		(void) close(server.fd);
+		server.fd = -1;
+	}
+}
+
+/* Answer the query in server.wire with 192.0.2.1 */
+static void server_answer()
+{
+	static const uint8_t answer[] = { 0xc0, 0x0c, 0, 1, 0, 1,
+	    0, 0, 0x01, 0x2c, 0, 4, 192, 0, 2, 1 };
+	uint8_t *wire = server.wire + 2;
+	size_t qlen;
+
+	/* Header and question (without the OPT RR) and the answer */
+	for (qlen = 12; qlen < server.len - 2 && wire[qlen];
+	    qlen += wire[qlen] + 1)
+		;
+	qlen += 5;
+	if (qlen + sizeof(answer) + 2 > sizeof(server.wire))
+		FAIL("Malformed query");
+	wire[2] |= 0x80; /* QR */
+	wire[3] = 0;
+	wire[6] = 0; wire[7] = 1; /* ANCOUNT */
+	wire[8] = 0; wire[9] = 0;
+	wire[10] = 0; wire[11] = 0;
+	(void) memcpy(wire + qlen, answer, sizeof(answer));
+	server.wire[0] = (uint8_t)((qlen + sizeof(answer)) >> 8);
+	server.wire[1] = (uint8_t)(qlen + sizeof(answer));
+	if (SSL_write(server.ssl, server.wire, qlen + sizeof(answer) + 2)
+	    != (int)(qlen + sizeof(answer) + 2))
+		FAIL("SSL_write");
+}
+
+/* Make progress with the connection without blocking */
+static void server_serve()
+{
+	int r;
+
+	if (!server.ssl) {
+		if ((server.fd = accept(server.listen_fd, NULL, NULL)) == -1)
+			return;
+		if (fcntl(server.fd, F_SETFL, O_NONBLOCK) == -1 ||
+		    !(server.ssl = SSL_new(server.ctx)) ||
+		    !SSL_set_fd(server.ssl, server.fd) ||
+		    !SSL_use_certificate(server.ssl, certs[server.cert]) ||
+		    !SSL_use_PrivateKey(server.ssl, keys[server.cert]))
+			FAIL("Could not set up the connection");
+		SSL_set_accept_state(server.ssl);
+		server.len = 0;
+	}
+	if (!SSL_is_init_finished(server.ssl) &&
+	    (r = SSL_do_handshake(server.ssl)) != 1) {
+		r = SSL_get_error(server.ssl, r);
+		if (r != SSL_ERROR_WANT_READ && r != SSL_ERROR_WANT_WRITE)
+			server_close();
+		return;
+	}
+	if ((r = SSL_read(server.ssl, server.wire + server.len,
+	    sizeof(server.wire) - server.len)) <= 0) {
+		r = SSL_get_error(server.ssl, r);
+		if (r != SSL_ERROR_WANT_READ && r != SSL_ERROR_WANT_WRITE)
+			server_close();
+		return;
+	}
+	server.len += r;
+	if (server.len < 14 ||
+	    server.len < (size_t)(server.wire[0] << 8 | server.wire[1]) + 2)
+		return;
+	server_answer();
+	server_close();
+}
+
+static void callbackfn(getdns_context *context,
+    getdns_callback_type_t callback_type, getdns_dict *response,
+    void *userarg, getdns_transaction_t transaction_id)
+{
+	getdns_bindata *status;
+
+	(void)context; (void)userarg; (void)transaction_id;
+	called_back++;
+	if (callback_type != GETDNS_CALLBACK_COMPLETE)
+		FAIL("Callback type %d", (int)callback_type);
+	if (getdns_dict_get_bindata(response,
+	    "/call_reporting/0/tls_auth_status", &status))
+		FAIL("No tls_auth_status in the call_reporting");
+	(void) snprintf(auth_status, sizeof(auth_status), "%.*s",
+	    (int)status->size, (const char *)status->data);
+	getdns_dict_destroy(response);
+}
+
+static getdns_context *create_context()
+{
+	getdns_return_t r;
+	getdns_context *context;
+	getdns_transport_list_t tls = GETDNS_TRANSPORT_TLS;
+
+	if ((r = getdns_context_create(&context, 0)))
+		FAIL_r("getdns_context_create");
+	if ((r = getdns_context_set_resolution_type(
+	    context, GETDNS_RESOLUTION_STUB)))
+		FAIL_r("getdns_context_set_resolution_type");
+	if ((r = getdns_context_set_dns_transport_list(context, 1, &tls)))
+		FAIL_r("getdns_context_set_dns_transport_list");
+	/* Failed authentication still gives an answer (and an auth state) */
+	if ((r = getdns_context_set_tls_authentication(
+	    context, GETDNS_AUTHENTICATION_NONE)))
+		FAIL_r("getdns_context_set_tls_authentication");
+	if ((r = getdns_context_set_timeout(context, 5000)))
+		FAIL_r("getdns_context_set_timeout");
+	return context;
+}
+
+/* Set a single upstream with auth_name and the pins of the keys in
+ * pin_keys (a bitmask of the indices in keys).
+ */
+static void set_upstream(getdns_context *context, const char *auth_name,
+    int pin_keys)
+{
+	getdns_return_t r;
+	getdns_dict *upstream, *pin;
+	getdns_list *upstreams, *pinset;
+	getdns_bindata localhost = { 4, (uint8_t *)"\x7f\x00\x00\x01" };
+	getdns_bindata value;
+	uint8_t spki[512], *p, digest[SHA256_DIGEST_LENGTH];
+	size_t i, n = 0;
+	int len;
+
+	if (!(upstream = getdns_dict_create()) ||
+	    !(upstreams = getdns_list_create()) ||
+	    !(pinset = getdns_list_create()))
+		FAIL("Could not create upstreams");
+	if ((r = getdns_dict_util_set_string(upstream, "address_type", "IPv4")) ||
+	    (r = getdns_dict_set_bindata(upstream, "address_data", &localhost)) ||
+	    (r = getdns_dict_set_int(upstream, "tls_port", server.port)) ||
+	    (r = getdns_dict_util_set_string(
+	        upstream, "tls_auth_name", (char *)auth_name)))
+		FAIL_r("Setting upstream");
+	for (i = 0; i < 2; i++) {
+		if (!(pin_keys & (1 << i)))
+			continue;
+		p = spki;
+		if ((len = i2d_PUBKEY(keys[i], NULL)) <= 0 ||
+		    len > (int)sizeof(spki) || i2d_PUBKEY(keys[i], &p) != len ||
+		    !EVP_Digest(spki, len, digest, NULL, EVP_sha256(), NULL))
+			FAIL("Could not create pin");
+		value.size = sizeof(digest);
+		value.data = digest;
+		if (!(pin = getdns_dict_create()))
+			FAIL("Could not create pin");
+		if ((r = getdns_dict_util_set_string(pin, "digest", "sha256")) ||
+		    (r = getdns_dict_set_bindata(pin, "value", &value)) ||
+		    (r = getdns_list_set_dict(pinset, n++, pin)))
+			FAIL_r("Setting pin");
+		getdns_dict_destroy(pin);
+	}
+	if (pin_keys &&
+	    (r = getdns_dict_set_list(upstream, "tls_pubkey_pinset", pinset)))
+		FAIL_r("Setting tls_pubkey_pinset");
+	if ((r = getdns_list_set_dict(upstreams, 0, upstream)))
+		FAIL_r("Setting upstream");
+	if ((r = getdns_context_set_upstream_recursive_servers(
+	    context, upstreams)))
+		FAIL_r("getdns_context_set_upstream_recursive_servers");
+	getdns_list_destroy(pinset);
+	getdns_list_destroy(upstreams);
+	getdns_dict_destroy(upstream);
+}
+
+/* Have the context verify certificates with store (which it takes over) */
+static void set_store(getdns_context *context, X509_STORE *store)
+{
+	getdns_return_t r;
+
+	if ((r = _getdns_context_prepare_for_resolution(context, 0)))
+		FAIL_r("_getdns_context_prepare_for_resolution");
+	if (!context->tls_ctx)
+		FAIL("No SSL_CTX");
+	if (!X509_STORE_up_ref(store))
+		FAIL("X509_STORE_up_ref");
+	SSL_CTX_set_cert_store(context->tls_ctx, store);
+}
+
+/* Do a query on a new connection and print the auth state it got */
+static void reconnect(getdns_context *context, const char *auth_name,
+    int pin_keys, int cert, X509_STORE *store)
+{
+	getdns_return_t r;
+	getdns_dict *extensions;
+	getdns_eventloop *loop;
+	uint64_t end;
+
+	set_upstream(context, auth_name, pin_keys);
+	set_store(context, store);
+	server.cert = cert;
+	called_back = 0;
+
+	if ((r = getdns_str2dict(
+	    "{ return_call_reporting: GETDNS_EXTENSION_TRUE }", &extensions)))
+		FAIL_r("getdns_str2dict");
+	if ((r = getdns_general(context, "verified.test", GETDNS_RRTYPE_A,
+	    extensions, NULL, NULL, callbackfn)))
+		FAIL_r("getdns_general");
+	getdns_dict_destroy(extensions);
+	if (getdns_context_get_eventloop(context, &loop))
+		FAIL("getdns_context_get_eventloop");
+	for (end = now_ms() + 5000; !called_back && now_ms() < end; ) {
+		loop->vmt->run_once(loop, 0);
+		server_serve();
+		usleep(1000);
+	}
+	if (!called_back)
+		FAIL("No answer");
+
+	printf("  %-13s pins %c%c, certificate %d, %-9s: %s, %d verified\n",
+	    auth_name, pin_keys & 1 ? '0' : '-', pin_keys & 2 ? '1' : '-',
+	    cert, store == trusted ? "trusted" : "untrusted",
+	    auth_status, (int)context->n_tls_verified);
+}
+
+int main()
+{
+	getdns_context *context;
+
+	create_cert(0);
+	create_cert(1);
+	if (!(trusted = X509_STORE_new()) || !(untrusted = X509_STORE_new()) ||
+	    !X509_STORE_add_cert(trusted, certs[0]) ||
+	    !X509_STORE_add_cert(trusted, certs[1]))
+		FAIL("Could not create stores");
+	server_start();
+	context = create_context();
+
+	/* A verified certificate is cached and used for the same credentials
+	 * on the next connection, without verifying the chain again (which
+	 * would fail with the untrusted store).
+	 */
+	printf("same credentials\n");
+	reconnect(context, "dns.example", 0, 0, trusted);
+	reconnect(context, "dns.example", 0, 0, untrusted);
+	reconnect(context, "dns.example", 0, 0, untrusted);
+
+	/* But not for other credentials, or another certificate */
+	printf("changed credentials\n");
+	reconnect(context, "dns2.example", 0, 0, untrusted);
+	reconnect(context, "dns.example", 1, 0, untrusted);
+	reconnect(context, "dns.example", 0, 1, untrusted);
+
+	/* Which are cached on their own */
+	printf("changed credentials verified\n");
+	reconnect(context, "dns2.example", 0, 0, trusted);
+	reconnect(context, "dns.example", 1, 0, trusted);
+	reconnect(context, "dns2.example", 0, 0, untrusted);
+	reconnect(context, "dns.example", 1, 0, untrusted);
+	reconnect(context, "dns.example", 3, 0, untrusted);
+	reconnect(context, "dns.example", 0, 0, untrusted);
+
+	/* Failed verifications are not cached */
+	printf("failed verifications\n");
+	reconnect(context, "other.example", 0, 0, trusted);
+	reconnect(context, "dns.example", 2, 0, trusted);
+	reconnect(context, "dns.example", 2, 0, trusted);
+
+	getdns_context_destroy(context);
+	server_close();
+	(void) close(server.listen_fd);
+	SSL_CTX_free(server.ctx);
+	X509_STORE_free(trusted);
+	X509_STORE_free(untrusted);
+	X509_free(certs[0]);
+	X509_free(certs[1]);
+	EVP_PKEY_free(keys[0]);
+	EVP_PKEY_free(keys[1]);
+	exit(EXIT_SUCCESS);
+}
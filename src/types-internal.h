@@ -54,6 +54,10 @@ typedef union getdns_union {
 
 typedef struct getdns_item {
 	getdns_data_type dtype;
+	/* When set, data.bindata->data points into memory that is not owned
+	 * by the item (see getdns_bin2dict_borrow()) and will not be freed.
+	 */
+	unsigned         borrowed : 1;
 	getdns_union     data;
 } getdns_item;
 
@@ -125,7 +129,11 @@ struct getdns_upstream;
 #define GETDNS_TRANSPORTS_MAX 3
 #define GETDNS_UPSTREAM_TRANSPORTS 2
 #define GETDNS_CONN_ATTEMPTS 2
+#define GETDNS_TFO_ATTEMPTS 3 /* The first one only fetches the cookie */
 #define GETDNS_TRANSPORT_FAIL_MULT 5
+#define GETDNS_CONN_QUEUE_THRESHOLD 8
+#define GETDNS_WRITE_BATCH_MAX 64
+#define GETDNS_WRITE_BATCH_SZ 16384 /* One full TLS record */
 
 
 /* declarations */
@@ -158,6 +166,41 @@ struct mem_funcs {
 struct mem_funcs *
 priv_getdns_context_mf(getdns_context *context);
 
+/* Answers are received in buffers from a per context pool.  A buffer
+ * is taken from the smallest of the size classes (256 << i bytes) that
+ * fits the answer.  Released buffers are kept on a free list per class,
+ * so that in the steady state answers are received without calls to the
+ * memory functions.
+ */
+#define _GETDNS_BUF_POOL_N_CLASSES 9 /* 256 up to 65536 bytes */
+
+typedef struct _getdns_buf_pool {
+	struct mem_funcs  mf;
+	void             *free_bufs[_GETDNS_BUF_POOL_N_CLASSES];
+	size_t            n_free[_GETDNS_BUF_POOL_N_CLASSES];
+} _getdns_buf_pool;
+
+/* The network requests outstanding on a stateful connection, by query id.
+ * An open addressing table, directly indexed by the low bits of the
+ * (random) query id and resolving collisions by linear probing.  It is
+ * kept at most half full, so insertion, lookup and removal take O(1).
+ * Only with more than 32768 query ids in use, it fills up further, as
+ * there is no use for more slots than query ids.
+ */
+#define _GETDNS_QID_TABLE_MIN_SLOTS 64
+#define _GETDNS_QID_TABLE_MAX_SLOTS 65536
+
+/* A query id that is never handed out, for queries that are not sent on
+ * behalf of a netreq (see upstream_warm_probe_cb in stub.c).
+ */
+#define _GETDNS_QID_RESERVED 0
+
+typedef struct _getdns_qid_table {
+	size_t                      count;
+	size_t                      mask;  /* Number of slots - 1 */
+	struct getdns_network_req **slots; /* NULL until first use */
+} _getdns_qid_table;
+
 typedef enum network_req_state_enum
 {
 	NET_REQ_NOT_SENT  =  0,
@@ -176,6 +219,11 @@ typedef struct getdns_tcp_state {
 	size_t   write_buf_len;
 	size_t   written;
 
+	/* Unwritten remainder of a coalesced write (from the buf_pool) */
+	uint8_t *write_batch;
+	size_t   write_batch_len;
+	size_t   write_batch_written;
+
 	uint8_t *read_buf;
 	size_t   read_buf_len;
 	uint8_t *read_pos;
@@ -189,8 +237,6 @@ typedef struct getdns_tcp_state {
  **/
 typedef struct getdns_network_req
 {
-	/* For storage in upstream->netreq_by_query_id */
-	_getdns_rbnode_t node;
 	/* the async_id from unbound */
 	int unbound_id;
 	/* state var */
@@ -232,15 +278,27 @@ typedef struct getdns_network_req
 	/* Network requests scheduled to write after me */
 	struct getdns_network_req *write_queue_tail;
 
+	/* Time (in microseconds) after which a timed out UDP query is no
+	   longer retransmitted */
+	uint64_t                udp_deadline;
+
+	/* The other outstanding transmission of a hedged UDP query */
+	int                     hedge_fd;
+	struct getdns_upstream *hedge_upstream;
+	uint16_t                hedge_query_id;
+	uint64_t                hedge_start_time;
+	getdns_eventloop_event  hedge_event;
+
 	/* Some fields to record info for return_call_reporting */
 	uint64_t                debug_start_time;
 	uint64_t                debug_end_time;
 	getdns_auth_state_t     debug_tls_auth_status;
 	size_t                  debug_udp;
 
-	/* When more space is needed for the wire_data response than is
-	 * available in wire_data[], it will be allocated seperately.
-	 * response will then not point to wire_data anymore.
+	/* wire_data[] has room for the query only.  Before an answer is
+	 * received, response points right after the query.  Answers are
+	 * received in a buffer from the context's buf_pool, to which
+	 * response will then point.
 	 */
 	uint8_t *query;
 	uint8_t *opt; /* offset of OPT RR in query */
@@ -250,15 +308,21 @@ typedef struct getdns_network_req
 	 * the network_req is created.  When the query is sent out to
 	 * a given upstream, some additional options are added that
 	 * are specific to the upstream.  There can be at most
-	 * GETDNS_MAXIMUM_UPSTREAM_OPTION_SPACE bytes of
-	 * upstream-specific options.
+	 * upstream_option_space bytes of upstream-specific options,
+	 * which is never more than MAXIMUM_UPSTREAM_OPTION_SPACE.
 
 	 * use _getdns_network_req_clear_upstream_options() and
 	 * _getdns_network_req_add_upstream_option() to fiddle with the
 	 */
 	size_t   base_query_option_sz;
+	size_t   upstream_option_space;
 	size_t   response_len;
 	uint8_t *response;
+
+	/* Index of the RRs in response, created on demand with
+	 * _getdns_netreq_rr_index() and released with the response.
+	 */
+	struct _getdns_rr_index *response_index;
 	size_t   wire_data_sz;
 	uint8_t  wire_data[];
 	
@@ -322,6 +386,12 @@ typedef struct getdns_dns_req {
 	unsigned validating				: 1;
 	int *freed;
 
+	/* Memory for the request is part of a larger allocation that is
+	 * released by its owner (i.e. getdns_general_bulk), and not by
+	 * _getdns_dns_req_free().
+	 */
+	unsigned in_slab				: 1;
+
 	uint16_t tls_query_padding_blocksize;
 
 	/* internally scheduled request */
@@ -405,7 +475,68 @@ extern getdns_dict *dnssec_ok_checking_disabled;
 extern getdns_dict *dnssec_ok_checking_disabled_roadblock_avoidance;
 extern getdns_dict *dnssec_ok_checking_disabled_avoid_roadblocks;
 
+/* The properties of a request that follow from the context and the
+ * extensions alone.  Determined once, they can be shared by all requests
+ * made with the same extensions.
+ */
+typedef struct getdns_dns_req_settings {
+	uint32_t request_class;
+
+	unsigned dnssec_extension_set			: 1;
+	unsigned dnssec_return_status			: 1;
+	unsigned dnssec_return_only_secure		: 1;
+	unsigned dnssec_return_all_statuses		: 1;
+	unsigned dnssec_return_validation_chain		: 1;
+	unsigned dnssec_return_full_validation_chain	: 1;
+#ifdef DNSSEC_ROADBLOCK_AVOIDANCE
+	unsigned dnssec_roadblock_avoidance		: 1;
+	unsigned avoid_dnssec_roadblocks		: 1;
+#endif
+	unsigned edns_cookies				: 1;
+	unsigned return_both_v4_and_v6			: 1;
+	unsigned return_call_reporting			: 1;
+	unsigned add_warning_for_bad_dns		: 1;
+
+	/* The OPT RR */
+	unsigned with_opt				: 1;
+	unsigned edns_do_bit				: 1;
+	int      edns_maximum_udp_payload_size;
+	uint8_t  edns_extended_rcode;
+	uint8_t  edns_version;
+	getdns_list *options;
+	size_t   noptions;
+	size_t   opt_options_size;
+
+	/* When not NULL, the OPT RR as written by
+	 * _getdns_dns_req_settings_opt_rr(), to be copied into each query.
+	 */
+	const uint8_t *opt_rr;
+
+	/* The ID and flags of each query */
+	uint8_t  query_header[4];
+
+	size_t   upstream_option_space;
+	size_t   max_query_sz;
+} getdns_dns_req_settings;
+
 /* dns request utils */
+void _getdns_dns_req_settings_init(getdns_dns_req_settings *settings,
+    getdns_context *context, getdns_dict *extensions);
+
+void _getdns_dns_req_settings_opt_rr(
+    const getdns_dns_req_settings *settings, uint8_t *buf);
+
+/* Size of the memory region for a request with the given settings */
+size_t _getdns_dns_req_size(getdns_context *context,
+    const getdns_dns_req_settings *settings, uint16_t request_type);
+
+/* Create a new request in region (of _getdns_dns_req_size() bytes), or in
+ * newly allocated memory when region is NULL.
+ */
+getdns_dns_req *_getdns_dns_req_new_in(getdns_context *context,
+    getdns_eventloop *loop, const char *name, uint16_t request_type,
+    const getdns_dns_req_settings *settings, uint8_t *region);
+
 getdns_dns_req *_getdns_dns_req_new(getdns_context *context, getdns_eventloop *loop,
     const char *name, uint16_t request_type, getdns_dict *extensions);
 
@@ -414,6 +545,8 @@ void _getdns_dns_req_free(getdns_dns_req * req);
 /* network request utils */
 getdns_return_t _getdns_network_req_add_upstream_option(getdns_network_req * req,
 					     uint16_t code, uint16_t sz, const void* data);
+getdns_return_t _getdns_network_req_add_upstream_options(
+    getdns_network_req * req, const uint8_t *options, size_t sz);
 void _getdns_network_req_clear_upstream_options(getdns_network_req * req);
 
 /* Adds TSIG signature (if needed) and returns query length */
@@ -421,8 +554,14 @@ size_t _getdns_network_req_add_tsig(getdns_network_req *req);
 
 void _getdns_network_validate_tsig(getdns_network_req *req);
 
+/* Frees the keyed HMAC that signing and validation set up for upstream */
+void _getdns_upstream_tsig_hmac_free(struct getdns_upstream *upstream);
+
 void _getdns_netreq_reinit(getdns_network_req *netreq);
 
+/* Returns the (lazily created) index of the RRs in the response */
+struct _getdns_rr_index *_getdns_netreq_rr_index(getdns_network_req *netreq);
+
 const char * _getdns_auth_str(getdns_auth_state_t auth);
 
 #endif
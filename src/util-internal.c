@@ -463,8 +463,9 @@ static inline int has_all_numeric_label(const uint8_t *dname)
 }
 
 typedef struct _srv_rr {
-	_getdns_rr_iter i;
-	unsigned        running_sum;
+	_getdns_rr_iter   i;
+	_getdns_rr_index *index;
+	unsigned          running_sum;
 } _srv_rr;
 
 typedef struct _srvs {
@@ -592,9 +593,13 @@ _getdns_create_reply_dict(getdns_context *context, getdns_network_req *req,
 		goto error;
 	header = NULL;
 
+	/* req->response points to the reply (in a buffer from the context's
+	 * buf_pool) now, so the end of the query is not known here.  The
+	 * iterator stops after the question anyway.
+	 */
 	if (req->query &&
 	    (rr_iter = _getdns_rr_iter_init(&rr_iter_storage, req->query
-	                                   , req->response  - req->query)))
+	                  , (req->wire_data + req->wire_data_sz) - req->query)))
 
 		query_name = _getdns_owner_if_or_as_decompressed(
 		    rr_iter, query_name_space, &query_name_len);
@@ -653,6 +658,8 @@ _getdns_create_reply_dict(getdns_context *context, getdns_network_req *req,
 			    !_grow_srvs(&context->mf, srvs))
 				goto error;
 
+			srvs->rrs[srvs->count].index =
+			    _getdns_netreq_rr_index(req);
 			srvs->rrs[srvs->count++].i = *rr_iter;
 			continue;
 		}
@@ -704,7 +711,8 @@ _getdns_create_reply_dict(getdns_context *context, getdns_network_req *req,
 		goto error;
 	
 	answer = _getdns_rrset_answer(&answer_spc, req->response
-	                                         , req->response_len);
+	                                         , req->response_len
+	                                         , _getdns_netreq_rr_index(req));
 
 	if (answer_spc.rrset.name &&
 	    _getdns_dict_set_const_bindata(result, "canonical_name"
@@ -1041,6 +1049,7 @@ _create_srv_addrs(getdns_context *context, _srvs *srvs)
 		a.pkt = rr->pkt;
 		a.pkt_len = rr->pkt_end - rr->pkt;
 		a.sections = SECTION_ADDITIONAL;
+		a.index = srvs->rrs[i].index;
 
 		for ( a_rr = _getdns_rrtype_iter_init(&a_rr_spc, &a)
 		    ; a_rr ; a_rr = _getdns_rrtype_iter_next(a_rr)) {
@@ -1293,11 +1302,9 @@ getdns_apply_network_result(getdns_network_req* netreq,
 			      :            GETDNS_DNSSEC_BOGUS;
 
 	if (pkt) {
-		if (netreq->max_udp_payload_size < pkt_len)
-			netreq->response = GETDNS_XMALLOC(
-			    netreq->owner->context->mf,
-			    uint8_t, pkt_len
-			);
+		if (!(netreq->response = _getdns_buf_pool_alloc(
+		    &netreq->owner->context->buf_pool, pkt_len, NULL)))
+			return GETDNS_RETURN_MEMORY_ERROR;
 		(void) memcpy(netreq->response, pkt,
 		    (netreq->response_len = pkt_len));
 		return GETDNS_RETURN_GOOD;
@@ -1313,6 +1320,11 @@ getdns_apply_network_result(getdns_network_req* netreq,
 	 * so ub_res->answer_packet=NULL, ub_res->answer_len=0
 	 * So we need to create an answer packet.
 	 */
+	if (!(netreq->response = _getdns_buf_pool_alloc(
+	    &netreq->owner->context->buf_pool,
+	    GLDNS_HEADER_SIZE + netreq->owner->name_len + 4, NULL)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
 	gldns_write_uint16(netreq->response    , 0); /* query_id */
 	gldns_write_uint16(netreq->response + 2, 0); /* reset all flags */
 	gldns_write_uint16(netreq->response + GLDNS_QDCOUNT_OFF, 1);
@@ -1562,6 +1574,247 @@ void _getdns_wire2list(uint8_t *pkt, size_t pkt_len, getdns_list *l)
 	}
 }
 
+/* Every pool buffer is preceded by this header.  It holds the size class
+ * of the buffer while in use, and links the buffer in its free list once
+ * released.
+ */
+typedef union buf_pool_hdr {
+	size_t               cls;
+	union buf_pool_hdr  *next;
+	uint64_t             align;
+} buf_pool_hdr;
+
+#define BUF_POOL_CLASS_SZ(cls) ((size_t)256 << (cls))
+/* Keep 256K worth of released buffers per class, but at least 4 */
+#define BUF_POOL_MAX_FREE(cls) \
+	((cls) < 6 ? ((size_t)1 << 18) / BUF_POOL_CLASS_SZ(cls) : 4)
+
+static size_t
+buf_pool_class(size_t sz)
+{
+	size_t cls = 0;
+
+	while (cls < _GETDNS_BUF_POOL_N_CLASSES && BUF_POOL_CLASS_SZ(cls) < sz)
+		cls++;
+	return cls;
+}
+
+void
+_getdns_buf_pool_init(_getdns_buf_pool *pool, struct mem_funcs *mf)
+{
+	pool->mf = *mf;
+	(void) memset(pool->free_bufs, 0, sizeof(pool->free_bufs));
+	(void) memset(pool->n_free, 0, sizeof(pool->n_free));
+}
+
+void
+_getdns_buf_pool_clear(_getdns_buf_pool *pool)
+{
+	buf_pool_hdr *hdr;
+	size_t cls;
+
+	for (cls = 0; cls < _GETDNS_BUF_POOL_N_CLASSES; cls++) {
+		while ((hdr = pool->free_bufs[cls])) {
+			pool->free_bufs[cls] = hdr->next;
+			GETDNS_FREE(pool->mf, hdr);
+		}
+		pool->n_free[cls] = 0;
+	}
+}
+
+uint8_t *
+_getdns_buf_pool_alloc(_getdns_buf_pool *pool, size_t sz, size_t *cap)
+{
+	size_t cls = buf_pool_class(sz);
+	buf_pool_hdr *hdr;
+
+	if (cls >= _GETDNS_BUF_POOL_N_CLASSES)
+		return NULL;
+
+	if ((hdr = pool->free_bufs[cls])) {
+		pool->free_bufs[cls] = hdr->next;
+		pool->n_free[cls]--;
+
+	} else if (!(hdr = (buf_pool_hdr *)GETDNS_XMALLOC(pool->mf, uint8_t,
+	    sizeof(buf_pool_hdr) + BUF_POOL_CLASS_SZ(cls))))
+		return NULL;
+
+	hdr->cls = cls;
+	if (cap)
+		*cap = BUF_POOL_CLASS_SZ(cls);
+	return (uint8_t *)(hdr + 1);
+}
+
+void
+_getdns_buf_pool_release(_getdns_buf_pool *pool, uint8_t *buf)
+{
+	buf_pool_hdr *hdr;
+	size_t cls;
+
+	if (!buf)
+		return;
+
+	hdr = (buf_pool_hdr *)buf - 1;
+	cls = hdr->cls;
+	assert(cls < _GETDNS_BUF_POOL_N_CLASSES);
+
+	if (pool->n_free[cls] >= BUF_POOL_MAX_FREE(cls)) {
+		GETDNS_FREE(pool->mf, hdr);
+		return;
+	}
+	hdr->next = pool->free_bufs[cls];
+	pool->free_bufs[cls] = hdr;
+	pool->n_free[cls]++;
+}
+
+uint8_t *
+_getdns_buf_pool_fit(_getdns_buf_pool *pool, uint8_t *buf, size_t len)
+{
+	uint8_t *fit;
+
+	if (buf_pool_class(len) >= ((buf_pool_hdr *)buf - 1)->cls)
+		return buf;
+
+	if (!(fit = _getdns_buf_pool_alloc(pool, len, NULL)))
+		return buf;
+
+	(void) memcpy(fit, buf, len);
+	_getdns_buf_pool_release(pool, buf);
+	return fit;
+}
+
+void
+_getdns_qid_table_init(_getdns_qid_table *table)
+{
+	table->count = 0;
+	table->mask = 0;
+	table->slots = NULL;
+}
+
+void
+_getdns_qid_table_clear(_getdns_qid_table *table, struct mem_funcs *mf)
+{
+	if (table->slots)
+		GETDNS_FREE(*mf, table->slots);
+	_getdns_qid_table_init(table);
+}
+
+/* Index of the slot holding query_id, or of the empty slot that ends the
+ * probe sequence for query_id.  table->slots must not be NULL.
+ */
+static size_t
+qid_table_find(_getdns_qid_table *table, uint16_t query_id)
+{
+	size_t i = query_id & table->mask;
+
+	while (table->slots[i] && table->slots[i]->query_id != query_id)
+		i = (i + 1) & table->mask;
+	return i;
+}
+
+static int
+qid_table_grow(_getdns_qid_table *table, struct mem_funcs *mf)
+{
+	size_t n_slots = table->slots ? (table->mask + 1) * 2
+	                              : _GETDNS_QID_TABLE_MIN_SLOTS;
+	getdns_network_req **old_slots = table->slots;
+	size_t i, old_n_slots = table->slots ? table->mask + 1 : 0;
+
+	if (!(table->slots = GETDNS_XMALLOC(*mf, getdns_network_req *, n_slots))) {
+		table->slots = old_slots;
+		return -1;
+	}
+	(void) memset(table->slots, 0, n_slots * sizeof(getdns_network_req *));
+	table->mask = n_slots - 1;
+	for (i = 0; i < old_n_slots; i++)
+		if (old_slots[i])
+			table->slots[qid_table_find(table,
+			    old_slots[i]->query_id)] = old_slots[i];
+	if (old_slots)
+		GETDNS_FREE(*mf, old_slots);
+	return 0;
+}
+
+int
+_getdns_qid_table_add(_getdns_qid_table *table, struct mem_funcs *mf,
+    getdns_network_req *netreq)
+{
+	uint16_t query_id;
+	size_t   i;
+
+	/* All but the reserved query id in use, none left to hand out */
+	if (table->count >= 0xFFFF)
+		return -1;
+
+	/* Keep at least half of the slots free */
+	if ((!table->slots || ((table->count + 1) * 2 > table->mask + 1 &&
+	    table->mask + 1 < _GETDNS_QID_TABLE_MAX_SLOTS)) &&
+	    qid_table_grow(table, mf))
+		return -1;
+
+	/* With at most 32768 ids in use, this takes two tries at worst
+	 * on average.  Beyond that it slows down, but it ends as long as
+	 * there is a free id.
+	 */
+	do {
+		query_id = (uint16_t)arc4random();
+	} while (query_id == _GETDNS_QID_RESERVED ||
+	    table->slots[(i = qid_table_find(table, query_id))]);
+
+	netreq->query_id = query_id;
+	table->slots[i] = netreq;
+	table->count++;
+	return query_id;
+}
+
+getdns_network_req *
+_getdns_qid_table_remove(_getdns_qid_table *table, uint16_t query_id)
+{
+	getdns_network_req *netreq;
+	size_t i, j, k;
+
+	if (!table->count ||
+	    !(netreq = table->slots[(i = qid_table_find(table, query_id))]))
+		return NULL;
+
+	/* Shift back the entries that follow in the same probe run, so that
+	 * no lookup will stop early at the freed slot.
+	 */
+	for (j = i;;) {
+		table->slots[i] = NULL;
+		do {
+			j = (j + 1) & table->mask;
+			if (!table->slots[j]) {
+				table->count--;
+				return netreq;
+			}
+			k = table->slots[j]->query_id & table->mask;
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		table->slots[i] = table->slots[j];
+		i = j;
+	}
+}
+
+void
+_getdns_qid_table_del(_getdns_qid_table *table, getdns_network_req *netreq)
+{
+	if (table->count && table->slots[
+	    qid_table_find(table, netreq->query_id)] == netreq)
+		(void) _getdns_qid_table_remove(table, netreq->query_id);
+}
+
+getdns_network_req *
+_getdns_qid_table_any(_getdns_qid_table *table)
+{
+	size_t i;
+
+	if (!table->count)
+		return NULL;
+	for (i = 0; !table->slots[i]; i++)
+		; /* pass */
+	return table->slots[i];
+}
+
 const char * _getdns_auth_str(getdns_auth_state_t auth) {
 	static const char*
 	getdns_auth_str_array[] = {
@@ -159,6 +159,65 @@ uint8_t *_getdns_reply2wire(
 
 void _getdns_wire2list(uint8_t *pkt, size_t pkt_len, getdns_list *l);
 
+void _getdns_buf_pool_init(_getdns_buf_pool *pool, struct mem_funcs *mf);
+void _getdns_buf_pool_clear(_getdns_buf_pool *pool);
+
+/**
+ * Get a buffer of at least sz bytes from the pool.
+ * @param pool The pool
+ * @param sz   The minimum size of the buffer
+ * @param cap  When not NULL, receives the actual size of the buffer
+ * @return The buffer, or NULL when sz is larger than 65536 or when out
+ *         of memory
+ */
+uint8_t *_getdns_buf_pool_alloc(_getdns_buf_pool *pool, size_t sz, size_t *cap);
+
+/**
+ * Return a buffer to the pool.
+ * @param pool The pool buf was taken from
+ * @param buf  The buffer, may be NULL
+ */
+void _getdns_buf_pool_release(_getdns_buf_pool *pool, uint8_t *buf);
+
+/**
+ * Move the first len bytes of buf to a buffer of the smallest size class
+ * that fits, if that is smaller than the class of buf itself.
+ * @return The buffer containing the data.  This is buf itself, when it
+ *         was already in the smallest fitting class, or when no smaller
+ *         buffer could be had.
+ */
+uint8_t *_getdns_buf_pool_fit(_getdns_buf_pool *pool, uint8_t *buf, size_t len);
+
+void _getdns_qid_table_init(_getdns_qid_table *table);
+void _getdns_qid_table_clear(_getdns_qid_table *table, struct mem_funcs *mf);
+
+/**
+ * Register netreq in table under a fresh random query id, which is also
+ * stored in netreq->query_id.
+ * @return The query id, or -1 when out of memory or when all query ids
+ *         (but _GETDNS_QID_RESERVED) are in use
+ */
+int _getdns_qid_table_add(_getdns_qid_table *table, struct mem_funcs *mf,
+    getdns_network_req *netreq);
+
+/**
+ * Remove and return the network request registered under query_id.
+ * @return The network request, or NULL when there was none
+ */
+getdns_network_req *_getdns_qid_table_remove(
+    _getdns_qid_table *table, uint16_t query_id);
+
+/**
+ * Remove netreq from table, if it is registered there.
+ */
+void _getdns_qid_table_del(_getdns_qid_table *table,
+    getdns_network_req *netreq);
+
+/**
+ * Any of the network requests in table, or NULL when it is empty.
+ */
+getdns_network_req *_getdns_qid_table_any(_getdns_qid_table *table);
+
 
 /**
  * detect unrecognized extension strings or invalid extension formats
@@ -183,14 +242,7 @@ INLINE getdns_eventloop_event *getdns_eventloop_event_init(
 
 INLINE void _dname_canonicalize(const uint8_t *src, uint8_t *dst)
 {
-	const uint8_t *next_label;
-
-	while (*src) {
-		next_label = src + *src + 1;
-		*dst++ = *src++;
-		while (src < next_label)
-			*dst++ = (uint8_t)tolower((unsigned char)*src++);
-	}
+	_getdns_dname_fold(dst, src, _getdns_dname_len(src));
 }
 
 INLINE void _dname_canonicalize2(uint8_t *dname)